@@ -1,608 +1,5744 @@
-/* Copyright 2011 Adam Green (http://mbed.org/users/AdamGreen/)
-
-   Licensed under the Apache License, Version 2.0 (the "License");
-   you may not use this file except in compliance with the License.
-   You may obtain a copy of the License at
-
-       http://www.apache.org/licenses/LICENSE-2.0
-
-   Unless required by applicable law or agreed to in writing, software
-   distributed under the License is distributed on an "AS IS" BASIS,
-   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
-   See the License for the specific language governing permissions and
-   limitations under the License.
-*/
-/* Specifies the classes used to implement the FlashFileSystem which is a
-   read-only file system that exists in the internal FLASH of the mbed
-   device.
-*/
-#include <mbed.h>
-#include <assert.h>
-#include "FlashFileSystem.h"
-#include "ffsformat.h"
-
-
-// Set FFS_TRACE to 1 to enable tracing within the FlashFileSystem class.
-#define FFS_TRACE 0
-#if FFS_TRACE
-    #define TRACE printf
-#else
-    static void __trace(...)
-    {
-        return;
-    }
-    #define TRACE __trace
-#endif // FFS_TRACE
-
-
-
-/* Constructor for FlashFileSystemFileHandle which initializes to the specified
-   file entry in the image.
-   
-   Parameters:
-    pFileStart is the beginning offset of this file in FLASH memory.
-    pFileEnd is the ending offset (1 bytes past last valid byte) of this file
-        FLASH memory.
-*/
-FlashFileSystemFileHandle::FlashFileSystemFileHandle(const char* pFileStart,
-                                                     const char* pFileEnd)
-{
-    m_pFileStart = pFileStart;
-    m_pFileEnd = pFileEnd;
-    m_pCurr = pFileStart;
-}
-
-
-// Constructs a blank FlashFileSystemFileHandle object.
-FlashFileSystemFileHandle::FlashFileSystemFileHandle()
-{
-    FlashFileSystemFileHandle(NULL, NULL);
-}
-    
-
-/* Write the contents of a buffer to the file
-
-   Parameters:
-    pBuffer is the buffer from which to write.
-    Length is the number of characters to write.
-
-   Returns
-    The number of characters written (possibly 0) on success, -1 on error.
- */
-ssize_t FlashFileSystemFileHandle::write(const void* pBuffer, size_t Length)
-{
-    // This file system doesn't support writing.
-    return -1;
-}
-
-
-/* Close the file
-
-   Returns
-    Zero on success, -1 on error.
-*/
-int FlashFileSystemFileHandle::close()
-{
-    m_pFileStart = NULL;
-    m_pFileEnd = NULL;
-    m_pCurr = NULL;
-    
-    return 0;
-}
-
-/*  Reads the contents of the file into a buffer.
-
-   Parameters
-    pBuffer is the buffer into which the read should occur.
-    Length is the number of characters to read into pBuffer.
-
-   Returns
-    The number of characters read (zero at end of file) on success, -1 on error.
-*/
-ssize_t FlashFileSystemFileHandle::read(void* pBuffer, size_t Length)
-{
-    unsigned int    BytesLeft;
-
-    // Don't read more bytes than what are left in the file.
-    BytesLeft = m_pFileEnd - m_pCurr;
-    if (Length > BytesLeft)
-    {
-        Length = BytesLeft;
-    }
-    
-    // Copy the bytes from FLASH into the caller provided buffer.
-    memcpy(pBuffer, m_pCurr, Length);
-    
-    // Update the file pointer.
-    m_pCurr += Length;
-    
-    return Length;
-}
-
-
-/* Move the file position to a given offset from a given location.
- 
-   Parameters
-    offset is the offset from whence to move to.
-    whence - SEEK_SET for the start of the file, 
-             SEEK_CUR for the current file position, or 
-             SEEK_END for the end of the file.
-  
-   Returns
-    New file position on success, -1 on failure or unsupported
-*/
-off_t FlashFileSystemFileHandle::seek(off_t offset, int whence)
-{
-    switch(whence)
-    {
-    case SEEK_SET:
-        m_pCurr = m_pFileStart + offset;
-        break;
-    case SEEK_CUR:
-        m_pCurr += offset;
-        break;
-    case SEEK_END:
-        m_pCurr = (m_pFileEnd - 1) + offset;
-        break;
-    default:
-        TRACE("FlashFileSytem: Received unknown origin code (%d) for seek.\r\n", whence);
-        return -1;
-    }
-    
-    return (m_pCurr - m_pFileStart);
-}
-
-
-/* Returns the length of the file.
-
-   Parameters:
-    None
-   Returns:
-    Length of file.
-*/
-off_t FlashFileSystemFileHandle::size()
-{
-    return (m_pFileEnd - m_pFileStart);
-}
-
-
-
-/* Construct and initialize a directory handle enumeration object.
-
-   Parameters:
-    pFLASHBase points to the beginning of the file system in FLASH memory.
-    pFirstFileEntry is a pointer to the first entry found in this directory.
-    DirectoryNameLength is the length of the directory name for which this
-        handle is being used to enumerate.
-        
-   Returns:
-    Nothing.
-*/
-FlashFileSystemDirHandle::FlashFileSystemDirHandle(const char*              pFLASHBase,
-                                                   const _SFileSystemEntry* pFirstFileEntry,
-                                                   unsigned int             FileEntriesLeft,
-                                                   unsigned int             DirectoryNameLength)
-{
-    m_pFLASHBase = pFLASHBase;
-    m_pFirstFileEntry = pFirstFileEntry;
-    m_pCurrentFileEntry = pFirstFileEntry;
-    m_FileEntriesLeft = FileEntriesLeft;
-    m_DirectoryNameLength = DirectoryNameLength;
-    m_DirectoryEntry.d_name[0] = '\0';
-}
-
-
-// Used to construct a closed directory handle.
-FlashFileSystemDirHandle::FlashFileSystemDirHandle()
-{
-    FlashFileSystemDirHandle(NULL, NULL, 0, 0);
-}
-
-                             
-/* Closes the directory enumeration object.
-  
-   Parameters:
-    None.
-    
-   Returns:
-    0 on success, or -1 on error.
-*/
-int FlashFileSystemDirHandle::close()
-{
-    m_pFLASHBase = NULL;
-    m_pFirstFileEntry = NULL;
-    m_pCurrentFileEntry = NULL;
-    m_FileEntriesLeft = 0;
-    m_DirectoryNameLength = 0;
-    m_DirectoryEntry.d_name[0] = '\0';
-    
-    return 0;
-}
-
-
-/* Return the directory entry at the current position, and
-   advances the position to the next entry.
-  
-   Parameters:
-    None.
-    
-   Returns:
-    1 on reading a filename, 0 at end of directory, negative error on failure.
-*/
-ssize_t FlashFileSystemDirHandle::read(struct dirent *ent)
-{
-    const char*  pPrevEntryName;
-    const char*  pCurrentEntryName;
-    char*        pSlash;
-    size_t       PrefixLength;
-    unsigned int FileEntriesUsed;
-    unsigned int FileEntriesLeft;  
-    
-    // Just return now if we have already finished enumerating the entries in
-    // the directory.
-    if (!m_pCurrentFileEntry)
-    {
-        m_DirectoryEntry.d_name[0] = '\0';
-        return 0;
-    }
-    
-    // Calculate the number of valid entries are left in the file entry array.
-    FileEntriesUsed = m_pCurrentFileEntry - m_pFirstFileEntry;
-    FileEntriesLeft = m_FileEntriesLeft - FileEntriesUsed;
-    
-    // Fill in the directory entry structure for the current entry.
-    pPrevEntryName = m_pFLASHBase + 
-                     m_pCurrentFileEntry->FilenameOffset;
-    strncpy(m_DirectoryEntry.d_name, 
-            pPrevEntryName + m_DirectoryNameLength, 
-            sizeof(m_DirectoryEntry.d_name));
-    m_DirectoryEntry.d_name[sizeof(m_DirectoryEntry.d_name) - 1] = '\0';
-    
-    // If the entry to be returned contains a slash then this is a directory
-    // entry.
-    pSlash = strchr(m_DirectoryEntry.d_name, '/');
-    if (pSlash)
-    {
-        // I am truncating everything after the slash but leaving the
-        // slash so that I can tell it is a directory and not a file.
-        pSlash[1] = '\0';
-    }
-    
-    // Skip entries that have the same prefix as the current entry.  This
-    // will skip the files in the same sub-tree.
-    PrefixLength = strlen(m_DirectoryEntry.d_name) + m_DirectoryNameLength;
-    do
-    {
-        m_pCurrentFileEntry++;
-        FileEntriesLeft--;
-        pCurrentEntryName = m_pFLASHBase + m_pCurrentFileEntry->FilenameOffset;
-    } while (FileEntriesLeft && 
-             0 == strncmp(pPrevEntryName, pCurrentEntryName, PrefixLength));
-    
-    // If we have walked past the end of all file entries in the file system or
-    // the prefix no longer matches this directory, then there are no more files
-    // for this directory enumeration.
-    if (0 == FileEntriesLeft || 
-        0 != strncmp(pPrevEntryName, pCurrentEntryName, m_DirectoryNameLength))
-    {
-        m_pCurrentFileEntry = NULL;
-    }
-    
-    // Return a pointer to the directory entry structure that was previously
-    // setup.
-    ent = &m_DirectoryEntry;
-    return 1;
-}
-
-
-//Resets the position to the beginning of the directory.
-void FlashFileSystemDirHandle::rewind()
-{
-    m_pCurrentFileEntry = m_pFirstFileEntry;
-}
-
-
-/* Returns the current position of the DirHandle.
- 
-   Parameters:
-    None.
-    
-   Returns:
-    The current position, or -1 on error.
-*/
-off_t FlashFileSystemDirHandle::tell()
-{
-    return (off_t)m_pCurrentFileEntry;
-}
-
-
-/* Sets the position of the DirHandle.
- 
-   Parameters:
-    Location is the location to seek to. Must be a value returned
-        by telldir.
-        
-   Returns;
-    Nothing.
-*/
-void FlashFileSystemDirHandle::seek(off_t Location)
-{
-    SFileSystemEntry*   pLocation = (SFileSystemEntry*)Location;
-    
-    assert ( NULL != pLocation &&
-             pLocation > m_pFirstFileEntry &&
-             (pLocation - m_pFirstFileEntry) < m_FileEntriesLeft );
-    
-    m_pCurrentFileEntry = pLocation;
-}
-
-
-
-// Structure used to hold context about current filename search.
-struct SSearchContext
-{
-    // Name of file to be found in file system image.
-    const char* pKey;
-    // Base pointer for the file system image.
-    const char* pFLASHBase;
-};
-
-
-/* Internal routine used as callback for bsearch() when searching for a
-   requested filename in the FLASH file system image.
-   
-   pvKey is a pointer to the SSearchContext object for this search.
-   pvEntry is a pointer to the current file system entry being checked by
-    bsearch().
-    
-   Returns <0 if filename to find is lower in sort order than current entry.
-            0 if filename to find is the same as the current entry.
-           >0 if filename to find is higher in sort order than current entry.
-*/
-static int _CompareKeyToFileEntry(const void* pvKey, const void* pvEntry)
-{
-    const SSearchContext*       pContext = (const SSearchContext*)pvKey;
-    const char*                 pKey = pContext->pKey;
-    const SFileSystemEntry*     pEntry = (const SFileSystemEntry*)pvEntry;
-    const char*                 pEntryName = pContext->pFLASHBase + pEntry->FilenameOffset;
-
-    return strcmp(pKey, pEntryName);
-}
-
-
-/* Constructor for FlashFileSystem
-
-   Parameters:
-    pName is the root name to be used for this file system in fopen()
-        pathnames.
-    pFlashDrive (optional) is a pointer to the read-only file system (const char array).
-        When pFlashDrive is not specified, it is up to the user to append the
-        read-only file system file to the compiled binary.
-    FlashSize (optional) is the size of the FLASH (KB) on the device to
-        search through for the file system signature (default = 512).
-*/
-FlashFileSystem::FlashFileSystem(const char* pName, const uint8_t *pFlashDrive, const uint32_t FlashSize) : FileSystemLike(pName)
-{
-    static const char   FileSystemSignature[] = FILE_SYSTEM_SIGNATURE;
-    SFileSystemHeader*  pHeader = NULL;
-    char*               pCurr = (char*)(FlashSize * 1024) - sizeof(pHeader->FileSystemSignature);
-    
-    // Initialize the members
-    m_pFLASHBase = NULL;
-    m_FileCount = 0;
-    m_pFileEntries = NULL;
-    
-    // Scan backwards through 512k FLASH looking for the file system signature
-    // NOTE: The file system image should be located after this code itself
-    //       so stop the search.
-    if(pFlashDrive == NULL)
-    {
-        while (pCurr > FileSystemSignature)
-        {
-            if (0 == memcmp(pCurr, FileSystemSignature, sizeof(pHeader->FileSystemSignature)))
-            {
-                break;
-            }
-            pCurr--;
-        }
-        if (pCurr <= FileSystemSignature)
-        {
-            TRACE("FlashFileSystem: Failed to find file system image in ROM.\n");
-            return;
-        }
-    }
-    else
-    {
-        pCurr = (char *)pFlashDrive;
-    }
-    if (((unsigned int)pCurr & 0x3) != 0)
-    {
-        TRACE("FlashFileSystem: File system image at address %08X isn't 4-byte aligned.\n", pCurr);
-        return;
-    }
-    
-    // Record the location of the file system image in the member fields.
-    m_pFLASHBase = pCurr;
-    pHeader = (SFileSystemHeader*)m_pFLASHBase;
-    m_FileCount = pHeader->FileCount;
-    m_pFileEntries = (SFileSystemEntry*)(m_pFLASHBase + sizeof(*pHeader));
-}
-
-
-/* Opens specified file in FLASH file system when an appropriate call to
-   fopen() is made.
-   
-   pFilename is the name of the file to be opened within the file system.
-   Flags specify flags to determine open mode of file.  This file system only
-    support O_RDONLY.
-   
-   Returns NULL if an error was encountered or a pointer to a FileHandle object
-    representing the requrested file otherwise.
-*/
-int FlashFileSystem::open(FileHandle** file, const char* pFilename, int Flags)
-{
-    const SFileSystemEntry*     pEntry = NULL;
-    FlashFileSystemFileHandle*  pFileHandle = NULL;
-    SSearchContext              SearchContext;
-    
-    TRACE("FlashFileSystem: Attempt to open file /FLASH/%s with flags:%x\r\n", pFilename, Flags);
-    
-    // Can't find the file if file system hasn't been mounted.
-    if (!IsMounted())
-    {
-        return -ENODEV;
-    }
-
-    // Can only open files in FLASH for read.
-    if (O_RDONLY != Flags)
-    {
-        TRACE("FlashFileSystem: Can only open files for reading.\r\n");
-        return -EROFS;
-    }
-    
-    // Attempt to find the specified file in the file system image.
-    SearchContext.pKey = pFilename;
-    SearchContext.pFLASHBase = m_pFLASHBase;
-    pEntry = (const SFileSystemEntry*) bsearch(&SearchContext,
-                                               m_pFileEntries,
-                                               m_FileCount, 
-                                               sizeof(*m_pFileEntries), 
-                                               _CompareKeyToFileEntry);
-    if(!pEntry)
-    {
-        // Create failure response.
-        TRACE("FlashFileSystem: Failed to find '%s' in file system image.\n", pFilename);
-        return -ENOENT;
-    }
-
-    // Attempt to find a free file handle.
-    pFileHandle = FindFreeFileHandle();
-    if (!pFileHandle)
-    {
-        TRACE("FlashFileSystem: File handle table is full.\n");
-        return -ENOSR;
-    }
-    
-    // Initialize the file handle and return it to caller.
-    pFileHandle->SetEntry(m_pFLASHBase + pEntry->FileBinaryOffset,
-                          m_pFLASHBase + pEntry->FileBinaryOffset + pEntry->FileBinarySize);
-    *file = pFileHandle;
-    return 0;
-}
-
-int  FlashFileSystem::open(DirHandle** dir, const char *pDirectoryName)
-{
-    const SFileSystemEntry* pEntry = m_pFileEntries;
-    unsigned int            DirectoryNameLength;
-    unsigned int            i;
-    
-    assert ( pDirectoryName);
-    
-    // Removing leading slash since the file system image doesn't contain
-    // leading slashes.
-    if ('/' == pDirectoryName[0])
-    {
-        pDirectoryName++;
-    }
-    
-    // Make sure that the directory name length would include the trailing
-    // slash.
-    DirectoryNameLength = strlen(pDirectoryName);
-    if (0 != DirectoryNameLength && '/' != pDirectoryName[DirectoryNameLength-1])
-    {
-        // Add the implicit slash to this count.
-        DirectoryNameLength++;
-    }
-    
-    // Search through the file entries from the beginning to find the first
-    // entry which has pDirectoryName/ as the prefix.
-    for (i = 0 ; i < m_FileCount ; i++)
-    {
-        const char* pEntryFilename = pEntry->FilenameOffset + m_pFLASHBase;
-        
-        if (0 == DirectoryNameLength ||
-            (pEntryFilename == strstr(pEntryFilename, pDirectoryName) &&
-             '/' == pEntryFilename[DirectoryNameLength-1]) )
-        {
-            // Found the beginning of the list of files/folders for the
-            // requested directory so return it to the caller.
-            FlashFileSystemDirHandle* pDirHandle = FindFreeDirHandle();
-            if (!pDirHandle)
-            {
-                TRACE("FlashFileSystem: Dir handle table is full.\n");
-                return NULL;
-            }
-            
-            pDirHandle->SetEntry(m_pFLASHBase,
-                                 pEntry,
-                                 m_FileCount - (pEntry - m_pFileEntries),
-                                 DirectoryNameLength);
-            
-            *dir = pDirHandle;
-            return 0;
-        }
-        
-        // Advance to the next file entry
-        pEntry++;
-    }
-    
-    // Get here when the requested directory wasn't found.
-    TRACE("FlashFileSystem: Failed to find '%s' directory in file system image.\n", 
-          pDirectoryName);
-    return -ENOENT;
-}
-
-
-/* Protected method which attempts to find a free file handle in the object's
-   file handle table.
-   
-   Parameters:
-    None
-    
-   Returns:
-    Pointer to first free file handle entry or NULL if the table is full.
-*/
-FlashFileSystemFileHandle* FlashFileSystem::FindFreeFileHandle()
-{
-    size_t  i;
-    
-    // Iterate through the file handle array, looking for a close file handle.
-    for (i = 0 ; i < sizeof(m_FileHandles)/sizeof(m_FileHandles[0]) ; i++)
-    {
-        if (m_FileHandles[i].IsClosed())
-        {
-            return &(m_FileHandles[i]);
-        }
-    }
-    
-    // If we get here, then no free entries were found.
-    return NULL;
-}
-
-
-/* Protected method which attempts to find a free dir handle in the object's
-   directory handle table.
-   
-   Parameters:
-    None
-    
-   Returns:
-    Pointer to first free directory handle entry or NULL if the table is full.
-*/
-FlashFileSystemDirHandle* FlashFileSystem::FindFreeDirHandle()
-{
-    size_t  i;
-    
-    // Iterate through the direcotry handle array, looking for a closed 
-    // directory handle.
-    for (i = 0 ; i < sizeof(m_DirHandles)/sizeof(m_DirHandles[0]) ; i++)
-    {
-        if (m_DirHandles[i].IsClosed())
-        {
-            return &(m_DirHandles[i]);
-        }
-    }
-    
-    // If we get here, then no free entries were found.
-    return NULL;
-}
+/* Copyright 2011 Adam Green (http://mbed.org/users/AdamGreen/)
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+/* Specifies the classes used to implement the FlashFileSystem which is a
+   read-only file system that exists in the internal FLASH of the mbed
+   device.
+*/
+#include <mbed.h>
+#include <assert.h>
+#include <new>
+#include <stddef.h>
+#include "FlashFileSystem.h"
+#include "ffsformat.h"
+#include "ffslz4.h"
+#include "ffscrc32c.h"
+#include "ffscopy.h"
+#include "ffstrace.h"
+#if FFS_MAPPED_FILE
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+
+// The fields of the image are little endian and are read in place.
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "FlashFileSystem requires a little endian target."
+#endif
+
+
+// Set FFS_TRACE to 1 to enable tracing within the FlashFileSystem class.
+#define FFS_TRACE 0
+#if FFS_TRACE
+    #define TRACE printf
+#else
+    static void __trace(...)
+    {
+        return;
+    }
+    #define TRACE __trace
+#endif // FFS_TRACE
+
+
+// Size of the buffers which filenames are copied into when they are read
+// from a block device.  A name which doesn't fit is truncated to one more
+// character than the longest name which can be looked up, so it still
+// compares correctly against every key which can be.
+#if FFS_BLOCK_DEVICE
+#define FFS_NAME_BUFFER_SIZE    (FFS_MAX_NAME_LENGTH + 2)
+#else
+#define FFS_NAME_BUFFER_SIZE    1
+#endif
+
+
+// Free running 32-bit counter used to time the calls recorded in the
+// FFS_STATS_HISTOGRAMS histograms.
+#if FFS_STATS_HISTOGRAMS && !defined(FFS_STATS_CYCLE_COUNT)
+#define FFS_STATS_CYCLE_COUNT()     (DWT->CYCCNT)
+#endif
+
+
+
+/* Returns the length of a directory name, including its trailing slash
+   even if pDirectoryName doesn't end with one.  The root directory ("") has
+   a length of 0. */
+static unsigned int _GetDirectoryNameLength(const char* pDirectoryName)
+{
+    unsigned int    DirectoryNameLength = strlen(pDirectoryName);
+    
+    if (0 != DirectoryNameLength && '/' != pDirectoryName[DirectoryNameLength-1])
+    {
+        // Add the implicit slash to this count.
+        DirectoryNameLength++;
+    }
+    
+    return DirectoryNameLength;
+}
+
+
+/* Returns the number of slashes in a directory name, counting its trailing
+   slash even if pDirectoryName doesn't end with one.  This is the Depth of
+   the directory's SFileSystemDirectory record. */
+static unsigned int _GetDirectoryDepth(const char* pDirectoryName, unsigned int DirectoryNameLength)
+{
+    unsigned int    Depth = 0;
+    unsigned int    i;
+    
+    if (0 == DirectoryNameLength)
+    {
+        return 0;
+    }
+    for (i = 0 ; i + 1 < DirectoryNameLength ; i++)
+    {
+        if ('/' == pDirectoryName[i])
+        {
+            Depth++;
+        }
+    }
+    
+    return Depth + 1;
+}
+
+
+/* Rounds Offset up to the next multiple of Alignment (a power of 2). */
+static uintptr_t _AlignUp(uintptr_t Offset, size_t Alignment)
+{
+    return (Offset + Alignment - 1) & ~(uintptr_t)(Alignment - 1);
+}
+
+
+#if FFS_STATS
+/* Counts a newly claimed handle in the number of handles in use and raises
+   the high water mark if it has been passed.  Threads which race here retry
+   until the high water mark is at least as large as what they saw. */
+static void _CountHandleClaimed(uint32_t* pInUse, uint32_t* pHighWater)
+{
+    uint32_t    InUse = core_util_atomic_incr_u32(pInUse, 1);
+    uint32_t    HighWater = core_util_atomic_load_u32(pHighWater);
+    
+    while (InUse > HighWater && !core_util_atomic_cas_u32(pHighWater, &HighWater, InUse))
+    {
+    }
+}
+
+
+/* Counts the bytes returned by one of the file handle's read methods.  A
+   handle which wasn't opened by a FlashFileSystem has no statistics. */
+static void _CountBytesRead(SFlashFileSystemStats* pStats, ssize_t Result)
+{
+    if (pStats && Result > 0)
+    {
+        core_util_atomic_incr_u64(&pStats->BytesRead, (uint64_t)Result);
+    }
+}
+#endif
+
+
+#if FFS_STATS_HISTOGRAMS
+/* Adds the cycles which have passed since StartCycles to the bucket of a
+   histogram which holds floor(log2(cycles)). */
+static void _RecordCycles(uint32_t* pHistogram, uint32_t StartCycles)
+{
+    uint32_t        Cycles = FFS_STATS_CYCLE_COUNT() - StartCycles;
+    unsigned int    Bucket = 0;
+    
+    while (Cycles >>= 1)
+    {
+        Bucket++;
+    }
+    core_util_atomic_incr_u32(&pHistogram[Bucket], 1);
+}
+#endif
+
+
+#if FFS_LOOKUP_CACHE_SIZE > 0
+/* Returns the hash used to find a filename in the lookup cache.  Only the
+   length and up to 8 characters from each end of the name are mixed in
+   since every cache hit is compared against the image anyway and hashing
+   the whole of a long path costs more than the search it saves. */
+static unsigned int _HashCacheKey(const char* pFilename)
+{
+    size_t          Length = strlen(pFilename);
+    unsigned int    Hash = 2166136261U ^ (unsigned int)Length;
+    size_t          i;
+    
+    for (i = 0 ; i < Length ; i++)
+    {
+        if (i == 8 && Length > 16)
+        {
+            i = Length - 8;
+        }
+        Hash = (Hash ^ (unsigned char)pFilename[i]) * 16777619U;
+    }
+    
+    return Hash;
+}
+#endif
+
+
+// Constructs storage which doesn't hold an image yet.
+FlashFileSystemStorage::FlashFileSystemStorage()
+{
+    m_pBase = NULL;
+    m_Size = 0;
+#if FFS_BLOCK_DEVICE
+    m_pDevice = NULL;
+    m_Address = 0;
+    m_pCache = NULL;
+#endif
+}
+
+
+/* Points the storage at an image in memory mapped FLASH.
+   
+   Parameters:
+    pBase points to the first byte of the image.
+    Size is the number of bytes which can be read from pBase.
+    
+   Returns:
+    Nothing.
+*/
+void FlashFileSystemStorage::SetMemory(const char* pBase, ffs_offset_t Size)
+{
+    m_pBase = pBase;
+    m_Size = Size;
+}
+
+
+#if FFS_BLOCK_DEVICE
+/* Points the storage at an image on a block device.
+   
+   Parameters:
+    pDevice is the block device which holds the image.
+    Address is the address of the first byte of the image on the device.
+    Size is the number of bytes which can be read from Address.
+    pCache is the block cache used for reads from the device.
+    
+   Returns:
+    Nothing.
+*/
+void FlashFileSystemStorage::SetBlockDevice(BlockDevice* pDevice, bd_addr_t Address, ffs_offset_t Size, FlashFileSystemBlockCache* pCache)
+{
+    m_pBase = NULL;
+    m_Size = Size;
+    m_pDevice = pDevice;
+    m_Address = Address;
+    m_pCache = pCache;
+}
+
+
+/* Protected method used by Map() to copy bytes from the block device into
+   a scratch buffer.  Bytes which can't be read are returned as 0, which the
+   lookups treat like any other corrupt data.
+   
+   Parameters:
+    Offset is the offset of the bytes within the image.
+    pScratch is the buffer to be filled in.
+    Size is the number of bytes to be copied.
+    
+   Returns:
+    pScratch.
+*/
+const void* FlashFileSystemStorage::ReadScratch(ffs_offset_t Offset, void* pScratch, size_t Size)
+{
+    if (Read(Offset, pScratch, Size))
+    {
+        TRACE("FlashFileSystem: Failed to read %u bytes at offset %llu.\n", (unsigned int)Size, (unsigned long long)Offset);
+        memset(pScratch, 0, Size);
+    }
+    return pScratch;
+}
+#endif
+
+
+/* Returns a pointer to the NUL terminated string at the specified offset in
+   the image.  Strings on a block device are copied into pScratch a cache
+   line at a time until the terminator is found.
+   
+   Parameters:
+    Offset is the offset of the string within the image.
+    pScratch is the buffer which strings from a block device are copied
+        into.
+    ScratchSize is the size of pScratch in bytes.  Longer strings are
+        truncated to ScratchSize - 1 characters.
+    
+   Returns:
+    Pointer to the string.
+*/
+const char* FlashFileSystemStorage::MapString(ffs_offset_t Offset, char* pScratch, size_t ScratchSize)
+{
+#if FFS_BLOCK_DEVICE
+    if (!m_pBase)
+    {
+        size_t  Length = 0;
+        
+        while (Length < ScratchSize - 1 && Offset < m_Size)
+        {
+            size_t  Chunk = FFS_BLOCK_CACHE_LINE_SIZE - (size_t)((m_Address + Offset) % FFS_BLOCK_CACHE_LINE_SIZE);
+            
+            if (Chunk > ScratchSize - 1 - Length)
+            {
+                Chunk = ScratchSize - 1 - Length;
+            }
+            if (Chunk > m_Size - Offset)
+            {
+                Chunk = m_Size - Offset;
+            }
+            if (Read(Offset, pScratch + Length, Chunk))
+            {
+                break;
+            }
+            if (memchr(pScratch + Length, '\0', Chunk))
+            {
+                return pScratch;
+            }
+            Length += Chunk;
+            Offset += Chunk;
+        }
+        pScratch[Length] = '\0';
+        return pScratch;
+    }
+#endif
+    return m_pBase + Offset;
+}
+
+
+/* Copies bytes from the image into a caller supplied buffer.
+   
+   Parameters:
+    Offset is the offset of the bytes within the image.
+    pBuffer is the buffer to be filled in.
+    Size is the number of bytes to be copied.
+    
+   Returns:
+    0 on success or -EIO if the bytes lie outside of the image or can't be
+    read from the block device.
+*/
+int FlashFileSystemStorage::Read(ffs_offset_t Offset, void* pBuffer, size_t Size)
+{
+    if (Offset > m_Size || Size > m_Size - Offset)
+    {
+        return -EIO;
+    }
+#if FFS_BLOCK_DEVICE
+    if (!m_pBase)
+    {
+        return m_pCache->Read(m_pDevice, m_Address + Offset, pBuffer, Size);
+    }
+#endif
+    memcpy(pBuffer, m_pBase + Offset, Size);
+    return 0;
+}
+
+
+
+#if FFS_BLOCK_DEVICE
+// Constructs an empty block cache.
+FlashFileSystemBlockCache::FlashFileSystemBlockCache()
+{
+    memset(m_pDevices, 0, sizeof(m_pDevices));
+    memset(m_Addresses, 0, sizeof(m_Addresses));
+    memset(m_Lengths, 0, sizeof(m_Lengths));
+    memset(m_Referenced, 0, sizeof(m_Referenced));
+    m_Hand = 0;
+    m_pNextDevice = NULL;
+    m_NextAddress = 0;
+}
+
+
+/* Copies bytes from a block device, through the cache.  The parts of the
+   range which cover whole cache lines are read straight into the caller's
+   buffer with one device read and the partial lines at either end are
+   served from the cache.
+   
+   Parameters:
+    pDevice is the block device to read from.
+    Address is the device address of the first byte to be read.
+    pBuffer is the buffer to be filled in.
+    Size is the number of bytes to be read.
+    
+   Returns:
+    0 on success or -EIO if the device failed the read.
+*/
+int FlashFileSystemBlockCache::Read(BlockDevice* pDevice, bd_addr_t Address, void* pBuffer, size_t Size)
+{
+    char*   pDest = (char*)pBuffer;
+    int     Readahead = 1;
+    int     Result = 0;
+    
+    m_Mutex.lock();
+    while (Size > 0)
+    {
+        bd_addr_t   LineAddress = Address & ~(bd_addr_t)(FFS_BLOCK_CACHE_LINE_SIZE - 1);
+        size_t      LineOffset = (size_t)(Address - LineAddress);
+        size_t      CopyLength;
+        int         Line;
+        
+        if (0 == LineOffset && Size >= FFS_BLOCK_CACHE_LINE_SIZE)
+        {
+            CopyLength = Size & ~(size_t)(FFS_BLOCK_CACHE_LINE_SIZE - 1);
+            if (pDevice->read(pDest, Address, CopyLength))
+            {
+                Result = -EIO;
+                break;
+            }
+            m_pNextDevice = pDevice;
+            m_NextAddress = Address + CopyLength;
+        }
+        else
+        {
+            Line = FindLine(pDevice, LineAddress);
+            if (Line < 0)
+            {
+                // Only the first miss in a request can start a readahead,
+                // otherwise a random read which straddles two lines would
+                // look sequential to the second miss.
+                Line = FillLine(pDevice, LineAddress, Readahead);
+                Readahead = 0;
+            }
+            if (Line < 0 || LineOffset >= m_Lengths[Line])
+            {
+                Result = -EIO;
+                break;
+            }
+            CopyLength = m_Lengths[Line] - LineOffset;
+            if (CopyLength > Size)
+            {
+                CopyLength = Size;
+            }
+            memcpy(pDest, &m_Data[Line][LineOffset], CopyLength);
+        }
+        
+        pDest += CopyLength;
+        Address += CopyLength;
+        Size -= CopyLength;
+    }
+    m_Mutex.unlock();
+    
+    return Result;
+}
+
+
+/* Protected method which looks for a line in the cache.  The mutex must be
+   held.
+   
+   Parameters:
+    pDevice is the block device which the line was read from.
+    Address is the line aligned device address of the line.
+    
+   Returns:
+    The index of the line or -1 if it isn't cached.
+*/
+int FlashFileSystemBlockCache::FindLine(BlockDevice* pDevice, bd_addr_t Address)
+{
+    int i;
+    
+    for (i = 0 ; i < FFS_BLOCK_CACHE_LINE_COUNT ; i++)
+    {
+        if (pDevice == m_pDevices[i] && Address == m_Addresses[i])
+        {
+            m_Referenced[i] = 1;
+            return i;
+        }
+    }
+    
+    return -1;
+}
+
+
+/* Protected method which reads a line from the block device into the cache.
+   When the miss carries on from the end of the previous device read, the
+   lines which follow it are read as well, in the same device read, so that
+   sequential scans through the entry table or a file pay the device's
+   per-read latency once every FFS_BLOCK_CACHE_READAHEAD lines.  The mutex
+   must be held.
+   
+   Parameters:
+    pDevice is the block device to read from.
+    Address is the line aligned device address of the line.
+    Readahead is non-zero if the lines which follow may be read as well.
+    
+   Returns:
+    The index of the line or -EIO if it couldn't be read.
+*/
+int FlashFileSystemBlockCache::FillLine(BlockDevice* pDevice, bd_addr_t Address, int Readahead)
+{
+    bd_size_t       DeviceSize = pDevice->size();
+    unsigned int    Count = 1;
+    unsigned int    First;
+    bd_size_t       Length;
+    unsigned int    i;
+    
+    if (Address >= DeviceSize)
+    {
+        return -EIO;
+    }
+    
+    // Stop the readahead before lines which are already cached.
+    if (Readahead && pDevice == m_pNextDevice && Address == m_NextAddress)
+    {
+        while (Count < FFS_BLOCK_CACHE_READAHEAD &&
+               Address + Count * FFS_BLOCK_CACHE_LINE_SIZE < DeviceSize &&
+               FindLine(pDevice, Address + Count * FFS_BLOCK_CACHE_LINE_SIZE) < 0)
+        {
+            Count++;
+        }
+    }
+    
+    // A single line replaces the first line which the CLOCK hand finds
+    // unreferenced.  A readahead needs adjacent lines so it takes the run
+    // which starts at the hand.
+    if (1 == Count)
+    {
+        for (i = 0 ; i < 2 * FFS_BLOCK_CACHE_LINE_COUNT && m_Referenced[m_Hand] ; i++)
+        {
+            m_Referenced[m_Hand] = 0;
+            m_Hand = (m_Hand + 1) % FFS_BLOCK_CACHE_LINE_COUNT;
+        }
+    }
+    if (m_Hand + Count > FFS_BLOCK_CACHE_LINE_COUNT)
+    {
+        m_Hand = 0;
+    }
+    First = m_Hand;
+    m_Hand = (m_Hand + Count) % FFS_BLOCK_CACHE_LINE_COUNT;
+    
+    // The lines are left empty if the read fails.
+    Length = (bd_size_t)Count * FFS_BLOCK_CACHE_LINE_SIZE;
+    if (Length > DeviceSize - Address)
+    {
+        Length = DeviceSize - Address;
+    }
+    for (i = 0 ; i < Count ; i++)
+    {
+        m_pDevices[First + i] = NULL;
+    }
+    if (pDevice->read(m_Data[First], Address, Length))
+    {
+        TRACE("FlashFileSystem: Failed to read %u bytes from the block device.\n", (unsigned int)Length);
+        return -EIO;
+    }
+    for (i = 0 ; i < Count ; i++)
+    {
+        bd_size_t   LineLength = Length - (bd_size_t)i * FFS_BLOCK_CACHE_LINE_SIZE;
+        
+        m_pDevices[First + i] = pDevice;
+        m_Addresses[First + i] = Address + (bd_addr_t)i * FFS_BLOCK_CACHE_LINE_SIZE;
+        m_Lengths[First + i] = (LineLength < FFS_BLOCK_CACHE_LINE_SIZE) ? (uint32_t)LineLength : FFS_BLOCK_CACHE_LINE_SIZE;
+        m_Referenced[First + i] = 0;
+    }
+    m_pNextDevice = pDevice;
+    m_NextAddress = Address + Length;
+    
+    return First;
+}
+#endif
+
+
+
+#if FFS_MAPPED_FILE
+// Constructs an object with no file open.
+FlashFileSystemMappedFile::FlashFileSystemMappedFile()
+{
+    m_pData = NULL;
+    m_Size = 0;
+}
+
+
+// Unmaps the file.  The file systems using it must already be destroyed.
+FlashFileSystemMappedFile::~FlashFileSystemMappedFile()
+{
+    Close();
+}
+
+
+/* Maps an image file read-only into memory, replacing any file which was
+   already open.  The mapping stays valid after the file is closed, so no
+   descriptor is kept open.
+
+   Parameters:
+    pFilename is the path of the image file on the host.
+    Flags is a combination of the FFS_MAP_* hints.  FFS_MAP_POPULATE reads
+        the whole file into the page cache before returning, which suits
+        tools that are about to touch most of a large image.
+
+   Returns:
+    0 on success, -EINVAL if the file is empty or isn't a regular file,
+    -EFBIG if it is too large to map, or the negative errno value from the
+    system call which failed.
+*/
+int FlashFileSystemMappedFile::Open(const char* pFilename, unsigned int Flags)
+{
+    struct stat Stat;
+    void*       pData;
+    int         MapFlags = MAP_PRIVATE;
+    int         File;
+    int         Result;
+    
+    Close();
+    File = ::open(pFilename, O_RDONLY | O_CLOEXEC);
+    if (File < 0)
+    {
+        return -errno;
+    }
+    if (fstat(File, &Stat))
+    {
+        Result = -errno;
+        ::close(File);
+        return Result;
+    }
+    if (!S_ISREG(Stat.st_mode) || 0 == Stat.st_size)
+    {
+        ::close(File);
+        return -EINVAL;
+    }
+    if ((uint64_t)Stat.st_size > SIZE_MAX)
+    {
+        ::close(File);
+        return -EFBIG;
+    }
+#ifdef MAP_POPULATE
+    if (Flags & FFS_MAP_POPULATE)
+    {
+        MapFlags |= MAP_POPULATE;
+    }
+#endif
+    pData = mmap(NULL, (size_t)Stat.st_size, PROT_READ, MapFlags, File, 0);
+    Result = (MAP_FAILED == pData) ? -errno : 0;
+    ::close(File);
+    if (Result)
+    {
+        return Result;
+    }
+    m_pData = (const uint8_t*)pData;
+    m_Size = (size_t)Stat.st_size;
+    
+    // The hints only affect performance so a kernel which ignores them is
+    // fine.  MAP_POPULATE has already read the file where it is supported.
+#ifdef MAP_POPULATE
+    Advise(Flags & ~FFS_MAP_POPULATE);
+#else
+    Advise(Flags);
+#endif
+    
+    return 0;
+}
+
+
+/* Tells the kernel how the mapped image is about to be read, so that a tool
+   can switch to FFS_MAP_SEQUENTIAL while it scans every file and back to
+   FFS_MAP_RANDOM when it starts serving lookups.
+
+   Parameters:
+    Flags is a combination of the FFS_MAP_* hints.  FFS_MAP_SEQUENTIAL takes
+        priority over FFS_MAP_RANDOM and giving neither restores the default
+        readahead.  FFS_MAP_POPULATE starts reading the whole image into the
+        page cache in the background.
+
+   Returns:
+    0 on success, -EBADF if no file is open, or the negative errno value
+    from madvise().
+*/
+int FlashFileSystemMappedFile::Advise(unsigned int Flags)
+{
+    int Advice = MADV_NORMAL;
+    
+    if (!m_pData)
+    {
+        return -EBADF;
+    }
+    if (Flags & FFS_MAP_SEQUENTIAL)
+    {
+        Advice = MADV_SEQUENTIAL;
+    }
+    else if (Flags & FFS_MAP_RANDOM)
+    {
+        Advice = MADV_RANDOM;
+    }
+    if (madvise((void*)m_pData, m_Size, Advice))
+    {
+        return -errno;
+    }
+    if ((Flags & FFS_MAP_POPULATE) && madvise((void*)m_pData, m_Size, MADV_WILLNEED))
+    {
+        return -errno;
+    }
+    
+    return 0;
+}
+
+
+// Unmaps the file if one is open.
+void FlashFileSystemMappedFile::Close()
+{
+    if (m_pData)
+    {
+        munmap((void*)m_pData, m_Size);
+    }
+    m_pData = NULL;
+    m_Size = 0;
+}
+#endif
+
+
+
+#if FFS_ACCESS_TRACE
+/* Returns non-zero for the types of access record which are followed by a
+   name. */
+static int _IsNamedAccess(unsigned int Type)
+{
+    return (FFS_ACCESS_OPEN == Type || FFS_ACCESS_OPEN_ENCODED == Type || FFS_ACCESS_OPENDIR == Type);
+}
+
+
+// Constructs an access trace which is disabled.
+FlashFileSystemAccessTrace::FlashFileSystemAccessTrace()
+{
+    m_pSlots = NULL;
+    m_pRing = NULL;
+    m_Mask = 0;
+    m_Head = 0;
+}
+
+
+/* Starts recording into a ring buffer, discarding anything recorded into a
+   previous one.  The ring uses the largest power of 2 number of 24 byte
+   slots which fits in the buffer.
+   
+   Parameters:
+    pBuffer is the ring buffer.  It must be 8-byte aligned and stay valid
+        until tracing is disabled.
+    BufferSize is the size of the buffer in bytes.
+    
+   Returns:
+    0 on success or -EINVAL if the buffer can't hold 2 slots.
+*/
+int FlashFileSystemAccessTrace::Enable(void* pBuffer, size_t BufferSize)
+{
+    size_t  SlotCount = 2;
+    
+    if (!pBuffer || ((uintptr_t)pBuffer & 7) || BufferSize < SlotCount * sizeof(SFileSystemAccessRecord))
+    {
+        return -EINVAL;
+    }
+    while (SlotCount < 0x80000000 && SlotCount * 2 * sizeof(SFileSystemAccessRecord) <= BufferSize)
+    {
+        SlotCount *= 2;
+    }
+    
+    // Stop recording into the old ring before switching to the new one.
+    m_pSlots = NULL;
+    core_util_atomic_store_u32(&m_Mask, SlotCount - 1);
+    core_util_atomic_store_u32(&m_Head, 0);
+    m_pRing = (SFileSystemAccessRecord*)pBuffer;
+    m_pSlots = m_pRing;
+    
+    return 0;
+}
+
+
+/* Stops recording.  Calls which are already being recorded can still write
+   their records into the ring buffer before they return. */
+void FlashFileSystemAccessTrace::Disable()
+{
+    m_pSlots = NULL;
+}
+
+
+/* Copies the whole records which are still in the ring buffer, oldest first,
+   into a linear buffer which can be saved and replayed later.  They are
+   preceded by an SFileSystemAccessTraceHeader.  Slots whose record has been
+   overwritten are skipped.  Tracing should be disabled first since records
+   which are being written while they are copied can be torn.
+   
+   Parameters:
+    pDest is the buffer to be filled in.
+    DestSize is the size of pDest in bytes.
+    
+   Returns:
+    The number of bytes copied into pDest, a multiple of 24, or 0 if pDest
+    can't hold the header.
+*/
+size_t FlashFileSystemAccessTrace::Copy(void* pDest, size_t DestSize)
+{
+    const SFileSystemAccessRecord*  pSlots = m_pRing;
+    char*                           pOut = (char*)pDest;
+    size_t                          Capacity = DestSize / sizeof(SFileSystemAccessRecord);
+    size_t                          Copied = 1;
+    SFileSystemAccessTraceHeader    Header;
+    uint32_t                        Mask;
+    uint32_t                        Head;
+    uint32_t                        Pos;
+    
+    if (!pSlots || Capacity < 1)
+    {
+        return 0;
+    }
+    
+    // The header takes up the first slot so that the records stay aligned.
+    memset(&Header, 0, sizeof(Header));
+    Header.Signature = FFS_ACCESS_TRACE_SIGNATURE;
+    Header.Version = FFS_ACCESS_TRACE_VERSION_2;
+    Header.RecordSize = sizeof(SFileSystemAccessRecord);
+    memcpy(pOut, &Header, sizeof(Header));
+    
+    Mask = core_util_atomic_load_u32(&m_Mask);
+    Head = core_util_atomic_load_u32(&m_Head);
+    Pos = (Head > Mask) ? Head - Mask - 1 : 0;
+    
+    while (Pos != Head)
+    {
+        const SFileSystemAccessRecord*  pRecord = &pSlots[Pos & Mask];
+        uint32_t                        SlotCount = 1;
+        uint32_t                        i;
+        
+        // A record is only trusted if its slot number matches the position
+        // it was found at.  Anything else is a name or an overwritten slot.
+        if (pRecord->Sequence != Pos || 
+            pRecord->Type < FFS_ACCESS_OPEN || 
+            pRecord->Type > FFS_ACCESS_CLOSEDIR)
+        {
+            Pos++;
+            continue;
+        }
+        if (_IsNamedAccess(pRecord->Type))
+        {
+            SlotCount += (uint32_t)((pRecord->Value + sizeof(SFileSystemAccessRecord) - 1) / sizeof(SFileSystemAccessRecord));
+        }
+        if (SlotCount > Head - Pos || Copied + SlotCount > Capacity)
+        {
+            break;
+        }
+        for (i = 0 ; i < SlotCount ; i++)
+        {
+            memcpy(pOut + (Copied + i) * sizeof(SFileSystemAccessRecord), 
+                   &pSlots[(Pos + i) & Mask], 
+                   sizeof(SFileSystemAccessRecord));
+        }
+        Copied += SlotCount;
+        Pos += SlotCount;
+    }
+    
+    return Copied * sizeof(SFileSystemAccessRecord);
+}
+
+
+/* Records a call in the ring buffer if tracing is enabled.  The record and
+   the slots for its name are reserved with one atomic add and the record's
+   slot number is written last.
+   
+   Parameters:
+    Type is the FFS_ACCESS_* type of the call.
+    Whence is the SFileSystemAccessRecord::Whence of the call.
+    Handle is the number of the handle which the call was made on or
+        FFS_ACCESS_NO_HANDLE.
+    Value is the SFileSystemAccessRecord::Value of the call, which is the
+        length of pName for the open events.  Negative seek offsets are
+        recorded in two's complement.
+    Result is the value returned by the call.
+    pName is the name passed to the open events and NULL otherwise.
+    
+   Returns:
+    Nothing.
+*/
+void FlashFileSystemAccessTrace::Record(unsigned int Type, 
+                                        unsigned int Whence, 
+                                        unsigned int Handle, 
+                                        uint64_t     Value, 
+                                        int64_t      Result, 
+                                        const char*  pName)
+{
+    SFileSystemAccessRecord*    pSlots = m_pSlots;
+    SFileSystemAccessRecord*    pRecord;
+    uint32_t                    Mask;
+    uint32_t                    SlotCount = 1;
+    uint32_t                    Start;
+    uint32_t                    i;
+    
+    if (!pSlots)
+    {
+        return;
+    }
+    Mask = core_util_atomic_load_u32(&m_Mask);
+    if (pName)
+    {
+        SlotCount += (uint32_t)((Value + sizeof(SFileSystemAccessRecord) - 1) / sizeof(SFileSystemAccessRecord));
+    }
+    
+    // Names which don't fit in the ring aren't recorded at all.
+    if (SlotCount > Mask)
+    {
+        return;
+    }
+    Start = core_util_atomic_incr_u32(&m_Head, SlotCount) - SlotCount;
+    
+    for (i = 1 ; i < SlotCount ; i++)
+    {
+        char*   pDest = (char*)&pSlots[(Start + i) & Mask];
+        size_t  Offset = (i - 1) * sizeof(SFileSystemAccessRecord);
+        size_t  Length = Value - Offset;
+        
+        if (Length > sizeof(SFileSystemAccessRecord))
+        {
+            Length = sizeof(SFileSystemAccessRecord);
+        }
+        memcpy(pDest, pName + Offset, Length);
+        memset(pDest + Length, 0, sizeof(SFileSystemAccessRecord) - Length);
+    }
+    pRecord = &pSlots[Start & Mask];
+    pRecord->Type = Type;
+    pRecord->Whence = Whence;
+    pRecord->Handle = Handle;
+    pRecord->Value = Value;
+    pRecord->Result = Result;
+    core_util_atomic_store_u32((volatile uint32_t*)&pRecord->Sequence, Start);
+}
+#endif
+
+
+
+/* Constructor for FlashFileSystemFileHandle which initializes to the specified
+   file entry in the image.
+   
+   Parameters:
+    pFileStart is the beginning offset of this file in FLASH memory.
+    pFileEnd is the ending offset (1 bytes past last valid byte) of this file
+        FLASH memory.
+*/
+FlashFileSystemFileHandle::FlashFileSystemFileHandle(const char* pFileStart,
+                                                     const char* pFileEnd)
+{
+    SetEntry(pFileStart, pFileEnd);
+#if FFS_STATS
+    m_pStats = NULL;
+#endif
+#if FFS_ACCESS_TRACE
+    m_pAccessTrace = NULL;
+    m_AccessTraceId = FFS_ACCESS_NO_HANDLE;
+#endif
+    m_InUse = 0;
+}
+
+
+// Constructs a blank FlashFileSystemFileHandle object.
+FlashFileSystemFileHandle::FlashFileSystemFileHandle()
+{
+    SetEntry(NULL, NULL);
+#if FFS_STATS
+    m_pStats = NULL;
+#endif
+#if FFS_ACCESS_TRACE
+    m_pAccessTrace = NULL;
+    m_AccessTraceId = FFS_ACCESS_NO_HANDLE;
+#endif
+    m_InUse = 0;
+}
+
+
+/* Used by FlashFileSystem to point a handle at the data of a file which
+   isn't compressed.
+   
+   Parameters:
+    pStorage is the storage of the image which holds the file.
+    FileOffset is the offset of the file's data within the image.
+    FileSize is the number of bytes in the file.
+    
+   Returns:
+    Nothing.
+*/
+void FlashFileSystemFileHandle::SetEntry(FlashFileSystemStorage* pStorage, ffs_offset_t FileOffset, ffs_offset_t FileSize)
+{
+    const char* pBase = pStorage->GetBase();
+    
+#if FFS_BLOCK_DEVICE
+    if (!pBase)
+    {
+        SetEntry(NULL, NULL);
+        m_pStorage = pStorage;
+        m_FileOffset = FileOffset;
+        m_FileSize = FileSize;
+        return;
+    }
+#endif
+    SetEntry(pBase + FileOffset, pBase + FileOffset + FileSize);
+}
+
+
+/* Used by FlashFileSystem to point a handle at the data of a compressed
+   file.
+   
+   Parameters:
+    pStorage is the storage of the image which holds the file.
+    FileOffset is the offset of the file's SFileSystemCompressedFile header
+        within the image.
+    FileSize is the number of bytes stored for the file, including the
+        header.
+    pCompressedFile is the file's header, which has already been checked.
+    pBlockBuffer is the buffer to decompress the file's blocks into.
+    pFileSystem is the file system which owns the handle.
+    
+   Returns:
+    Nothing.
+*/
+void FlashFileSystemFileHandle::SetCompressedEntry(FlashFileSystemStorage*          pStorage, 
+                                                   ffs_offset_t                     FileOffset, 
+                                                   ffs_offset_t                     FileSize, 
+                                                   const SFileSystemCompressedFile* pCompressedFile,
+                                                   SFlashFileSystemBlockBuffer*     pBlockBuffer,
+                                                   FlashFileSystem*                 pFileSystem)
+{
+    SetEntry(pStorage, FileOffset, FileSize);
+    m_UncompressedSize = pCompressedFile->UncompressedSize;
+    m_BlockSize = pCompressedFile->BlockSize;
+    m_pBlockBuffer = pBlockBuffer;
+    m_pFileSystem = pFileSystem;
+}
+    
+
+/* Write the contents of a buffer to the file
+
+   Parameters:
+    pBuffer is the buffer from which to write.
+    Length is the number of characters to write.
+
+   Returns
+    The number of characters written (possibly 0) on success, -1 on error.
+ */
+ssize_t FlashFileSystemFileHandle::write(const void* pBuffer, size_t Length)
+{
+    // This file system doesn't support writing.
+    return -1;
+}
+
+
+/* Close the file
+
+   Returns
+    Zero on success, -1 on error.
+*/
+int FlashFileSystemFileHandle::close()
+{
+    // Return the block buffer of a compressed file to the pool.
+    if (m_pBlockBuffer)
+    {
+        core_util_atomic_store_u8(&m_pBlockBuffer->InUse, 0);
+    }
+    SetEntry(NULL, NULL);
+#if FFS_ACCESS_TRACE
+    if (m_pAccessTrace)
+    {
+        m_pAccessTrace->Record(FFS_ACCESS_CLOSE, 0, m_AccessTraceId, 0, 0);
+    }
+#endif
+#if FFS_STATS
+    if (m_pStats)
+    {
+        core_util_atomic_decr_u32(&m_pStats->FileHandlesInUse, 1);
+    }
+#endif
+    
+    // Release the handle last so that it isn't reused while being cleared.
+    core_util_atomic_store_u8(&m_InUse, 0);
+    
+    return 0;
+}
+
+/*  Reads the contents of the file into a buffer.
+
+   Parameters
+    pBuffer is the buffer into which the read should occur.
+    Length is the number of characters to read into pBuffer.
+
+   Returns
+    The number of characters read (zero at end of file) on success, -EIO if
+    the data couldn't be read from the block device.
+*/
+ssize_t FlashFileSystemFileHandle::read(void* pBuffer, size_t Length)
+{
+#if FFS_STATS_HISTOGRAMS
+    uint32_t        StartCycles = FFS_STATS_CYCLE_COUNT();
+#endif
+    ssize_t         Result;
+
+    if (m_BlockSize)
+    {
+        Result = ReadCompressed(pBuffer, Length);
+    }
+    else
+    {
+        Result = ReadUncompressed(pBuffer, Length);
+    }
+    
+#if FFS_STATS
+    _CountBytesRead(m_pStats, Result);
+#endif
+#if FFS_STATS_HISTOGRAMS
+    if (m_pStats)
+    {
+        _RecordCycles(m_pStats->ReadCycles, StartCycles);
+    }
+#endif
+#if FFS_ACCESS_TRACE
+    if (m_pAccessTrace)
+    {
+        m_pAccessTrace->Record(FFS_ACCESS_READ, 0, m_AccessTraceId, Length, Result);
+    }
+#endif
+    
+    return Result;
+}
+
+
+/* Protected method which reads the contents of a file which isn't
+   compressed, starting at the current file position.
+
+   Parameters
+    pBuffer is the buffer into which the read should occur.
+    Length is the number of characters to read into pBuffer.
+
+   Returns
+    The number of characters read (zero at end of file) on success, -EIO if
+    the data couldn't be read from the block device.
+*/
+ssize_t FlashFileSystemFileHandle::ReadUncompressed(void* pBuffer, size_t Length)
+{
+    ffs_offset_t    BytesLeft;
+
+    // Don't read more bytes than what are left in the file.
+    if (m_Position < 0 || m_Position >= (off_t)m_FileSize)
+    {
+        return 0;
+    }
+    BytesLeft = m_FileSize - m_Position;
+    if (Length > BytesLeft)
+    {
+        Length = BytesLeft;
+    }
+    
+    // Copy the bytes from FLASH into the caller provided buffer.
+    if (ReadData(m_Position, pBuffer, Length))
+    {
+        return -EIO;
+    }
+    
+    // Update the file pointer.
+    m_Position += Length;
+    
+    return Length;
+}
+
+
+/* Returns a pointer to the contents of the file at the current file position
+   instead of copying them into a caller provided buffer.  Since the file
+   system image is already mapped into the device's address space, the
+   returned data can be handed directly to DMA engines or network stacks.
+   Repeated calls walk through the file in chunks of up to Length bytes.
+
+   Parameters
+    ppBuffer is filled in with a pointer to the data at the current file
+        position.  The pointer remains valid for as long as the file system
+        is mounted.
+    Length is the maximum number of bytes the caller wants to consume.
+
+   Returns
+    The number of bytes available at *ppBuffer (zero at end of file), or
+    -EINVAL for compressed files since their data must be decompressed by
+    read() and for files on a block device since they aren't mapped into
+    memory.
+*/
+ssize_t FlashFileSystemFileHandle::ReadDirect(const void** ppBuffer, size_t Length)
+{
+    ffs_offset_t    BytesLeft;
+
+    if (m_BlockSize || !m_pFileStart)
+    {
+        return -EINVAL;
+    }
+
+    // Don't return more bytes than what are left in the file.
+    if (m_Position < 0 || m_Position >= (off_t)m_FileSize)
+    {
+        *ppBuffer = m_pFileStart + m_FileSize;
+        return 0;
+    }
+    BytesLeft = m_FileSize - m_Position;
+    if (Length > BytesLeft)
+    {
+        Length = BytesLeft;
+    }
+    
+    // Hand out a pointer to the FLASH data and update the file pointer as if
+    // it had been read.
+    *ppBuffer = m_pFileStart + m_Position;
+    m_Position += Length;
+#if FFS_STATS
+    _CountBytesRead(m_pStats, Length);
+#endif
+    
+    return Length;
+}
+
+
+/* Reads the contents of the file at a given offset into a buffer without
+   using or updating the file position, like pread().  Since nothing in the
+   handle is modified, any number of threads can call it on the same handle
+   at once.
+
+   Parameters
+    pBuffer is the buffer into which the read should occur.
+    Length is the number of characters to read into pBuffer.
+    Offset is the position in the file from which to start reading.
+
+   Returns
+    The number of characters read (zero at or past the end of the file) on
+    success, -EINVAL if Offset is negative, -ENOSR if the file is compressed
+    and no block buffer is free, or -EIO if the data couldn't be read.
+*/
+ssize_t FlashFileSystemFileHandle::ReadAt(void* pBuffer, size_t Length, off_t Offset)
+{
+    SFlashFileSystemIoVector    Vector;
+    
+    Vector.pBuffer = pBuffer;
+    Vector.Length = Length;
+    
+    return ReadVectorAt(&Vector, 1, Offset);
+}
+
+
+/* Scatters the contents of the file starting at a given offset across
+   several buffers in one call, like preadv().  Each buffer is filled
+   completely before moving on to the next one.  As with ReadAt(), the file
+   position isn't used or updated.  Compressed files are decompressed into
+   a block buffer which is only claimed for the length of the call, so the
+   handle's own block buffer is left alone.
+
+   Parameters
+    pVectors is the array of buffers to be filled in order.
+    VectorCount is the number of elements in pVectors.
+    Offset is the position in the file from which to start reading.
+
+   Returns
+    The total number of characters read into all of the buffers, which is
+    less than their total length only when the end of the file is reached,
+    -EINVAL if Offset or VectorCount is negative, -ENOSR if the file is
+    compressed and no block buffer is free, or -EIO if the data couldn't be
+    read from the block device or is corrupt.
+*/
+ssize_t FlashFileSystemFileHandle::ReadVectorAt(const SFlashFileSystemIoVector* pVectors,
+                                                int                             VectorCount,
+                                                off_t                           Offset)
+{
+    ffs_offset_t    Curr;
+    ffs_offset_t    BytesLeft;
+    int             i;
+
+    if (Offset < 0 || VectorCount < 0)
+    {
+        return -EINVAL;
+    }
+    if (m_BlockSize)
+    {
+        return ReadVectorAtCompressed(pVectors, VectorCount, Offset);
+    }
+    if ((uint64_t)Offset >= m_FileSize)
+    {
+        return 0;
+    }
+    
+    // Work from a local position so that the handle is never written.
+    Curr = (ffs_offset_t)Offset;
+    for (i = 0 ; i < VectorCount && Curr < m_FileSize ; i++)
+    {
+        size_t  Length = pVectors[i].Length;
+        
+        BytesLeft = m_FileSize - Curr;
+        if (Length > BytesLeft)
+        {
+            Length = BytesLeft;
+        }
+        if (ReadData(Curr, pVectors[i].pBuffer, Length))
+        {
+            return -EIO;
+        }
+        Curr += Length;
+    }
+#if FFS_STATS
+    _CountBytesRead(m_pStats, Curr - (ffs_offset_t)Offset);
+#endif
+    
+    return Curr - (ffs_offset_t)Offset;
+}
+
+
+/* Move the file position to a given offset from a given location.
+ 
+   Parameters
+    offset is the offset from whence to move to.
+    whence - SEEK_SET for the start of the file, 
+             SEEK_CUR for the current file position, or 
+             SEEK_END for the end of the file.
+  
+   Returns
+    New file position on success, -1 on failure or unsupported
+*/
+off_t FlashFileSystemFileHandle::seek(off_t offset, int whence)
+{
+    off_t   Position = m_Position;
+    
+    switch(whence)
+    {
+    case SEEK_SET:
+        Position = offset;
+        break;
+    case SEEK_CUR:
+        Position += offset;
+        break;
+    case SEEK_END:
+        Position = (size() - 1) + offset;
+        break;
+    default:
+        TRACE("FlashFileSytem: Received unknown origin code (%d) for seek.\r\n", whence);
+        return -1;
+    }
+    
+    // Seeking within a compressed file doesn't decompress anything until the
+    // next read.
+    m_Position = Position;
+#if FFS_ACCESS_TRACE
+    if (m_pAccessTrace)
+    {
+        m_pAccessTrace->Record(FFS_ACCESS_SEEK, whence, m_AccessTraceId, (uint64_t)offset, Position);
+    }
+#endif
+    
+    return Position;
+}
+
+
+/* Returns the length of the file.
+
+   Parameters:
+    None
+   Returns:
+    Length of file.
+*/
+off_t FlashFileSystemFileHandle::size()
+{
+    if (m_BlockSize)
+    {
+        return m_UncompressedSize;
+    }
+    return m_FileSize;
+}
+
+
+/* Reads the contents of a compressed file into a buffer, decompressing only
+   the blocks which overlap the requested range.
+
+   Parameters
+    pBuffer is the buffer into which the read should occur.
+    Length is the number of characters to read into pBuffer.
+
+   Returns
+    The number of characters read (zero at end of file) on success, -EIO if
+    the compressed data is corrupt.
+*/
+ssize_t FlashFileSystemFileHandle::ReadCompressed(void* pBuffer, size_t Length)
+{
+    unsigned int    UncompressedSize = m_UncompressedSize;
+    unsigned int    BlockSize = m_BlockSize;
+    char*           pDest = (char*)pBuffer;
+    
+    // Don't read more bytes than what are left in the file.
+    if (m_Position < 0 || m_Position >= (off_t)UncompressedSize)
+    {
+        return 0;
+    }
+    if (Length > (size_t)(UncompressedSize - m_Position))
+    {
+        Length = UncompressedSize - m_Position;
+    }
+    
+    while (Length > 0)
+    {
+        unsigned int    Block = m_Position / BlockSize;
+        unsigned int    BlockOffset = m_Position % BlockSize;
+        unsigned int    BlockLength = UncompressedSize - Block * BlockSize;
+        unsigned int    CopyLength;
+        const char*     pBlock;
+        
+        if (BlockLength > BlockSize)
+        {
+            BlockLength = BlockSize;
+        }
+        pBlock = LoadBlock(Block, BlockLength);
+        if (!pBlock)
+        {
+            TRACE("FlashFileSystem: Failed to decompress block %u.\n", Block);
+            return -EIO;
+        }
+        
+        CopyLength = BlockLength - BlockOffset;
+        if (CopyLength > Length)
+        {
+            CopyLength = Length;
+        }
+        memcpy(pDest, pBlock + BlockOffset, CopyLength);
+        
+        pDest += CopyLength;
+        Length -= CopyLength;
+        m_Position += CopyLength;
+    }
+    
+    return pDest - (char*)pBuffer;
+}
+
+
+/* Protected method which scatters the uncompressed contents of a compressed
+   file across several buffers for ReadVectorAt().  The blocks are
+   decompressed into a block buffer claimed from the file system for the
+   length of the call so that any number of threads can read through the
+   handle at once.
+
+   Parameters
+    pVectors is the array of buffers to be filled in order.
+    VectorCount is the number of elements in pVectors.
+    Offset is the non-negative position in the uncompressed contents from
+        which to start reading.
+
+   Returns
+    The total number of characters read into all of the buffers, -ENOSR if
+    no block buffer is free, or -EIO if the compressed data is corrupt.
+*/
+ssize_t FlashFileSystemFileHandle::ReadVectorAtCompressed(const SFlashFileSystemIoVector* pVectors,
+                                                          int                             VectorCount,
+                                                          off_t                           Offset)
+{
+    unsigned int                    UncompressedSize = m_UncompressedSize;
+    unsigned int                    BlockSize = m_BlockSize;
+    unsigned int                    LoadedBlock = ~0U;
+    const char*                     pBlock = NULL;
+    SFlashFileSystemBlockBuffer*    pBlockBuffer;
+    uint64_t                        Curr;
+    int                             i;
+
+    if ((uint64_t)Offset >= UncompressedSize)
+    {
+        return 0;
+    }
+    pBlockBuffer = m_pFileSystem->FindFreeBlockBuffer();
+    if (!pBlockBuffer)
+    {
+        TRACE("FlashFileSystem: Block buffer table is full.\n");
+        return -ENOSR;
+    }
+    
+    Curr = (uint64_t)Offset;
+    for (i = 0 ; i < VectorCount && Curr < UncompressedSize ; i++)
+    {
+        char*   pDest = (char*)pVectors[i].pBuffer;
+        size_t  Length = pVectors[i].Length;
+        
+        if (Length > UncompressedSize - Curr)
+        {
+            Length = UncompressedSize - Curr;
+        }
+        while (Length > 0)
+        {
+            unsigned int    Block = Curr / BlockSize;
+            unsigned int    BlockOffset = Curr % BlockSize;
+            unsigned int    BlockLength = UncompressedSize - Block * BlockSize;
+            unsigned int    CopyLength;
+            
+            if (BlockLength > BlockSize)
+            {
+                BlockLength = BlockSize;
+            }
+            if (Block != LoadedBlock)
+            {
+                pBlock = DecodeBlock(Block, BlockLength, pBlockBuffer);
+                if (!pBlock)
+                {
+                    TRACE("FlashFileSystem: Failed to decompress block %u.\n", Block);
+                    core_util_atomic_store_u8(&pBlockBuffer->InUse, 0);
+                    return -EIO;
+                }
+                LoadedBlock = Block;
+            }
+            
+            CopyLength = BlockLength - BlockOffset;
+            if (CopyLength > Length)
+            {
+                CopyLength = Length;
+            }
+            memcpy(pDest, pBlock + BlockOffset, CopyLength);
+            
+            pDest += CopyLength;
+            Length -= CopyLength;
+            Curr += CopyLength;
+        }
+    }
+    core_util_atomic_store_u8(&pBlockBuffer->InUse, 0);
+#if FFS_STATS
+    _CountBytesRead(m_pStats, Curr - (uint64_t)Offset);
+#endif
+    
+    return Curr - (uint64_t)Offset;
+}
+
+
+/* Returns a pointer to the uncompressed contents of a block in a compressed
+   file.  The block is decoded into the handle's block buffer, where it is
+   kept until a different block is needed.
+
+   Parameters
+    Block is the index of the block to be loaded.
+    BlockLength is the uncompressed length of the block.
+
+   Returns
+    Pointer to the uncompressed block contents or NULL if the block is
+    corrupt.
+*/
+const char* FlashFileSystemFileHandle::LoadBlock(unsigned int Block, unsigned int BlockLength)
+{
+    const char* pBlock;
+    
+    if (m_CachedBlock == Block)
+    {
+        return m_pBlockBuffer->Data;
+    }
+    
+    pBlock = DecodeBlock(Block, BlockLength, m_pBlockBuffer);
+    if (pBlock == m_pBlockBuffer->Data)
+    {
+        m_CachedBlock = Block;
+    }
+    else if (!pBlock)
+    {
+        m_CachedBlock = ~0U;
+    }
+    
+    return pBlock;
+}
+
+
+/* Protected method which returns a pointer to the uncompressed contents of a
+   block in a compressed file.  Blocks which were stored without compression
+   are returned directly from FLASH and the rest are decompressed into the
+   given block buffer.  Blocks of images on a block device are always read
+   into the block buffer.
+
+   Parameters
+    Block is the index of the block to be decoded.
+    BlockLength is the uncompressed length of the block.
+    pBlockBuffer is the buffer into which the block can be decoded.
+
+   Returns
+    Pointer to the uncompressed block contents or NULL if the block is
+    corrupt.
+*/
+const char* FlashFileSystemFileHandle::DecodeBlock(unsigned int                 Block, 
+                                                   unsigned int                 BlockLength, 
+                                                   SFlashFileSystemBlockBuffer* pBlockBuffer)
+{
+    unsigned int        BlockOffsets[2];
+    const unsigned int* pBlockOffsets;
+    unsigned int        Start;
+    unsigned int        End;
+    const char*         pCompressed;
+    
+    pBlockOffsets = (const unsigned int*)MapData(sizeof(SFileSystemCompressedFile) + Block * sizeof(unsigned int),
+                                                 BlockOffsets, 
+                                                 sizeof(BlockOffsets));
+    Start = pBlockOffsets[0];
+    End = pBlockOffsets[1];
+    if (Start > End || End > m_FileSize)
+    {
+        return NULL;
+    }
+    if (End - Start == BlockLength && m_pFileStart)
+    {
+        return m_pFileStart + Start;
+    }
+    
+    if (End - Start == BlockLength)
+    {
+        if (ReadData(Start, pBlockBuffer->Data, BlockLength))
+        {
+            return NULL;
+        }
+    }
+    else
+    {
+#if FFS_BLOCK_DEVICE
+        if (End - Start > sizeof(pBlockBuffer->Compressed))
+        {
+            return NULL;
+        }
+        pCompressed = MapData(Start, pBlockBuffer->Compressed, End - Start);
+#else
+        pCompressed = m_pFileStart + Start;
+#endif
+        if ((int)BlockLength != FFSLZ4Decompress(pCompressed, End - Start, 
+                                                 pBlockBuffer->Data, BlockLength))
+        {
+            return NULL;
+        }
+    }
+    
+    return pBlockBuffer->Data;
+}
+
+
+/* Protected method which copies part of the file's stored data into a
+   buffer.  The range must lie within the file.
+
+   Parameters
+    Offset is the offset of the data within the file's stored data.
+    pBuffer is the buffer to be filled in.
+    Length is the number of bytes to be copied.
+
+   Returns
+    0 on success or -EIO if the data couldn't be read from the block device.
+*/
+int FlashFileSystemFileHandle::ReadData(ffs_offset_t Offset, void* pBuffer, size_t Length)
+{
+#if FFS_BLOCK_DEVICE
+    if (!m_pFileStart)
+    {
+        return m_pStorage->Read(m_FileOffset + Offset, pBuffer, Length);
+    }
+#endif
+#if FFS_WIDE_COPY
+    FFSCopy(pBuffer, m_pFileStart + Offset, Length);
+#else
+    memcpy(pBuffer, m_pFileStart + Offset, Length);
+#endif
+    return 0;
+}
+
+
+/* Protected method which returns a pointer to part of the file's stored
+   data, copying it into pScratch first for files on a block device.  Data
+   which can't be read is returned as 0.
+
+   Parameters
+    Offset is the offset of the data within the file's stored data.
+    pScratch is the buffer which data from a block device is copied into.
+    Length is the number of bytes needed.
+
+   Returns
+    Pointer to the data.
+*/
+const char* FlashFileSystemFileHandle::MapData(ffs_offset_t Offset, void* pScratch, size_t Length)
+{
+#if FFS_BLOCK_DEVICE
+    if (!m_pFileStart)
+    {
+        return (const char*)m_pStorage->Map(m_FileOffset + Offset, pScratch, Length);
+    }
+#endif
+    return m_pFileStart + Offset;
+}
+
+
+
+/* Construct and initialize a directory handle enumeration object.
+
+   Parameters:
+    pFileSystem is the file system which contains the directory.
+    pFirstIndices is the index of the first entry found in this directory
+        in each image, or FFS_NO_ENTRY for images which don't contain it.
+    pDirectories is the directory's record in each image's directory tree,
+        or FFS_NO_ENTRY for images without one.
+    DirectoryNameLength is the length of the directory name for which this
+        handle is being used to enumerate.
+        
+   Returns:
+    Nothing.
+*/
+FlashFileSystemDirHandle::FlashFileSystemDirHandle(FlashFileSystem*    pFileSystem,
+                                                   const unsigned int* pFirstIndices,
+                                                   const unsigned int* pDirectories,
+                                                   unsigned int        DirectoryNameLength)
+{
+    SetEntry(pFileSystem, pFirstIndices, pDirectories, DirectoryNameLength);
+#if FFS_ACCESS_TRACE
+    m_AccessTraceId = FFS_ACCESS_NO_HANDLE;
+#endif
+    m_InUse = 0;
+}
+
+
+// Used to construct a closed directory handle.
+FlashFileSystemDirHandle::FlashFileSystemDirHandle()
+{
+    SetEntry(NULL, NULL, NULL, 0);
+#if FFS_ACCESS_TRACE
+    m_AccessTraceId = FFS_ACCESS_NO_HANDLE;
+#endif
+    m_InUse = 0;
+}
+
+                             
+/* Closes the directory enumeration object.
+  
+   Parameters:
+    None.
+    
+   Returns:
+    0 on success, or -1 on error.
+*/
+int FlashFileSystemDirHandle::close()
+{
+#if FFS_ACCESS_TRACE
+    if (m_pFileSystem)
+    {
+        m_pFileSystem->m_AccessTrace.Record(FFS_ACCESS_CLOSEDIR, 0, m_AccessTraceId, 0, 0);
+    }
+#endif
+#if FFS_STATS
+    if (m_pFileSystem)
+    {
+        core_util_atomic_decr_u32(&m_pFileSystem->m_Stats.DirHandlesInUse, 1);
+    }
+#endif
+    SetEntry(NULL, NULL, NULL, 0);
+    
+    // Release the handle last so that it isn't reused while being cleared.
+    core_util_atomic_store_u8(&m_InUse, 0);
+    
+    return 0;
+}
+
+
+/* Return the directory entry at the current position, and
+   advances the position to the next entry.
+  
+   Parameters:
+    None.
+    
+   Returns:
+    1 on reading a filename, 0 at end of directory, negative error on failure.
+*/
+ssize_t FlashFileSystemDirHandle::read(struct dirent *ent)
+{
+    ssize_t Result;
+    
+    Result = ReadEntry(ent);
+#if FFS_ACCESS_TRACE
+    m_pFileSystem->m_AccessTrace.Record(FFS_ACCESS_READDIR, 0, m_AccessTraceId, 0, Result);
+#endif
+    
+    return Result;
+}
+
+
+/* Protected method which does the work of read() without recording it in
+   the access trace, so that seek() can replay the enumeration through it.
+   When overlays are mounted, each image's entries for the directory are
+   already sorted so they are merged as they are read: the lowest name is
+   returned and every image which holds that name moves past it, so names
+   found in several images are only returned once.
+  
+   Parameters:
+    ent is filled in with the name of the entry at the current position.
+    
+   Returns:
+    1 on reading a filename, 0 at end of directory, negative error on failure.
+*/
+ssize_t FlashFileSystemDirHandle::ReadEntry(struct dirent* ent)
+{
+    char            Name[sizeof(ent->d_name)];
+    size_t          NameLengths[FFS_MAX_IMAGES];
+    uint32_t        Matches = 0;
+    int             IsDirectory;
+    size_t          Length;
+    unsigned int    i;
+    
+    for (i = 0 ; i < FFS_MAX_IMAGES ; i++)
+    {
+        FlashFileSystemImage*   pImage;
+        char*                   pDest;
+        char*                   pSlash;
+        
+        // Skip the images which have finished enumerating the directory.
+        if (FFS_NO_ENTRY == m_CurrentIndex[i])
+        {
+            continue;
+        }
+        
+        // Fill in the caller's directory entry structure directly from the
+        // name stored in FLASH for the first image.  Later images are
+        // compared against it.
+        pImage = &m_pFileSystem->m_Images[i];
+        pDest = Matches ? Name : ent->d_name;
+        NameLengths[i] = pImage->GetEntryName(m_CurrentIndex[i], 
+                                              m_DirectoryNameLength, 
+                                              pDest, 
+                                              sizeof(Name));
+        
+        // If the entry to be returned contains a slash then this is a
+        // directory entry.
+        pSlash = strchr(pDest, '/');
+        if (pSlash)
+        {
+            // I am truncating everything after the slash but leaving the
+            // slash so that I can tell it is a directory and not a file.
+            pSlash[1] = '\0';
+        }
+        
+        if (!Matches)
+        {
+            Matches = 1U << i;
+        }
+        else
+        {
+            int Result = strcmp(Name, ent->d_name);
+            
+            if (Result < 0)
+            {
+                strcpy(ent->d_name, Name);
+                Matches = 1U << i;
+            }
+            else if (0 == Result)
+            {
+                Matches |= 1U << i;
+            }
+        }
+    }
+    
+    // Just return now if we have already finished enumerating the entries in
+    // the directory.
+    if (!Matches)
+    {
+        ent->d_name[0] = '\0';
+        return 0;
+    }
+    
+    // Skip entries that have the same prefix as the returned entry in each
+    // image which held it.  This will skip the files in the same sub-tree,
+    // in one step for images with a directory tree.  Otherwise the prefix of
+    // a file includes its terminator so that siblings whose names start with
+    // the file's name (like "a0" after "a") aren't skipped as well.
+    Length = strlen(ent->d_name);
+    IsDirectory = (Length > 0 && '/' == ent->d_name[Length - 1]);
+    for (i = 0 ; i < FFS_MAX_IMAGES ; i++)
+    {
+        size_t  PrefixLength = Length + m_DirectoryNameLength;
+        
+        if (0 == (Matches & (1U << i)))
+        {
+            continue;
+        }
+        if (FFS_NO_ENTRY != m_Directory[i])
+        {
+            m_CurrentIndex[i] = m_pFileSystem->m_Images[i].SkipDirectoryEntry(m_Directory[i], 
+                                                                              m_CurrentIndex[i], 
+                                                                              &m_NextChild[i]);
+            continue;
+        }
+        if (!IsDirectory && PrefixLength == NameLengths[i])
+        {
+            PrefixLength++;
+        }
+        m_CurrentIndex[i] = m_pFileSystem->m_Images[i].FindNextDirectoryEntry(m_CurrentIndex[i],
+                                                                              PrefixLength,
+                                                                              m_DirectoryNameLength);
+    }
+#if FFS_MAX_IMAGES > 1
+    m_Position++;
+#endif
+    
+    return 1;
+}
+
+
+//Resets the position to the beginning of the directory.
+void FlashFileSystemDirHandle::rewind()
+{
+    unsigned int    i;
+    
+    for (i = 0 ; i < FFS_MAX_IMAGES ; i++)
+    {
+        m_CurrentIndex[i] = m_FirstIndex[i];
+        m_NextChild[i] = FFS_NO_ENTRY;
+        if (FFS_NO_ENTRY != m_Directory[i])
+        {
+            m_NextChild[i] = m_pFileSystem->m_Images[i].GetChildDirectory(m_Directory[i], m_Directory[i] + 1);
+        }
+    }
+#if FFS_MAX_IMAGES > 1
+    m_Position = 0;
+#endif
+}
+
+
+/* Returns the current position of the DirHandle.
+ 
+   Parameters:
+    None.
+    
+   Returns:
+    The current position, or -1 on error.
+*/
+off_t FlashFileSystemDirHandle::tell()
+{
+#if FFS_MAX_IMAGES > 1
+    return (off_t)m_Position;
+#else
+    return (off_t)m_CurrentIndex[0];
+#endif
+}
+
+
+/* Sets the position of the DirHandle.
+ 
+   Parameters:
+    Location is the location to seek to. Must be a value returned
+        by telldir.
+        
+   Returns;
+    Nothing.
+*/
+void FlashFileSystemDirHandle::seek(off_t Location)
+{
+#if FFS_MAX_IMAGES > 1
+    struct dirent   Entry;
+    
+    // A position in the merged enumeration can't be turned back into an
+    // index within each image so the enumeration is replayed up to it.
+    rewind();
+    while ((off_t)m_Position < Location && ReadEntry(&Entry) > 0)
+    {
+    }
+#else
+    FlashFileSystemImage*   pImage;
+    SFileSystemDirectory    Scratch;
+    
+    m_CurrentIndex[0] = (unsigned int)Location;
+    if (FFS_NO_ENTRY == m_Directory[0])
+    {
+        return;
+    }
+    
+    // The next subdirectory to be returned is the first one which doesn't
+    // end before the new position.
+    pImage = &m_pFileSystem->m_Images[0];
+    m_NextChild[0] = pImage->GetChildDirectory(m_Directory[0], m_Directory[0] + 1);
+    while (FFS_NO_ENTRY != m_NextChild[0] && 
+           pImage->GetDirectoryRecord(m_NextChild[0], &Scratch)->EndEntry <= m_CurrentIndex[0])
+    {
+        m_NextChild[0] = pImage->GetNextSibling(m_Directory[0], m_NextChild[0]);
+    }
+#endif
+}
+
+
+
+/* Internal routine which converts a 64-bit offset or size from a version 3
+   image into an ffs_offset_t.  Values which don't fit are limited to
+   FFS_MAX_OFFSET so that they fail the usual bounds checks. */
+static ffs_offset_t _NarrowOffset(uint64_t Value)
+{
+    return (Value > FFS_MAX_OFFSET) ? FFS_MAX_OFFSET : (ffs_offset_t)Value;
+}
+
+
+/* Internal routine which returns the FilenameOffset of an entry in the
+   file entry table.
+   
+   pStorage is the storage of the image.
+   EntriesOffset is the offset of the file entry table within the image.
+   EntrySize is the size of each entry, sizeof(SFileSystemEntryV3) for
+    version 3 images and sizeof(SFileSystemEntry) for the others.
+   Index is the index of the entry.
+   
+   Returns the offset of the entry's name within the image.
+*/
+static ffs_offset_t _GetFilenameOffset(FlashFileSystemStorage* pStorage, 
+                                       ffs_offset_t            EntriesOffset, 
+                                       unsigned int            EntrySize, 
+                                       unsigned int            Index)
+{
+    ffs_offset_t    Offset = EntriesOffset + (ffs_offset_t)Index * EntrySize;
+    uint64_t        Scratch;
+    
+    if (sizeof(SFileSystemEntryV3) == EntrySize)
+    {
+        return _NarrowOffset(*(const uint64_t*)pStorage->Map(Offset + offsetof(SFileSystemEntryV3, FilenameOffset),
+                                                             &Scratch,
+                                                             sizeof(uint64_t)));
+    }
+    return *(const uint32_t*)pStorage->Map(Offset + offsetof(SFileSystemEntry, FilenameOffset),
+                                           &Scratch,
+                                           sizeof(uint32_t));
+}
+
+
+/* Internal routine which returns the plain filename of an entry in the file
+   entry table.  Names on a block device are copied into pScratch, which
+   holds FFS_NAME_BUFFER_SIZE characters. */
+static const char* _GetEntryFilename(FlashFileSystemStorage* pStorage, 
+                                     ffs_offset_t            EntriesOffset, 
+                                     unsigned int            EntrySize, 
+                                     unsigned int            Index, 
+                                     char*                   pScratch)
+{
+    return pStorage->MapString(_GetFilenameOffset(pStorage, EntriesOffset, EntrySize, Index), pScratch, FFS_NAME_BUFFER_SIZE);
+}
+
+
+/* Internal routine used to compare a directory prefix against the beginning
+   of a filename in the FLASH file system image.
+   
+   pDirectoryName is the name of the directory.  It may or may not contain
+    the trailing slash.
+   DirectoryNameLength is the length of the directory prefix including the
+    trailing slash.
+   pFilename is the filename from the file system image.
+    
+   Returns <0 if the prefix is lower in sort order than the filename.
+            0 if the filename starts with the prefix.
+           >0 if the prefix is higher in sort order than the filename.
+*/
+static int _CompareDirectoryToFilename(const char*  pDirectoryName,
+                                       unsigned int DirectoryNameLength,
+                                       const char*  pFilename)
+{
+    int Result;
+    
+    Result = strncmp(pDirectoryName, pFilename, DirectoryNameLength - 1);
+    if (0 != Result)
+    {
+        return Result;
+    }
+    return (int)(unsigned char)'/' - (int)(unsigned char)pFilename[DirectoryNameLength - 1];
+}
+
+
+/* Key searched for in front coded filenames.  The Terminator character is
+   treated as if it followed the Length characters at pName, which lets a
+   directory name be searched for with its trailing slash without copying it. */
+struct SNameKey
+{
+    const char*     pName;
+    unsigned int    Length;
+    char            Terminator;
+};
+
+
+/* Returns the character at Position in the key, 0 past its end. */
+static int _GetKeyChar(const SNameKey* pKey, unsigned int Position)
+{
+    if (Position < pKey->Length)
+    {
+        return (unsigned char)pKey->pName[Position];
+    }
+    if (Position == pKey->Length)
+    {
+        return (unsigned char)pKey->Terminator;
+    }
+    return 0;
+}
+
+
+/* Compares the key against a name which is already known to match the key
+   for its first Start characters.
+   
+   pKey is the key to be compared.
+   Start is the number of leading characters known to match.
+   pText is the rest of the name, starting at character Start.
+   pResult is filled in with <0, 0 or >0 depending on whether the key is
+    less than, equal to or greater than the name.
+   
+   Returns the number of leading characters which the key and name share.
+*/
+static unsigned int _MatchKeyToText(const SNameKey* pKey, unsigned int Start, const char* pText, int* pResult)
+{
+    unsigned int    Position = Start;
+    int             KeyChar;
+    int             TextChar;
+    
+    // The characters in pName are never NUL so a NUL in pText stops this
+    // loop as well.
+    while (Position < pKey->Length && pKey->pName[Position] == *pText)
+    {
+        Position++;
+        pText++;
+    }
+    
+    // Compare the rest of the key, including its terminator, one character
+    // at a time.
+    for (;;)
+    {
+        KeyChar = _GetKeyChar(pKey, Position);
+        TextChar = (unsigned char)*pText++;
+        if (KeyChar != TextChar || 0 == KeyChar)
+        {
+            *pResult = KeyChar - TextChar;
+            return Position;
+        }
+        Position++;
+    }
+}
+
+
+/* Returns the text stored in the front coded record at the specified offset
+   and fills in *pShared with the number of characters which its name shares
+   with the previous entry's name.  For restart points the text is the whole
+   name.  Records on a block device are copied into pScratch, which holds
+   FFS_NAME_BUFFER_SIZE characters. */
+static const char* _GetNameRecord(FlashFileSystemStorage* pStorage,
+                                  ffs_offset_t            RecordOffset,
+                                  unsigned int*           pShared,
+                                  char*                   pScratch)
+{
+    unsigned int    Shared = 0;
+    unsigned int    Shift = 0;
+    unsigned char   Byte;
+    
+    do
+    {
+        Byte = *(const unsigned char*)pStorage->Map(RecordOffset++, &Byte, sizeof(Byte));
+        Shared |= (unsigned int)(Byte & 0x7F) << Shift;
+        Shift += 7;
+    } while ((Byte & 0x80) && Shift < 32);
+    
+    *pShared = Shared;
+    return pStorage->MapString(RecordOffset, pScratch, FFS_NAME_BUFFER_SIZE);
+}
+
+
+/* Updates the comparison between the key and the previous name to be a
+   comparison between the key and the next name in sort order.  Only the part
+   of the next name which differs from the previous one is examined.
+   
+   pKey is the key being searched for.
+   Shared is the number of leading characters the next name shares with the
+    previous name.
+   pText is the rest of the next name, starting at character Shared.
+   pMatchLength is the number of leading characters the key shares with the
+    previous name on entry and with the next name on exit.
+   pResult is the comparison of the key against the previous name on entry
+    and against the next name on exit.
+*/
+static void _MatchKeyToNextName(const SNameKey* pKey,
+                                unsigned int    Shared,
+                                const char*     pText,
+                                unsigned int*   pMatchLength,
+                                int*            pResult)
+{
+    if (Shared < *pMatchLength)
+    {
+        // The next name is larger than the previous one at a character where
+        // the previous one still matched the key so it must be larger than
+        // the key.
+        *pMatchLength = Shared;
+        *pResult = -1;
+    }
+    else if (Shared == *pMatchLength)
+    {
+        *pMatchLength = _MatchKeyToText(pKey, Shared, pText, pResult);
+    }
+    // Otherwise the next name matches the previous name past the point where
+    // it differed from the key so the comparison doesn't change.
+}
+
+
+/* Location of the front coded filenames used by the routines below. */
+struct SFrontCodedNames
+{
+    FlashFileSystemStorage* pStorage;
+    ffs_offset_t            EntriesOffset;
+    unsigned int            EntrySize;
+    unsigned int            EntryCount;
+    unsigned int            RestartInterval;
+};
+
+
+/* Returns the text of the front coded record for the specified entry. */
+static const char* _GetFrontCodedRecord(const SFrontCodedNames* pNames,
+                                        unsigned int            Index,
+                                        unsigned int*           pShared,
+                                        char*                   pScratch)
+{
+    return _GetNameRecord(pNames->pStorage, 
+                          _GetFilenameOffset(pNames->pStorage, pNames->EntriesOffset, pNames->EntrySize, Index), 
+                          pShared, 
+                          pScratch);
+}
+
+
+/* Internal routine which finds the first entry whose front coded name isn't
+   less than the key.  The restart points are binary searched and then the
+   records which follow the last restart point below the key are compared
+   incrementally, so the prefix shared by neighbouring names is only scanned
+   once.
+   
+   pNames describes the front coded filenames.
+   pKey is the key to be found.
+   pMatchLength is filled in with the number of leading characters the key
+    shares with the returned entry's name.
+   pResult is filled in with the comparison of the key against the returned
+    entry's name.
+   pProbes is filled in with the number of names which were read.
+   
+   Returns the index of the entry or EntryCount if all names are less than the
+   key.
+*/
+static unsigned int _FindFrontCodedLowerBound(const SFrontCodedNames* pNames,
+                                              const SNameKey*         pKey,
+                                              unsigned int*           pMatchLength,
+                                              int*                    pResult,
+                                              unsigned int*           pProbes)
+{
+    unsigned int    Interval = pNames->RestartInterval;
+    unsigned int    Low = 0;
+    unsigned int    High = (pNames->EntryCount + Interval - 1) / Interval;
+    unsigned int    Index;
+    unsigned int    End;
+    unsigned int    Shared;
+    const char*     pText;
+    char            Scratch[FFS_NAME_BUFFER_SIZE];
+    
+    // Find the first restart point which isn't less than the key.
+    *pProbes = 0;
+    while (Low < High)
+    {
+        unsigned int    Middle = Low + (High - Low) / 2;
+        int             Result;
+        
+        (*pProbes)++;
+        pText = _GetFrontCodedRecord(pNames, Middle * Interval, &Shared, Scratch);
+        _MatchKeyToText(pKey, 0, pText, &Result);
+        if (Result > 0)
+        {
+            Low = Middle + 1;
+        }
+        else
+        {
+            High = Middle;
+        }
+    }
+    
+    // The lower bound is either in the group of entries following the
+    // previous restart point or is the restart point itself.
+    Index = (Low > 0) ? (Low - 1) * Interval : 0;
+    End = Low * Interval;
+    if (End > pNames->EntryCount)
+    {
+        End = pNames->EntryCount;
+    }
+    (*pProbes)++;
+    pText = _GetFrontCodedRecord(pNames, Index, &Shared, Scratch);
+    *pMatchLength = _MatchKeyToText(pKey, 0, pText, pResult);
+    while (*pResult > 0 && ++Index < End)
+    {
+        (*pProbes)++;
+        pText = _GetFrontCodedRecord(pNames, Index, &Shared, Scratch);
+        _MatchKeyToNextName(pKey, Shared, pText, pMatchLength, pResult);
+    }
+    if (*pResult > 0 && Index < pNames->EntryCount)
+    {
+        // Every name before the next restart point was less than the key so
+        // the lower bound is that restart point.
+        (*pProbes)++;
+        pText = _GetFrontCodedRecord(pNames, Index, &Shared, Scratch);
+        *pMatchLength = _MatchKeyToText(pKey, 0, pText, pResult);
+    }
+    
+    return Index;
+}
+
+
+/* Internal routine which compares the key against the front coded name of
+   the specified entry, decoding from the preceding restart point.
+   
+   Returns <0, 0 or >0 depending on whether the key is less than, equal to or
+   greater than the entry's name.
+*/
+static int _CompareKeyToFrontCodedEntry(const SFrontCodedNames* pNames,
+                                        const SNameKey*         pKey,
+                                        unsigned int            Index)
+{
+    unsigned int    Curr = Index - Index % pNames->RestartInterval;
+    unsigned int    MatchLength;
+    unsigned int    Shared;
+    int             Result;
+    const char*     pText;
+    char            Scratch[FFS_NAME_BUFFER_SIZE];
+    
+    pText = _GetFrontCodedRecord(pNames, Curr, &Shared, Scratch);
+    MatchLength = _MatchKeyToText(pKey, 0, pText, &Result);
+    while (Curr++ < Index)
+    {
+        pText = _GetFrontCodedRecord(pNames, Curr, &Shared, Scratch);
+        _MatchKeyToNextName(pKey, Shared, pText, &MatchLength, &Result);
+    }
+    
+    return Result;
+}
+
+
+/* Internal routine which rebuilds part of the front coded name of the
+   specified entry.  It works back from the entry's record towards the
+   preceding restart point, only copying the characters of each record which
+   later records don't replace, and stops as soon as the characters from
+   Start onwards are known.
+   
+   pNames describes the front coded filenames.
+   Index is the index of the entry.
+   Start is the index of the first character of the name to be copied.
+   pDest is filled in with the NUL terminated characters of the name which
+    follow Start, truncated to fit.
+   DestSize is the size of the pDest buffer in bytes.
+   
+   Returns the length of the whole name.
+*/
+static size_t _GetFrontCodedName(const SFrontCodedNames* pNames,
+                                 unsigned int            Index,
+                                 size_t                  Start,
+                                 char*                   pDest,
+                                 size_t                  DestSize)
+{
+    unsigned int    Shared;
+    const char*     pText;
+    size_t          Length;
+    size_t          Limit;
+    char            Scratch[FFS_NAME_BUFFER_SIZE];
+    
+    pText = _GetFrontCodedRecord(pNames, Index, &Shared, Scratch);
+    if (0 == Index % pNames->RestartInterval)
+    {
+        Shared = 0;
+    }
+    Length = Shared + strlen(pText);
+    
+    // Limit is the end of the characters which are still to be copied.
+    Limit = Length;
+    if (Limit > Start + DestSize - 1)
+    {
+        Limit = Start + DestSize - 1;
+    }
+    pDest[(Limit > Start) ? Limit - Start : 0] = '\0';
+    
+    while (Limit > Start)
+    {
+        if (Limit > Shared)
+        {
+            size_t  From = (Shared > Start) ? Shared : Start;
+            
+            memcpy(pDest + (From - Start), pText + (From - Shared), Limit - From);
+            Limit = Shared;
+            if (Limit <= Start)
+            {
+                break;
+            }
+        }
+        
+        // The rest of the characters come from the previous name.
+        Index--;
+        pText = _GetFrontCodedRecord(pNames, Index, &Shared, Scratch);
+        if (0 == Index % pNames->RestartInterval)
+        {
+            Shared = 0;
+        }
+    }
+    
+    return Length;
+}
+
+
+/* Internal routine which determines if the specified address contains the
+   signature of a version 1, 2 or 3 file system image.
+   
+   pSignature points to the 8 bytes to be checked.
+   
+   Returns non-zero if it is a valid file system signature and 0 otherwise.
+*/
+static int _IsFileSystemSignature(const char* pSignature)
+{
+    // The signatures only differ in their last character.
+    if (0 != memcmp(pSignature, FILE_SYSTEM_SIGNATURE, sizeof(FILE_SYSTEM_SIGNATURE) - 2))
+    {
+        return 0;
+    }
+    return (FILE_SYSTEM_SIGNATURE[7] == pSignature[7] || 
+            FILE_SYSTEM_SIGNATURE_V2[7] == pSignature[7] ||
+            FILE_SYSTEM_SIGNATURE_V3[7] == pSignature[7]);
+}
+
+
+/* Internal routine which reads the header of a potential file system image
+   into the version 3 layout so that every version can be checked and
+   mounted by the same code.  Version 1 images are given a Version of 1, no
+   sections and the size of the storage as their ImageSize.
+   
+   pStorage is the storage holding the potential file system image.
+   pHeader is filled in with the header.
+   
+   Returns non-zero if the image starts with a known signature and version
+   and 0 otherwise.
+*/
+static int _ReadImageHeader(FlashFileSystemStorage* pStorage, SFileSystemHeaderV3* pHeader)
+{
+    SFileSystemHeaderV2         Scratch;
+    const SFileSystemHeaderV2*  pHeaderV2;
+    
+    // Even the smallest version 1 image is larger than a version 2 header.
+    if (pStorage->GetSize() < sizeof(Scratch))
+    {
+        return 0;
+    }
+    pHeaderV2 = (const SFileSystemHeaderV2*)pStorage->Map(0, &Scratch, sizeof(Scratch));
+    if (!_IsFileSystemSignature(pHeaderV2->FileSystemSignature))
+    {
+        return 0;
+    }
+    
+    // The 64-bit fields of a version 3 header might not be aligned yet.
+    if (FILE_SYSTEM_SIGNATURE_V3[7] == pHeaderV2->FileSystemSignature[7])
+    {
+        return (pStorage->GetSize() >= sizeof(*pHeader) &&
+                0 == pStorage->Read(0, pHeader, sizeof(*pHeader)) &&
+                FILE_SYSTEM_VERSION_3 == pHeader->Version);
+    }
+    
+    memcpy(pHeader->FileSystemSignature, pHeaderV2->FileSystemSignature, sizeof(pHeader->FileSystemSignature));
+    pHeader->FileCount = pHeaderV2->FileCount;
+    pHeader->Reserved = 0;
+    if (FILE_SYSTEM_SIGNATURE_V2[7] == pHeaderV2->FileSystemSignature[7])
+    {
+        pHeader->Version = pHeaderV2->Version;
+        pHeader->FileEntriesOffset = pHeaderV2->FileEntriesOffset;
+        pHeader->ImageSize = pHeaderV2->ImageSize;
+        pHeader->SectionCount = pHeaderV2->SectionCount;
+        return (FILE_SYSTEM_VERSION_2 == pHeader->Version);
+    }
+    pHeader->Version = 1;
+    pHeader->FileEntriesOffset = sizeof(SFileSystemHeader);
+    pHeader->ImageSize = pStorage->GetSize();
+    pHeader->SectionCount = 0;
+    
+    return 1;
+}
+
+
+/* Internal routine which reads one of the section records which follow the
+   header of a version 2 or version 3 image into the version 3 layout.
+   
+   pStorage is the storage holding the image.
+   pHeader is the image's header, as filled in by _ReadImageHeader().
+   Index is the index of the section record, which must be less than
+    SectionCount.
+   pSection is filled in with the section record.
+*/
+static void _ReadSection(FlashFileSystemStorage*     pStorage, 
+                         const SFileSystemHeaderV3*  pHeader, 
+                         unsigned int                Index, 
+                         SFileSystemSectionV3*       pSection)
+{
+    SFileSystemSection          Scratch;
+    const SFileSystemSection*   pSectionV2;
+    
+    if (FILE_SYSTEM_VERSION_3 == pHeader->Version)
+    {
+        *pSection = *(const SFileSystemSectionV3*)pStorage->Map(sizeof(*pHeader) + Index * sizeof(*pSection), 
+                                                                pSection, 
+                                                                sizeof(*pSection));
+        return;
+    }
+    
+    pSectionV2 = (const SFileSystemSection*)pStorage->Map(sizeof(SFileSystemHeaderV2) + Index * sizeof(Scratch), 
+                                                          &Scratch, 
+                                                          sizeof(Scratch));
+    pSection->Type = pSectionV2->Type;
+    pSection->Reserved = 0;
+    pSection->Offset = pSectionV2->Offset;
+    pSection->Size = pSectionV2->Size;
+}
+
+
+/* Internal routine which performs cheap sanity checks on the header of a
+   potential file system image before it is mounted.  It makes sure that the
+   entry table fits within the image and that the first and last entries
+   point past the end of the entry table.
+   
+   pStorage is the storage holding the potential file system image.  Its
+    size is the number of bytes which can contain the image.
+    
+   Returns non-zero if the image looks valid and 0 otherwise.
+*/
+static int _IsValidFileSystemImage(FlashFileSystemStorage* pStorage)
+{
+    SFileSystemHeaderV3         Header;
+    uint64_t                    HeaderSize = sizeof(SFileSystemHeader);
+    uint64_t                    SectionSize = 0;
+    uint64_t                    EntrySize = sizeof(SFileSystemEntry);
+    uint64_t                    EntriesEnd;
+    uint64_t                    Alignment = 4;
+    ffs_offset_t                FirstNameOffset;
+    ffs_offset_t                LastNameOffset;
+    
+    if (!_ReadImageHeader(pStorage, &Header))
+    {
+        return 0;
+    }
+    if (FILE_SYSTEM_VERSION_2 == Header.Version)
+    {
+        HeaderSize = sizeof(SFileSystemHeaderV2);
+        SectionSize = sizeof(SFileSystemSection);
+    }
+    else if (FILE_SYSTEM_VERSION_3 == Header.Version)
+    {
+        // The 64-bit fields are read in place so memory mapped images must
+        // be 8-byte aligned.
+        if (0 != ((uintptr_t)pStorage->GetBase() & 0x7))
+        {
+            TRACE("FlashFileSystem: Version 3 file system image at address %p isn't 8-byte aligned.\n", pStorage->GetBase());
+            return 0;
+        }
+        HeaderSize = sizeof(SFileSystemHeaderV3);
+        SectionSize = sizeof(SFileSystemSectionV3);
+        EntrySize = sizeof(SFileSystemEntryV3);
+        Alignment = 8;
+    }
+    
+    // The section records follow the header and come before the entry
+    // table.  Version 3 images which are larger than FFS_MAX_OFFSET don't
+    // fit in the storage.
+    if (Header.ImageSize > pStorage->GetSize() ||
+        Header.ImageSize < HeaderSize ||
+        (SectionSize && Header.SectionCount > (Header.ImageSize - HeaderSize) / SectionSize) ||
+        Header.FileEntriesOffset < HeaderSize + Header.SectionCount * SectionSize ||
+        0 != (Header.FileEntriesOffset & (Alignment - 1)))
+    {
+        return 0;
+    }
+    
+    // The entry table must fit in the image and can't be empty.
+    if (Header.FileEntriesOffset > Header.ImageSize ||
+        0 == Header.FileCount ||
+        Header.FileCount > (Header.ImageSize - Header.FileEntriesOffset) / EntrySize)
+    {
+        return 0;
+    }
+    
+    // Filenames and file data are stored after the entry table.
+    EntriesEnd = Header.FileEntriesOffset + Header.FileCount * EntrySize;
+    FirstNameOffset = _GetFilenameOffset(pStorage, (ffs_offset_t)Header.FileEntriesOffset, (unsigned int)EntrySize, 0);
+    LastNameOffset = _GetFilenameOffset(pStorage, (ffs_offset_t)Header.FileEntriesOffset, (unsigned int)EntrySize, Header.FileCount - 1);
+    if (FirstNameOffset < EntriesEnd ||
+        FirstNameOffset >= Header.ImageSize ||
+        LastNameOffset < EntriesEnd ||
+        LastNameOffset >= Header.ImageSize)
+    {
+        return 0;
+    }
+    
+    return 1;
+}
+
+
+/* Internal routine which returns the number of bytes of memory mapped FLASH
+   which can contain an image.
+   
+   pImage points to the potential file system image.
+   pLimit points just past the last byte of FLASH which can contain the
+    image.  It can be NULL if this isn't known.
+    
+   Returns the size, limited to what an ffs_offset_t can address.
+*/
+static ffs_offset_t _GetMappedImageLimit(const char* pImage, const char* pLimit)
+{
+    uintptr_t   Size = pLimit ? (uintptr_t)(pLimit - pImage) : ~(uintptr_t)0 - (uintptr_t)pImage;
+    
+    return (Size > FFS_MAX_OFFSET) ? FFS_MAX_OFFSET : (ffs_offset_t)Size;
+}
+
+
+/* Internal routine which checks a potential file system image in memory
+   mapped FLASH.
+   
+   pImage points to the potential file system image.  It must be 4-byte
+    aligned.
+   pLimit points just past the last byte of FLASH which can contain the
+    image.  It can be NULL if this isn't known.
+    
+   Returns non-zero if the image looks valid and 0 otherwise.
+*/
+static int _IsValidMappedImage(const char* pImage, const char* pLimit)
+{
+    FlashFileSystemStorage  Storage;
+    
+    Storage.SetMemory(pImage, _GetMappedImageLimit(pImage, pLimit));
+    return _IsValidFileSystemImage(&Storage);
+}
+
+
+/* Internal routine which searches backwards from the end of FLASH for the
+   file system image that was appended to the program binary.
+   
+   Erased FLASH at the top of the device is skipped a word at a time.  If the
+   last programmed bytes are a SFileSystemTrailer then it leads straight to
+   the header.  Otherwise the programmed region is scanned backwards for the
+   signature, only at 4-byte aligned addresses since the image must be
+   aligned anyway.
+   
+   pFlashStart points to the lowest address at which the image can start.
+   pFlashEnd points just past the last byte of the device's FLASH.
+   
+   Returns a pointer to the file system image or NULL if it wasn't found.
+*/
+static const char* _FindFileSystemImage(const char* pFlashStart, const char* pFlashEnd)
+{
+    const uint32_t*             pWord = (const uint32_t*)((uintptr_t)pFlashEnd & ~(uintptr_t)0x3);
+    const SFileSystemTrailer*   pTrailer;
+    uint32_t                    Signature0;
+    uint32_t                    Signature1;
+    uint32_t                    Signature1V2;
+    uint32_t                    Signature1V3;
+    
+    // Skip over the erased FLASH after the end of the image.
+    while ((const char*)pWord > pFlashStart && 0xFFFFFFFF == pWord[-1])
+    {
+        pWord--;
+    }
+    
+    // Check for a trailer record in the last programmed bytes.
+    pTrailer = (const SFileSystemTrailer*)pWord - 1;
+    if ((const char*)pTrailer >= pFlashStart &&
+        0 == memcmp(pTrailer->TrailerSignature, FILE_SYSTEM_TRAILER_SIGNATURE, sizeof(pTrailer->TrailerSignature)) &&
+        0 == (pTrailer->TrailerOffset & 0x3) &&
+        pTrailer->TrailerOffset <= (uintptr_t)((const char*)pTrailer - pFlashStart))
+    {
+        const char* pImage = (const char*)pTrailer - pTrailer->TrailerOffset;
+        
+        if (_IsValidMappedImage(pImage, pFlashEnd))
+        {
+            return pImage;
+        }
+    }
+    
+    // Fall back to scanning the aligned words for the signature.
+    memcpy(&Signature0, FILE_SYSTEM_SIGNATURE, sizeof(Signature0));
+    memcpy(&Signature1, FILE_SYSTEM_SIGNATURE + sizeof(Signature0), sizeof(Signature1));
+    memcpy(&Signature1V2, FILE_SYSTEM_SIGNATURE_V2 + sizeof(Signature0), sizeof(Signature1V2));
+    memcpy(&Signature1V3, FILE_SYSTEM_SIGNATURE_V3 + sizeof(Signature0), sizeof(Signature1V3));
+    pWord -= 2;
+    while ((const char*)pWord >= pFlashStart)
+    {
+        if (Signature0 == pWord[0] && 
+            (Signature1 == pWord[1] || Signature1V2 == pWord[1] || Signature1V3 == pWord[1]) &&
+            _IsValidMappedImage((const char*)pWord, pFlashEnd))
+        {
+            return (const char*)pWord;
+        }
+        pWord--;
+    }
+    
+    return NULL;
+}
+
+
+// Used to construct an image which hasn't been mounted yet.
+FlashFileSystemImage::FlashFileSystemImage()
+{
+    m_FileEntriesOffset = 0;
+    m_EntrySize = sizeof(SFileSystemEntry);
+    m_FileCount = 0;
+    m_HashSlotsOffset = 0;
+    m_HashSlotCount = 0;
+    m_EntryFlagsOffset = 0;
+    m_RestartInterval = 0;
+    m_VariantsOffset = 0;
+    m_VariantCount = 0;
+    m_VariantSize = sizeof(SFileSystemEncodedVariant);
+    m_ChecksumsOffset = 0;
+    m_VariantChecksumCount = 0;
+    m_DirectoriesOffset = 0;
+    m_DirectoryCount = 0;
+    m_PayloadAlignment = 4;
+    m_pVerifyBitmap = NULL;
+#if FFS_LOOKUP_CACHE_SIZE > 0
+    memset(m_CacheSlots, 0, sizeof(m_CacheSlots));
+    m_CacheHand = 0;
+    m_CacheHits = 0;
+    m_CacheMisses = 0;
+#endif
+#if FFS_STATS
+    m_pStats = NULL;
+#endif
+}
+
+
+/* Protected method which mounts a file system image in memory mapped FLASH.
+   
+   Parameters:
+    pImage points to the file system image.
+    pLimit points just past the last byte of FLASH which can contain the
+        image.  It can be NULL if this isn't known.
+    
+   Returns:
+    0 on success or -EINVAL if pImage doesn't point to a valid image.
+*/
+int FlashFileSystemImage::Mount(const char* pImage, const char* pLimit)
+{
+    if (((uintptr_t)pImage & 0x3) != 0)
+    {
+        TRACE("FlashFileSystem: File system image at address %08X isn't 4-byte aligned.\n", pImage);
+        return -EINVAL;
+    }
+    
+    m_Storage.SetMemory(pImage, _GetMappedImageLimit(pImage, pLimit));
+    return MountStorage();
+}
+
+
+#if FFS_BLOCK_DEVICE
+/* Protected method which mounts a file system image stored on a block
+   device.
+   
+   Parameters:
+    pDevice is the block device which holds the image.  It must already be
+        initialized.
+    Address is the address of the image on the device.
+    pCache is the block cache used for reads from the device.
+    
+   Returns:
+    0 on success or -EINVAL if there isn't a valid image at Address or the
+    device's read size doesn't divide FFS_BLOCK_CACHE_LINE_SIZE.
+*/
+int FlashFileSystemImage::Mount(BlockDevice* pDevice, bd_addr_t Address, FlashFileSystemBlockCache* pCache)
+{
+    bd_size_t   ReadSize = pDevice->get_read_size();
+    bd_size_t   DeviceSize = pDevice->size();
+    bd_size_t   Size;
+    
+    // Cache lines are filled with whole device reads.
+    if (0 == ReadSize || 0 != FFS_BLOCK_CACHE_LINE_SIZE % ReadSize)
+    {
+        TRACE("FlashFileSystem: Block device read size of %u isn't supported.\n", (unsigned int)ReadSize);
+        return -EINVAL;
+    }
+    if (Address >= DeviceSize)
+    {
+        TRACE("FlashFileSystem: Image address is past the end of the block device.\n");
+        return -EINVAL;
+    }
+    
+    Size = DeviceSize - Address;
+    m_Storage.SetBlockDevice(pDevice, Address, (Size > FFS_MAX_OFFSET) ? FFS_MAX_OFFSET : (ffs_offset_t)Size, pCache);
+    return MountStorage();
+}
+#endif
+
+
+/* Protected method which checks the file system image in m_Storage and
+   records where its entry table and optional sections are located.
+   
+   Parameters:
+    None.
+    
+   Returns:
+    0 on success or -EINVAL if m_Storage doesn't hold a valid image.
+*/
+int FlashFileSystemImage::MountStorage()
+{
+    SFileSystemHeaderV3         Header;
+    uint64_t                    ChecksumsSize = 0;
+    uint64_t                    SectionAlignment;
+    unsigned int                i;
+    
+    if (!_IsValidFileSystemImage(&m_Storage))
+    {
+        TRACE("FlashFileSystem: No valid file system image found.\n");
+        return -EINVAL;
+    }
+    
+    // Record the location of the file system image in the member fields.
+    _ReadImageHeader(&m_Storage, &Header);
+    m_EntrySize = (FILE_SYSTEM_VERSION_3 == Header.Version) ? sizeof(SFileSystemEntryV3) : sizeof(SFileSystemEntry);
+    SectionAlignment = (FILE_SYSTEM_VERSION_3 == Header.Version) ? 8 : 4;
+    
+    // Version 2 and 3 images locate the entry table through the extended
+    // header and can contain optional sections.
+    m_Storage.SetSize((ffs_offset_t)Header.ImageSize);
+    for (i = 0 ; i < Header.SectionCount ; i++)
+    {
+        SFileSystemSectionV3        Section;
+        
+        _ReadSection(&m_Storage, &Header, i, &Section);
+        
+        // Ignore sections which don't fit within the image.
+        if (Section.Offset > Header.ImageSize ||
+            Section.Size > Header.ImageSize - Section.Offset)
+        {
+            TRACE("FlashFileSystem: Ignoring out of bounds section type %u.\n", Section.Type);
+            continue;
+        }
+        
+        // Ignore sections which aren't aligned for the structures they hold.
+        if (0 != (Section.Offset & (SectionAlignment - 1)))
+        {
+            TRACE("FlashFileSystem: Ignoring misaligned section type %u.\n", Section.Type);
+            continue;
+        }
+        
+        switch (Section.Type)
+        {
+        case FFS_SECTION_HASH_INDEX:
+        {
+            SFileSystemHashIndex        Scratch;
+            const SFileSystemHashIndex* pHashIndex;
+            
+            if (Section.Size < sizeof(*pHashIndex))
+            {
+                break;
+            }
+            
+            // Fall back to the binary search if the table can't terminate
+            // every probe sequence.
+            pHashIndex = (const SFileSystemHashIndex*)m_Storage.Map(Section.Offset, &Scratch, sizeof(Scratch));
+            if (pHashIndex->SlotCount > Header.FileCount &&
+                0 == (pHashIndex->SlotCount & (pHashIndex->SlotCount - 1)) &&
+                pHashIndex->SlotCount <= (Section.Size - sizeof(*pHashIndex)) / sizeof(SFileSystemHashSlot))
+            {
+                m_HashSlotsOffset = Section.Offset + sizeof(*pHashIndex);
+                m_HashSlotCount = pHashIndex->SlotCount;
+            }
+            break;
+        }
+        case FFS_SECTION_ENTRY_FLAGS:
+            if (Section.Size >= Header.FileCount)
+            {
+                m_EntryFlagsOffset = Section.Offset;
+            }
+            break;
+        case FFS_SECTION_FRONT_CODED_NAMES:
+        {
+            SFileSystemFrontCodedNames          Scratch;
+            const SFileSystemFrontCodedNames*   pNames;
+            
+            if (Section.Size < sizeof(*pNames))
+            {
+                break;
+            }
+            pNames = (const SFileSystemFrontCodedNames*)m_Storage.Map(Section.Offset, &Scratch, sizeof(Scratch));
+            m_RestartInterval = pNames->RestartInterval;
+            break;
+        }
+        case FFS_SECTION_ENCODED_VARIANTS:
+        {
+            SFileSystemEncodedVariants          Scratch;
+            const SFileSystemEncodedVariants*   pVariants;
+            unsigned int                        RecordsOffset = sizeof(*pVariants);
+            unsigned int                        RecordSize = sizeof(SFileSystemEncodedVariant);
+            
+            // The records of version 3 images are padded to 8-byte
+            // alignment.
+            if (FILE_SYSTEM_VERSION_3 == Header.Version)
+            {
+                RecordsOffset = sizeof(uint64_t);
+                RecordSize = sizeof(SFileSystemEncodedVariantV3);
+            }
+            if (Section.Size < RecordsOffset)
+            {
+                break;
+            }
+            pVariants = (const SFileSystemEncodedVariants*)m_Storage.Map(Section.Offset, &Scratch, sizeof(Scratch));
+            if (pVariants->VariantCount <= (Section.Size - RecordsOffset) / RecordSize)
+            {
+                m_VariantsOffset = Section.Offset + RecordsOffset;
+                m_VariantCount = pVariants->VariantCount;
+                m_VariantSize = RecordSize;
+            }
+            break;
+        }
+        case FFS_SECTION_FILE_CHECKSUMS:
+        {
+            SFileSystemChecksums        Scratch;
+            const SFileSystemChecksums* pChecksums;
+            
+            if (Section.Size < sizeof(*pChecksums))
+            {
+                break;
+            }
+            
+            // Checksums which this runtime can't compute are ignored.
+            pChecksums = (const SFileSystemChecksums*)m_Storage.Map(Section.Offset, &Scratch, sizeof(Scratch));
+            if (FFS_CHECKSUM_CRC32C == pChecksums->Algorithm &&
+                Header.FileCount <= (Section.Size - sizeof(*pChecksums)) / sizeof(unsigned int))
+            {
+                m_ChecksumsOffset = Section.Offset;
+                ChecksumsSize = Section.Size;
+            }
+            break;
+        }
+        case FFS_SECTION_DIRECTORY_TREE:
+        {
+            struct
+            {
+                SFileSystemDirectoryTree    Tree;
+                SFileSystemDirectory        Root;
+            }                               Scratch;
+            const SFileSystemDirectoryTree* pTree;
+            const SFileSystemDirectory*     pRoot;
+            
+            if (Section.Size < sizeof(*pTree) + sizeof(*pRoot))
+            {
+                break;
+            }
+            pTree = (const SFileSystemDirectoryTree*)m_Storage.Map(Section.Offset, &Scratch.Tree, sizeof(Scratch.Tree));
+            pRoot = (const SFileSystemDirectory*)m_Storage.Map(Section.Offset + sizeof(*pTree), &Scratch.Root, sizeof(Scratch.Root));
+            
+            // The first record must describe the root directory.
+            if (pTree->DirectoryCount >= 1 &&
+                pTree->DirectoryCount <= (Section.Size - sizeof(*pTree)) / sizeof(*pRoot) &&
+                0 == pRoot->FirstEntry && Header.FileCount == pRoot->EndEntry && 0 == pRoot->Depth)
+            {
+                m_DirectoriesOffset = Section.Offset + sizeof(*pTree);
+                m_DirectoryCount = pTree->DirectoryCount;
+            }
+            break;
+        }
+        case FFS_SECTION_PAYLOAD_ALIGNMENT:
+        {
+            SFileSystemPayloadAlignment         Scratch;
+            const SFileSystemPayloadAlignment*  pAlignment;
+            
+            if (Section.Size < sizeof(*pAlignment))
+            {
+                break;
+            }
+            pAlignment = (const SFileSystemPayloadAlignment*)m_Storage.Map(Section.Offset, &Scratch, sizeof(Scratch));
+            if (pAlignment->Alignment > 4 && 0 == (pAlignment->Alignment & (pAlignment->Alignment - 1)))
+            {
+                m_PayloadAlignment = pAlignment->Alignment;
+            }
+            break;
+        }
+        default:
+            // Sections which this runtime doesn't know about are optional.
+            TRACE("FlashFileSystem: Ignoring unknown section type %u.\n", Section.Type);
+            break;
+        }
+    }
+    m_FileEntriesOffset = (ffs_offset_t)Header.FileEntriesOffset;
+    m_FileCount = Header.FileCount;
+    
+    // Older images only have checksums for the files themselves.
+    if (m_ChecksumsOffset &&
+        (uint64_t)m_VariantCount <= (ChecksumsSize - sizeof(SFileSystemChecksums)) / sizeof(uint32_t) - m_FileCount)
+    {
+        m_VariantChecksumCount = m_VariantCount;
+    }
+    
+    return 0;
+}
+
+
+/* Constructor for FlashFileSystem
+
+   Parameters:
+    pName is the root name to be used for this file system in fopen()
+        pathnames.
+    pFlashDrive (optional) is a pointer to the read-only file system (const char array).
+        When pFlashDrive is not specified, it is up to the user to append the
+        read-only file system file to the compiled binary.
+    FlashSize (optional) is the size of the FLASH (KB) on the device to
+        search through for the file system signature (default = 512).
+*/
+FlashFileSystem::FlashFileSystem(const char* pName, const uint8_t *pFlashDrive, const uint32_t FlashSize) : FileSystemLike(pName)
+{
+    // NOTE: The file system image should be located after this code itself
+    //       so stop the search once it reaches this signature.
+    static const char   FileSystemSignature[] = FILE_SYSTEM_SIGNATURE;
+    const char*         pFlashEnd = (const char*)(uintptr_t)(FlashSize * 1024);
+    const char*         pCurr = NULL;
+    const char*         pLimit = NULL;
+    
+    Initialize();
+    
+    // Search backwards through FLASH for the file system image when the
+    // caller didn't tell us where it is.
+    if(pFlashDrive == NULL)
+    {
+        pCurr = _FindFileSystemImage(FileSystemSignature + sizeof(FileSystemSignature), pFlashEnd);
+        if (!pCurr)
+        {
+            TRACE("FlashFileSystem: Failed to find file system image in ROM.\n");
+            return;
+        }
+        pLimit = pFlashEnd;
+    }
+    else
+    {
+        pCurr = (const char*)pFlashDrive;
+    }
+    
+    // The base image is left unmounted if it isn't valid.
+    m_Images[0].Mount(pCurr, pLimit);
+}
+
+
+/* Searches a range of memory mapped FLASH for a file system image in the
+   same way as the constructor does when it isn't given the image's address:
+   the erased words at the end of the range are skipped, the trailer is
+   followed if there is one and otherwise the range is scanned backwards for
+   the signature.  Host tools use it to measure how long that search takes.
+
+   Parameters:
+    pFlashStart points to the lowest address at which the image can start.
+    pFlashEnd points just past the last byte of the range.
+
+   Returns:
+    A pointer to the image, which can be passed to the constructor, or NULL
+    if no valid image was found.
+*/
+const uint8_t* FlashFileSystem::FindImage(const uint8_t* pFlashStart, const uint8_t* pFlashEnd)
+{
+    assert ( pFlashStart && pFlashEnd );
+    
+    return (const uint8_t*)_FindFileSystemImage((const char*)pFlashStart, (const char*)pFlashEnd);
+}
+
+
+#if FFS_BLOCK_DEVICE
+/* Constructor for a FlashFileSystem whose image is stored on a block device,
+   such as external SPI or QSPI NOR FLASH, instead of in memory mapped FLASH.
+   Reads go through a RAM cache of FFS_BLOCK_CACHE_LINE_COUNT lines.
+
+   Parameters:
+    pName is the root name to be used for this file system in fopen()
+        pathnames.
+    Device is the block device which holds the image.  Its init() must have
+        been called already and it must outlive the file system object.
+    Address (optional) is the address of the image on the device
+        (default = 0).
+*/
+FlashFileSystem::FlashFileSystem(const char* pName, BlockDevice& Device, bd_addr_t Address) : FileSystemLike(pName)
+{
+    Initialize();
+    
+    // The base image is left unmounted if it isn't valid.
+    m_Images[0].Mount(&Device, Address, &m_BlockCache);
+}
+#endif
+
+
+#if FFS_MAPPED_FILE
+/* Constructor for a FlashFileSystem whose image is an image file mapped
+   into memory on a POSIX host.  Nothing past the end of the file is read
+   even if the image is corrupt.
+
+   Parameters:
+    pName is the root name to be used for this file system in fopen()
+        pathnames.
+    File is the open file which holds the image.  It must outlive the file
+        system object.
+*/
+FlashFileSystem::FlashFileSystem(const char* pName, FlashFileSystemMappedFile& File) : FileSystemLike(pName)
+{
+    const char* pImage = (const char*)File.GetData();
+    
+    Initialize();
+    
+    // The base image is left unmounted if the file isn't open or isn't a
+    // valid image.
+    if (pImage)
+    {
+        m_Images[0].Mount(pImage, pImage + File.GetSize());
+    }
+}
+#endif
+
+
+// Protected method which initializes the members shared by the constructors.
+void FlashFileSystem::Initialize()
+{
+#if FFS_STATS
+    unsigned int    i;
+    
+    memset(&m_Stats, 0, sizeof(m_Stats));
+    for (i = 0 ; i < FFS_MAX_IMAGES ; i++)
+    {
+        m_Images[i].m_pStats = &m_Stats;
+    }
+#endif
+    m_pOverflowFileHandles = NULL;
+    m_pOverflowDirHandles = NULL;
+    m_OverflowFileHandleCount = 0;
+    m_OverflowDirHandleCount = 0;
+    memset(m_BlockBuffers, 0, sizeof(m_BlockBuffers));
+    m_ImageCount = 1;
+}
+
+
+/* Opens specified file in FLASH file system when an appropriate call to
+   fopen() is made.
+   
+   pFilename is the name of the file to be opened within the file system.
+   Flags specify flags to determine open mode of file.  This file system only
+    support O_RDONLY.
+   
+   Returns NULL if an error was encountered or a pointer to a FileHandle object
+    representing the requrested file otherwise.
+*/
+int FlashFileSystem::open(FileHandle** file, const char* pFilename, int Flags)
+{
+#if FFS_STATS_HISTOGRAMS
+    uint32_t                    StartCycles = FFS_STATS_CYCLE_COUNT();
+#endif
+    FlashFileSystemImage*       pImage = NULL;
+    unsigned int                Index;
+    int                         Result;
+    
+    TRACE("FlashFileSystem: Attempt to open file /FLASH/%s with flags:%x\r\n", pFilename, Flags);
+    
+    // Can't find the file if file system hasn't been mounted.
+    if (!IsMounted())
+    {
+        return -ENODEV;
+    }
+
+    // Can only open files in FLASH for read.
+    if (O_RDONLY != Flags)
+    {
+        TRACE("FlashFileSystem: Can only open files for reading.\r\n");
+        return -EROFS;
+    }
+    
+    // Attempt to find the specified file in the file system image.
+    Index = FindEntry(pFilename, &pImage);
+    if (FFS_NO_ENTRY == Index)
+    {
+        // Create failure response.
+        TRACE("FlashFileSystem: Failed to find '%s' in file system image.\n", pFilename);
+        Result = -ENOENT;
+    }
+    else
+    {
+        Result = OpenEntry(file, pImage, Index);
+    }
+    
+#if FFS_STATS
+    core_util_atomic_incr_u32((FFS_NO_ENTRY == Index) ? &m_Stats.OpenMisses : &m_Stats.OpenHits, 1);
+#endif
+#if FFS_STATS_HISTOGRAMS
+    _RecordCycles(m_Stats.OpenCycles, StartCycles);
+#endif
+#if FFS_ACCESS_TRACE
+    m_AccessTrace.Record(FFS_ACCESS_OPEN, 
+                         0, 
+                         Result ? FFS_ACCESS_NO_HANDLE : ((FlashFileSystemFileHandle*)*file)->GetAccessTraceId(), 
+                         strlen(pFilename), 
+                         Result, 
+                         pFilename);
+#endif
+
+    return Result;
+}
+
+
+/* Opens a file, handing out a precompressed variant of it instead when the
+   image has one in an encoding which the caller accepts.  A web server can
+   pass the encodings listed in a request's Accept-Encoding header and send
+   the bytes read from the returned handle as is, with a matching
+   Content-Encoding header.  The variant's bytes are read straight from FLASH
+   (ReadDirect() works on them) and nothing is decoded on the device.
+   
+   Parameters:
+    ppFile is filled in with the handle of the opened file.
+    pFilename is the name of the file to be opened within the file system.
+    AcceptedEncodings is a bit mask of (1 << FFS_ENCODING_*) values from
+        ffsformat.h.  The smallest accepted variant is picked.
+    pEncoding is filled in with the FFS_ENCODING_* value of the data which
+        will be read from the handle.  It is FFS_ENCODING_IDENTITY when the
+        file itself was opened.
+    
+   Returns:
+    0 on success or a negative error code on failure, the same as open().
+*/
+int FlashFileSystem::OpenPreferringEncoding(FileHandle**  ppFile, 
+                                            const char*   pFilename, 
+                                            unsigned int  AcceptedEncodings, 
+                                            unsigned int* pEncoding)
+{
+    SFileSystemEncodedVariantV3         Variant;
+    FlashFileSystemImage*               pImage = NULL;
+    FlashFileSystemFileHandle*          pFileHandle = NULL;
+    unsigned int                        Index;
+    unsigned int                        VariantIndex = 0;
+    int                                 Result;
+    
+    assert ( ppFile && pFilename && pEncoding );
+    
+    if (!IsMounted())
+    {
+        return -ENODEV;
+    }
+    
+    // Only the variants stored alongside the file which was found are used
+    // so that an overlay never serves a variant of the file which it hides.
+    Index = FindEntry(pFilename, &pImage);
+#if FFS_STATS
+    core_util_atomic_incr_u32((FFS_NO_ENTRY == Index) ? &m_Stats.OpenMisses : &m_Stats.OpenHits, 1);
+#endif
+    if (FFS_NO_ENTRY == Index)
+    {
+        TRACE("FlashFileSystem: Failed to find '%s' in file system image.\n", pFilename);
+        Result = -ENOENT;
+    }
+    else if (!pImage->FindEncodedVariant(Index, AcceptedEncodings, &Variant, &VariantIndex))
+    {
+        *pEncoding = FFS_ENCODING_IDENTITY;
+        Result = OpenEntry(ppFile, pImage, Index);
+    }
+    else if (pImage->VerifyEntry(Index) || pImage->VerifyEncodedVariant(VariantIndex))
+    {
+        TRACE("FlashFileSystem: Entry %u or its encoded variant failed verification.\n", Index);
+        Result = -EIO;
+    }
+    else
+    {
+        pFileHandle = FindFreeFileHandle();
+        if (!pFileHandle)
+        {
+            TRACE("FlashFileSystem: File handle table is full.\n");
+            Result = -ENOSR;
+        }
+        else
+        {
+            pFileHandle->SetEntry(&pImage->m_Storage, Variant.FileBinaryOffset, Variant.FileBinarySize);
+            *pEncoding = Variant.Encoding;
+            *ppFile = pFileHandle;
+            Result = 0;
+        }
+    }
+    
+#if FFS_ACCESS_TRACE
+    m_AccessTrace.Record(FFS_ACCESS_OPEN_ENCODED, 
+                         AcceptedEncodings & 0xFF, 
+                         Result ? FFS_ACCESS_NO_HANDLE : ((FlashFileSystemFileHandle*)*ppFile)->GetAccessTraceId(), 
+                         strlen(pFilename), 
+                         Result, 
+                         pFilename);
+#endif
+    return Result;
+}
+
+
+/* Protected method which claims a file handle for the specified entry.
+   
+   Parameters:
+    ppFile is filled in with the handle of the opened file.
+    pImage is the image which contains the entry.
+    Index is the index of the file entry to be opened.
+    
+   Returns:
+    0 on success or a negative error code on failure.
+*/
+int FlashFileSystem::OpenEntry(FileHandle** ppFile, FlashFileSystemImage* pImage, unsigned int Index)
+{
+    FlashFileSystemFileHandle*  pFileHandle = NULL;
+    SFlashFileSystemBlockBuffer* pBlockBuffer = NULL;
+    SFlashFileSystemEntry       EntryScratch;
+    SFileSystemCompressedFile   CompressedScratch;
+    const SFlashFileSystemEntry* pEntry;
+    const SFileSystemCompressedFile* pCompressedFile = NULL;
+    
+    if (pImage->VerifyEntry(Index))
+    {
+        TRACE("FlashFileSystem: Entry %u failed verification.\n", Index);
+        return -EIO;
+    }
+    
+    pEntry = pImage->GetEntry(Index, &EntryScratch);
+    if (pImage->IsCompressed(Index))
+    {
+        pCompressedFile = pImage->GetCompressedFile(Index, &CompressedScratch);
+        if (!pCompressedFile)
+        {
+            TRACE("FlashFileSystem: Unsupported or corrupt compressed file at entry %u.\n", Index);
+            return -EIO;
+        }
+        
+        pBlockBuffer = FindFreeBlockBuffer();
+        if (!pBlockBuffer)
+        {
+            TRACE("FlashFileSystem: Block buffer table is full.\n");
+            return -ENOSR;
+        }
+    }
+    
+    // Attempt to find a free file handle.
+    pFileHandle = FindFreeFileHandle();
+    if (!pFileHandle)
+    {
+        TRACE("FlashFileSystem: File handle table is full.\n");
+        if (pBlockBuffer)
+        {
+            core_util_atomic_store_u8(&pBlockBuffer->InUse, 0);
+        }
+        return -ENOSR;
+    }
+    
+    // Initialize the file handle and return it to caller.
+    if (pBlockBuffer)
+    {
+        pFileHandle->SetCompressedEntry(&pImage->m_Storage, 
+                                        pEntry->FileBinaryOffset, 
+                                        pEntry->FileBinarySize, 
+                                        pCompressedFile, 
+                                        pBlockBuffer,
+                                        this);
+    }
+    else
+    {
+        pFileHandle->SetEntry(&pImage->m_Storage, pEntry->FileBinaryOffset, pEntry->FileBinarySize);
+    }
+    *ppFile = pFileHandle;
+    return 0;
+}
+
+/* Provides direct access to the contents of a file in the FLASH file system
+   image without consuming an entry in the file handle table or copying any
+   of its data.
+   
+   Parameters:
+    pFilename is the name of the file within the file system, relative to the
+        mount point (ie. "index.html" for "/flash/index.html").
+    ppData is filled in with a pointer to the first byte of the file.  The
+        data remains valid for as long as the file system is mounted.
+    pSize is filled in with the length of the file in bytes.
+    
+   Returns:
+    0 on success, or a negative error code on failure.  Compressed files, and
+    files in images on a block device, return -EINVAL since their data can
+    only be accessed through read().
+*/
+int FlashFileSystem::GetFileData(const char* pFilename, const void** ppData, size_t* pSize)
+{
+    SFlashFileSystemEntry        EntryScratch;
+    const SFlashFileSystemEntry* pEntry = NULL;
+    FlashFileSystemImage*        pImage = NULL;
+    unsigned int            Index;
+    
+    assert ( pFilename && ppData && pSize );
+    
+    if (!IsMounted())
+    {
+        return -ENODEV;
+    }
+    
+    Index = FindEntry(pFilename, &pImage);
+    if (FFS_NO_ENTRY == Index)
+    {
+        TRACE("FlashFileSystem: Failed to find '%s' in file system image.\n", pFilename);
+        return -ENOENT;
+    }
+    if (pImage->IsCompressed(Index) || !pImage->m_Storage.GetBase())
+    {
+        return -EINVAL;
+    }
+    if (pImage->VerifyEntry(Index))
+    {
+        return -EIO;
+    }
+    
+    pEntry = pImage->GetEntry(Index, &EntryScratch);
+    *ppData = pImage->m_Storage.GetBase() + pEntry->FileBinaryOffset;
+    *pSize = pEntry->FileBinarySize;
+    return 0;
+}
+
+/* Returns the number of bytes that the bitmap passed to EnableVerification()
+   must contain for the mounted images.
+   
+   Returns:
+    Required bitmap size in bytes, 2 bits for each file and each encoded
+    variant with a checksum rounded up to a whole word for each image.
+*/
+size_t FlashFileSystem::GetVerificationBitmapSize()
+{
+    size_t          Size = 0;
+    unsigned int    i;
+    
+    for (i = 0 ; i < m_ImageCount ; i++)
+    {
+        Size += m_Images[i].GetVerificationBitmapSize();
+    }
+    return Size;
+}
+
+
+/* Turns on verification of each file against the checksum stored in the
+   image.  A file is checked the first time that it is opened and the result
+   is remembered in the caller supplied bitmap so that mounting stays fast
+   and each file is only checked once.  open() and GetFileData() return -EIO
+   for files which fail the check, and OpenPreferringEncoding() also does so
+   for encoded variants which fail it.  It should be called once at startup,
+   after any overlays have been added and before any files are opened.
+   
+   Parameters:
+    pBitmap points to the memory used to remember which files have been
+        checked.  It must remain valid for the lifetime of the file system
+        object.
+    BitmapSize is the size of the bitmap in bytes.
+        GetVerificationBitmapSize() returns the size needed.
+    
+   Returns:
+    0 on success, -ENODEV if no image is mounted, -ENOTSUP if an image
+    doesn't contain checksums, or -EINVAL if the bitmap is too small.
+*/
+int FlashFileSystem::EnableVerification(uint32_t* pBitmap, size_t BitmapSize)
+{
+    unsigned int    i;
+    
+    assert ( pBitmap );
+    
+    if (!IsMounted())
+    {
+        return -ENODEV;
+    }
+    for (i = 0 ; i < m_ImageCount ; i++)
+    {
+        if (!m_Images[i].m_ChecksumsOffset)
+        {
+            return -ENOTSUP;
+        }
+    }
+    if (BitmapSize < GetVerificationBitmapSize())
+    {
+        return -EINVAL;
+    }
+    
+    // Each image gets its own run of words in the caller's bitmap.
+    memset(pBitmap, 0, GetVerificationBitmapSize());
+    for (i = 0 ; i < m_ImageCount ; i++)
+    {
+        m_Images[i].m_pVerifyBitmap = pBitmap;
+        pBitmap += m_Images[i].GetVerificationBitmapSize() / sizeof(*pBitmap);
+    }
+    return 0;
+}
+
+
+/* Checks the entry table and every file in each mounted image against their
+   stored checksums, which reads the whole of every image.  The result for
+   each file is also recorded in the verification bitmap if
+   EnableVerification() was called.
+   
+   Parameters:
+    pBadFileCount is optionally filled in with the number of files which
+        failed the check.
+    
+   Returns:
+    0 if the images are intact, -EIO if anything failed the check, -ENODEV if
+    no image is mounted or -ENOTSUP if an image doesn't contain checksums.
+*/
+int FlashFileSystem::VerifyImage(unsigned int* pBadFileCount)
+{
+    unsigned int    BadFileCount = 0;
+    int             Result = 0;
+    unsigned int    i;
+    
+    if (!IsMounted())
+    {
+        return -ENODEV;
+    }
+    for (i = 0 ; i < m_ImageCount ; i++)
+    {
+        if (!m_Images[i].m_ChecksumsOffset)
+        {
+            return -ENOTSUP;
+        }
+    }
+    
+    for (i = 0 ; i < m_ImageCount ; i++)
+    {
+        if (m_Images[i].VerifyImage(&BadFileCount))
+        {
+            Result = -EIO;
+        }
+    }
+    
+    if (pBadFileCount)
+    {
+        *pBadFileCount = BadFileCount;
+    }
+    return Result;
+}
+
+
+/* Stacks another image on top of the mounted ones.  Files in the overlay
+   hide files with the same name in the images below it and directories
+   list the files from every image.  This lets a small image of updated
+   files be placed in FLASH without rebuilding the image underneath it.  It
+   should be called once at startup, before any files are opened.  Up to
+   FFS_MAX_IMAGES images, including the base image, can be mounted.
+   
+   Parameters:
+    pImage points to the overlay's file system image.  It must be 4-byte
+        aligned.
+    
+   Returns:
+    0 on success, -ENODEV if the base image isn't mounted, -EBUSY if
+    verification has already been enabled, -ENOSPC if FFS_MAX_IMAGES images
+    are already mounted, or -EINVAL if pImage isn't a valid image.
+*/
+int FlashFileSystem::AddOverlay(const uint8_t* pImage)
+{
+    assert ( pImage );
+    
+    return MountOverlay((const char*)pImage, NULL);
+}
+
+
+#if FFS_MAPPED_FILE
+/* Stacks the image in a mapped file on top of the mounted ones, the same way
+   as AddOverlay(pImage).  Nothing past the end of the file is read even if
+   the image is corrupt.
+   
+   Parameters:
+    File is the open file holding the overlay.  It must outlive the file
+        system object.
+    
+   Returns:
+    0 on success, -ENODEV if the base image isn't mounted, -EBUSY if
+    verification has already been enabled, -ENOSPC if FFS_MAX_IMAGES images
+    are already mounted, or -EINVAL if File isn't open or doesn't hold a
+    valid image.
+*/
+int FlashFileSystem::AddOverlay(FlashFileSystemMappedFile& File)
+{
+    const char* pImage = (const char*)File.GetData();
+    
+    if (!pImage)
+    {
+        return -EINVAL;
+    }
+    return MountOverlay(pImage, pImage + File.GetSize());
+}
+#endif
+
+
+/* Protected method which mounts an overlay image for AddOverlay().
+   
+   Parameters:
+    pImage points to the overlay's file system image.
+    pLimit points just past the last byte which can contain the image.  It
+        can be NULL if this isn't known.
+    
+   Returns:
+    The same values as AddOverlay().
+*/
+int FlashFileSystem::MountOverlay(const char* pImage, const char* pLimit)
+{
+    if (!IsMounted())
+    {
+        return -ENODEV;
+    }
+    if (m_Images[0].m_pVerifyBitmap)
+    {
+        return -EBUSY;
+    }
+    if (m_ImageCount >= FFS_MAX_IMAGES)
+    {
+        return -ENOSPC;
+    }
+    if (m_Images[m_ImageCount].Mount(pImage, pLimit))
+    {
+        return -EINVAL;
+    }
+    
+    m_ImageCount++;
+    return 0;
+}
+
+
+/* Returns the number of bytes that a caller supplied arena must contain for
+   AddOverflowHandles() to succeed, no matter how the arena is aligned.
+   
+   Parameters:
+    FileHandleCount is the number of extra file handles to be placed in the
+        arena.
+    DirHandleCount is the number of extra directory handles to be placed in
+        the arena.
+    
+   Returns:
+    Required arena size in bytes.
+*/
+size_t FlashFileSystem::GetOverflowArenaSize(unsigned int FileHandleCount, unsigned int DirHandleCount)
+{
+    return (alignof(FlashFileSystemFileHandle) - 1) + 
+           FileHandleCount * sizeof(FlashFileSystemFileHandle) +
+           (alignof(FlashFileSystemDirHandle) - 1) +
+           DirHandleCount * sizeof(FlashFileSystemDirHandle);
+}
+
+
+/* Adds extra file and directory handles, constructed in a caller supplied
+   arena, which are handed out once the fixed FFS_FILE_HANDLE_COUNT and
+   FFS_DIR_HANDLE_COUNT tables are full.  This lets a board with RAM to spare
+   support more open files without growing the table on every other build.
+   It should be called once at startup, before any files are opened.
+   
+   Parameters:
+    pArena points to the memory in which to construct the handles.  It must
+        remain valid for the lifetime of the file system object.
+    ArenaSize is the size of the arena in bytes.  GetOverflowArenaSize()
+        returns the size needed for a given number of handles.
+    FileHandleCount is the number of extra file handles to add.
+    DirHandleCount is the number of extra directory handles to add.
+    
+   Returns:
+    0 on success, -EBUSY if overflow handles have already been added, or
+    -EINVAL if the arena is too small.
+*/
+int FlashFileSystem::AddOverflowHandles(void* pArena, size_t ArenaSize, 
+                                        unsigned int FileHandleCount, unsigned int DirHandleCount)
+{
+    uintptr_t   Curr = (uintptr_t)pArena;
+    unsigned int i;
+    
+    if (m_pOverflowFileHandles || m_pOverflowDirHandles)
+    {
+        return -EBUSY;
+    }
+    if (!pArena || ArenaSize < GetOverflowArenaSize(FileHandleCount, DirHandleCount))
+    {
+        return -EINVAL;
+    }
+    
+    // Construct the closed handles in place, file handles first.
+    Curr = _AlignUp(Curr, alignof(FlashFileSystemFileHandle));
+    m_pOverflowFileHandles = (FlashFileSystemFileHandle*)Curr;
+    for (i = 0 ; i < FileHandleCount ; i++)
+    {
+        new ((void*)Curr) FlashFileSystemFileHandle();
+        Curr += sizeof(FlashFileSystemFileHandle);
+    }
+    Curr = _AlignUp(Curr, alignof(FlashFileSystemDirHandle));
+    m_pOverflowDirHandles = (FlashFileSystemDirHandle*)Curr;
+    for (i = 0 ; i < DirHandleCount ; i++)
+    {
+        new ((void*)Curr) FlashFileSystemDirHandle();
+        Curr += sizeof(FlashFileSystemDirHandle);
+    }
+    m_OverflowFileHandleCount = FileHandleCount;
+    m_OverflowDirHandleCount = DirHandleCount;
+    
+    return 0;
+}
+
+
+int  FlashFileSystem::open(DirHandle** dir, const char *pDirectoryName)
+{
+    FlashFileSystemDirHandle*   pDirHandle = NULL;
+    unsigned int                FirstIndices[FFS_MAX_IMAGES];
+    unsigned int                Directories[FFS_MAX_IMAGES];
+    unsigned int                DirectoryNameLength;
+    int                         Found = 0;
+    unsigned int                i;
+    
+    assert ( pDirectoryName);
+    
+    // Removing leading slash since the file system image doesn't contain
+    // leading slashes.
+    if ('/' == pDirectoryName[0])
+    {
+        pDirectoryName++;
+    }
+    
+    // Find the first entry which has pDirectoryName/ as the prefix in each
+    // image.  The directory exists if any of the images contain it.
+    DirectoryNameLength = _GetDirectoryNameLength(pDirectoryName);
+    for (i = 0 ; i < FFS_MAX_IMAGES ; i++)
+    {
+        FirstIndices[i] = FFS_NO_ENTRY;
+        if (i < m_ImageCount)
+        {
+            FirstIndices[i] = m_Images[i].FindDirectory(pDirectoryName, DirectoryNameLength);
+        }
+        Directories[i] = FFS_NO_ENTRY;
+        if (FFS_NO_ENTRY != FirstIndices[i] && m_Images[i].m_DirectoryCount)
+        {
+            Directories[i] = m_Images[i].FindDirectoryRecord(FirstIndices[i], 
+                                                             _GetDirectoryDepth(pDirectoryName, DirectoryNameLength));
+        }
+        Found |= (FFS_NO_ENTRY != FirstIndices[i]);
+    }
+    if (!Found)
+    {
+        TRACE("FlashFileSystem: Failed to find '%s' directory in file system image.\n", 
+              pDirectoryName);
+#if FFS_ACCESS_TRACE
+        m_AccessTrace.Record(FFS_ACCESS_OPENDIR, 0, FFS_ACCESS_NO_HANDLE, strlen(pDirectoryName), -ENOENT, pDirectoryName);
+#endif
+        return -ENOENT;
+    }
+    
+    // Found the beginning of the list of files/folders for the requested
+    // directory so return it to the caller.
+    pDirHandle = FindFreeDirHandle();
+    if (!pDirHandle)
+    {
+        TRACE("FlashFileSystem: Dir handle table is full.\n");
+#if FFS_ACCESS_TRACE
+        m_AccessTrace.Record(FFS_ACCESS_OPENDIR, 0, FFS_ACCESS_NO_HANDLE, strlen(pDirectoryName), -ENOSR, pDirectoryName);
+#endif
+        return -ENOSR;
+    }
+    
+    pDirHandle->SetEntry(this, FirstIndices, Directories, DirectoryNameLength);
+#if FFS_ACCESS_TRACE
+    m_AccessTrace.Record(FFS_ACCESS_OPENDIR, 0, pDirHandle->GetAccessTraceId(), strlen(pDirectoryName), 0, pDirectoryName);
+#endif
+    
+    *dir = pDirHandle;
+    return 0;
+}
+
+
+/* Returns information about a file or directory without using any of the
+   file or directory handles.
+   
+   Parameters:
+    pPath is the name of the file or directory within the file system.
+    pStat is filled in with the type of the object and, for files, the size
+        of the file.  Compressed files report their uncompressed size.
+    
+   Returns:
+    0 on success, -ENOENT if the path doesn't exist, or another negative error
+    code on failure.
+*/
+int FlashFileSystem::stat(const char* pPath, struct stat* pStat)
+{
+    SFlashFileSystemEntry       EntryScratch;
+    FlashFileSystemImage*       pImage = NULL;
+    unsigned int                Index;
+    unsigned int                i;
+    
+    assert ( pPath && pStat );
+    
+    if (!IsMounted())
+    {
+        return -ENODEV;
+    }
+    if ('/' == pPath[0])
+    {
+        pPath++;
+    }
+    
+    memset(pStat, 0, sizeof(*pStat));
+    pStat->st_nlink = 1;
+    
+    // Files are found through the same lookup used by open().  Inode numbers
+    // follow on from those of the images below.
+    Index = FindEntry(pPath, &pImage);
+    if (FFS_NO_ENTRY != Index)
+    {
+        pStat->st_mode = S_IFREG | S_IRUSR | S_IRGRP | S_IROTH;
+        pStat->st_ino = Index + 1;
+        for (i = 0 ; &m_Images[i] != pImage ; i++)
+        {
+            pStat->st_ino += m_Images[i].m_FileCount;
+        }
+        pStat->st_size = pImage->GetEntry(Index, &EntryScratch)->FileBinarySize;
+        if (pImage->IsCompressed(Index))
+        {
+            SFileSystemCompressedFile           CompressedScratch;
+            const SFileSystemCompressedFile*    pCompressedFile = pImage->GetCompressedFile(Index, &CompressedScratch);
+            
+            if (!pCompressedFile)
+            {
+                return -EIO;
+            }
+            pStat->st_size = pCompressedFile->UncompressedSize;
+        }
+        return 0;
+    }
+    
+    // Directories only exist as the prefix of the files which they contain.
+    for (i = 0 ; i < m_ImageCount ; i++)
+    {
+        if (FFS_NO_ENTRY != m_Images[i].FindDirectory(pPath, _GetDirectoryNameLength(pPath)))
+        {
+            break;
+        }
+    }
+    if (i == m_ImageCount)
+    {
+        return -ENOENT;
+    }
+    pStat->st_mode = S_IFDIR | S_IRUSR | S_IXUSR | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
+    return 0;
+}
+
+
+/* Calls stat() for each of the specified paths.
+   
+   Parameters:
+    ppPaths is the array of paths to be looked up.
+    Count is the number of elements in the ppPaths, pStats and pResults
+        arrays.
+    pStats is filled in with the stat() result for each path.
+    pResults (optional) is filled in with the value returned by stat() for
+        each path.
+    
+   Returns:
+    The number of paths which were found.
+*/
+size_t FlashFileSystem::StatFiles(const char* const* ppPaths, size_t Count, struct stat* pStats, int* pResults)
+{
+    size_t  Found = 0;
+    size_t  i;
+    
+    assert ( ppPaths && pStats );
+    
+    for (i = 0 ; i < Count ; i++)
+    {
+        int Result = FlashFileSystem::stat(ppPaths[i], &pStats[i]);
+        
+        if (pResults)
+        {
+            pResults[i] = Result;
+        }
+        if (0 == Result)
+        {
+            Found++;
+        }
+    }
+    
+    return Found;
+}
+
+
+/* Returns the number of files and subdirectories under a directory and the
+   total size of its files, at any depth, without enumerating them.  The
+   totals come from the image's FFS_SECTION_DIRECTORY_TREE section so only
+   images built with a directory tree support this.
+   
+   Parameters:
+    pDirectoryName is the name of the directory within the file system.  ""
+        or "/" is the root directory.
+    pTotals is filled in with the totals for the directory.
+    
+   Returns:
+    0 on success, -ENOENT if the directory doesn't exist, -ENODEV if no image
+    is mounted, or -ENOTSUP if the image doesn't have a directory tree or
+    overlays are mounted, since their totals can't simply be added up.
+*/
+int FlashFileSystem::GetDirectoryTotals(const char* pDirectoryName, SFlashFileSystemDirectoryTotals* pTotals)
+{
+    FlashFileSystemImage*       pImage = &m_Images[0];
+    SFileSystemDirectory        Scratch;
+    const SFileSystemDirectory* pDirectory = NULL;
+    unsigned int                DirectoryNameLength;
+    unsigned int                FirstEntry;
+    unsigned int                Directory;
+    
+    assert ( pDirectoryName && pTotals );
+    
+    if (!IsMounted())
+    {
+        return -ENODEV;
+    }
+    if (!pImage->m_DirectoryCount || m_ImageCount > 1)
+    {
+        return -ENOTSUP;
+    }
+    if ('/' == pDirectoryName[0])
+    {
+        pDirectoryName++;
+    }
+    
+    DirectoryNameLength = _GetDirectoryNameLength(pDirectoryName);
+    FirstEntry = pImage->FindDirectory(pDirectoryName, DirectoryNameLength);
+    if (FFS_NO_ENTRY == FirstEntry)
+    {
+        return -ENOENT;
+    }
+    Directory = pImage->FindDirectoryRecord(FirstEntry, _GetDirectoryDepth(pDirectoryName, DirectoryNameLength));
+    if (FFS_NO_ENTRY == Directory)
+    {
+        return -EIO;
+    }
+    
+    pDirectory = pImage->GetDirectoryRecord(Directory, &Scratch);
+    pTotals->FileCount = pDirectory->EndEntry - pDirectory->FirstEntry;
+    pTotals->DirectoryCount = pDirectory->SubdirectoryCount;
+    pTotals->TotalSize = pDirectory->TotalSize;
+    return 0;
+}
+
+
+/* Internal routine which matches the part of a filename which follows the
+   prefix passed to FindFirst() against a simple glob.  '*' matches any run
+   of characters within one path component, "**" matches any run of
+   characters including slashes, '?' matches any one character other than a
+   slash and every other character matches itself.
+   
+   pPattern is the NUL terminated glob.
+   pName is the NUL terminated name to be matched.
+   
+   Returns non-zero if the whole name matches the pattern.
+*/
+static int _MatchPattern(const char* pPattern, const char* pName)
+{
+    while (*pPattern)
+    {
+        if ('*' == *pPattern)
+        {
+            int CrossesSlash = ('*' == pPattern[1]);
+            
+            pPattern += CrossesSlash ? 2 : 1;
+            for (;;)
+            {
+                if (_MatchPattern(pPattern, pName))
+                {
+                    return 1;
+                }
+                if ('\0' == *pName || (!CrossesSlash && '/' == *pName))
+                {
+                    return 0;
+                }
+                pName++;
+            }
+        }
+        if ('\0' == *pName || 
+            ('?' == *pPattern && '/' == *pName) || 
+            ('?' != *pPattern && *pPattern != *pName))
+        {
+            return 0;
+        }
+        pPattern++;
+        pName++;
+    }
+    
+    return ('\0' == *pName);
+}
+
+
+/* Starts an enumeration of the files whose names start with a prefix, and
+   optionally whose remaining characters match a simple glob.  All of the
+   names which share a prefix are next to each other in the sorted file
+   entry table, so the enumeration starts with a binary search for the
+   first of them and then walks the table with FindNext(), without opening
+   any directories or claiming any handles:
+   
+    FlashFileSystemFind         Find;
+    SFlashFileSystemFindData    File;
+    
+    flash.FindFirst(&Find, "static/js/", "*.js");
+    while (flash.FindNext(&Find, &File) > 0)
+    {
+        printf("%s is %u bytes\n", File.pName, (unsigned int)File.Size);
+    }
+   
+   Parameters:
+    pFind is filled in with the start of the enumeration.
+    pPrefix is the start of the names to be returned.  It isn't limited to
+        whole directory names, so "img/logo" finds "img/logo.png" and
+        "img/logos/a.png".  "" or "/" enumerates every file.  It must stay
+        valid until the enumeration is finished.
+    pPattern is a glob which the characters following the prefix must match,
+        or NULL to return every file with the prefix.  '*' matches any run
+        of characters other than '/', "**" matches any run of characters and
+        '?' matches any one character other than '/'.  It must stay valid
+        until the enumeration is finished.
+    
+   Returns:
+    0 on success or -ENODEV if no image is mounted.
+*/
+int FlashFileSystem::FindFirst(FlashFileSystemFind* pFind, const char* pPrefix, const char* pPattern)
+{
+    unsigned int    i;
+    
+    assert ( pFind && pPrefix );
+    
+    if (!IsMounted())
+    {
+        return -ENODEV;
+    }
+    if ('/' == pPrefix[0])
+    {
+        pPrefix++;
+    }
+    
+    // Unless the pattern can match a slash, nothing in the subdirectories
+    // below the prefix can match it.
+    pFind->m_pPrefix = pPrefix;
+    pFind->m_pPattern = pPattern;
+    pFind->m_PrefixLength = strlen(pPrefix);
+    pFind->m_SkipSubdirectories = (pPattern && !strchr(pPattern, '/') && !strstr(pPattern, "**"));
+    for (i = 0 ; i < FFS_MAX_IMAGES ; i++)
+    {
+        pFind->m_NextIndex[i] = FFS_NO_ENTRY;
+        if (i < m_ImageCount && pFind->m_PrefixLength <= FFS_MAX_NAME_LENGTH)
+        {
+            pFind->m_NextIndex[i] = m_Images[i].FindLowerBound(pPrefix);
+        }
+    }
+    
+    return 0;
+}
+
+
+/* Returns the next file of an enumeration started with FindFirst().  Files
+   are returned in name order.  When overlays are mounted each image's
+   entries are merged as they are read, like readdir() does, and a name
+   found in several images is returned once with the data from the top one.
+   Names longer than FFS_MAX_NAME_LENGTH are skipped unless they are stored
+   whole in memory mapped FLASH.
+   
+   Parameters:
+    pFind is the enumeration to be advanced.
+    pData is filled in with the name, size and data of the file.
+    
+   Returns:
+    1 on returning a file, 0 once there are no more files, or -EIO if the
+    header of a compressed file couldn't be read.
+*/
+int FlashFileSystem::FindNext(FlashFileSystemFind* pFind, SFlashFileSystemFindData* pData)
+{
+    SFlashFileSystemEntry               EntryScratch;
+    const SFlashFileSystemEntry*        pEntry = NULL;
+    FlashFileSystemImage*               pImage = NULL;
+    const char*                         pName = NULL;
+    unsigned int                        Index = FFS_NO_ENTRY;
+    char                                Scratch[FFS_MAX_NAME_LENGTH + 2];
+    
+    assert ( pFind && pData );
+    
+    while (!pImage)
+    {
+        const char*     pRest;
+        const char*     pSlash;
+        uint32_t        Matches = 0;
+        unsigned int    Top = 0;
+        unsigned int    i;
+        
+        // Find the lowest name at the current position of the images.  The
+        // first image's name is copied into m_Name if it has to be copied
+        // at all, and later images are compared against it.
+        pName = NULL;
+        for (i = 0 ; i < m_ImageCount ; i++)
+        {
+            FlashFileSystemImage*   pCurrent = &m_Images[i];
+            unsigned int            Next = pFind->m_NextIndex[i];
+            const char*             pEntryName = NULL;
+            int                     Result;
+            
+            if (FFS_NO_ENTRY == Next)
+            {
+                continue;
+            }
+            for ( ; Next < pCurrent->m_FileCount ; Next++)
+            {
+                pEntryName = pCurrent->MapEntryName(Next, pName ? Scratch : pFind->m_Name, sizeof(Scratch));
+                if (pEntryName)
+                {
+                    break;
+                }
+            }
+            if (Next == pCurrent->m_FileCount || 
+                0 != strncmp(pEntryName, pFind->m_pPrefix, pFind->m_PrefixLength))
+            {
+                pFind->m_NextIndex[i] = FFS_NO_ENTRY;
+                continue;
+            }
+            pFind->m_NextIndex[i] = Next;
+            
+            Result = pName ? strcmp(pEntryName, pName) : -1;
+            if (Result < 0)
+            {
+                if (pEntryName == Scratch)
+                {
+                    strcpy(pFind->m_Name, Scratch);
+                    pEntryName = pFind->m_Name;
+                }
+                pName = pEntryName;
+                Matches = 1U << i;
+                Top = i;
+            }
+            else if (0 == Result)
+            {
+                Matches |= 1U << i;
+                Top = i;
+            }
+        }
+        if (!pName)
+        {
+            return 0;
+        }
+        
+        // Skip a whole subdirectory in one binary search when the pattern
+        // can't match anything in it, by searching for the first name after
+        // its trailing slash.
+        pRest = pName + pFind->m_PrefixLength;
+        pSlash = pFind->m_SkipSubdirectories ? strchr(pRest, '/') : NULL;
+        if (pSlash && (size_t)(pSlash - pName) + 2 <= sizeof(Scratch))
+        {
+            size_t  Length = pSlash - pName;
+            
+            memcpy(Scratch, pName, Length);
+            Scratch[Length] = '/' + 1;
+            Scratch[Length + 1] = '\0';
+            for (i = 0 ; i < m_ImageCount ; i++)
+            {
+                if (Matches & (1U << i))
+                {
+                    pFind->m_NextIndex[i] = m_Images[i].FindLowerBound(Scratch);
+                }
+            }
+            continue;
+        }
+        
+        if (!pSlash && (!pFind->m_pPattern || _MatchPattern(pFind->m_pPattern, pRest)))
+        {
+            pImage = &m_Images[Top];
+            Index = pFind->m_NextIndex[Top];
+        }
+        for (i = 0 ; i < m_ImageCount ; i++)
+        {
+            if (Matches & (1U << i))
+            {
+                pFind->m_NextIndex[i]++;
+            }
+        }
+    }
+    
+    pEntry = pImage->GetEntry(Index, &EntryScratch);
+    pData->pName = pName;
+    pData->pData = NULL;
+    pData->Size = pEntry->FileBinarySize;
+    if (pImage->IsCompressed(Index))
+    {
+        SFileSystemCompressedFile           CompressedScratch;
+        const SFileSystemCompressedFile*    pCompressedFile = pImage->GetCompressedFile(Index, &CompressedScratch);
+        
+        if (!pCompressedFile)
+        {
+            return -EIO;
+        }
+        pData->Size = pCompressedFile->UncompressedSize;
+    }
+    else if (pImage->m_Storage.GetBase() && 0 == pImage->VerifyEntry(Index))
+    {
+        pData->pData = pImage->m_Storage.GetBase() + pEntry->FileBinaryOffset;
+    }
+    
+    return 1;
+}
+
+
+/* Protected method which searches the mounted images for the specified
+   filename, starting with the top overlay so that its files hide those in
+   the images below it.
+   
+   Parameters:
+    pFilename is the name of the file to be found within the file system.
+    ppImage is filled in with the image which contains the file.
+    
+   Returns:
+    Index of the matching file entry or FFS_NO_ENTRY if it wasn't found.
+*/
+unsigned int FlashFileSystem::FindEntry(const char* pFilename, FlashFileSystemImage** ppImage)
+{
+    unsigned int    i = m_ImageCount;
+    
+    while (i-- > 0)
+    {
+        unsigned int    Index = m_Images[i].FindEntry(pFilename);
+        
+        if (FFS_NO_ENTRY != Index)
+        {
+            *ppImage = &m_Images[i];
+            return Index;
+        }
+    }
+    
+    return FFS_NO_ENTRY;
+}
+
+
+/* Protected method which returns one of the entries in the file entry
+   table.  Entries which are stored in the SFlashFileSystemEntry layout are
+   returned in place and the others are converted into pScratch.
+   
+   Parameters:
+    Index is the index of the entry, which must be valid.
+    pScratch is filled in with the entry when the image is on a block
+        device or its entries have a different layout.
+    
+   Returns:
+    Pointer to the entry.
+*/
+const SFlashFileSystemEntry* FlashFileSystemImage::GetEntry(unsigned int Index, SFlashFileSystemEntry* pScratch)
+{
+    ffs_offset_t    Offset = m_FileEntriesOffset + (ffs_offset_t)Index * m_EntrySize;
+    
+    assert ( Index < m_FileCount );
+    
+    if (sizeof(*pScratch) == m_EntrySize)
+    {
+        return (const SFlashFileSystemEntry*)m_Storage.Map(Offset, pScratch, sizeof(*pScratch));
+    }
+    if (sizeof(SFileSystemEntryV3) == m_EntrySize)
+    {
+        SFileSystemEntryV3          Scratch;
+        const SFileSystemEntryV3*   pEntry = (const SFileSystemEntryV3*)m_Storage.Map(Offset, &Scratch, sizeof(Scratch));
+        
+        pScratch->FilenameOffset = _NarrowOffset(pEntry->FilenameOffset);
+        pScratch->FileBinaryOffset = _NarrowOffset(pEntry->FileBinaryOffset);
+        pScratch->FileBinarySize = _NarrowOffset(pEntry->FileBinarySize);
+    }
+    else
+    {
+        SFileSystemEntry            Scratch;
+        const SFileSystemEntry*     pEntry = (const SFileSystemEntry*)m_Storage.Map(Offset, &Scratch, sizeof(Scratch));
+        
+        pScratch->FilenameOffset = pEntry->FilenameOffset;
+        pScratch->FileBinaryOffset = pEntry->FileBinaryOffset;
+        pScratch->FileBinarySize = pEntry->FileBinarySize;
+    }
+    
+    return pScratch;
+}
+
+
+/* Protected method which finds the first entry in the sorted file entry
+   table that is contained within the specified directory.  Since all of the
+   entries sharing a directory prefix are contiguous in the table, the start
+   of the directory can be found with a binary search for the lowest entry
+   whose name isn't less than the prefix.
+   
+   Parameters:
+    pDirectoryName is the name of the directory without a leading slash.  The
+        trailing slash is optional.
+    DirectoryNameLength is the length of the directory name, including the
+        trailing slash even if pDirectoryName doesn't contain it.  0 refers
+        to the root directory.
+    
+   Returns:
+    Index of the first file entry in the directory or FFS_NO_ENTRY if the
+    directory doesn't exist.
+*/
+unsigned int FlashFileSystemImage::FindDirectory(const char*  pDirectoryName,
+                                                 unsigned int DirectoryNameLength)
+{
+    unsigned int    Low = 0;
+    unsigned int    High = m_FileCount;
+    unsigned int    Probes = 0;
+    char            Scratch[FFS_NAME_BUFFER_SIZE];
+    
+    if (0 == m_FileCount)
+    {
+        return FFS_NO_ENTRY;
+    }
+    if (0 == DirectoryNameLength)
+    {
+        return 0;
+    }
+#if FFS_BLOCK_DEVICE
+    if (DirectoryNameLength > FFS_MAX_NAME_LENGTH)
+    {
+        return FFS_NO_ENTRY;
+    }
+#endif
+    if (m_RestartInterval)
+    {
+        SFrontCodedNames    Names = { &m_Storage, m_FileEntriesOffset, m_EntrySize, m_FileCount, m_RestartInterval };
+        SNameKey            Key = { pDirectoryName, DirectoryNameLength - 1, '/' };
+        unsigned int        MatchLength;
+        int                 Result;
+        
+        Low = _FindFrontCodedLowerBound(&Names, &Key, &MatchLength, &Result, &Probes);
+        CountSearchProbes(Probes);
+        if (Low == m_FileCount || MatchLength < DirectoryNameLength)
+        {
+            return FFS_NO_ENTRY;
+        }
+        return Low;
+    }
+    
+    while (Low < High)
+    {
+        unsigned int    Middle = Low + (High - Low) / 2;
+        const char*     pEntryName = _GetEntryFilename(&m_Storage, m_FileEntriesOffset, m_EntrySize, Middle, Scratch);
+        
+        Probes++;
+        if (_CompareDirectoryToFilename(pDirectoryName, DirectoryNameLength, pEntryName) > 0)
+        {
+            Low = Middle + 1;
+        }
+        else
+        {
+            High = Middle;
+        }
+    }
+    CountSearchProbes(Probes);
+    
+    if (Low == m_FileCount ||
+        0 != _CompareDirectoryToFilename(pDirectoryName, 
+                                         DirectoryNameLength, 
+                                         _GetEntryFilename(&m_Storage, m_FileEntriesOffset, m_EntrySize, Low, Scratch)))
+    {
+        return FFS_NO_ENTRY;
+    }
+    
+    return Low;
+}
+
+
+/* Protected method which searches the sorted file entry table for the
+   specified filename.
+   
+   Parameters:
+    pFilename is the name of the file to be found within the file system.
+    
+   Returns:
+    Index of the matching file entry or FFS_NO_ENTRY if it wasn't found.
+*/
+unsigned int FlashFileSystemImage::FindEntry(const char* pFilename)
+{
+#if FFS_LOOKUP_CACHE_SIZE > 0
+    unsigned int            Index;
+    unsigned int            Hash;
+    unsigned int            Value;
+#endif
+
+#if FFS_BLOCK_DEVICE
+    // Names read from a block device are only compared up to
+    // FFS_MAX_NAME_LENGTH characters.
+    if (!m_Storage.GetBase() && strlen(pFilename) > FFS_MAX_NAME_LENGTH)
+    {
+        return FFS_NO_ENTRY;
+    }
+#endif
+#if FFS_LOOKUP_CACHE_SIZE > 0
+    Hash = _HashCacheKey(pFilename);
+    if (LookupCache(pFilename, Hash, &Value))
+    {
+        core_util_atomic_incr_u32(&m_CacheHits, 1);
+        return (Value & FFS_CACHE_NOT_FOUND) ? FFS_NO_ENTRY : Value - 1;
+    }
+    core_util_atomic_incr_u32(&m_CacheMisses, 1);
+    
+    // Remember where the file was found or, if it wasn't, where it would be
+    // so that the miss can be verified against its neighbours next time.
+    Index = SearchEntry(pFilename);
+    if (FFS_NO_ENTRY != Index)
+    {
+        Value = Index + 1;
+    }
+    else
+    {
+        Value = FFS_CACHE_NOT_FOUND | FindLowerBound(pFilename);
+    }
+    InsertCache(Hash, Value);
+    
+    return Index;
+#else
+    return SearchEntry(pFilename);
+#endif
+}
+
+
+/* Protected method which searches the image for the specified filename,
+   without consulting the lookup cache.
+   
+   Parameters:
+    pFilename is the name of the file to be found within the file system.
+    
+   Returns:
+    Index of the matching file entry or FFS_NO_ENTRY if it wasn't found.
+*/
+unsigned int FlashFileSystemImage::SearchEntry(const char* pFilename)
+{
+    unsigned int    Index;
+    
+    // Images with a hash index can be searched without the binary search.
+    if (m_HashSlotCount)
+    {
+        return FindEntryByHash(pFilename);
+    }
+    if (m_RestartInterval)
+    {
+        SFrontCodedNames    Names = { &m_Storage, m_FileEntriesOffset, m_EntrySize, m_FileCount, m_RestartInterval };
+        SNameKey            Key = { pFilename, (unsigned int)strlen(pFilename), '\0' };
+        unsigned int        MatchLength;
+        unsigned int        Probes;
+        int                 Result;
+        
+        Index = _FindFrontCodedLowerBound(&Names, &Key, &MatchLength, &Result, &Probes);
+        CountSearchProbes(Probes);
+        if (Index == m_FileCount || 0 != Result)
+        {
+            return FFS_NO_ENTRY;
+        }
+        return Index;
+    }
+    
+    Index = FindLowerBound(pFilename);
+    if (Index == m_FileCount || 0 != CompareKeyToEntry(pFilename, Index))
+    {
+        return FFS_NO_ENTRY;
+    }
+    return Index;
+}
+
+
+/* Protected method which compares a filename against the name of an entry.
+   It works with both plain and front coded filenames.
+   
+   Parameters:
+    pFilename is the name of the file to be compared.
+    Index is the index of the entry in the file entry table.
+    
+   Returns:
+    <0, 0 or >0 depending on whether pFilename is less than, equal to or
+    greater than the entry's name.
+*/
+int FlashFileSystemImage::CompareKeyToEntry(const char* pFilename, unsigned int Index)
+{
+    char    Scratch[FFS_NAME_BUFFER_SIZE];
+    
+    if (m_RestartInterval)
+    {
+        SFrontCodedNames    Names = { &m_Storage, m_FileEntriesOffset, m_EntrySize, m_FileCount, m_RestartInterval };
+        SNameKey            Key = { pFilename, (unsigned int)strlen(pFilename), '\0' };
+        
+        return _CompareKeyToFrontCodedEntry(&Names, &Key, Index);
+    }
+    return strcmp(pFilename, _GetEntryFilename(&m_Storage, m_FileEntriesOffset, m_EntrySize, Index, Scratch));
+}
+
+
+/* Protected method which finds where a filename belongs in the sorted file
+   entry table.
+   
+   Parameters:
+    pFilename is the name of the file to be found.
+    
+   Returns:
+    The index of the first entry whose name isn't less than pFilename or the
+    number of entries if they are all less than it.
+*/
+unsigned int FlashFileSystemImage::FindLowerBound(const char* pFilename)
+{
+    unsigned int    Low = 0;
+    unsigned int    High = m_FileCount;
+    unsigned int    Probes = 0;
+    char            Scratch[FFS_NAME_BUFFER_SIZE];
+    
+    if (m_RestartInterval)
+    {
+        SFrontCodedNames    Names = { &m_Storage, m_FileEntriesOffset, m_EntrySize, m_FileCount, m_RestartInterval };
+        SNameKey            Key = { pFilename, (unsigned int)strlen(pFilename), '\0' };
+        unsigned int        MatchLength;
+        int                 Result;
+        
+        Low = _FindFrontCodedLowerBound(&Names, &Key, &MatchLength, &Result, &Probes);
+        CountSearchProbes(Probes);
+        return Low;
+    }
+    
+    while (Low < High)
+    {
+        unsigned int    Middle = Low + (High - Low) / 2;
+        
+        Probes++;
+        if (strcmp(pFilename, _GetEntryFilename(&m_Storage, m_FileEntriesOffset, m_EntrySize, Middle, Scratch)) > 0)
+        {
+            Low = Middle + 1;
+        }
+        else
+        {
+            High = Middle;
+        }
+    }
+    CountSearchProbes(Probes);
+    
+    return Low;
+}
+
+
+#if FFS_LOOKUP_CACHE_SIZE > 0
+/* Protected method which looks for the result of an earlier lookup of the
+   specified filename in the lookup cache.  Slots are read without a lock so
+   every cached result is checked against the image before it is used.
+   
+   Parameters:
+    pFilename is the name of the file being looked up.
+    Hash is _HashCacheKey() of pFilename.
+    pValue is filled in with the SFlashFileSystemCacheSlot::Value of the
+        matching slot.
+    
+   Returns:
+    Non-zero if a verified result was found and 0 otherwise.
+*/
+int FlashFileSystemImage::LookupCache(const char* pFilename, unsigned int Hash, unsigned int* pValue)
+{
+    size_t  i;
+    
+    for (i = 0 ; i < FFS_LOOKUP_CACHE_SIZE ; i++)
+    {
+        SFlashFileSystemCacheSlot*  pSlot = &m_CacheSlots[i];
+        unsigned int                Value;
+        unsigned int                Index;
+        
+        if (Hash != core_util_atomic_load_u32(&pSlot->Hash))
+        {
+            continue;
+        }
+        Value = core_util_atomic_load_u32(&pSlot->Value);
+        Index = Value & ~FFS_CACHE_NOT_FOUND;
+        if (0 == Value || Index > m_FileCount)
+        {
+            continue;
+        }
+        
+        // A file is verified by comparing its name and a missing file by
+        // making sure that it would sit between two neighbouring entries.
+        if (Value & FFS_CACHE_NOT_FOUND)
+        {
+            if ((Index > 0 && CompareKeyToEntry(pFilename, Index - 1) <= 0) ||
+                (Index < m_FileCount && CompareKeyToEntry(pFilename, Index) >= 0))
+            {
+                continue;
+            }
+        }
+        else if (0 == Index || 0 != CompareKeyToEntry(pFilename, Index - 1))
+        {
+            continue;
+        }
+        
+        if (!core_util_atomic_load_u8(&pSlot->Referenced))
+        {
+            core_util_atomic_store_u8(&pSlot->Referenced, 1);
+        }
+        *pValue = Value;
+        return 1;
+    }
+    
+    return 0;
+}
+
+
+/* Protected method which records the result of a lookup in the lookup cache.
+   The slot to be replaced is chosen with the CLOCK algorithm, which gives
+   each recently used slot a second chance before it is evicted.
+   
+   Parameters:
+    Hash is _HashCacheKey() of the filename which was looked up.
+    Value is the SFlashFileSystemCacheSlot::Value to be recorded.
+    
+   Returns:
+    Nothing.
+*/
+void FlashFileSystemImage::InsertCache(unsigned int Hash, unsigned int Value)
+{
+    SFlashFileSystemCacheSlot*  pSlot = NULL;
+    uint32_t                    Hand = core_util_atomic_load_u32(&m_CacheHand);
+    size_t                      i;
+    
+    // After one sweep every slot has had its referenced bit cleared so the
+    // second sweep is only needed when other threads keep setting them.  New
+    // slots start unreferenced so that names which are only looked up once
+    // are the first to be evicted.  Two threads which race here can pick the
+    // same slot, which only costs one of them its cached result.
+    for (i = 0 ; i < 2 * FFS_LOOKUP_CACHE_SIZE ; i++)
+    {
+        pSlot = &m_CacheSlots[Hand++ % FFS_LOOKUP_CACHE_SIZE];
+        if (!core_util_atomic_load_u8(&pSlot->Referenced))
+        {
+            break;
+        }
+        core_util_atomic_store_u8(&pSlot->Referenced, 0);
+    }
+    core_util_atomic_store_u32(&m_CacheHand, Hand);
+    
+    // Clear the value first so that readers never pair the new hash with
+    // the old value.  They verify every result anyway.
+    core_util_atomic_store_u32(&pSlot->Value, 0);
+    core_util_atomic_store_u32(&pSlot->Hash, Hash);
+    core_util_atomic_store_u32(&pSlot->Value, Value);
+}
+#endif
+
+
+/* Returns the number of lookups which were answered from the lookup cache and
+   the number which had to search the image.  Both are 0 when the cache is
+   disabled (FFS_LOOKUP_CACHE_SIZE is 0).  Each mounted image has its own
+   cache and the counts are summed over all of them.
+   
+   Parameters:
+    pHits is filled in with the number of lookups found in the cache.
+    pMisses is filled in with the number of lookups not found in the cache.
+    
+   Returns:
+    Nothing.
+*/
+void FlashFileSystem::GetLookupCacheStats(uint32_t* pHits, uint32_t* pMisses)
+{
+    uint32_t        Hits;
+    uint32_t        Misses;
+    unsigned int    i;
+    
+    *pHits = 0;
+    *pMisses = 0;
+    for (i = 0 ; i < m_ImageCount ; i++)
+    {
+        m_Images[i].GetLookupCacheStats(&Hits, &Misses);
+        *pHits += Hits;
+        *pMisses += Misses;
+    }
+}
+
+
+/* Returns the alignment which is guaranteed for the start of every file's
+   data in all of the mounted images.  It is the alignment recorded by
+   ffsbuild --align, or 4 for images built without it, reduced to the
+   alignment of the address where a memory mapped image was placed.
+   
+   Parameters:
+    None.
+    
+   Returns:
+    Power of 2 alignment in bytes or 0 if no image is mounted.
+*/
+unsigned int FlashFileSystem::GetPayloadAlignment()
+{
+    unsigned int    Alignment = 0;
+    unsigned int    i;
+    
+    if (!IsMounted())
+    {
+        return 0;
+    }
+    for (i = 0 ; i < m_ImageCount ; i++)
+    {
+        unsigned int    ImageAlignment = m_Images[i].m_PayloadAlignment;
+        const char*     pBase = m_Images[i].m_Storage.GetBase();
+        
+        while (pBase && ((uintptr_t)pBase & (ImageAlignment - 1)))
+        {
+            ImageAlignment >>= 1;
+        }
+        if (0 == Alignment || ImageAlignment < Alignment)
+        {
+            Alignment = ImageAlignment;
+        }
+    }
+    
+    return Alignment;
+}
+
+
+/* Protected method which returns the lookup cache counts for this image.
+   
+   Parameters:
+    pHits is filled in with the number of lookups found in the cache.
+    pMisses is filled in with the number of lookups not found in the cache.
+    
+   Returns:
+    Nothing.
+*/
+void FlashFileSystemImage::GetLookupCacheStats(uint32_t* pHits, uint32_t* pMisses)
+{
+#if FFS_LOOKUP_CACHE_SIZE > 0
+    *pHits = core_util_atomic_load_u32(&m_CacheHits);
+    *pMisses = core_util_atomic_load_u32(&m_CacheMisses);
+#else
+    *pHits = 0;
+    *pMisses = 0;
+#endif
+}
+
+
+/* Protected method which adds the names compared by a search of the image to
+   the statistics of the file system which mounted it.  It does nothing when
+   FFS_STATS is 0.
+   
+   Parameters:
+    Probes is the number of names or hash slots which the search compared.
+    
+   Returns:
+    Nothing.
+*/
+void FlashFileSystemImage::CountSearchProbes(unsigned int Probes)
+{
+#if FFS_STATS
+    if (m_pStats)
+    {
+        core_util_atomic_incr_u32(&m_pStats->SearchProbes, Probes);
+    }
+#endif
+}
+
+
+/* Takes a snapshot of the file system's performance counters.  Each counter
+   is read atomically but they aren't read at the same instant, so counters
+   which are being updated by other threads may not agree with each other
+   exactly.  Every counter is 0 when FFS_STATS is 0.
+   
+   Parameters:
+    pStats is filled in with the counters.
+    
+   Returns:
+    Nothing.
+*/
+void FlashFileSystem::GetStats(SFlashFileSystemStats* pStats)
+{
+#if FFS_STATS_HISTOGRAMS
+    unsigned int    i;
+#endif
+
+    assert ( pStats );
+    
+    memset(pStats, 0, sizeof(*pStats));
+#if FFS_STATS
+    pStats->OpenHits = core_util_atomic_load_u32(&m_Stats.OpenHits);
+    pStats->OpenMisses = core_util_atomic_load_u32(&m_Stats.OpenMisses);
+    pStats->SearchProbes = core_util_atomic_load_u32(&m_Stats.SearchProbes);
+    pStats->BytesRead = core_util_atomic_load_u64(&m_Stats.BytesRead);
+    pStats->FileHandlesInUse = core_util_atomic_load_u32(&m_Stats.FileHandlesInUse);
+    pStats->FileHandleHighWater = core_util_atomic_load_u32(&m_Stats.FileHandleHighWater);
+    pStats->DirHandlesInUse = core_util_atomic_load_u32(&m_Stats.DirHandlesInUse);
+    pStats->DirHandleHighWater = core_util_atomic_load_u32(&m_Stats.DirHandleHighWater);
+    pStats->FileHandleExhaustions = core_util_atomic_load_u32(&m_Stats.FileHandleExhaustions);
+    pStats->DirHandleExhaustions = core_util_atomic_load_u32(&m_Stats.DirHandleExhaustions);
+    pStats->BlockBufferExhaustions = core_util_atomic_load_u32(&m_Stats.BlockBufferExhaustions);
+#endif
+#if FFS_STATS_HISTOGRAMS
+    for (i = 0 ; i < FFS_STATS_HISTOGRAM_BUCKETS ; i++)
+    {
+        pStats->OpenCycles[i] = core_util_atomic_load_u32(&m_Stats.OpenCycles[i]);
+        pStats->ReadCycles[i] = core_util_atomic_load_u32(&m_Stats.ReadCycles[i]);
+    }
+#endif
+}
+
+
+/* Clears the file system's performance counters so that the next
+   GetStats() only covers what happens from now on.  The numbers of handles
+   in use are left alone and become the new high water marks.
+   
+   Parameters:
+    None.
+    
+   Returns:
+    Nothing.
+*/
+void FlashFileSystem::ResetStats()
+{
+#if FFS_STATS_HISTOGRAMS
+    unsigned int    i;
+#endif
+
+#if FFS_STATS
+    core_util_atomic_store_u32(&m_Stats.OpenHits, 0);
+    core_util_atomic_store_u32(&m_Stats.OpenMisses, 0);
+    core_util_atomic_store_u32(&m_Stats.SearchProbes, 0);
+    core_util_atomic_store_u64(&m_Stats.BytesRead, 0);
+    core_util_atomic_store_u32(&m_Stats.FileHandleHighWater, core_util_atomic_load_u32(&m_Stats.FileHandlesInUse));
+    core_util_atomic_store_u32(&m_Stats.DirHandleHighWater, core_util_atomic_load_u32(&m_Stats.DirHandlesInUse));
+    core_util_atomic_store_u32(&m_Stats.FileHandleExhaustions, 0);
+    core_util_atomic_store_u32(&m_Stats.DirHandleExhaustions, 0);
+    core_util_atomic_store_u32(&m_Stats.BlockBufferExhaustions, 0);
+#endif
+#if FFS_STATS_HISTOGRAMS
+    for (i = 0 ; i < FFS_STATS_HISTOGRAM_BUCKETS ; i++)
+    {
+        core_util_atomic_store_u32(&m_Stats.OpenCycles[i], 0);
+        core_util_atomic_store_u32(&m_Stats.ReadCycles[i], 0);
+    }
+#endif
+}
+
+
+/* Starts recording the calls made on the file system and its handles into a
+   caller supplied ring buffer.  Each call is written as an
+   SFileSystemAccessRecord from ffstrace.h, followed by the name for opens,
+   and the oldest records are overwritten once the ring is full.  Calling it
+   again discards what was recorded and starts over in the new buffer.
+   
+   Parameters:
+    pBuffer is the ring buffer.  It must be 8-byte aligned and stay valid
+        until DisableAccessTrace() is called.  Only the largest power of 2
+        number of 24 byte slots which fit in it are used.
+    BufferSize is the size of the buffer in bytes.
+    
+   Returns:
+    0 on success, -EINVAL if the buffer is too small or misaligned, or
+    -ENOTSUP if the file system was built without FFS_ACCESS_TRACE.
+*/
+int FlashFileSystem::EnableAccessTrace(void* pBuffer, size_t BufferSize)
+{
+#if FFS_ACCESS_TRACE
+    return m_AccessTrace.Enable(pBuffer, BufferSize);
+#else
+    return -ENOTSUP;
+#endif
+}
+
+
+/* Stops recording calls into the access trace ring buffer.  What was
+   recorded can still be read with CopyAccessTrace() until tracing is enabled
+   again.
+   
+   Parameters:
+    None.
+    
+   Returns:
+    Nothing.
+*/
+void FlashFileSystem::DisableAccessTrace()
+{
+#if FFS_ACCESS_TRACE
+    m_AccessTrace.Disable();
+#endif
+}
+
+
+/* Copies the access records which are still in the ring buffer, oldest
+   first, into a linear buffer which can be saved to a file and replayed on
+   the PC by ffsreplay.  The records follow an SFileSystemAccessTraceHeader
+   which identifies their layout.  Call DisableAccessTrace() first so that
+   no records are being written while they are copied.
+   
+   Parameters:
+    pDest is the buffer to be filled in.
+    DestSize is the size of pDest in bytes.
+    
+   Returns:
+    The number of bytes copied into pDest, or 0 if the file system was built
+    without FFS_ACCESS_TRACE.
+*/
+size_t FlashFileSystem::CopyAccessTrace(void* pDest, size_t DestSize)
+{
+#if FFS_ACCESS_TRACE
+    return m_AccessTrace.Copy(pDest, DestSize);
+#else
+    return 0;
+#endif
+}
+
+
+/* Protected method which looks up the specified filename in the image's
+   FFS_SECTION_HASH_INDEX section.  Only filenames with a matching hash
+   are compared against the key.
+   
+   Parameters:
+    pFilename is the name of the file to be found within the file system.
+    
+   Returns:
+    Index of the matching file entry or FFS_NO_ENTRY if it wasn't found.
+*/
+unsigned int FlashFileSystemImage::FindEntryByHash(const char* pFilename)
+{
+    unsigned int                Mask = m_HashSlotCount - 1;
+    unsigned int                Hash = FileSystemHashFilename(pFilename);
+    unsigned int                Slot = Hash & Mask;
+    unsigned int                Probes;
+    
+    for (Probes = 0 ; Probes <= Mask ; Probes++)
+    {
+        SFileSystemHashSlot         Scratch;
+        const SFileSystemHashSlot*  pSlot;
+        
+        pSlot = (const SFileSystemHashSlot*)m_Storage.Map(m_HashSlotsOffset + Slot * sizeof(Scratch), &Scratch, sizeof(Scratch));
+        if (FFS_HASH_SLOT_EMPTY == pSlot->FileIndex)
+        {
+            break;
+        }
+        if (Hash == pSlot->Hash && pSlot->FileIndex < m_FileCount)
+        {
+            if (0 == CompareKeyToEntry(pFilename, pSlot->FileIndex))
+            {
+                CountSearchProbes(Probes + 1);
+                return pSlot->FileIndex;
+            }
+        }
+        Slot = (Slot + 1) & Mask;
+    }
+    CountSearchProbes((Probes <= Mask) ? Probes + 1 : Probes);
+    
+    return FFS_NO_ENTRY;
+}
+
+
+/* Protected method which copies part of an entry's filename into a buffer.
+   It works with both plain and front coded filenames.
+   
+   Parameters:
+    Index is the index of the entry in the file entry table.
+    Start is the index of the first character of the name to be copied.
+    pDest is filled in with the NUL terminated characters of the name which
+        follow Start, truncated to fit.
+    DestSize is the size of the pDest buffer in bytes.
+    
+   Returns:
+    The length of the whole filename.
+*/
+size_t FlashFileSystemImage::GetEntryName(unsigned int Index, size_t Start, char* pDest, size_t DestSize)
+{
+    const char* pName;
+    size_t      Length;
+    size_t      CopyLength;
+    char        Scratch[FFS_NAME_BUFFER_SIZE];
+    
+    assert ( Index < m_FileCount && DestSize > 0 );
+    
+    if (m_RestartInterval)
+    {
+        SFrontCodedNames    Names = { &m_Storage, m_FileEntriesOffset, m_EntrySize, m_FileCount, m_RestartInterval };
+        
+        return _GetFrontCodedName(&Names, Index, Start, pDest, DestSize);
+    }
+    
+    pName = _GetEntryFilename(&m_Storage, m_FileEntriesOffset, m_EntrySize, Index, Scratch);
+    Length = strlen(pName);
+    CopyLength = (Length > Start) ? Length - Start : 0;
+    if (CopyLength > DestSize - 1)
+    {
+        CopyLength = DestSize - 1;
+    }
+    memcpy(pDest, pName + Start, CopyLength);
+    pDest[CopyLength] = '\0';
+    
+    return Length;
+}
+
+
+/* Protected method which returns the whole name of an entry.  Names which
+   are stored whole in memory mapped FLASH are returned in place and the
+   others are copied into pScratch.
+   
+   Parameters:
+    Index is the index of the entry in the file entry table.
+    pScratch is the buffer which names are copied into.
+    ScratchSize is the size of the pScratch buffer in bytes.
+    
+   Returns:
+    Pointer to the NUL terminated name or NULL if it had to be copied and
+    is longer than ScratchSize - 2 characters.
+*/
+const char* FlashFileSystemImage::MapEntryName(unsigned int Index, char* pScratch, size_t ScratchSize)
+{
+    const char* pName;
+    
+    assert ( Index < m_FileCount && ScratchSize > 1 );
+    
+    if (m_RestartInterval)
+    {
+        return (GetEntryName(Index, 0, pScratch, ScratchSize) < ScratchSize - 1) ? pScratch : NULL;
+    }
+    
+    pName = m_Storage.MapString(_GetFilenameOffset(&m_Storage, m_FileEntriesOffset, m_EntrySize, Index), pScratch, ScratchSize);
+    if (pName == pScratch && strlen(pName) >= ScratchSize - 1)
+    {
+        return NULL;
+    }
+    return pName;
+}
+
+
+/* Protected method used by directory handles to skip over the entries which
+   share a prefix with the entry that was just returned.
+   
+   Parameters:
+    Index is the index of the entry that was just returned.
+    PrefixLength is the length of the prefix, including the directory name,
+        shared by the entries to be skipped.
+    DirectoryNameLength is the length of the directory name, including its
+        trailing slash.
+    
+   Returns:
+    The index of the next entry in the directory or FFS_NO_ENTRY if there
+    are no more entries in the directory.
+*/
+unsigned int FlashFileSystemImage::FindNextDirectoryEntry(unsigned int Index, 
+                                                          unsigned int PrefixLength, 
+                                                          unsigned int DirectoryNameLength)
+{
+    unsigned int    Next = Index + 1;
+    const char*     pPrevEntryName;
+    char            PrevScratch[FFS_NAME_BUFFER_SIZE];
+    char            Scratch[FFS_NAME_BUFFER_SIZE];
+    
+    // The front coded records already hold the length of the prefix shared
+    // with the previous entry, and sharing is transitive along sorted names.
+    if (m_RestartInterval)
+    {
+        SFrontCodedNames    Names = { &m_Storage, m_FileEntriesOffset, m_EntrySize, m_FileCount, m_RestartInterval };
+        unsigned int        Shared = 0;
+        
+        for ( ; Next < m_FileCount ; Next++)
+        {
+            _GetFrontCodedRecord(&Names, Next, &Shared, Scratch);
+            if (Shared < PrefixLength)
+            {
+                break;
+            }
+        }
+        if (Next == m_FileCount || Shared < DirectoryNameLength)
+        {
+            return FFS_NO_ENTRY;
+        }
+        return Next;
+    }
+    
+    pPrevEntryName = _GetEntryFilename(&m_Storage, m_FileEntriesOffset, m_EntrySize, Index, PrevScratch);
+    
+    // The entry following the last one in the table is never dereferenced.
+    while (Next < m_FileCount && 
+           0 == strncmp(pPrevEntryName, 
+                        _GetEntryFilename(&m_Storage, m_FileEntriesOffset, m_EntrySize, Next, Scratch), 
+                        PrefixLength))
+    {
+        Next++;
+    }
+    
+    // If we have walked past the end of all file entries in the file system or
+    // the prefix no longer matches this directory, then there are no more files
+    // for this directory enumeration.
+    if (Next == m_FileCount || 
+        0 != strncmp(pPrevEntryName, 
+                     _GetEntryFilename(&m_Storage, m_FileEntriesOffset, m_EntrySize, Next, Scratch), 
+                     DirectoryNameLength))
+    {
+        return FFS_NO_ENTRY;
+    }
+    
+    return Next;
+}
+
+
+/* Protected method which finds a directory's record in the image's
+   FFS_SECTION_DIRECTORY_TREE section.  The records are sorted by their
+   first entry and then by depth so this is a binary search.
+   
+   Parameters:
+    FirstEntry is the index of the first entry in the directory.
+    Depth is the number of slashes in the directory's name.
+    
+   Returns:
+    The index of the directory's record or FFS_NO_ENTRY if it wasn't found
+    or is corrupt.
+*/
+unsigned int FlashFileSystemImage::FindDirectoryRecord(unsigned int FirstEntry, unsigned int Depth)
+{
+    SFileSystemDirectory        Scratch;
+    const SFileSystemDirectory* pRecord;
+    unsigned int                Low = 0;
+    unsigned int                High = m_DirectoryCount;
+    
+    while (Low < High)
+    {
+        unsigned int    Middle = Low + (High - Low) / 2;
+        
+        pRecord = GetDirectoryRecord(Middle, &Scratch);
+        if (pRecord->FirstEntry < FirstEntry ||
+            (pRecord->FirstEntry == FirstEntry && pRecord->Depth < Depth))
+        {
+            Low = Middle + 1;
+        }
+        else
+        {
+            High = Middle;
+        }
+    }
+    
+    // Records which don't fit the entry table are treated as missing so that
+    // enumerations fall back to comparing names.
+    if (Low == m_DirectoryCount)
+    {
+        return FFS_NO_ENTRY;
+    }
+    pRecord = GetDirectoryRecord(Low, &Scratch);
+    if (pRecord->FirstEntry != FirstEntry || 
+        pRecord->Depth != Depth ||
+        pRecord->EndEntry <= FirstEntry ||
+        pRecord->EndEntry > m_FileCount)
+    {
+        return FFS_NO_ENTRY;
+    }
+    return Low;
+}
+
+
+/* Protected method which returns one of the records in the image's
+   FFS_SECTION_DIRECTORY_TREE section.
+   
+   Parameters:
+    Directory is the index of the record, which must be valid.
+    pScratch is filled in with the record when the image is on a block
+        device.
+    
+   Returns:
+    Pointer to the record.
+*/
+const SFileSystemDirectory* FlashFileSystemImage::GetDirectoryRecord(unsigned int Directory, SFileSystemDirectory* pScratch)
+{
+    assert ( Directory < m_DirectoryCount );
+    
+    return (const SFileSystemDirectory*)m_Storage.Map(m_DirectoriesOffset + Directory * sizeof(*pScratch), pScratch, sizeof(*pScratch));
+}
+
+
+/* Protected method which checks whether a record is a subdirectory of the
+   specified directory.  The record following a directory is its first child
+   if it has one.
+   
+   Parameters:
+    Directory is the index of the parent directory's record.
+    Child is the index of the record to be checked.
+    
+   Returns:
+    Child if it is a subdirectory of Directory and FFS_NO_ENTRY otherwise.
+    Records which would let an enumeration go backwards or outside of the
+    parent are treated as missing.
+*/
+unsigned int FlashFileSystemImage::GetChildDirectory(unsigned int Directory, unsigned int Child)
+{
+    SFileSystemDirectory        ParentScratch;
+    SFileSystemDirectory        ChildScratch;
+    const SFileSystemDirectory* pParent = GetDirectoryRecord(Directory, &ParentScratch);
+    const SFileSystemDirectory* pChild;
+    
+    if (Child >= m_DirectoryCount || Child <= Directory)
+    {
+        return FFS_NO_ENTRY;
+    }
+    pChild = GetDirectoryRecord(Child, &ChildScratch);
+    if (pChild->Depth != pParent->Depth + 1 ||
+        pChild->FirstEntry < pParent->FirstEntry ||
+        pChild->FirstEntry >= pChild->EndEntry ||
+        pChild->EndEntry > pParent->EndEntry)
+    {
+        return FFS_NO_ENTRY;
+    }
+    
+    return Child;
+}
+
+
+/* Protected method which returns the next subdirectory of a directory.
+   
+   Parameters:
+    Directory is the index of the parent directory's record.
+    Child is the index of one of its subdirectories.
+    
+   Returns:
+    The index of the next subdirectory's record or FFS_NO_ENTRY if Child was
+    the last one.
+*/
+unsigned int FlashFileSystemImage::GetNextSibling(unsigned int Directory, unsigned int Child)
+{
+    SFileSystemDirectory    Scratch;
+    unsigned int            SubdirectoryCount = GetDirectoryRecord(Child, &Scratch)->SubdirectoryCount;
+    
+    // The subdirectories of Child come between it and its next sibling.
+    if (SubdirectoryCount >= m_DirectoryCount - Child)
+    {
+        return FFS_NO_ENTRY;
+    }
+    return GetChildDirectory(Directory, Child + 1 + SubdirectoryCount);
+}
+
+
+/* Protected method used by directory handles to move past the entry that
+   was just returned with the help of the directory tree.  A subdirectory is
+   stepped over in one go, without looking at any of the entries within it.
+   
+   Parameters:
+    Directory is the index of the record for the directory being enumerated.
+    Index is the index of the entry that was just returned.
+    pNextChild points to the index of the next subdirectory which hasn't
+        been returned yet, or FFS_NO_ENTRY.  It is updated when Index was
+        the first entry of that subdirectory.
+    
+   Returns:
+    The index of the next entry in the directory or FFS_NO_ENTRY if there
+    are no more entries in the directory.
+*/
+unsigned int FlashFileSystemImage::SkipDirectoryEntry(unsigned int Directory, unsigned int Index, unsigned int* pNextChild)
+{
+    SFileSystemDirectory    Scratch;
+    unsigned int            Next = Index + 1;
+    
+    if (FFS_NO_ENTRY != *pNextChild)
+    {
+        const SFileSystemDirectory* pChild = GetDirectoryRecord(*pNextChild, &Scratch);
+        
+        if (Index == pChild->FirstEntry)
+        {
+            Next = pChild->EndEntry;
+            *pNextChild = GetNextSibling(Directory, *pNextChild);
+        }
+    }
+    if (Next <= Index || Next >= GetDirectoryRecord(Directory, &Scratch)->EndEntry)
+    {
+        return FFS_NO_ENTRY;
+    }
+    
+    return Next;
+}
+
+
+/* Protected method which attempts to find and claim a free file handle in the
+   object's file handle table.  Handles are claimed with an atomic
+   compare-and-swap so it is safe to call from multiple threads without a
+   lock.
+   
+   Parameters:
+    None
+    
+   Returns:
+    Pointer to first free file handle entry or NULL if the table is full.
+*/
+FlashFileSystemFileHandle* FlashFileSystem::FindFreeFileHandle()
+{
+    FlashFileSystemFileHandle*  pFileHandle = NULL;
+    size_t                      i;
+    
+    // Iterate through the file handle array, claiming the first closed one.
+    for (i = 0 ; !pFileHandle && i < sizeof(m_FileHandles)/sizeof(m_FileHandles[0]) ; i++)
+    {
+        if (m_FileHandles[i].TryClaim())
+        {
+            pFileHandle = &(m_FileHandles[i]);
+        }
+    }
+    
+    // Fall back to any overflow handles supplied by the caller.
+    for (i = 0 ; !pFileHandle && i < m_OverflowFileHandleCount ; i++)
+    {
+        if (m_pOverflowFileHandles[i].TryClaim())
+        {
+            pFileHandle = &(m_pOverflowFileHandles[i]);
+        }
+    }
+    
+#if FFS_ACCESS_TRACE
+    // Handles are numbered by their place in the fixed table followed by the
+    // overflow handles.
+    if (pFileHandle)
+    {
+        if (pFileHandle >= m_FileHandles && pFileHandle < m_FileHandles + FFS_FILE_HANDLE_COUNT)
+        {
+            pFileHandle->SetAccessTrace(&m_AccessTrace, pFileHandle - m_FileHandles);
+        }
+        else
+        {
+            pFileHandle->SetAccessTrace(&m_AccessTrace, FFS_FILE_HANDLE_COUNT + (pFileHandle - m_pOverflowFileHandles));
+        }
+    }
+#endif
+#if FFS_STATS
+    if (pFileHandle)
+    {
+        pFileHandle->SetStats(&m_Stats);
+        _CountHandleClaimed(&m_Stats.FileHandlesInUse, &m_Stats.FileHandleHighWater);
+    }
+    else
+    {
+        core_util_atomic_incr_u32(&m_Stats.FileHandleExhaustions, 1);
+    }
+#endif
+    
+    // NULL if no free entries were found.
+    return pFileHandle;
+}
+
+
+/* Protected method which attempts to find and claim a free dir handle in the
+   object's directory handle table.  Handles are claimed with an atomic
+   compare-and-swap so it is safe to call from multiple threads without a
+   lock.
+   
+   Parameters:
+    None
+    
+   Returns:
+    Pointer to first free directory handle entry or NULL if the table is full.
+*/
+FlashFileSystemDirHandle* FlashFileSystem::FindFreeDirHandle()
+{
+    FlashFileSystemDirHandle*   pDirHandle = NULL;
+    size_t                      i;
+    
+    // Iterate through the direcotry handle array, claiming the first closed
+    // one.
+    for (i = 0 ; !pDirHandle && i < sizeof(m_DirHandles)/sizeof(m_DirHandles[0]) ; i++)
+    {
+        if (m_DirHandles[i].TryClaim())
+        {
+            pDirHandle = &(m_DirHandles[i]);
+        }
+    }
+    
+    // Fall back to any overflow handles supplied by the caller.
+    for (i = 0 ; !pDirHandle && i < m_OverflowDirHandleCount ; i++)
+    {
+        if (m_pOverflowDirHandles[i].TryClaim())
+        {
+            pDirHandle = &(m_pOverflowDirHandles[i]);
+        }
+    }
+    
+#if FFS_ACCESS_TRACE
+    if (pDirHandle)
+    {
+        if (pDirHandle >= m_DirHandles && pDirHandle < m_DirHandles + FFS_DIR_HANDLE_COUNT)
+        {
+            pDirHandle->SetAccessTraceId(pDirHandle - m_DirHandles);
+        }
+        else
+        {
+            pDirHandle->SetAccessTraceId(FFS_DIR_HANDLE_COUNT + (pDirHandle - m_pOverflowDirHandles));
+        }
+    }
+#endif
+#if FFS_STATS
+    if (pDirHandle)
+    {
+        _CountHandleClaimed(&m_Stats.DirHandlesInUse, &m_Stats.DirHandleHighWater);
+    }
+    else
+    {
+        core_util_atomic_incr_u32(&m_Stats.DirHandleExhaustions, 1);
+    }
+#endif
+    
+    // NULL if no free entries were found.
+    return pDirHandle;
+}
+
+
+/* Protected method which attempts to find a free block buffer in the object's
+   block buffer table and atomically claims it.
+   
+   Parameters:
+    None
+    
+   Returns:
+    Pointer to first free block buffer or NULL if the table is full.
+*/
+SFlashFileSystemBlockBuffer* FlashFileSystem::FindFreeBlockBuffer()
+{
+    size_t  i;
+    
+    for (i = 0 ; i < sizeof(m_BlockBuffers)/sizeof(m_BlockBuffers[0]) ; i++)
+    {
+        uint8_t Expected = 0;
+        
+        if (core_util_atomic_cas_u8(&m_BlockBuffers[i].InUse, &Expected, 1))
+        {
+            return &(m_BlockBuffers[i]);
+        }
+    }
+    
+    // If we get here, then no free entries were found.
+#if FFS_STATS
+    core_util_atomic_incr_u32(&m_Stats.BlockBufferExhaustions, 1);
+#endif
+    return NULL;
+}
+
+
+/* Protected method which determines whether an entry holds a compressed
+   file.
+   
+   Parameters:
+    Index is the index of the file entry.
+    
+   Returns:
+    Non-zero if the entry is compressed and 0 otherwise.
+*/
+int FlashFileSystemImage::IsCompressed(unsigned int Index)
+{
+    unsigned char   Scratch;
+    
+    if (!m_EntryFlagsOffset)
+    {
+        return 0;
+    }
+    return (*(const unsigned char*)m_Storage.Map(m_EntryFlagsOffset + Index, &Scratch, sizeof(Scratch)) & FFS_ENTRY_FLAG_COMPRESSED);
+}
+
+
+/* Protected method which returns the header of a compressed file after
+   making sure that this runtime can decompress it.
+   
+   Parameters:
+    Index is the index of the file entry of a compressed file.
+    pScratch is filled in with the header when the image is on a block
+        device.
+    
+   Returns:
+    Pointer to the compressed file's header or NULL if its compression isn't
+    supported or the header is corrupt.
+*/
+const SFileSystemCompressedFile* FlashFileSystemImage::GetCompressedFile(unsigned int Index, SFileSystemCompressedFile* pScratch)
+{
+    SFlashFileSystemEntry               EntryScratch;
+    const SFlashFileSystemEntry*        pEntry = GetEntry(Index, &EntryScratch);
+    const SFileSystemCompressedFile*    pCompressedFile;
+    unsigned int                        BlockCount;
+    
+    // Make sure that the block size is supported and the block offset
+    // table fits within the file's data.
+    if (pEntry->FileBinarySize < sizeof(*pCompressedFile) ||
+        pEntry->FileBinaryOffset > m_Storage.GetSize() - sizeof(*pCompressedFile))
+    {
+        return NULL;
+    }
+    pCompressedFile = (const SFileSystemCompressedFile*)m_Storage.Map(pEntry->FileBinaryOffset, pScratch, sizeof(*pScratch));
+    if (FFS_COMPRESSION_LZ4 != pCompressedFile->Compression ||
+        0 == pCompressedFile->BlockSize ||
+        pCompressedFile->BlockSize > FFS_MAX_COMPRESSED_BLOCK_SIZE)
+    {
+        return NULL;
+    }
+    BlockCount = (pCompressedFile->UncompressedSize + pCompressedFile->BlockSize - 1) / pCompressedFile->BlockSize;
+    if (BlockCount >= (pEntry->FileBinarySize - sizeof(*pCompressedFile)) / sizeof(unsigned int))
+    {
+        return NULL;
+    }
+    
+    return pCompressedFile;
+}
+
+
+/* Protected method which reads one of the encoded variant records into the
+   version 3 layout.
+   
+   Parameters:
+    Variant is the index of the record, which must be valid.
+    pVariant is filled in with the record.
+    
+   Returns:
+    Nothing.
+*/
+void FlashFileSystemImage::ReadEncodedVariant(unsigned int Variant, SFileSystemEncodedVariantV3* pVariant)
+{
+    ffs_offset_t                        Offset = m_VariantsOffset + (ffs_offset_t)Variant * m_VariantSize;
+    SFileSystemEncodedVariant           Scratch;
+    const SFileSystemEncodedVariant*    pRecord;
+    
+    assert ( Variant < m_VariantCount );
+    
+    if (sizeof(*pVariant) == m_VariantSize)
+    {
+        *pVariant = *(const SFileSystemEncodedVariantV3*)m_Storage.Map(Offset, pVariant, sizeof(*pVariant));
+        return;
+    }
+    pRecord = (const SFileSystemEncodedVariant*)m_Storage.Map(Offset, &Scratch, sizeof(Scratch));
+    pVariant->FileIndex = pRecord->FileIndex;
+    pVariant->Encoding = pRecord->Encoding;
+    pVariant->FileBinaryOffset = pRecord->FileBinaryOffset;
+    pVariant->FileBinarySize = pRecord->FileBinarySize;
+}
+
+
+/* Protected method which picks the smallest precompressed variant of an
+   entry in one of the accepted encodings.
+   
+   Parameters:
+    Index is the index of the file entry.
+    AcceptedEncodings is a bit mask of (1 << FFS_ENCODING_*) values.
+    pVariant is filled in with the chosen variant.
+    
+    pVariantIndex is filled in with the index of the chosen variant.
+    
+   Returns:
+    Non-zero if a variant was chosen or 0 if the entry doesn't have a usable
+    variant in any of the accepted encodings.
+*/
+int FlashFileSystemImage::FindEncodedVariant(unsigned int                   Index, 
+                                             unsigned int                   AcceptedEncodings, 
+                                             SFileSystemEncodedVariantV3*   pVariant, 
+                                             unsigned int*                  pVariantIndex)
+{
+    SFileSystemEncodedVariantV3         Curr;
+    ffs_offset_t                        ImageSize = m_Storage.GetSize();
+    unsigned int                        Low = 0;
+    unsigned int                        High = m_VariantCount;
+    int                                 Found = 0;
+    
+    // Find the first variant of this entry.
+    while (Low < High)
+    {
+        unsigned int    Middle = Low + (High - Low) / 2;
+        
+        ReadEncodedVariant(Middle, &Curr);
+        if (Curr.FileIndex < Index)
+        {
+            Low = Middle + 1;
+        }
+        else
+        {
+            High = Middle;
+        }
+    }
+    
+    for ( ; Low < m_VariantCount ; Low++)
+    {
+        ReadEncodedVariant(Low, &Curr);
+        if (Index != Curr.FileIndex)
+        {
+            break;
+        }
+        if (Curr.Encoding >= 32 ||
+            0 == (AcceptedEncodings & (1U << Curr.Encoding)) ||
+            Curr.FileBinaryOffset > ImageSize ||
+            Curr.FileBinarySize > ImageSize - Curr.FileBinaryOffset)
+        {
+            continue;
+        }
+        if (!Found || Curr.FileBinarySize < pVariant->FileBinarySize)
+        {
+            *pVariant = Curr;
+            *pVariantIndex = Low;
+            Found = 1;
+        }
+    }
+    
+    return Found;
+}
+
+
+/* Protected method which returns the number of bytes of the verification
+   bitmap used by this image.
+   
+   Returns:
+    Bitmap size in bytes, 2 bits for each file and each encoded variant with
+    a checksum rounded up to a whole word.
+*/
+size_t FlashFileSystemImage::GetVerificationBitmapSize()
+{
+    return ((2 * ((size_t)m_FileCount + m_VariantChecksumCount) + 31) / 32) * sizeof(uint32_t);
+}
+
+
+/* Protected method which checks the entry table, every file and every
+   encoded variant with a checksum in this image against their stored
+   checksums.  The image must contain checksums.
+   
+   Parameters:
+    pBadFileCount has the number of files and variants which failed the
+        check added to it.
+    
+   Returns:
+    0 if the image is intact or -EIO if anything failed the check.
+*/
+int FlashFileSystemImage::VerifyImage(unsigned int* pBadFileCount)
+{
+    SFileSystemChecksums        Scratch;
+    const SFileSystemChecksums* pChecksums;
+    int                         Result = 0;
+    unsigned int                i;
+    
+    assert ( m_ChecksumsOffset );
+    
+    pChecksums = (const SFileSystemChecksums*)m_Storage.Map(m_ChecksumsOffset, &Scratch, sizeof(Scratch));
+    if (pChecksums->EntryTableChecksum != Checksum(m_FileEntriesOffset, (ffs_offset_t)m_FileCount * m_EntrySize))
+    {
+        TRACE("FlashFileSystem: The file entry table is corrupt.\n");
+        Result = -EIO;
+    }
+    for (i = 0 ; i < m_FileCount + m_VariantChecksumCount ; i++)
+    {
+        int IsBad = (i < m_FileCount) ? CheckEntry(i) : CheckEncodedVariant(i - m_FileCount);
+        
+        if (IsBad)
+        {
+            TRACE("FlashFileSystem: %s %u is corrupt.\n", (i < m_FileCount) ? "Entry" : "Encoded variant", 
+                  (i < m_FileCount) ? i : i - m_FileCount);
+            (*pBadFileCount)++;
+            Result = -EIO;
+        }
+        if (m_pVerifyBitmap)
+        {
+            core_util_atomic_fetch_or_u32(&m_pVerifyBitmap[i / 16], (IsBad ? 3U : 1U) << (2 * (i % 16)));
+        }
+    }
+    
+    return Result;
+}
+
+
+/* Protected method which checks an entry against its stored checksum the
+   first time that it is used while verification is enabled.  Two threads
+   which race here both compute the checksum, which gives the same result.
+   
+   Parameters:
+    Index is the index of the file entry about to be used, or m_FileCount
+        plus the index of an encoded variant with a checksum.
+    
+   Returns:
+    0 if the entry can be used or -EIO if it failed verification.
+*/
+int FlashFileSystemImage::VerifyEntry(unsigned int Index)
+{
+    volatile uint32_t*  pWord;
+    unsigned int        Shift;
+    uint32_t            Bits;
+    
+    if (!m_pVerifyBitmap)
+    {
+        return 0;
+    }
+    
+    pWord = &m_pVerifyBitmap[Index / 16];
+    Shift = 2 * (Index % 16);
+    Bits = (core_util_atomic_load_u32(pWord) >> Shift) & 0x3;
+    if (0 == (Bits & 0x1))
+    {
+        Bits = ((Index < m_FileCount) ? CheckEntry(Index) : CheckEncodedVariant(Index - m_FileCount)) ? 0x3 : 0x1;
+        core_util_atomic_fetch_or_u32(pWord, Bits << Shift);
+    }
+    
+    return (Bits & 0x2) ? -EIO : 0;
+}
+
+
+/* Protected method which checks an encoded variant against its stored
+   checksum the first time that it is used while verification is enabled.
+   Variants of images built without variant checksums aren't checked.
+   
+   Parameters:
+    Variant is the index of the encoded variant about to be used.
+    
+   Returns:
+    0 if the variant can be used or -EIO if it failed verification.
+*/
+int FlashFileSystemImage::VerifyEncodedVariant(unsigned int Variant)
+{
+    if (Variant >= m_VariantChecksumCount)
+    {
+        return 0;
+    }
+    return VerifyEntry(m_FileCount + Variant);
+}
+
+
+/* Protected method which makes sure that an entry's data lies within the
+   image and matches its stored checksum.
+   
+   Parameters:
+    Index is the index of the file entry to be checked.
+    
+   Returns:
+    0 if the entry is intact and non-zero otherwise.
+*/
+int FlashFileSystemImage::CheckEntry(unsigned int Index)
+{
+    SFlashFileSystemEntry        EntryScratch;
+    const SFlashFileSystemEntry* pEntry = GetEntry(Index, &EntryScratch);
+    unsigned int                 ChecksumScratch;
+    ffs_offset_t                 ImageSize = m_Storage.GetSize();
+    
+    if (pEntry->FileBinaryOffset > ImageSize ||
+        pEntry->FileBinarySize > ImageSize - pEntry->FileBinaryOffset)
+    {
+        return 1;
+    }
+    
+    return *(const unsigned int*)m_Storage.Map(m_ChecksumsOffset + sizeof(SFileSystemChecksums) + Index * sizeof(ChecksumScratch), 
+                                               &ChecksumScratch, 
+                                               sizeof(ChecksumScratch)) != 
+           Checksum(pEntry->FileBinaryOffset, pEntry->FileBinarySize);
+}
+
+
+/* Protected method which makes sure that an encoded variant's data lies
+   within the image and matches its stored checksum, which follows the file
+   checksums.
+   
+   Parameters:
+    Variant is the index of the encoded variant to be checked.
+    
+   Returns:
+    0 if the variant is intact and non-zero otherwise.
+*/
+int FlashFileSystemImage::CheckEncodedVariant(unsigned int Variant)
+{
+    SFileSystemEncodedVariantV3 Record;
+    unsigned int                ChecksumScratch;
+    ffs_offset_t                ImageSize = m_Storage.GetSize();
+    
+    assert ( Variant < m_VariantChecksumCount );
+    
+    ReadEncodedVariant(Variant, &Record);
+    if (Record.FileBinaryOffset > ImageSize ||
+        Record.FileBinarySize > ImageSize - Record.FileBinaryOffset)
+    {
+        return 1;
+    }
+    
+    return *(const unsigned int*)m_Storage.Map(m_ChecksumsOffset + sizeof(SFileSystemChecksums) + 
+                                               ((ffs_offset_t)m_FileCount + Variant) * sizeof(ChecksumScratch), 
+                                               &ChecksumScratch, 
+                                               sizeof(ChecksumScratch)) != 
+           Checksum((ffs_offset_t)Record.FileBinaryOffset, (ffs_offset_t)Record.FileBinarySize);
+}
+
+
+/* Protected method which computes the CRC32C of a range of the image.
+   Images on a block device are read a chunk at a time.
+   
+   Parameters:
+    Offset is the offset of the range within the image.
+    Size is the number of bytes in the range, which must lie within the
+        image.
+    
+   Returns:
+    The CRC32C of the range.  A range which can't be read from the device
+    gets a checksum of 0, which only matches by accident.
+*/
+unsigned int FlashFileSystemImage::Checksum(ffs_offset_t Offset, ffs_offset_t Size)
+{
+#if FFS_BLOCK_DEVICE
+    if (!m_Storage.GetBase())
+    {
+        uint32_t    Crc = 0;
+        char        Buffer[256];
+        
+        while (Size > 0)
+        {
+            unsigned int    Chunk = (Size < sizeof(Buffer)) ? Size : sizeof(Buffer);
+            
+            if (m_Storage.Read(Offset, Buffer, Chunk))
+            {
+                return 0;
+            }
+            Crc = FFSCRC32C(Crc, Buffer, Chunk);
+            Offset += Chunk;
+            Size -= Chunk;
+        }
+        return Crc;
+    }
+#endif
+    return FFSCRC32C(0, m_Storage.GetBase() + Offset, Size);
+}
@@ -1,325 +1,1093 @@
-/* Copyright 2011 Adam Green (http://mbed.org/users/AdamGreen/)
-
-   Licensed under the Apache License, Version 2.0 (the "License");
-   you may not use this file except in compliance with the License.
-   You may obtain a copy of the License at
-
-       http://www.apache.org/licenses/LICENSE-2.0
-
-   Unless required by applicable law or agreed to in writing, software
-   distributed under the License is distributed on an "AS IS" BASIS,
-   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
-   See the License for the specific language governing permissions and
-   limitations under the License.
-*/
-/* Specifies the classes used to implement the FlashFileSystem which is a
-   read-only file system that exists in the internal FLASH of the mbed
-   device.
-*/
-#ifndef _FLASHFILESYSTEM_H_
-#define _FLASHFILESYSTEM_H_
-
-#include "FileSystemLike.h"
-
-
-// Forward declare file system entry structure used internally in 
-// FlashFileSystem.
-struct _SFileSystemEntry;
-
-
-
-// Represents an opened file object in the FlashFileSystem.
-class FlashFileSystemFileHandle : public mbed::FileHandle 
-{
-public:
-    FlashFileSystemFileHandle();
-    FlashFileSystemFileHandle(const char* pFileStart, const char* pFileEnd);
-    
-    // FileHandle interface methods.
-    virtual ssize_t write(const void* buffer, size_t length) override;
-    virtual int close() override;
-    virtual ssize_t read(void* buffer, size_t length) override;
-    virtual off_t seek(off_t offset, int whence) override;
-    virtual off_t size() override;
-
-    // Used by FlashFileSystem to maintain entries in its handle table.
-    void SetEntry(const char* pFileStart, const char* pFileEnd)
-    {
-        m_pFileStart = pFileStart;
-        m_pFileEnd = pFileEnd;
-        m_pCurr = pFileStart;
-    }
-    int IsClosed()
-    {
-        return (NULL == m_pFileStart);
-    }
-
-    /** Check for poll event flags
-     * You can use or ignore the input parameter. You can return all events
-     * or check just the events listed in events.
-     * Call is nonblocking - returns instantaneous state of events.
-     * Whenever an event occurs, the derived class should call the sigio() callback).
-     *
-     * @param events        bitmask of poll events we're interested in - POLLIN/POLLOUT etc.
-     *
-     * @returns             bitmask of poll events that have occurred.
-     */
-    virtual short poll(short events) const override
-    {
-        // Only readable is true
-        return POLLIN;
-    }
-    
-protected:
-    // Beginning offset of file in FLASH memory.
-    const char*         m_pFileStart;
-    // Ending offset of file in FLASH memory.
-    const char*         m_pFileEnd;
-    // Current position in file to be updated by read and seek operations.
-    const char*         m_pCurr;
-};
-
-
-// Represents an open directory in the FlashFileSystem.
-class FlashFileSystemDirHandle : public DirHandle
-{
- public:
-    // Constructors
-    FlashFileSystemDirHandle();
-    FlashFileSystemDirHandle(const char*              pFLASHBase,
-                             const _SFileSystemEntry* pFirstFileEntry,
-                             unsigned int             FileEntriesLeft,
-                             unsigned int             DirectoryNameLength);
-                             
-    // Used by FlashFileSystem to maintain DirHandle entries in its cache.
-    void SetEntry(const char*              pFLASHBase,
-                  const _SFileSystemEntry* pFirstFileEntry,
-                  unsigned int             FileEntriesLeft,
-                  unsigned int             DirectoryNameLength)
-    {
-        m_pFLASHBase = pFLASHBase;
-        m_pFirstFileEntry = pFirstFileEntry;
-        m_pCurrentFileEntry = pFirstFileEntry;
-        m_FileEntriesLeft = FileEntriesLeft;
-        m_DirectoryNameLength = DirectoryNameLength;
-    }
-    int IsClosed()
-    {
-        return (NULL == m_pFirstFileEntry);
-    }
-    
-    // Methods defined by DirHandle interface.
-    virtual int    close() override;
-    virtual ssize_t read(struct dirent *ent) override;
-    virtual void   rewind() override;
-    virtual off_t  tell() override;
-    virtual void   seek(off_t location) override;
-
-protected:
-    // The first file entry for this directory.  rewinddir() takes the
-    // iterator back to here.
-    const _SFileSystemEntry*    m_pFirstFileEntry;
-    // The next file entry to be returned for this directory enumeration.
-    const _SFileSystemEntry*    m_pCurrentFileEntry;
-    // Pointer to where the file system image is located in the device's FLASH.
-    const char*                 m_pFLASHBase;
-    // Contents of previously return directory entry structure.
-    struct dirent               m_DirectoryEntry;
-    // This is the length of the directory name which was opened.  When the
-    // first m_DirectoryNameLength characters change then we have iterated
-    // through to a different directory.
-    unsigned int                m_DirectoryNameLength;
-    // The number of entries left in the file system file entries array.
-    unsigned int                m_FileEntriesLeft;
-};
-
-
-
-/** A filesystem for accessing a read-only file system placed in the internal\n
- *  FLASH memory of the mbed board.
- *\n
- *  The file system to be mounted by this file system should be created through\n
- *  the use of the fsbld utility on the PC.\n
- *\n
- *  As fsbld creates two output files (a binary and a header file), there are two\n
- *  ways to add the resulting file system image:\n
- *  -# Concatenate the binary file system to the end of the .bin file created\n
- *     by the mbed online compiler before uploading to the mbed device.\n
- *  -# Import the header file into your project, include this file in your main\n
- *     file and add 'roFlashDrive' to the FlashfileSystem constructor call.\n
- *     eg : static FlashFileSystem flash("flash", roFlashDrive);\n
- *
- *  A third (optional) parameter in the FlashfileSystem constructor call allows\n
- *  you to specify the size of the FLASH (KB) on the device (default = 512).\n
- *  eg (for a KL25Z device) : static FlashFileSystem flash("flash", NULL, 128);\n
- *  Note that in this example, the pointer to the header file has been omitted,\n
- *  so we need to append the binary file system ourselves (see above).\n
- *  When you use the binary file system header in your main file, you can\n
- *  use the roFlashDrive pointer.\n
- *  eg (for a KL25Z device) : static FlashFileSystem flash("flash", roFlashDrive, 128);\n
- *\n
- *  NOTE: This file system is case-sensitive.  Calling fopen("/flash/INDEX.html")\n
- *        won't successfully open a file named index.html in the root directory\n
- *        of the flash file system.\n
- *
- * Example:
- * @code
-#include <mbed.h>
-#include "FlashFileSystem.h"
-// Uncomment the line below when you imported the header file built with fsbld
-// and replace <Flashdrive> with its correct filename
-//#include "<FlashDrive>.h"
-
-static void _RecursiveDir(const char* pDirectoryName, DIR* pDirectory = NULL)
-{
-    DIR* pFreeDirectory = NULL;
-    
-    size_t DirectoryNameLength = strlen(pDirectoryName);
- 
-    // Open the specified directory.
-    if (!pDirectory)
-    {
-        pDirectory = opendir(pDirectoryName);
-        if (!pDirectory)
-        {
-            error("Failed to open directory '%s' for enumeration.\r\n", 
-                  pDirectoryName);
-        }
-        
-        // Remember to free this directory enumerator.
-        pFreeDirectory = pDirectory;
-    }
-        
-    // Determine if we should remove a trailing slash from future *printf()
-    // calls.
-    if (DirectoryNameLength && '/' == pDirectoryName[DirectoryNameLength-1])
-    {
-        DirectoryNameLength--;
-    }
-    
-    // Iterate though each item contained within this directory and display
-    // it to the console.
-    struct dirent* DirEntry;
-    while((DirEntry = readdir(pDirectory)) != NULL) 
-    {
-        char RecurseDirectoryName[256];
-        DIR* pSubdirectory;
-
-        // Try opening this file as a directory to see if it succeeds or not.
-        snprintf(RecurseDirectoryName, sizeof(RecurseDirectoryName),
-                 "%.*s/%s",
-                 DirectoryNameLength,
-                 pDirectoryName,
-                 DirEntry->d_name);
-        pSubdirectory = opendir(RecurseDirectoryName);
-        
-        if (pSubdirectory)
-        {
-            _RecursiveDir(RecurseDirectoryName, pSubdirectory);
-            closedir(pSubdirectory);
-        }
-        else
-        {
-            printf("    %.*s/%s\n", 
-                   DirectoryNameLength, 
-                   pDirectoryName, 
-                   DirEntry->d_name);
-        }
-    }
-    
-    // Close the directory enumerator if it was opened by this call.
-    if (pFreeDirectory)
-    {
-        closedir(pFreeDirectory);
-    }
-}
-
-int main() 
-{
-    static const char* Filename = "/flash/index.html";
-    char*              ReadResult = NULL;
-    int                SeekResult = -1;
-    char               Buffer[128];
-
-    // Create the file system under the name "flash".
-    // NOTE : When you include the the header file built with fsbld,
-    //        disable the first static FlashFileSystem... line
-    //        and enable the second static FlashFileSystem... line.
-    static FlashFileSystem flash("flash");
-//    static FlashFileSystem flash("flash", roFlashDrive);
-    if (!flash.IsMounted())
-    {
-        error("Failed to mount FlashFileSystem.\r\n");
-    }
-
-    // Open "index.html" on the file system for reading.
-    FILE *fp = fopen(Filename, "r");
-    if (NULL == fp)
-    {
-        error("Failed to open %s\r\n", Filename);
-    }
-    
-    // Use seek to determine the length of the file
-    SeekResult = fseek(fp, 0, SEEK_END);
-    if (SeekResult)
-    {
-        error("Failed to seek to end of %s.\r\n", Filename);
-    }
-    long FileLength = ftell(fp);
-    printf("%s is %ld bytes in length.\r\n", Filename, FileLength);
-    
-    // Reset the file pointer to the beginning of the file
-    SeekResult = fseek(fp, 0, SEEK_SET);
-    if (SeekResult)
-    {
-        error("Failed to seek to beginning of %s.\r\n", Filename);
-    }
-    
-    // Read the first line into Buffer and then display to user.
-    ReadResult = fgets(Buffer, sizeof(Buffer)/sizeof(Buffer[0]), fp);
-    if (NULL == ReadResult)
-    {
-        error("Failed to read first line of %s.\r\n", Filename);
-    }
-    printf("%s:1  %s", Filename, Buffer);
-    
-    // Done with the file so close it.
-    fclose(fp);                               
-
-    // Enumerate all content on mounted file systems.
-    printf("\r\nList all files in /flash...\r\n");
-    _RecursiveDir("/flash");
-        
-    printf("\r\nFlashFileSystem example has completed.\r\n");
-}
- * @endcode
- */
-class FlashFileSystem : public mbed::FileSystemLike 
-{
-public:
-    FlashFileSystem(const char* pName, const uint8_t *pFlashDrive = NULL, const uint32_t FlashSize = 512);
-    
-    virtual int open(FileHandle** file, const char* pFilename, int Flags) override;
-    virtual int  open(DirHandle** dir, const char *pDirectoryName) override;
-
-    virtual int         IsMounted() { return (m_FileCount != 0); }
-
-protected:
-    FlashFileSystemFileHandle*  FindFreeFileHandle();
-    FlashFileSystemDirHandle*   FindFreeDirHandle();
-    
-    // File handle table used by this file system so that it doesn't need
-    // to dynamically allocate file handles at runtime.
-    FlashFileSystemFileHandle   m_FileHandles[16];
-    // Directory handle table used by this file system so that it doesn't need
-    // to dynamically allocate file handles at runtime.
-    FlashFileSystemDirHandle    m_DirHandles[16];
-    // Pointer to where the file system image is located in the device's FLASH.
-    const char*                 m_pFLASHBase;
-    // Pointer to where the file entries are located in the device's FLASH.
-    const _SFileSystemEntry*    m_pFileEntries;
-    // The number of files in the file system image.
-    unsigned int                m_FileCount;
-};
-
-#endif // _FLASHFILESYSTEM_H_
+/* Copyright 2011 Adam Green (http://mbed.org/users/AdamGreen/)
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+/* Specifies the classes used to implement the FlashFileSystem which is a
+   read-only file system that exists in the internal FLASH of the mbed
+   device.
+*/
+#ifndef _FLASHFILESYSTEM_H_
+#define _FLASHFILESYSTEM_H_
+
+#include "FileSystemLike.h"
+#include "platform/mbed_atomic.h"
+
+// Set FFS_BLOCK_DEVICE to 1 to support images which are read through an
+// mbed BlockDevice, such as external SPI or QSPI NOR FLASH, instead of
+// being mapped into the device's address space.
+#ifndef FFS_BLOCK_DEVICE
+#define FFS_BLOCK_DEVICE                0
+#endif
+#if FFS_BLOCK_DEVICE
+#include "blockdevice/BlockDevice.h"
+#include "platform/PlatformMutex.h"
+#endif
+
+// Set FFS_MAPPED_FILE to 1 to support mounting image files on a POSIX host,
+// such as Linux, by mapping them read-only with mmap().  Host tools, tests
+// and simulators can then read images with the same code as the device.
+#ifndef FFS_MAPPED_FILE
+#define FFS_MAPPED_FILE                 0
+#endif
+
+// Set FFS_LARGE_IMAGES to 1 to mount version 3 images which are larger than
+// 4GB, such as image files mapped on a 64-bit host or images on large
+// external FLASH.  Offsets within images are then held in 64 bits, which
+// costs code and time on 32-bit devices.  Version 3 images smaller than 4GB
+// can be mounted either way.  Files over 2GB also need a 64-bit off_t.
+#ifndef FFS_LARGE_IMAGES
+#define FFS_LARGE_IMAGES                0
+#endif
+
+// Offset or size within a mounted image.
+#if FFS_LARGE_IMAGES
+typedef uint64_t ffs_offset_t;
+#else
+typedef uint32_t ffs_offset_t;
+#endif
+#define FFS_MAX_OFFSET                  ((ffs_offset_t)~(ffs_offset_t)0)
+
+
+// Forward declare file system entry structure used internally in 
+// FlashFileSystem.
+struct _SFileSystemCompressedFile;
+struct _SFileSystemEncodedVariantV3;
+struct _SFileSystemDirectory;
+struct _SFileSystemAccessRecord;
+class FlashFileSystem;
+class FlashFileSystemImage;
+class FlashFileSystemStorage;
+
+
+// Largest block size supported for compressed files in the image.  Each
+// block buffer below reserves this many bytes of RAM.
+#ifndef FFS_MAX_COMPRESSED_BLOCK_SIZE
+#define FFS_MAX_COMPRESSED_BLOCK_SIZE   1024
+#endif
+
+// Number of compressed files which can be open at the same time.  ReadAt()
+// and ReadVectorAt() on a compressed file also hold one while they run.
+#ifndef FFS_BLOCK_BUFFER_COUNT
+#define FFS_BLOCK_BUFFER_COUNT          2
+#endif
+
+// Number of files which can be open at the same time, not counting any
+// handles added later with FlashFileSystem::AddOverflowHandles().
+#ifndef FFS_FILE_HANDLE_COUNT
+#define FFS_FILE_HANDLE_COUNT           16
+#endif
+
+// Number of directories which can be open at the same time, not counting any
+// handles added later with FlashFileSystem::AddOverflowHandles().
+#ifndef FFS_DIR_HANDLE_COUNT
+#define FFS_DIR_HANDLE_COUNT            16
+#endif
+
+// Largest number of images which can be stacked with
+// FlashFileSystem::AddOverlay(), including the base image.  Each directory
+// handle keeps a position in every image.
+#ifndef FFS_MAX_IMAGES
+#define FFS_MAX_IMAGES                  1
+#endif
+#if FFS_MAX_IMAGES < 1 || FFS_MAX_IMAGES > 32
+#error FFS_MAX_IMAGES must be between 1 and 32.
+#endif
+
+#if FFS_BLOCK_DEVICE
+// Size of each line in the RAM block cache shared by the images read
+// through a block device.  Must be a power of 2 and a multiple of the
+// device's read size.
+#ifndef FFS_BLOCK_CACHE_LINE_SIZE
+#define FFS_BLOCK_CACHE_LINE_SIZE       512
+#endif
+
+// Number of lines in the block cache.
+#ifndef FFS_BLOCK_CACHE_LINE_COUNT
+#define FFS_BLOCK_CACHE_LINE_COUNT      8
+#endif
+
+// Number of lines read from the device in one go when a cache miss follows
+// on from the previous one.  1 disables readahead.
+#ifndef FFS_BLOCK_CACHE_READAHEAD
+#define FFS_BLOCK_CACHE_READAHEAD       4
+#endif
+
+#if (FFS_BLOCK_CACHE_LINE_SIZE & (FFS_BLOCK_CACHE_LINE_SIZE - 1)) != 0
+#error FFS_BLOCK_CACHE_LINE_SIZE must be a power of 2.
+#endif
+#if FFS_BLOCK_CACHE_READAHEAD < 1 || FFS_BLOCK_CACHE_READAHEAD > FFS_BLOCK_CACHE_LINE_COUNT
+#error FFS_BLOCK_CACHE_READAHEAD must be between 1 and FFS_BLOCK_CACHE_LINE_COUNT.
+#endif
+#endif
+
+// Longest filename, including its directories, which can be looked up in an
+// image read through a block device or returned by FlashFileSystem::FindNext()
+// from an image which doesn't store whole names in memory mapped FLASH.
+// Names are copied into buffers of this size while they are compared.
+#ifndef FFS_MAX_NAME_LENGTH
+#define FFS_MAX_NAME_LENGTH             255
+#endif
+
+
+// Set FFS_WIDE_COPY to 1 to have read() copy memory mapped file data with
+// FFSCopy() instead of memcpy().  It uses aligned 16 byte loads from FLASH
+// whatever the alignment of the caller's buffer, which helps C libraries
+// that fall back to byte copies for mismatched alignments.  Images built
+// with ffsbuild --align 16 let those loads start at the beginning of each
+// file.
+#ifndef FFS_WIDE_COPY
+#define FFS_WIDE_COPY                   0
+#endif
+
+
+// Set FFS_STATS to 1 to count lookups, reads and handle usage in an
+// SFlashFileSystemStats which can be read at runtime with
+// FlashFileSystem::GetStats().  The counters are updated atomically and
+// compile out completely when it is 0.
+#ifndef FFS_STATS
+#define FFS_STATS                       0
+#endif
+
+// Set FFS_STATS_HISTOGRAMS to 1 to also record histograms of the time
+// spent in open() and read().  The time is measured with
+// FFS_STATS_CYCLE_COUNT(), which defaults to the Cortex-M DWT cycle counter.
+// The application must enable the counter.
+#ifndef FFS_STATS_HISTOGRAMS
+#define FFS_STATS_HISTOGRAMS            0
+#endif
+#if FFS_STATS_HISTOGRAMS && !FFS_STATS
+#error FFS_STATS_HISTOGRAMS needs FFS_STATS.
+#endif
+
+// Number of buckets in each histogram.  Bucket i counts the calls which took
+// 2^i to 2^(i+1)-1 cycles, and bucket 0 also counts those which took 0.
+#define FFS_STATS_HISTOGRAM_BUCKETS     32
+
+// Counters returned by FlashFileSystem::GetStats().
+struct SFlashFileSystemStats
+{
+    // open() and OpenPreferringEncoding() calls which found the file and
+    // which didn't.
+    uint32_t    OpenHits;
+    uint32_t    OpenMisses;
+    // Names and hash slots compared while searching the images for files
+    // and directories.
+    uint32_t    SearchProbes;
+    // Bytes returned by read(), ReadAt(), ReadVectorAt() and ReadDirect().
+    uint64_t    BytesRead;
+    // File and directory handles which are open now and the most which have
+    // been open at once.  Overflow handles are included.
+    uint32_t    FileHandlesInUse;
+    uint32_t    FileHandleHighWater;
+    uint32_t    DirHandlesInUse;
+    uint32_t    DirHandleHighWater;
+    // Opens which failed with -ENOSR because every file handle, directory
+    // handle or block buffer was in use.
+    uint32_t    FileHandleExhaustions;
+    uint32_t    DirHandleExhaustions;
+    uint32_t    BlockBufferExhaustions;
+#if FFS_STATS_HISTOGRAMS
+    // Cycles spent in each open() of a file and each read().
+    uint32_t    OpenCycles[FFS_STATS_HISTOGRAM_BUCKETS];
+    uint32_t    ReadCycles[FFS_STATS_HISTOGRAM_BUCKETS];
+#endif
+};
+
+
+// Set FFS_ACCESS_TRACE to 1 so that the calls made on the file system and
+// its handles can be recorded, as the SFileSystemAccessRecords of
+// ffstrace.h, in a ring buffer passed to
+// FlashFileSystem::EnableAccessTrace().
+#ifndef FFS_ACCESS_TRACE
+#define FFS_ACCESS_TRACE                0
+#endif
+
+#if FFS_ACCESS_TRACE
+// Writes access records into a caller supplied ring buffer of 24 byte slots.
+// Each record reserves its slots with an atomic add so calls from several
+// threads can be recorded without a lock.
+class FlashFileSystemAccessTrace
+{
+public:
+    FlashFileSystemAccessTrace();
+    
+    int     Enable(void* pBuffer, size_t BufferSize);
+    void    Disable();
+    size_t  Copy(void* pDest, size_t DestSize);
+    void    Record(unsigned int Type, 
+                   unsigned int Whence, 
+                   unsigned int Handle, 
+                   uint64_t     Value, 
+                   int64_t      Result, 
+                   const char*  pName = NULL);
+    
+protected:
+    // Ring buffer which records are written to or NULL while tracing is
+    // disabled.
+    _SFileSystemAccessRecord* volatile  m_pSlots;
+    // Ring buffer which was last enabled, kept after tracing is disabled so
+    // that its records can still be copied.
+    _SFileSystemAccessRecord*           m_pRing;
+    // Number of slots in the ring, a power of 2, minus 1.
+    volatile uint32_t                   m_Mask;
+    // Number of slots reserved since tracing was enabled.
+    volatile uint32_t                   m_Head;
+};
+#endif
+
+
+// Buffer used by a file handle to hold the decompressed contents of the
+// current block of a compressed file.
+struct SFlashFileSystemBlockBuffer
+{
+    char                Data[FFS_MAX_COMPRESSED_BLOCK_SIZE];
+#if FFS_BLOCK_DEVICE
+    // Compressed contents of the block, read from the block device.  LZ4
+    // blocks which don't shrink are stored uncompressed so they fit.
+    char                Compressed[FFS_MAX_COMPRESSED_BLOCK_SIZE];
+#endif
+    // Non-zero while a file handle is using this buffer.  Only updated
+    // atomically.
+    volatile uint8_t    InUse;
+};
+
+
+
+#if FFS_BLOCK_DEVICE
+// RAM cache of the lines most recently read from the block devices holding
+// mounted images.  Lines are replaced with the CLOCK algorithm.  Reads which
+// cover whole lines go straight to the device so that streaming through a
+// large file doesn't evict the entry table and filenames.  The cache is
+// shared by every thread using the file system so it is protected by a
+// mutex.
+class FlashFileSystemBlockCache
+{
+public:
+    FlashFileSystemBlockCache();
+    
+    int Read(BlockDevice* pDevice, bd_addr_t Address, void* pBuffer, size_t Size);
+    
+protected:
+    int FindLine(BlockDevice* pDevice, bd_addr_t Address);
+    int FillLine(BlockDevice* pDevice, bd_addr_t Address, int Readahead);
+    
+    PlatformMutex   m_Mutex;
+    // Contents of each line.  Lines filled by the same readahead are next to
+    // each other so that they can be read from the device in one go.
+    char            m_Data[FFS_BLOCK_CACHE_LINE_COUNT][FFS_BLOCK_CACHE_LINE_SIZE];
+    // Device and line aligned address held by each line.  Lines with a NULL
+    // device are empty.
+    BlockDevice*    m_pDevices[FFS_BLOCK_CACHE_LINE_COUNT];
+    bd_addr_t       m_Addresses[FFS_BLOCK_CACHE_LINE_COUNT];
+    // Number of valid bytes in each line, less than a whole line at the end
+    // of the device.
+    uint32_t        m_Lengths[FFS_BLOCK_CACHE_LINE_COUNT];
+    // Set when the line is used and cleared as the CLOCK hand passes.
+    uint8_t         m_Referenced[FFS_BLOCK_CACHE_LINE_COUNT];
+    // Position of the CLOCK hand.
+    unsigned int    m_Hand;
+    // Device and address following the last line which was read from a
+    // device.  A miss there is part of a sequential scan and triggers
+    // readahead.
+    BlockDevice*    m_pNextDevice;
+    bd_addr_t       m_NextAddress;
+};
+#endif
+
+
+#if FFS_MAPPED_FILE
+// Access hints for FlashFileSystemMappedFile::Open() and Advise().
+// Read the whole image into the page cache up front.
+#define FFS_MAP_POPULATE                1
+// The image will be read from start to end, such as when scanning every
+// file, so the kernel should read ahead aggressively.
+#define FFS_MAP_SEQUENTIAL              2
+// The image will be read at random, such as when serving requests, so the
+// kernel shouldn't read ahead.
+#define FFS_MAP_RANDOM                  4
+
+// An image file on a POSIX host which is mapped read-only into memory so
+// that it can be mounted with FlashFileSystem(pName, File) or AddOverlay().
+// It must outlive the file systems which use it.
+class FlashFileSystemMappedFile
+{
+public:
+    FlashFileSystemMappedFile();
+    ~FlashFileSystemMappedFile();
+    
+    int     Open(const char* pFilename, unsigned int Flags = 0);
+    int     Advise(unsigned int Flags);
+    void    Close();
+    
+    // Start of the mapped image or NULL if no file is open.
+    const uint8_t*  GetData() { return m_pData; }
+    // Size of the mapped image.
+    size_t          GetSize() { return m_Size; }
+    
+protected:
+    // Copies would unmap the file when they were destroyed.
+    FlashFileSystemMappedFile(const FlashFileSystemMappedFile& Other);
+    FlashFileSystemMappedFile& operator=(const FlashFileSystemMappedFile& Other);
+    
+    const uint8_t*  m_pData;
+    size_t          m_Size;
+};
+#endif
+
+
+// Reads the bytes of a mounted image.  Images in memory mapped FLASH are
+// accessed in place while images on a block device are copied into caller
+// supplied buffers through the block cache.
+class FlashFileSystemStorage
+{
+public:
+    FlashFileSystemStorage();
+    
+    void SetMemory(const char* pBase, ffs_offset_t Size);
+#if FFS_BLOCK_DEVICE
+    void SetBlockDevice(BlockDevice* pDevice, bd_addr_t Address, ffs_offset_t Size, FlashFileSystemBlockCache* pCache);
+#endif
+    void SetSize(ffs_offset_t Size) { m_Size = Size; }
+    
+    // Returns a pointer to Size bytes at Offset in the image: straight into
+    // FLASH for memory mapped images, otherwise pScratch after the bytes
+    // have been copied into it.  Bytes which can't be read from the device
+    // are returned as 0.
+    const void* Map(ffs_offset_t Offset, void* pScratch, size_t Size)
+    {
+#if FFS_BLOCK_DEVICE
+        if (!m_pBase)
+        {
+            return ReadScratch(Offset, pScratch, Size);
+        }
+#endif
+        return m_pBase + Offset;
+    }
+    const char* MapString(ffs_offset_t Offset, char* pScratch, size_t ScratchSize);
+    int         Read(ffs_offset_t Offset, void* pBuffer, size_t Size);
+    
+    // Base address of a memory mapped image or NULL for a block device.
+    const char* GetBase() { return m_pBase; }
+    // Number of bytes in the image, or that can be safely read when the
+    // image hasn't been checked yet.
+    ffs_offset_t GetSize() { return m_Size; }
+    
+protected:
+#if FFS_BLOCK_DEVICE
+    const void* ReadScratch(ffs_offset_t Offset, void* pScratch, size_t Size);
+#endif
+    
+    const char*                 m_pBase;
+    ffs_offset_t                m_Size;
+#if FFS_BLOCK_DEVICE
+    BlockDevice*                m_pDevice;
+    bd_addr_t                   m_Address;
+    FlashFileSystemBlockCache*  m_pCache;
+#endif
+};
+
+
+// One of the buffers filled in by FlashFileSystemFileHandle::ReadVectorAt().
+struct SFlashFileSystemIoVector
+{
+    void*   pBuffer;
+    size_t  Length;
+};
+
+
+// Represents an opened file object in the FlashFileSystem.
+class FlashFileSystemFileHandle : public mbed::FileHandle 
+{
+public:
+    FlashFileSystemFileHandle();
+    FlashFileSystemFileHandle(const char* pFileStart, const char* pFileEnd);
+    
+    // FileHandle interface methods.
+    virtual ssize_t write(const void* buffer, size_t length) override;
+    virtual int close() override;
+    virtual ssize_t read(void* buffer, size_t length) override;
+    virtual off_t seek(off_t offset, int whence) override;
+    virtual off_t size() override;
+
+    // Zero-copy alternative to read() which returns a pointer directly into
+    // the FLASH image instead of copying the data into a caller buffer.
+    ssize_t ReadDirect(const void** ppBuffer, size_t Length);
+
+    // Positional reads which leave the file position alone so that several
+    // threads can read through the same handle at once.
+    ssize_t ReadAt(void* pBuffer, size_t Length, off_t Offset);
+    ssize_t ReadVectorAt(const SFlashFileSystemIoVector* pVectors, int VectorCount, off_t Offset);
+
+    // Used by FlashFileSystem to maintain entries in its handle table.
+    void SetEntry(const char* pFileStart, const char* pFileEnd)
+    {
+        m_pFileStart = pFileStart;
+        m_FileSize = pFileEnd - pFileStart;
+#if FFS_BLOCK_DEVICE
+        m_pStorage = NULL;
+        m_FileOffset = 0;
+#endif
+        m_UncompressedSize = 0;
+        m_BlockSize = 0;
+        m_pBlockBuffer = NULL;
+        m_pFileSystem = NULL;
+        m_CachedBlock = ~0U;
+        m_Position = 0;
+    }
+    void SetEntry(FlashFileSystemStorage* pStorage, ffs_offset_t FileOffset, ffs_offset_t FileSize);
+    void SetCompressedEntry(FlashFileSystemStorage*      pStorage, 
+                            ffs_offset_t                 FileOffset, 
+                            ffs_offset_t                 FileSize, 
+                            const _SFileSystemCompressedFile* pCompressedFile,
+                            SFlashFileSystemBlockBuffer* pBlockBuffer,
+                            FlashFileSystem*             pFileSystem);
+    // Atomically claims a closed handle so that concurrent open() calls
+    // never hand out the same handle.  close() releases it.
+    bool TryClaim()
+    {
+        uint8_t Expected = 0;
+        return core_util_atomic_cas_u8(&m_InUse, &Expected, 1);
+    }
+    int IsClosed()
+    {
+        return (0 == core_util_atomic_load_u8(&m_InUse));
+    }
+#if FFS_STATS
+    // Used by FlashFileSystem so that the handle's reads and close() are
+    // counted in its statistics.
+    void SetStats(SFlashFileSystemStats* pStats) { m_pStats = pStats; }
+#endif
+#if FFS_ACCESS_TRACE
+    // Used by FlashFileSystem so that the calls made on the handle are
+    // recorded in its access trace as handle number Id.
+    void SetAccessTrace(FlashFileSystemAccessTrace* pTrace, unsigned int Id)
+    {
+        m_pAccessTrace = pTrace;
+        m_AccessTraceId = Id;
+    }
+    unsigned int GetAccessTraceId() { return m_AccessTraceId; }
+#endif
+
+    /** Check for poll event flags
+     * You can use or ignore the input parameter. You can return all events
+     * or check just the events listed in events.
+     * Call is nonblocking - returns instantaneous state of events.
+     * Whenever an event occurs, the derived class should call the sigio() callback).
+     *
+     * @param events        bitmask of poll events we're interested in - POLLIN/POLLOUT etc.
+     *
+     * @returns             bitmask of poll events that have occurred.
+     */
+    virtual short poll(short events) const override
+    {
+        // Only readable is true
+        return POLLIN;
+    }
+    
+protected:
+    ssize_t             ReadUncompressed(void* pBuffer, size_t Length);
+    ssize_t             ReadCompressed(void* pBuffer, size_t Length);
+    ssize_t             ReadVectorAtCompressed(const SFlashFileSystemIoVector* pVectors, int VectorCount, off_t Offset);
+    const char*         LoadBlock(unsigned int Block, unsigned int BlockLength);
+    const char*         DecodeBlock(unsigned int Block, unsigned int BlockLength, SFlashFileSystemBlockBuffer* pBlockBuffer);
+    int                 ReadData(ffs_offset_t Offset, void* pBuffer, size_t Length);
+    const char*         MapData(ffs_offset_t Offset, void* pScratch, size_t Length);
+
+#if FFS_BLOCK_DEVICE
+    // Storage of an image read through a block device and the offset of the
+    // file's data within it.  Only used when m_pFileStart is NULL.
+    FlashFileSystemStorage*             m_pStorage;
+    ffs_offset_t        m_FileOffset;
+#endif
+    // Beginning of the file's data in memory mapped FLASH or NULL when it
+    // is read through a block device.
+    const char*         m_pFileStart;
+    // Number of bytes of data stored for the file.
+    ffs_offset_t        m_FileSize;
+    // Size of a compressed file once decompressed.
+    unsigned int        m_UncompressedSize;
+    // Number of uncompressed bytes in each block of a compressed file, 0
+    // for files which aren't compressed.
+    unsigned int        m_BlockSize;
+    // Buffer holding the decompressed contents of block m_CachedBlock for
+    // compressed files.
+    SFlashFileSystemBlockBuffer*        m_pBlockBuffer;
+    // File system which owns the handle, where ReadVectorAt() claims a
+    // block buffer of its own for compressed files.
+    FlashFileSystem*    m_pFileSystem;
+    // Index of the block currently held in m_pBlockBuffer.
+    unsigned int        m_CachedBlock;
+    // Current position in the file, within the uncompressed contents for
+    // compressed files, to be updated by read and seek operations.
+    off_t               m_Position;
+#if FFS_STATS
+    // Statistics of the file system which owns the handle.
+    SFlashFileSystemStats*  m_pStats;
+#endif
+#if FFS_ACCESS_TRACE
+    // Access trace of the file system which owns the handle and the number
+    // which identifies the handle in it.
+    FlashFileSystemAccessTrace* m_pAccessTrace;
+    uint16_t            m_AccessTraceId;
+#endif
+    // Non-zero while this handle is claimed by an open file.
+    volatile uint8_t    m_InUse;
+};
+
+
+// Number of slots in the RAM cache of recent filename lookups.  0 disables
+// the cache.  Every lookup scans all of the slots so keep it small.
+#ifndef FFS_LOOKUP_CACHE_SIZE
+#define FFS_LOOKUP_CACHE_SIZE           0
+#endif
+
+
+// Bit set in SFlashFileSystemCacheSlot::Value for files which don't exist.
+#define FFS_CACHE_NOT_FOUND 0x80000000
+
+// Slot in the lookup cache.  Each field is read and written atomically on
+// its own so a slot can be seen half updated; the cached result is always
+// checked against the image before it is used.
+struct SFlashFileSystemCacheSlot
+{
+    // Hash of the filename's length and its first and last few characters.
+    volatile uint32_t   Hash;
+    // 0 for an empty slot, the entry index + 1 for a file which was found, or
+    // FFS_CACHE_NOT_FOUND | the index of the first entry following the name
+    // for a file which wasn't found.
+    volatile uint32_t   Value;
+    // Set when the slot is used and cleared as the CLOCK hand passes.
+    volatile uint8_t    Referenced;
+};
+
+
+// Index used by directory handles once they reach the end of the directory.
+#define FFS_NO_ENTRY    0xFFFFFFFF
+
+
+// Totals returned by FlashFileSystem::GetDirectoryTotals() for everything
+// under a directory, at any depth.
+struct SFlashFileSystemDirectoryTotals
+{
+    // Number of files.
+    uint32_t    FileCount;
+    // Number of subdirectories.
+    uint32_t    DirectoryCount;
+    // Total uncompressed size of the files.
+    uint32_t    TotalSize;
+};
+
+// Represents an open directory in the FlashFileSystem.
+class FlashFileSystemDirHandle : public DirHandle
+{
+ public:
+    // Constructors
+    FlashFileSystemDirHandle();
+    FlashFileSystemDirHandle(FlashFileSystem*    pFileSystem,
+                             const unsigned int* pFirstIndices,
+                             const unsigned int* pDirectories,
+                             unsigned int        DirectoryNameLength);
+                             
+    // Used by FlashFileSystem to maintain DirHandle entries in its cache.
+    // pFirstIndices holds the first entry of the directory in each image,
+    // or FFS_NO_ENTRY for images which don't contain it.  pDirectories
+    // holds the directory's record in each image's directory tree, or
+    // FFS_NO_ENTRY for images without one.
+    void SetEntry(FlashFileSystem*    pFileSystem,
+                  const unsigned int* pFirstIndices,
+                  const unsigned int* pDirectories,
+                  unsigned int        DirectoryNameLength)
+    {
+        unsigned int    i;
+        
+        m_pFileSystem = pFileSystem;
+        for (i = 0 ; i < FFS_MAX_IMAGES ; i++)
+        {
+            m_FirstIndex[i] = pFirstIndices ? pFirstIndices[i] : FFS_NO_ENTRY;
+            m_Directory[i] = pDirectories ? pDirectories[i] : FFS_NO_ENTRY;
+        }
+        m_DirectoryNameLength = DirectoryNameLength;
+        FlashFileSystemDirHandle::rewind();
+    }
+    // Atomically claims a closed handle so that concurrent open() calls
+    // never hand out the same handle.  close() releases it.
+    bool TryClaim()
+    {
+        uint8_t Expected = 0;
+        return core_util_atomic_cas_u8(&m_InUse, &Expected, 1);
+    }
+    int IsClosed()
+    {
+        return (0 == core_util_atomic_load_u8(&m_InUse));
+    }
+#if FFS_ACCESS_TRACE
+    // Number which identifies the handle in the file system's access trace.
+    void SetAccessTraceId(unsigned int Id) { m_AccessTraceId = Id; }
+    unsigned int GetAccessTraceId() { return m_AccessTraceId; }
+#endif
+    
+    // Methods defined by DirHandle interface.
+    virtual int    close() override;
+    virtual ssize_t read(struct dirent *ent) override;
+    virtual void   rewind() override;
+    virtual off_t  tell() override;
+    virtual void   seek(off_t location) override;
+
+protected:
+    ssize_t                     ReadEntry(struct dirent* ent);
+    
+    // File system which owns the entries being enumerated.
+    FlashFileSystem*            m_pFileSystem;
+    // Index of the first file entry for this directory in each image.
+    // rewinddir() takes the iterator back to here.
+    unsigned int                m_FirstIndex[FFS_MAX_IMAGES];
+    // Index of the next file entry to be returned for this directory
+    // enumeration in each image or FFS_NO_ENTRY once it is done.
+    unsigned int                m_CurrentIndex[FFS_MAX_IMAGES];
+    // Record of this directory in each image's directory tree and of the
+    // next of its subdirectories to be returned, or FFS_NO_ENTRY.  Images
+    // without a directory tree skip subdirectories by comparing names.
+    unsigned int                m_Directory[FFS_MAX_IMAGES];
+    unsigned int                m_NextChild[FFS_MAX_IMAGES];
+    // This is the length of the directory name which was opened.  When the
+    // first m_DirectoryNameLength characters change then we have iterated
+    // through to a different directory.
+    unsigned int                m_DirectoryNameLength;
+#if FFS_MAX_IMAGES > 1
+    // Number of entries returned since the beginning of the directory.
+    // Used as the telldir() position when several images are merged.
+    unsigned int                m_Position;
+#endif
+#if FFS_ACCESS_TRACE
+    // Number which identifies the handle in the file system's access trace.
+    uint16_t                    m_AccessTraceId;
+#endif
+    // Non-zero while this handle is claimed by an open directory.
+    volatile uint8_t            m_InUse;
+};
+
+
+// File returned by FlashFileSystem::FindNext().
+struct SFlashFileSystemFindData
+{
+    // Full name of the file without a leading slash.  It points straight
+    // into the image when the image is memory mapped and doesn't front code
+    // its names, and into the FlashFileSystemFind otherwise.  It is valid
+    // until the next call to FindNext().
+    const char* pName;
+    // First byte of the file's data, or NULL for compressed files, files in
+    // images on a block device and files which failed verification.  Those
+    // have to be opened and read.
+    const void* pData;
+    // Size of the file in bytes once uncompressed.
+    ffs_offset_t Size;
+};
+
+// Position of an enumeration of the files whose names start with a prefix,
+// started by FlashFileSystem::FindFirst() and advanced by FindNext().  It
+// doesn't hold a handle so it can simply be dropped at any point.
+class FlashFileSystemFind
+{
+protected:
+    friend class FlashFileSystem;
+    
+    // Prefix and optional glob passed to FindFirst().
+    const char*     m_pPrefix;
+    const char*     m_pPattern;
+    unsigned int    m_PrefixLength;
+    // Non-zero if the pattern can't match a '/' so that the subdirectories
+    // below the prefix can be skipped in one step.
+    int             m_SkipSubdirectories;
+    // Index of the next entry to be looked at in each image or FFS_NO_ENTRY
+    // once the image has no more entries with the prefix.
+    unsigned int    m_NextIndex[FFS_MAX_IMAGES];
+    // Names which had to be copied out of the image.
+    char            m_Name[FFS_MAX_NAME_LENGTH + 2];
+};
+
+
+// File entry as used by the runtime.  Entries of images which store them in
+// this layout are read in place and the others are converted into it.
+struct SFlashFileSystemEntry
+{
+    ffs_offset_t    FilenameOffset;
+    ffs_offset_t    FileBinaryOffset;
+    ffs_offset_t    FileBinarySize;
+};
+
+
+// One file system image mounted by a FlashFileSystem.  A FlashFileSystem
+// holds a stack of these, the base image first and any overlays added with
+// FlashFileSystem::AddOverlay() above it, and does all of its lookups in
+// FLASH through them.
+class FlashFileSystemImage
+{
+public:
+    FlashFileSystemImage();
+
+protected:
+    friend class FlashFileSystem;
+    friend class FlashFileSystemDirHandle;
+    
+    int                         Mount(const char* pImage, const char* pLimit);
+#if FFS_BLOCK_DEVICE
+    int                         Mount(BlockDevice* pDevice, bd_addr_t Address, FlashFileSystemBlockCache* pCache);
+#endif
+    int                         MountStorage();
+    int                         IsMounted() { return (m_FileCount != 0); }
+    const SFlashFileSystemEntry* GetEntry(unsigned int Index, SFlashFileSystemEntry* pScratch);
+    unsigned int                FindEntry(const char* pFilename);
+    unsigned int                SearchEntry(const char* pFilename);
+    int                         CompareKeyToEntry(const char* pFilename, unsigned int Index);
+    unsigned int                FindLowerBound(const char* pFilename);
+#if FFS_LOOKUP_CACHE_SIZE > 0
+    int                         LookupCache(const char* pFilename, unsigned int Hash, unsigned int* pValue);
+    void                        InsertCache(unsigned int Hash, unsigned int Value);
+#endif
+    void                        GetLookupCacheStats(uint32_t* pHits, uint32_t* pMisses);
+    unsigned int                FindEntryByHash(const char* pFilename);
+    unsigned int                FindDirectory(const char* pDirectoryName, unsigned int DirectoryNameLength);
+    int                         IsCompressed(unsigned int Index);
+    const _SFileSystemCompressedFile* GetCompressedFile(unsigned int Index, _SFileSystemCompressedFile* pScratch);
+    void                        ReadEncodedVariant(unsigned int Variant, _SFileSystemEncodedVariantV3* pVariant);
+    int                         FindEncodedVariant(unsigned int Index, 
+                                                   unsigned int AcceptedEncodings, 
+                                                   _SFileSystemEncodedVariantV3* pVariant, 
+                                                   unsigned int* pVariantIndex);
+    size_t                      GetVerificationBitmapSize();
+    int                         VerifyImage(unsigned int* pBadFileCount);
+    int                         VerifyEntry(unsigned int Index);
+    int                         VerifyEncodedVariant(unsigned int Variant);
+    int                         CheckEntry(unsigned int Index);
+    int                         CheckEncodedVariant(unsigned int Variant);
+    unsigned int                Checksum(ffs_offset_t Offset, ffs_offset_t Size);
+    size_t                      GetEntryName(unsigned int Index, size_t Start, char* pDest, size_t DestSize);
+    const char*                 MapEntryName(unsigned int Index, char* pScratch, size_t ScratchSize);
+    unsigned int                FindNextDirectoryEntry(unsigned int Index, 
+                                                       unsigned int PrefixLength, 
+                                                       unsigned int DirectoryNameLength);
+    unsigned int                FindDirectoryRecord(unsigned int FirstEntry, unsigned int Depth);
+    const _SFileSystemDirectory* GetDirectoryRecord(unsigned int Directory, _SFileSystemDirectory* pScratch);
+    unsigned int                GetChildDirectory(unsigned int Directory, unsigned int Child);
+    unsigned int                GetNextSibling(unsigned int Directory, unsigned int Child);
+    unsigned int                SkipDirectoryEntry(unsigned int Directory, unsigned int Index, unsigned int* pNextChild);
+    void                        CountSearchProbes(unsigned int Probes);
+    
+    // Where the file system image is stored and how to read it.
+    FlashFileSystemStorage      m_Storage;
+    // Offset of the file entry table within the image and the size of each
+    // of its records, which depends on the version of the image.
+    ffs_offset_t                m_FileEntriesOffset;
+    unsigned int                m_EntrySize;
+    // The number of files in the file system image.
+    unsigned int                m_FileCount;
+    // The remaining fields locate the optional sections found in version 2
+    // images.  Offsets are 0 and counts are 0 for sections which aren't in
+    // the image.
+    // Filename hash index slots.
+    ffs_offset_t                m_HashSlotsOffset;
+    unsigned int                m_HashSlotCount;
+    // FFS_ENTRY_FLAG_* array.
+    ffs_offset_t                m_EntryFlagsOffset;
+    // Number of front coded filenames between restart points.
+    unsigned int                m_RestartInterval;
+    // Precompressed file variants.
+    ffs_offset_t                m_VariantsOffset;
+    unsigned int                m_VariantCount;
+    unsigned int                m_VariantSize;
+    // SFileSystemChecksums header of the file checksums.
+    ffs_offset_t                m_ChecksumsOffset;
+    // Number of encoded variants with checksums, either 0 for images which
+    // only have file checksums or m_VariantCount.
+    unsigned int                m_VariantChecksumCount;
+    // Directory tree records.
+    ffs_offset_t                m_DirectoriesOffset;
+    unsigned int                m_DirectoryCount;
+    // Alignment of the file data within the image, 4 unless the image has
+    // a FFS_SECTION_PAYLOAD_ALIGNMENT section.
+    unsigned int                m_PayloadAlignment;
+    // Caller supplied bitmap with 2 bits per entry, followed by 2 bits per
+    // encoded variant with a checksum, once verification is enabled: bit 0
+    // is set once the entry has been checked and bit 1 if its checksum
+    // didn't match.
+    volatile uint32_t*          m_pVerifyBitmap;
+#if FFS_LOOKUP_CACHE_SIZE > 0
+    // Results of recent filename lookups.
+    SFlashFileSystemCacheSlot   m_CacheSlots[FFS_LOOKUP_CACHE_SIZE];
+    // Position of the CLOCK hand, modulo FFS_LOOKUP_CACHE_SIZE.
+    volatile uint32_t           m_CacheHand;
+    // Number of lookups answered from and missing from the cache.
+    volatile uint32_t           m_CacheHits;
+    volatile uint32_t           m_CacheMisses;
+#endif
+#if FFS_STATS
+    // Statistics of the file system which mounted the image.
+    SFlashFileSystemStats*      m_pStats;
+#endif
+};
+
+
+
+/** A filesystem for accessing a read-only file system placed in the internal\n
+ *  FLASH memory of the mbed board.
+ *\n
+ *  The file system to be mounted by this file system should be created through\n
+ *  the use of the fsbld utility on the PC.\n
+ *\n
+ *  As fsbld creates two output files (a binary and a header file), there are two\n
+ *  ways to add the resulting file system image:\n
+ *  -# Concatenate the binary file system to the end of the .bin file created\n
+ *     by the mbed online compiler before uploading to the mbed device.\n
+ *  -# Import the header file into your project, include this file in your main\n
+ *     file and add 'roFlashDrive' to the FlashfileSystem constructor call.\n
+ *     eg : static FlashFileSystem flash("flash", roFlashDrive);\n
+ *
+ *  A third (optional) parameter in the FlashfileSystem constructor call allows\n
+ *  you to specify the size of the FLASH (KB) on the device (default = 512).\n
+ *  eg (for a KL25Z device) : static FlashFileSystem flash("flash", NULL, 128);\n
+ *  Note that in this example, the pointer to the header file has been omitted,\n
+ *  so we need to append the binary file system ourselves (see above).\n
+ *  When you use the binary file system header in your main file, you can\n
+ *  use the roFlashDrive pointer.\n
+ *  eg (for a KL25Z device) : static FlashFileSystem flash("flash", roFlashDrive, 128);\n
+ *\n
+ *  NOTE: This file system is case-sensitive.  Calling fopen("/flash/INDEX.html")\n
+ *        won't successfully open a file named index.html in the root directory\n
+ *        of the flash file system.\n
+ *
+ * Example:
+ * @code
+#include <mbed.h>
+#include "FlashFileSystem.h"
+// Uncomment the line below when you imported the header file built with fsbld
+// and replace <Flashdrive> with its correct filename
+//#include "<FlashDrive>.h"
+
+static void _RecursiveDir(const char* pDirectoryName, DIR* pDirectory = NULL)
+{
+    DIR* pFreeDirectory = NULL;
+    
+    size_t DirectoryNameLength = strlen(pDirectoryName);
+ 
+    // Open the specified directory.
+    if (!pDirectory)
+    {
+        pDirectory = opendir(pDirectoryName);
+        if (!pDirectory)
+        {
+            error("Failed to open directory '%s' for enumeration.\r\n", 
+                  pDirectoryName);
+        }
+        
+        // Remember to free this directory enumerator.
+        pFreeDirectory = pDirectory;
+    }
+        
+    // Determine if we should remove a trailing slash from future *printf()
+    // calls.
+    if (DirectoryNameLength && '/' == pDirectoryName[DirectoryNameLength-1])
+    {
+        DirectoryNameLength--;
+    }
+    
+    // Iterate though each item contained within this directory and display
+    // it to the console.
+    struct dirent* DirEntry;
+    while((DirEntry = readdir(pDirectory)) != NULL) 
+    {
+        char RecurseDirectoryName[256];
+        DIR* pSubdirectory;
+
+        // Try opening this file as a directory to see if it succeeds or not.
+        snprintf(RecurseDirectoryName, sizeof(RecurseDirectoryName),
+                 "%.*s/%s",
+                 DirectoryNameLength,
+                 pDirectoryName,
+                 DirEntry->d_name);
+        pSubdirectory = opendir(RecurseDirectoryName);
+        
+        if (pSubdirectory)
+        {
+            _RecursiveDir(RecurseDirectoryName, pSubdirectory);
+            closedir(pSubdirectory);
+        }
+        else
+        {
+            printf("    %.*s/%s\n", 
+                   DirectoryNameLength, 
+                   pDirectoryName, 
+                   DirEntry->d_name);
+        }
+    }
+    
+    // Close the directory enumerator if it was opened by this call.
+    if (pFreeDirectory)
+    {
+        closedir(pFreeDirectory);
+    }
+}
+
+int main() 
+{
+    static const char* Filename = "/flash/index.html";
+    char*              ReadResult = NULL;
+    int                SeekResult = -1;
+    char               Buffer[128];
+
+    // Create the file system under the name "flash".
+    // NOTE : When you include the the header file built with fsbld,
+    //        disable the first static FlashFileSystem... line
+    //        and enable the second static FlashFileSystem... line.
+    static FlashFileSystem flash("flash");
+//    static FlashFileSystem flash("flash", roFlashDrive);
+    if (!flash.IsMounted())
+    {
+        error("Failed to mount FlashFileSystem.\r\n");
+    }
+
+    // Open "index.html" on the file system for reading.
+    FILE *fp = fopen(Filename, "r");
+    if (NULL == fp)
+    {
+        error("Failed to open %s\r\n", Filename);
+    }
+    
+    // Use seek to determine the length of the file
+    SeekResult = fseek(fp, 0, SEEK_END);
+    if (SeekResult)
+    {
+        error("Failed to seek to end of %s.\r\n", Filename);
+    }
+    long FileLength = ftell(fp);
+    printf("%s is %ld bytes in length.\r\n", Filename, FileLength);
+    
+    // Reset the file pointer to the beginning of the file
+    SeekResult = fseek(fp, 0, SEEK_SET);
+    if (SeekResult)
+    {
+        error("Failed to seek to beginning of %s.\r\n", Filename);
+    }
+    
+    // Read the first line into Buffer and then display to user.
+    ReadResult = fgets(Buffer, sizeof(Buffer)/sizeof(Buffer[0]), fp);
+    if (NULL == ReadResult)
+    {
+        error("Failed to read first line of %s.\r\n", Filename);
+    }
+    printf("%s:1  %s", Filename, Buffer);
+    
+    // Done with the file so close it.
+    fclose(fp);                               
+
+    // Enumerate all content on mounted file systems.
+    printf("\r\nList all files in /flash...\r\n");
+    _RecursiveDir("/flash");
+        
+    printf("\r\nFlashFileSystem example has completed.\r\n");
+}
+ * @endcode
+ */
+class FlashFileSystem : public mbed::FileSystemLike 
+{
+public:
+    FlashFileSystem(const char* pName, const uint8_t *pFlashDrive = NULL, const uint32_t FlashSize = 512);
+#if FFS_BLOCK_DEVICE
+    FlashFileSystem(const char* pName, BlockDevice& Device, bd_addr_t Address = 0);
+#endif
+#if FFS_MAPPED_FILE
+    FlashFileSystem(const char* pName, FlashFileSystemMappedFile& File);
+#endif
+    
+    virtual int open(FileHandle** file, const char* pFilename, int Flags) override;
+    virtual int  open(DirHandle** dir, const char *pDirectoryName) override;
+    virtual int  stat(const char* pPath, struct stat* pStat) override;
+
+    virtual int         IsMounted() { return m_Images[0].IsMounted(); }
+
+    int GetFileData(const char* pFilename, const void** ppData, size_t* pSize);
+    int OpenPreferringEncoding(FileHandle** ppFile, const char* pFilename, 
+                               unsigned int AcceptedEncodings, unsigned int* pEncoding);
+    size_t StatFiles(const char* const* ppPaths, size_t Count, struct stat* pStats, int* pResults = NULL);
+    int GetDirectoryTotals(const char* pDirectoryName, SFlashFileSystemDirectoryTotals* pTotals);
+    int FindFirst(FlashFileSystemFind* pFind, const char* pPrefix, const char* pPattern = NULL);
+    int FindNext(FlashFileSystemFind* pFind, SFlashFileSystemFindData* pData);
+    void GetLookupCacheStats(uint32_t* pHits, uint32_t* pMisses);
+    unsigned int GetPayloadAlignment();
+    void GetStats(SFlashFileSystemStats* pStats);
+    void ResetStats();
+
+    int EnableAccessTrace(void* pBuffer, size_t BufferSize);
+    void DisableAccessTrace();
+    size_t CopyAccessTrace(void* pDest, size_t DestSize);
+
+    size_t GetVerificationBitmapSize();
+    int EnableVerification(uint32_t* pBitmap, size_t BitmapSize);
+    int VerifyImage(unsigned int* pBadFileCount = NULL);
+
+    int AddOverlay(const uint8_t* pImage);
+#if FFS_MAPPED_FILE
+    int AddOverlay(FlashFileSystemMappedFile& File);
+#endif
+
+    int AddOverflowHandles(void* pArena, size_t ArenaSize, 
+                           unsigned int FileHandleCount, unsigned int DirHandleCount);
+    static size_t GetOverflowArenaSize(unsigned int FileHandleCount, unsigned int DirHandleCount);
+
+    static const uint8_t* FindImage(const uint8_t* pFlashStart, const uint8_t* pFlashEnd);
+
+protected:
+    friend class FlashFileSystemFileHandle;
+    friend class FlashFileSystemDirHandle;
+    
+    void                        Initialize();
+    int                         MountOverlay(const char* pImage, const char* pLimit);
+    unsigned int                FindEntry(const char* pFilename, FlashFileSystemImage** ppImage);
+    int                         OpenEntry(FileHandle** ppFile, FlashFileSystemImage* pImage, unsigned int Index);
+    FlashFileSystemFileHandle*  FindFreeFileHandle();
+    FlashFileSystemDirHandle*   FindFreeDirHandle();
+    SFlashFileSystemBlockBuffer* FindFreeBlockBuffer();
+    
+    // File handle table used by this file system so that it doesn't need
+    // to dynamically allocate file handles at runtime.
+    FlashFileSystemFileHandle   m_FileHandles[FFS_FILE_HANDLE_COUNT];
+    // Directory handle table used by this file system so that it doesn't need
+    // to dynamically allocate file handles at runtime.
+    FlashFileSystemDirHandle    m_DirHandles[FFS_DIR_HANDLE_COUNT];
+    // Optional handles constructed in a caller supplied arena which are used
+    // once the fixed tables above are full.
+    FlashFileSystemFileHandle*  m_pOverflowFileHandles;
+    FlashFileSystemDirHandle*   m_pOverflowDirHandles;
+    unsigned int                m_OverflowFileHandleCount;
+    unsigned int                m_OverflowDirHandleCount;
+    // Buffers used by file handles for decompressing blocks of compressed
+    // files.
+    SFlashFileSystemBlockBuffer m_BlockBuffers[FFS_BLOCK_BUFFER_COUNT];
+    // Mounted images, starting with the base image.  Files in later images
+    // hide files with the same name in earlier ones.
+    FlashFileSystemImage        m_Images[FFS_MAX_IMAGES];
+    unsigned int                m_ImageCount;
+#if FFS_BLOCK_DEVICE
+    // Cache used by images which are read through a block device.
+    FlashFileSystemBlockCache   m_BlockCache;
+#endif
+#if FFS_STATS
+    // Counters returned by GetStats().
+    SFlashFileSystemStats       m_Stats;
+#endif
+#if FFS_ACCESS_TRACE
+    // Records the calls made on the file system and its handles.
+    FlashFileSystemAccessTrace  m_AccessTrace;
+#endif
+};
+
+#endif // _FLASHFILESYSTEM_H_
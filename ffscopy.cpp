@@ -0,0 +1,110 @@
+/* Copyright 2011 Adam Green (http://mbed.org/users/AdamGreen/)
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+/* Copy routine for moving file data out of memory mapped FLASH.  The C
+   libraries used on small targets often fall back to copying a byte at a
+   time when the source and destination aren't aligned the same way, which
+   is the common case for file data read into an arbitrary buffer.  This
+   routine brings the source up to a 16 byte boundary and then moves 16
+   bytes per iteration with aligned loads from FLASH and unaligned stores,
+   which Cortex-M3 and later cores support for single word stores.  The 16
+   byte chunks are a GCC vector type, so hosts with SIMD registers use
+   them and other targets get four word loads and stores.
+*/
+#include <string.h>
+#include "ffscopy.h"
+
+
+// Copies which are shorter than this just use memcpy() since setting up the
+// wide loop isn't worth it.
+#define FFS_COPY_MIN_WIDE   64
+
+// Distance in bytes ahead of the source at which FFS_COPY_PREFETCH prefetches
+// data for sequential reads.  0 doesn't prefetch, which suits cores whose
+// FLASH accelerator already prefetches on its own.
+#ifndef FFS_COPY_PREFETCH
+#define FFS_COPY_PREFETCH   0
+#endif
+
+
+#if defined(__GNUC__)
+typedef uint32_t SCopyChunk __attribute__((vector_size(16)));
+#else
+typedef struct
+{
+    uint32_t    Words[4];
+} SCopyChunk;
+#endif
+
+
+/* Copies Length bytes from pSource to pDest.  The buffers can't overlap.
+
+   Parameters:
+    pDest is the buffer to be filled in.  It can have any alignment.
+    pSource is the data to be copied.  It can have any alignment, but
+        sources which are already 16-byte aligned, like the start of files in
+        images built with ffsbuild --align 16, skip the byte copies used to
+        align them.
+    Length is the number of bytes to be copied.
+    
+   Returns:
+    Nothing.
+*/
+void FFSCopy(void* pDest, const void* pSource, size_t Length)
+{
+    uint8_t*        pOut = (uint8_t*)pDest;
+    const uint8_t*  pIn = (const uint8_t*)pSource;
+    size_t          Head;
+    
+    if (Length < FFS_COPY_MIN_WIDE)
+    {
+        memcpy(pDest, pSource, Length);
+        return;
+    }
+    
+    // Bring the source up to a chunk boundary so that every load in the
+    // main loop is aligned.
+    Head = (0 - (uintptr_t)pIn) & (sizeof(SCopyChunk) - 1);
+    memcpy(pOut, pIn, Head);
+    pIn += Head;
+    pOut += Head;
+    Length -= Head;
+    
+    while (Length >= 4 * sizeof(SCopyChunk))
+    {
+        SCopyChunk  Chunks[4];
+        
+#if FFS_COPY_PREFETCH
+        __builtin_prefetch(pIn + FFS_COPY_PREFETCH);
+#endif
+        Chunks[0] = ((const SCopyChunk*)pIn)[0];
+        Chunks[1] = ((const SCopyChunk*)pIn)[1];
+        Chunks[2] = ((const SCopyChunk*)pIn)[2];
+        Chunks[3] = ((const SCopyChunk*)pIn)[3];
+        memcpy(pOut, Chunks, sizeof(Chunks));
+        pIn += sizeof(Chunks);
+        pOut += sizeof(Chunks);
+        Length -= sizeof(Chunks);
+    }
+    while (Length >= sizeof(SCopyChunk))
+    {
+        SCopyChunk  Chunk = *(const SCopyChunk*)pIn;
+        
+        memcpy(pOut, &Chunk, sizeof(Chunk));
+        pIn += sizeof(Chunk);
+        pOut += sizeof(Chunk);
+        Length -= sizeof(Chunk);
+    }
+    memcpy(pOut, pIn, Length);
+}
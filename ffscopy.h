@@ -0,0 +1,27 @@
+/* Copyright 2011 Adam Green (http://mbed.org/users/AdamGreen/)
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+/* Copy routine used by read() to move file data out of memory mapped FLASH.
+*/
+#ifndef _FFSCOPY_H_
+#define _FFSCOPY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+void FFSCopy(void* pDest, const void* pSource, size_t Length);
+
+
+#endif /* _FFSCOPY_H_ */
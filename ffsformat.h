@@ -1,50 +1,374 @@
-/* Copyright 2011 Adam Green (http://mbed.org/users/AdamGreen/)
-
-   Licensed under the Apache License, Version 2.0 (the "License");
-   you may not use this file except in compliance with the License.
-   You may obtain a copy of the License at
-
-       http://www.apache.org/licenses/LICENSE-2.0
-
-   Unless required by applicable law or agreed to in writing, software
-   distributed under the License is distributed on an "AS IS" BASIS,
-   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
-   See the License for the specific language governing permissions and
-   limitations under the License.
-*/
-/* Specifies constants and structures used within the FLASH File System.  The
-   header is used by both the runtime and the tool which builds the image on
-   the PC.
-*/
-#ifndef _FFSFORMAT_H_
-#define _FFSFORMAT_H_
-
-
-/* The signature to be placed in SFileSystemHeader::FileSystemSignature.
-   Only the first 8 bytes are used and the NULL terminator discarded. */
-#define FILE_SYSTEM_SIGNATURE "FFileSys"
-
-/* Header stored at the beginning of the file system image. */
-typedef struct _SFileSystemHeader
-{
-    /* Signature should be set to FILE_SYSTEM_SIGNATURE. */
-    char            FileSystemSignature[8];
-    /* Number of entries in this file system image. */
-    unsigned int    FileCount;
-    /* The SFileSystemEntry[SFileSystemHeader::FileCount] array will start here. 
-       These entries are to be sorted so that a binary search can be performed
-       at file open time. */
-} SFileSystemHeader;
-
-/* Information about each file added to the file system image. */
-typedef struct _SFileSystemEntry
-{
-    /* The 2 following offsets are relative to the beginning of the file 
-       image. */
-    unsigned int    FilenameOffset;
-    unsigned int    FileBinaryOffset;
-    unsigned int    FileBinarySize;
-} SFileSystemEntry;
-
-
-#endif /* _FFSFORMAT_H_ */
+/* Copyright 2011 Adam Green (http://mbed.org/users/AdamGreen/)
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+/* Specifies constants and structures used within the FLASH File System.  The
+   header is used by both the runtime and the tool which builds the image on
+   the PC.  All fields are little endian.  The tool writes them that way on
+   any host, but the runtime reads them in place and so only builds for
+   little endian targets.
+*/
+#ifndef _FFSFORMAT_H_
+#define _FFSFORMAT_H_
+
+#include <stdint.h>
+
+
+/* The signature to be placed in SFileSystemHeader::FileSystemSignature.
+   Only the first 8 bytes are used and the NULL terminator discarded. */
+#define FILE_SYSTEM_SIGNATURE "FFileSys"
+
+/* Header stored at the beginning of the file system image. */
+typedef struct _SFileSystemHeader
+{
+    /* Signature should be set to FILE_SYSTEM_SIGNATURE. */
+    char            FileSystemSignature[8];
+    /* Number of entries in this file system image. */
+    uint32_t        FileCount;
+    /* The SFileSystemEntry[SFileSystemHeader::FileCount] array will start here. 
+       These entries are to be sorted so that a binary search can be performed
+       at file open time. */
+} SFileSystemHeader;
+
+/* Information about each file added to the file system image. */
+typedef struct _SFileSystemEntry
+{
+    /* The 2 following offsets are relative to the beginning of the file 
+       image. */
+    uint32_t        FilenameOffset;
+    uint32_t        FileBinaryOffset;
+    uint32_t        FileBinarySize;
+} SFileSystemEntry;
+
+
+/* Signature to be placed in SFileSystemTrailer::TrailerSignature. */
+#define FILE_SYSTEM_TRAILER_SIGNATURE "FFSTrail"
+
+/* Optional record placed in the last bytes of a file system image.  When an
+   image is appended to the program binary, the runtime skips the erased FLASH
+   above it and uses the trailer to locate the header directly instead of
+   scanning for the signature. */
+typedef struct _SFileSystemTrailer
+{
+    /* Offset of this trailer relative to the beginning of the file image.
+       Images which are too large for it don't have a trailer. */
+    uint32_t        TrailerOffset;
+    /* Signature should be set to FILE_SYSTEM_TRAILER_SIGNATURE. */
+    char            TrailerSignature[8];
+} SFileSystemTrailer;
+
+
+/* Signature used by images which start with a SFileSystemHeaderV2 instead of
+   the original SFileSystemHeader.  It only differs from FILE_SYSTEM_SIGNATURE
+   in its last character. */
+#define FILE_SYSTEM_SIGNATURE_V2 "FFileSy2"
+
+/* Value stored in SFileSystemHeaderV2::Version. */
+#define FILE_SYSTEM_VERSION_2   2
+
+/* Header stored at the beginning of version 2 file system images.  The first
+   two fields are laid out the same as in SFileSystemHeader. */
+typedef struct _SFileSystemHeaderV2
+{
+    /* Signature should be set to FILE_SYSTEM_SIGNATURE_V2. */
+    char            FileSystemSignature[8];
+    /* Number of entries in this file system image. */
+    uint32_t        FileCount;
+    /* Version of the image format (FILE_SYSTEM_VERSION_2). */
+    uint32_t        Version;
+    /* Offset of the sorted SFileSystemEntry[FileCount] array, relative to the
+       beginning of the file image. */
+    uint32_t        FileEntriesOffset;
+    /* Total size of the file image in bytes. */
+    uint32_t        ImageSize;
+    /* Number of SFileSystemSection records which immediately follow this
+       header. */
+    uint32_t        SectionCount;
+} SFileSystemHeaderV2;
+
+/* Describes an optional section in a version 2 image.  Sections with an
+   unknown Type are to be ignored by the runtime. */
+typedef struct _SFileSystemSection
+{
+    /* One of the FFS_SECTION_* values. */
+    uint32_t        Type;
+    /* Offset of the section data, relative to the beginning of the file
+       image.  Section data is 4-byte aligned. */
+    uint32_t        Offset;
+    /* Size of the section data in bytes. */
+    uint32_t        Size;
+} SFileSystemSection;
+
+
+/* Signature used by images which start with a SFileSystemHeaderV3.  Version 3
+   images have the same layout and sections as version 2 images except that
+   offsets and sizes within the image are 64 bits so that images can be
+   larger than 4GB. */
+#define FILE_SYSTEM_SIGNATURE_V3 "FFileSy3"
+
+/* Value stored in SFileSystemHeaderV3::Version. */
+#define FILE_SYSTEM_VERSION_3   3
+
+/* Header stored at the beginning of version 3 file system images. */
+typedef struct _SFileSystemHeaderV3
+{
+    /* Signature should be set to FILE_SYSTEM_SIGNATURE_V3. */
+    char            FileSystemSignature[8];
+    /* Number of entries in this file system image. */
+    uint32_t        FileCount;
+    /* Version of the image format (FILE_SYSTEM_VERSION_3). */
+    uint32_t        Version;
+    /* Offset of the sorted SFileSystemEntryV3[FileCount] array, relative to
+       the beginning of the file image.  Must be 8-byte aligned. */
+    uint64_t        FileEntriesOffset;
+    /* Total size of the file image in bytes. */
+    uint64_t        ImageSize;
+    /* Number of SFileSystemSectionV3 records which immediately follow this
+       header. */
+    uint32_t        SectionCount;
+    uint32_t        Reserved;
+} SFileSystemHeaderV3;
+
+/* Describes an optional section in a version 3 image.  The section data is
+   the same as in a version 2 image, except for the encoded variants. */
+typedef struct _SFileSystemSectionV3
+{
+    /* One of the FFS_SECTION_* values. */
+    uint32_t        Type;
+    uint32_t        Reserved;
+    /* Offset of the section data, relative to the beginning of the file
+       image.  Section data is 8-byte aligned. */
+    uint64_t        Offset;
+    /* Size of the section data in bytes. */
+    uint64_t        Size;
+} SFileSystemSectionV3;
+
+/* Information about each file in a version 3 image. */
+typedef struct _SFileSystemEntryV3
+{
+    uint64_t        FilenameOffset;
+    uint64_t        FileBinaryOffset;
+    uint64_t        FileBinarySize;
+} SFileSystemEntryV3;
+
+/* Section types. */
+#define FFS_SECTION_HASH_INDEX  1
+#define FFS_SECTION_ENTRY_FLAGS 2
+#define FFS_SECTION_FRONT_CODED_NAMES 3
+#define FFS_SECTION_ENCODED_VARIANTS 4
+#define FFS_SECTION_FILE_CHECKSUMS 5
+#define FFS_SECTION_DIRECTORY_TREE 6
+#define FFS_SECTION_PAYLOAD_ALIGNMENT 7
+
+
+/* The FFS_SECTION_HASH_INDEX section is an open addressing hash table which
+   maps the hash of each filename to its index in the SFileSystemEntry array.
+   A filename is looked up by probing linearly from slot
+   (Hash & (SlotCount - 1)) until a matching slot or an empty slot is found. */
+typedef struct _SFileSystemHashIndex
+{
+    /* Number of slots in the table.  Must be a power of 2 and larger than
+       FileCount so that every probe sequence ends at an empty slot. */
+    uint32_t        SlotCount;
+    /* The SFileSystemHashSlot[SlotCount] array will start here. */
+} SFileSystemHashIndex;
+
+typedef struct _SFileSystemHashSlot
+{
+    /* FileSystemHashFilename() of the entry's filename. */
+    uint32_t        Hash;
+    /* Index of the entry in the SFileSystemEntry array or FFS_HASH_SLOT_EMPTY
+       for an unused slot. */
+    uint32_t        FileIndex;
+} SFileSystemHashSlot;
+
+#define FFS_HASH_SLOT_EMPTY 0xFFFFFFFF
+
+/* 32-bit FNV-1a hash of the filename as stored in the image (no leading
+   slash). */
+static __inline uint32_t FileSystemHashFilename(const char* pFilename)
+{
+    uint32_t        Hash = 2166136261U;
+    
+    while (*pFilename)
+    {
+        Hash ^= (unsigned char)*pFilename++;
+        Hash *= 16777619U;
+    }
+    
+    return Hash;
+}
+
+
+/* The FFS_SECTION_ENTRY_FLAGS section is an unsigned char[FileCount] array
+   holding a combination of the following FFS_ENTRY_FLAG_* bits for each entry
+   in the SFileSystemEntry array. */
+    
+/* The entry's data starts with a SFileSystemCompressedFile header and
+   FileBinarySize is the size of the compressed data, including that header. */
+#define FFS_ENTRY_FLAG_COMPRESSED   0x01
+
+
+/* The FFS_SECTION_FRONT_CODED_NAMES section replaces the NUL terminated
+   filenames with front coded records, which saves the FLASH otherwise used to
+   repeat long directory prefixes.  There is one record per entry, in entry
+   order, and each entry's FilenameOffset holds the offset of its record
+   relative to the beginning of the file image.  A record starts with the
+   number of leading characters which the name shares with the previous
+   entry's name, stored as a LEB128 varint, followed by the rest of the name
+   and a NUL terminator.  Every RestartInterval'th entry, starting with the
+   first one, is a restart point whose record holds the whole name after the
+   shared length so that the restart points can be binary searched and any
+   name can be rebuilt by decoding at most RestartInterval records. */
+typedef struct _SFileSystemFrontCodedNames
+{
+    /* Number of entries between restart points.  Can't be 0. */
+    uint32_t        RestartInterval;
+    /* The records will start here. */
+} SFileSystemFrontCodedNames;
+
+
+/* Checksum algorithms for SFileSystemChecksums::Algorithm. */
+#define FFS_CHECKSUM_CRC32C     1
+
+/* The FFS_SECTION_FILE_CHECKSUMS section lets the runtime verify that the
+   image in FLASH is intact.  Each file's checksum covers its data as stored
+   in the image, so compressed files are checked without decompressing
+   them.  Images with encoded variants can also cover them by following the
+   file checksums with one for each variant; runtimes tell the two apart by
+   the size of the section. */
+typedef struct _SFileSystemChecksums
+{
+    /* One of the FFS_CHECKSUM_* values. */
+    uint32_t        Algorithm;
+    /* Checksum of the SFileSystemEntry[FileCount] array. */
+    uint32_t        EntryTableChecksum;
+    /* The uint32_t FileChecksums[FileCount] array will start here, in
+       entry order, optionally followed by the
+       uint32_t VariantChecksums[VariantCount] array in variant order. */
+} SFileSystemChecksums;
+
+
+/* Content encodings for SFileSystemEncodedVariant::Encoding.  They match the
+   HTTP Content-Encoding tokens "gzip" and "br". */
+#define FFS_ENCODING_IDENTITY   0
+#define FFS_ENCODING_GZIP       1
+#define FFS_ENCODING_BROTLI     2
+
+/* The FFS_SECTION_ENCODED_VARIANTS section holds precompressed copies of
+   files, such as the gzip encoded form of a web page, which the runtime hands
+   out as is without decoding them.  The variants are sorted by FileIndex and
+   then Encoding so that the variants of an entry can be found with a binary
+   search. */
+typedef struct _SFileSystemEncodedVariants
+{
+    /* Number of variants in the section. */
+    uint32_t        VariantCount;
+    /* The SFileSystemEncodedVariant[VariantCount] array will start here. */
+} SFileSystemEncodedVariants;
+
+typedef struct _SFileSystemEncodedVariant
+{
+    /* Index of the entry in the SFileSystemEntry array which this is a
+       variant of. */
+    uint32_t        FileIndex;
+    /* One of the FFS_ENCODING_* values other than FFS_ENCODING_IDENTITY. */
+    uint32_t        Encoding;
+    /* Location of the encoded data, relative to the beginning of the file
+       image. */
+    uint32_t        FileBinaryOffset;
+    uint32_t        FileBinarySize;
+} SFileSystemEncodedVariant;
+
+/* Version 3 images use these records instead.  The array starts 8 bytes into
+   the section, after VariantCount and 4 bytes of padding, so that its 64-bit
+   fields are aligned. */
+typedef struct _SFileSystemEncodedVariantV3
+{
+    uint32_t        FileIndex;
+    uint32_t        Encoding;
+    uint64_t        FileBinaryOffset;
+    uint64_t        FileBinarySize;
+} SFileSystemEncodedVariantV3;
+
+
+/* The FFS_SECTION_DIRECTORY_TREE section describes every directory in the
+   image so that readdir() can step over a subdirectory's contents without
+   looking at them.  The files under a directory are always a contiguous run
+   of the sorted SFileSystemEntry array.  The records are in depth first
+   order, parents before their children and siblings in name order, so they
+   are sorted by FirstEntry and then Depth.  The first record is the root
+   directory.  The first child of record N, if it has one, is record N + 1
+   and the next sibling of record N is record N + 1 + SubdirectoryCount when
+   it starts before the parent's EndEntry. */
+typedef struct _SFileSystemDirectoryTree
+{
+    /* Number of directories in the section, including the root. */
+    uint32_t        DirectoryCount;
+    /* The SFileSystemDirectory[DirectoryCount] array will start here. */
+} SFileSystemDirectoryTree;
+
+typedef struct _SFileSystemDirectory
+{
+    /* Index of the first entry under this directory and one past the last,
+       including the entries in its subdirectories. */
+    uint32_t        FirstEntry;
+    uint32_t        EndEntry;
+    /* Number of slashes in the directory's name, 0 for the root. */
+    uint32_t        Depth;
+    /* Number of directories under this one, at any depth. */
+    uint32_t        SubdirectoryCount;
+    /* Total uncompressed size of the files under this directory, at any
+       depth, limited to 0xFFFFFFFF. */
+    uint32_t        TotalSize;
+} SFileSystemDirectory;
+
+
+/* The FFS_SECTION_PAYLOAD_ALIGNMENT section records the alignment which the
+   builder used for file data.  Images without it only guarantee 4-byte
+   alignment.  Copies out of FLASH can use aligned wide loads from the start
+   of a file when the image itself is placed on a boundary at least this
+   large. */
+typedef struct _SFileSystemPayloadAlignment
+{
+    /* Power of 2, at least 4, which every FileBinaryOffset in the entries and
+       the encoded variants is a multiple of. */
+    uint32_t        Alignment;
+} SFileSystemPayloadAlignment;
+
+
+/* Compression algorithms for SFileSystemCompressedFile::Compression. */
+#define FFS_COMPRESSION_LZ4     1
+
+/* Header placed at the beginning of the data for compressed files.  The
+   uncompressed file is split into blocks of BlockSize bytes (the last one can
+   be shorter) and each block is compressed separately so that any part of the
+   file can be read by decompressing just the block which contains it.  Only
+   files smaller than 4GB are compressed, even in version 3 images. */
+typedef struct _SFileSystemCompressedFile
+{
+    /* Size of the file once decompressed. */
+    uint32_t        UncompressedSize;
+    /* Number of uncompressed bytes in each block. */
+    uint32_t        BlockSize;
+    /* One of the FFS_COMPRESSION_* values. */
+    uint32_t        Compression;
+    /* The uint32_t BlockOffsets[BlockCount + 1] array will start here,
+       where BlockCount is UncompressedSize / BlockSize rounded up.  The
+       offsets are relative to the beginning of this header and the last one
+       marks the end of the last block.  A block whose stored size equals its
+       uncompressed size is stored without compression. */
+} SFileSystemCompressedFile;
+
+
+#endif /* _FFSFORMAT_H_ */
@@ -0,0 +1,136 @@
+/* Copyright 2011 Adam Green (http://mbed.org/users/AdamGreen/)
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+/* Decoder for the LZ4 block format used to store compressed files in the
+   FLASH File System image.  Each block is a series of sequences made up of a
+   token byte, optional literal length bytes, the literals, a 2-byte little
+   endian match offset and optional match length bytes.  The last sequence
+   contains only literals.  Every access is bounds checked since the image
+   contents aren't trusted.
+*/
+#include <string.h>
+#include "ffslz4.h"
+
+
+// Matches are always at least this long.
+#define LZ4_MIN_MATCH   4
+
+
+/* Internal routine which reads the extra length bytes which follow a token
+   nibble of 15.
+   
+   ppCurr points to the current read position in the compressed data and is
+    advanced past the length bytes.
+   pEnd points just past the end of the compressed data.
+   pLength points to the length to be extended.
+   
+   Returns 0 on success and -1 if the compressed data is truncated.
+*/
+static int _ReadExtendedLength(const unsigned char** ppCurr, 
+                               const unsigned char*  pEnd, 
+                               size_t*               pLength)
+{
+    const unsigned char*    pCurr = *ppCurr;
+    unsigned char           Byte;
+    
+    do
+    {
+        if (pCurr >= pEnd)
+        {
+            return -1;
+        }
+        Byte = *pCurr++;
+        *pLength += Byte;
+    } while (255 == Byte);
+    
+    *ppCurr = pCurr;
+    return 0;
+}
+
+
+/* Decompresses a LZ4 block.
+   
+   Parameters:
+    pSource points to the compressed block.
+    SourceLength is the length of the compressed block.
+    pDest is the buffer into which the block should be decompressed.
+    DestLength is the size of the pDest buffer.
+    
+   Returns:
+    The number of bytes written to pDest or -1 if the block is corrupt or
+    doesn't fit in pDest.
+*/
+int FFSLZ4Decompress(const char* pSource, size_t SourceLength, char* pDest, size_t DestLength)
+{
+    const unsigned char*    pSrc = (const unsigned char*)pSource;
+    const unsigned char*    pSrcEnd = pSrc + SourceLength;
+    unsigned char*          pDst = (unsigned char*)pDest;
+    unsigned char*          pDstEnd = pDst + DestLength;
+    
+    while (pSrc < pSrcEnd)
+    {
+        unsigned int    Token = *pSrc++;
+        size_t          LiteralLength = Token >> 4;
+        size_t          MatchLength = Token & 0xF;
+        size_t          Offset;
+        
+        // Copy the literals.
+        if (15 == LiteralLength && _ReadExtendedLength(&pSrc, pSrcEnd, &LiteralLength))
+        {
+            return -1;
+        }
+        if (LiteralLength > (size_t)(pSrcEnd - pSrc) || LiteralLength > (size_t)(pDstEnd - pDst))
+        {
+            return -1;
+        }
+        memcpy(pDst, pSrc, LiteralLength);
+        pSrc += LiteralLength;
+        pDst += LiteralLength;
+        
+        // The last sequence in the block only contains literals.
+        if (pSrc == pSrcEnd)
+        {
+            break;
+        }
+        
+        // Copy the match from the previously decompressed data.
+        if (pSrcEnd - pSrc < 2)
+        {
+            return -1;
+        }
+        Offset = pSrc[0] | (pSrc[1] << 8);
+        pSrc += 2;
+        if (15 == MatchLength && _ReadExtendedLength(&pSrc, pSrcEnd, &MatchLength))
+        {
+            return -1;
+        }
+        MatchLength += LZ4_MIN_MATCH;
+        if (0 == Offset || 
+            Offset > (size_t)(pDst - (unsigned char*)pDest) || 
+            MatchLength > (size_t)(pDstEnd - pDst))
+        {
+            return -1;
+        }
+        
+        // The match can overlap the bytes being written so copy a byte at a
+        // time.
+        const unsigned char*    pMatch = pDst - Offset;
+        while (MatchLength--)
+        {
+            *pDst++ = *pMatch++;
+        }
+    }
+    
+    return (int)(pDst - (unsigned char*)pDest);
+}
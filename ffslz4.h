@@ -0,0 +1,27 @@
+/* Copyright 2011 Adam Green (http://mbed.org/users/AdamGreen/)
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+/* Decoder for the LZ4 block format used to store compressed files in the
+   FLASH File System image.
+*/
+#ifndef _FFSLZ4_H_
+#define _FFSLZ4_H_
+
+#include <stddef.h>
+
+
+int FFSLZ4Decompress(const char* pSource, size_t SourceLength, char* pDest, size_t DestLength);
+
+
+#endif /* _FFSLZ4_H_ */
@@ -0,0 +1,101 @@
+/* Copyright 2011 Adam Green (http://mbed.org/users/AdamGreen/)
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+/* Specifies the records which the FlashFileSystem writes when access tracing
+   is enabled with FFS_ACCESS_TRACE.  The header is used by both the runtime
+   and the tool which replays the trace on the PC.
+*/
+#ifndef _FFSTRACE_H_
+#define _FFSTRACE_H_
+
+#include <stdint.h>
+
+
+/* Types of event for SFileSystemAccessRecord::Type. */
+#define FFS_ACCESS_OPEN             1
+#define FFS_ACCESS_OPEN_ENCODED     2
+#define FFS_ACCESS_READ             3
+#define FFS_ACCESS_SEEK             4
+#define FFS_ACCESS_CLOSE            5
+#define FFS_ACCESS_OPENDIR          6
+#define FFS_ACCESS_READDIR          7
+#define FFS_ACCESS_CLOSEDIR         8
+
+/* SFileSystemAccessRecord::Handle of an open which failed. */
+#define FFS_ACCESS_NO_HANDLE        0xFFFF
+
+/* Values for SFileSystemAccessTraceHeader. */
+#define FFS_ACCESS_TRACE_SIGNATURE  0x54534646  /* "FFST" */
+#define FFS_ACCESS_TRACE_VERSION_2  2
+
+/* First record of a trace, which identifies the layout of the records that
+   follow it.  Version 1 traces have no header and start directly with an
+   SFileSystemAccessRecordV1, whose Type is never 0, so the two can be told
+   apart.  The header is 24 bytes long. */
+typedef struct _SFileSystemAccessTraceHeader
+{
+    /* FFS_ACCESS_TRACE_SIGNATURE. */
+    uint32_t        Signature;
+    /* Always 0, which isn't a valid record type. */
+    uint8_t         Zero;
+    /* FFS_ACCESS_TRACE_VERSION_2. */
+    uint8_t         Version;
+    /* sizeof(SFileSystemAccessRecord). */
+    uint16_t        RecordSize;
+    uint8_t         Reserved[16];
+} SFileSystemAccessTraceHeader;
+
+/* Record of one call on the file system or one of its handles.  Records are
+   24 bytes long.  The name passed to the open events follows its record,
+   without a NULL terminator, padded with zeroes to a multiple of 24 bytes.
+   A trace is an SFileSystemAccessTraceHeader followed by a sequence of these
+   records, oldest first. */
+typedef struct _SFileSystemAccessRecord
+{
+    /* Number of the 24 byte slot which the record was written to, counting
+       every slot written since tracing was enabled.  A gap means that older
+       records were overwritten before the trace was copied. */
+    uint32_t        Sequence;
+    /* One of the FFS_ACCESS_* values. */
+    uint8_t         Type;
+    /* SEEK_SET, SEEK_CUR or SEEK_END for FFS_ACCESS_SEEK, the accepted
+       encodings for FFS_ACCESS_OPEN_ENCODED and 0 otherwise. */
+    uint8_t         Whence;
+    /* Number of the file or directory handle which the call was made on,
+       or which the open returned.  Numbers are reused once a handle is
+       closed. */
+    uint16_t        Handle;
+    /* Length of the name for the open events, the number of bytes asked for
+       by FFS_ACCESS_READ, the offset for FFS_ACCESS_SEEK, in two's
+       complement, and 0 otherwise. */
+    uint64_t        Value;
+    /* Value returned by the call. */
+    int64_t         Result;
+} SFileSystemAccessRecord;
+
+/* Layout of the 16 byte records in version 1 traces, which only kept the
+   low 32 bits of seek offsets and positions.  Names were padded to a
+   multiple of 16 bytes. */
+typedef struct _SFileSystemAccessRecordV1
+{
+    uint32_t        Sequence;
+    uint8_t         Type;
+    uint8_t         Whence;
+    uint16_t        Handle;
+    uint32_t        Value;
+    int32_t         Result;
+} SFileSystemAccessRecordV1;
+
+
+#endif /* _FFSTRACE_H_ */
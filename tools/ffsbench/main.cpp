@@ -0,0 +1,1927 @@
+/* Copyright 2011 Adam Green (http://mbed.org/users/AdamGreen/)
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+/* Host benchmark for the FlashFileSystem.  It builds a synthetic image with
+   FlashFileSystemBuilder and reports latency percentiles for mounting,
+   opening, enumerating and reading files.
+*/
+#include <mbed.h>
+#include <math.h>
+#include <stdarg.h>
+#include <algorithm>
+#include <chrono>
+#include <atomic>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "FlashFileSystem.h"
+#include "ffsformat.h"
+#include "ffstrace.h"
+#include "ffscopy.h"
+#include "../ffsbuild/FlashFileSystemBuilder.h"
+#include "LatencyRecorder.h"
+#if FFS_BLOCK_DEVICE
+#include "MemoryBlockDevice.h"
+#endif
+#if FFS_MAPPED_FILE
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+
+// Parameters used to generate the synthetic image and drive the benchmarks.
+struct SBenchOptions
+{
+    // Number of files in the image.
+    unsigned int    FileCount;
+    // Number of directory levels above each file.
+    unsigned int    Depth;
+    // Number of subdirectories in each directory.
+    unsigned int    Fanout;
+    // Length of each filename component.
+    unsigned int    NameLength;
+    // Average size of each file.  Sizes vary from half to 1.5x this value.
+    unsigned int    FileSize;
+    // Size of each read() call.
+    unsigned int    ReadSize;
+    // Number of timed operations for each benchmark.
+    unsigned int    Iterations;
+    // Seed for the random number generator.
+    unsigned int    Seed;
+    // Largest number of threads used by the concurrent benchmark.
+    unsigned int    MaxThreads;
+    // Exponent of the Zipf distribution used by the hot file benchmark.
+    double          ZipfExponent;
+    // Percentage of files which are copies of an earlier file.
+    unsigned int    DuplicatePercent;
+    // Add a gzip encoded variant of every file.
+    bool            EncodedVariants;
+    // Percentage of files which are replaced by an overlay image, which
+    // also adds the same number of new files.
+    unsigned int    OverlayPercent;
+    // Also mount the image from a simulated block device whose reads take
+    // BlockDeviceLatencyUs plus the time to transfer the bytes at
+    // BlockDeviceMBps.
+    bool            BlockDevice;
+    double          BlockDeviceLatencyUs;
+    double          BlockDeviceMBps;
+    // File to save the image to or NULL.
+    const char*     pSaveImageFilename;
+    // File to save the access trace of the single threaded benchmarks to or
+    // NULL.
+    const char*     pTraceFilename;
+    // Compare memcpy() and FFSCopy() across read sizes and source
+    // alignments.
+    bool            CopySweep;
+    // Sparse file to write a version 3 image larger than 4GB to, instead of
+    // running the other benchmarks, or NULL.
+    const char*     pLargeImageFilename;
+    // Options passed to the image builder.
+    SFlashFileSystemBuildOptions    BuildOptions;
+};
+
+
+/* Builds the name of a file in the synthetic image.  The directory components
+   are taken from the digits of the file index in base Fanout so that the
+   files are spread evenly across the tree.
+*/
+static std::string _SyntheticFilename(const SBenchOptions& Options, unsigned int Index)
+{
+    std::string     Name;
+    unsigned int    Remaining = Index;
+    unsigned int    Level;
+    char            Component[32];
+
+    for (Level = 0 ; Level < Options.Depth ; Level++)
+    {
+        snprintf(Component, sizeof(Component), "d%u", Remaining % Options.Fanout);
+        Remaining /= Options.Fanout;
+        Name += Component;
+        Name.append(Options.NameLength > strlen(Component) ? Options.NameLength - strlen(Component) : 0, '_');
+        Name += '/';
+    }
+    snprintf(Component, sizeof(Component), "f%u", Index);
+    Name += Component;
+    Name.append(Options.NameLength > strlen(Component) ? Options.NameLength - strlen(Component) : 0, '_');
+
+    return Name;
+}
+
+
+/* Generates file contents which look like text so that compression has
+   something realistic to work with.
+*/
+static void _SyntheticContents(std::mt19937& Random, size_t Size, std::vector<uint8_t>& Data)
+{
+    static const char*  Words[] = { "function", "return", "var", "the", "div", "class=",
+                                    "{", "}", "0x1F", "static", "index", "<p>", "\n" };
+
+    Data.clear();
+    while (Data.size() < Size)
+    {
+        const char* pWord = Words[Random() % (sizeof(Words)/sizeof(Words[0]))];
+
+        Data.insert(Data.end(), pWord, pWord + strlen(pWord));
+        Data.push_back(' ');
+    }
+    Data.resize(Size);
+}
+
+
+/* Walks the whole directory tree like the _RecursiveDir() example in
+   FlashFileSystem.h, probing each entry with opendir() to see if it is a
+   directory.
+
+   Returns the number of files found.
+*/
+static unsigned int _RecursiveDir(FlashFileSystem& FileSystem, const std::string& DirectoryName)
+{
+    DirHandle*      pDirectory = NULL;
+    struct dirent   DirEntry;
+    unsigned int    FileCount = 0;
+
+    if (0 != FileSystem.open(&pDirectory, DirectoryName.c_str()))
+    {
+        return 0;
+    }
+    while (pDirectory->read(&DirEntry) > 0)
+    {
+        std::string Name(DirEntry.d_name);
+        DirHandle*  pSubdirectory = NULL;
+
+        // Directory entries are returned with a trailing slash.
+        if (!Name.empty() && '/' == Name[Name.size() - 1])
+        {
+            Name.erase(Name.size() - 1);
+        }
+        Name = DirectoryName.empty() ? Name : DirectoryName + "/" + Name;
+        if (0 == FileSystem.open(&pSubdirectory, Name.c_str()))
+        {
+            pSubdirectory->close();
+            FileCount += _RecursiveDir(FileSystem, Name);
+        }
+        else
+        {
+            FileCount++;
+        }
+    }
+    pDirectory->close();
+
+    return FileCount;
+}
+
+
+/* Checks that files which share their data in the image still behave as
+   independent files.  Each duplicate is opened along with the file that it
+   copies, one handle is moved to a random offset and then the two are read
+   in alternating chunks, checking every byte and the position of each
+   handle against the original contents.
+
+   Returns the number of errors detected.
+*/
+static unsigned int _CheckDuplicateReads(FlashFileSystem&                           FileSystem,
+                                         const std::vector<std::string>&            Filenames,
+                                         const std::vector<std::vector<uint8_t> >&  Contents,
+                                         const std::vector<int>&                    Sources,
+                                         const SBenchOptions&                       Options,
+                                         std::mt19937&                              Random)
+{
+    std::vector<char>   Buffer(Options.ReadSize);
+    unsigned int        PairCount = 0;
+    unsigned int        Errors = 0;
+    size_t              i;
+
+    for (i = 0 ; i < Sources.size() ; i++)
+    {
+        const std::vector<uint8_t>& Data = Contents[i];
+        FileHandle*                 pFiles[2] = { NULL, NULL };
+        size_t                      Positions[2];
+        int                         Done[2] = { 0, 0 };
+        int                         j;
+
+        if (Sources[i] < 0)
+        {
+            continue;
+        }
+        PairCount++;
+        if (FileSystem.open(&pFiles[0], Filenames[Sources[i]].c_str(), O_RDONLY) ||
+            FileSystem.open(&pFiles[1], Filenames[i].c_str(), O_RDONLY))
+        {
+            Errors++;
+            if (pFiles[0])
+            {
+                pFiles[0]->close();
+            }
+            continue;
+        }
+        Positions[0] = Random() % (Data.size() + 1);
+        Positions[1] = 0;
+        pFiles[0]->seek(Positions[0], SEEK_SET);
+        while (!Done[0] || !Done[1])
+        {
+            for (j = 0 ; j < 2 ; j++)
+            {
+                ssize_t BytesRead;
+
+                if (Done[j])
+                {
+                    continue;
+                }
+                BytesRead = pFiles[j]->read(Buffer.data(), Buffer.size());
+                if (BytesRead < 0 ||
+                    (size_t)BytesRead > Data.size() - Positions[j] ||
+                    0 != memcmp(Buffer.data(), &Data[Positions[j]], BytesRead))
+                {
+                    Errors++;
+                    Done[j] = 1;
+                    continue;
+                }
+                Positions[j] += BytesRead;
+                Done[j] = (0 == BytesRead);
+                if (pFiles[j]->seek(0, SEEK_CUR) != (off_t)Positions[j])
+                {
+                    Errors++;
+                }
+            }
+        }
+        if (Positions[0] != Data.size() || Positions[1] != Data.size())
+        {
+            Errors++;
+        }
+        pFiles[0]->close();
+        pFiles[1]->close();
+    }
+    printf("duplicate file reads     %9u pairs  %u errors\n", PairCount, Errors);
+
+    return Errors;
+}
+
+
+/* Has ThreadCount threads open, read and close random files on the same file
+   system at the same time.  Every thread checks that the handle it was given
+   refers to the file it asked for by comparing the data read against the
+   file's generated contents, so handing the same handle to two threads
+   shows up as an error.
+
+   Returns the number of errors detected.
+*/
+static unsigned int _ConcurrentOpenReadClose(FlashFileSystem&                           FileSystem,
+                                             const std::vector<std::string>&            Filenames,
+                                             const std::vector<std::vector<uint8_t> >&  Contents,
+                                             const SBenchOptions&                       Options,
+                                             unsigned int                               ThreadCount)
+{
+    std::vector<std::thread>    Threads;
+    std::atomic<unsigned int>   Errors(0);
+    std::atomic<uint64_t>       Bytes(0);
+    unsigned int                OperationsPerThread = Options.Iterations / ThreadCount;
+    unsigned int                i;
+
+    auto    Worker = [&](unsigned int Seed)
+    {
+        std::mt19937        Random(Seed);
+        std::vector<char>   Buffer(Options.ReadSize);
+        uint64_t            BytesRead = 0;
+        unsigned int        j;
+
+        for (j = 0 ; j < OperationsPerThread ; j++)
+        {
+            size_t                      Index = Random() % Filenames.size();
+            const std::vector<uint8_t>& Expected = Contents[Index];
+            FileHandle*                 pFile = NULL;
+            ssize_t                     Result;
+            size_t                      FileBytes = 0;
+            bool                        Mismatch = false;
+            int                         OpenResult;
+
+            // Retry while all of the handles are in use by the other threads.
+            while (-ENOSR == (OpenResult = FileSystem.open(&pFile, Filenames[Index].c_str(), O_RDONLY)))
+            {
+                std::this_thread::yield();
+            }
+            if (OpenResult)
+            {
+                Errors++;
+                continue;
+            }
+            while ((Result = pFile->read(Buffer.data(), Buffer.size())) > 0)
+            {
+                if (FileBytes + Result > Expected.size() ||
+                    0 != memcmp(Buffer.data(), Expected.data() + FileBytes, Result))
+                {
+                    Mismatch = true;
+                    break;
+                }
+                FileBytes += Result;
+            }
+            if (Mismatch || FileBytes != Expected.size() || pFile->size() != (off_t)Expected.size())
+            {
+                Errors++;
+            }
+            pFile->close();
+            BytesRead += FileBytes;
+        }
+        Bytes += BytesRead;
+    };
+
+    std::chrono::steady_clock::time_point   Start = std::chrono::steady_clock::now();
+    for (i = 0 ; i < ThreadCount ; i++)
+    {
+        Threads.push_back(std::thread(Worker, Options.Seed + i));
+    }
+    for (i = 0 ; i < ThreadCount ; i++)
+    {
+        Threads[i].join();
+    }
+    double  Seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+
+    printf("open/read/close %2u thr  %9u ops  %10.0f ops/s  %9.1f MB/s  %u errors\n",
+           ThreadCount,
+           OperationsPerThread * ThreadCount,
+           (OperationsPerThread * ThreadCount) / Seconds,
+           (Bytes / (1024.0 * 1024.0)) / Seconds,
+           Errors.load());
+
+    return Errors;
+}
+
+
+/* Has ThreadCount threads make random positional reads through one shared
+   handle at the same time.  Every other read scatters its data into three
+   fragments with ReadVectorAt() instead of using ReadAt().  The results are
+   compared against the file's contents as read() returned them beforehand,
+   so any read which depended on another thread's position shows up as an
+   error.
+
+   Returns the number of errors detected.
+*/
+static unsigned int _ConcurrentReadAt(FlashFileSystemFileHandle*  pFile,
+                                      const std::vector<char>&    Expected,
+                                      const SBenchOptions&        Options,
+                                      unsigned int                ThreadCount)
+{
+    std::vector<std::thread>    Threads;
+    std::atomic<unsigned int>   Errors(0);
+    std::atomic<uint64_t>       Bytes(0);
+    unsigned int                OperationsPerThread = Options.Iterations / ThreadCount;
+    unsigned int                i;
+
+    auto    Worker = [&](unsigned int Seed)
+    {
+        std::mt19937        Random(Seed);
+        std::vector<char>   Buffer(Options.ReadSize);
+        uint64_t            BytesRead = 0;
+        unsigned int        j;
+
+        for (j = 0 ; j < OperationsPerThread ; j++)
+        {
+            size_t  Offset = Random() % (Expected.size() + 1);
+            size_t  Length = std::min(Buffer.size(), Expected.size() - Offset);
+            ssize_t Result;
+
+            for (;;)
+            {
+                if (j & 1)
+                {
+                    SFlashFileSystemIoVector    Vectors[3];
+                    size_t                      Split1 = Buffer.size() / 3;
+                    size_t                      Split2 = 2 * Buffer.size() / 3;
+
+                    Vectors[0].pBuffer = Buffer.data();
+                    Vectors[0].Length = Split1;
+                    Vectors[1].pBuffer = Buffer.data() + Split1;
+                    Vectors[1].Length = Split2 - Split1;
+                    Vectors[2].pBuffer = Buffer.data() + Split2;
+                    Vectors[2].Length = Buffer.size() - Split2;
+                    Result = pFile->ReadVectorAt(Vectors, 3, Offset);
+                }
+                else
+                {
+                    Result = pFile->ReadAt(Buffer.data(), Buffer.size(), Offset);
+                }
+
+                // Retry while all of the block buffers are in use by the
+                // other threads.
+                if (-ENOSR != Result)
+                {
+                    break;
+                }
+                std::this_thread::yield();
+            }
+            if (Result != (ssize_t)Length || 0 != memcmp(Buffer.data(), Expected.data() + Offset, Length))
+            {
+                Errors++;
+                continue;
+            }
+            BytesRead += Length;
+        }
+        Bytes += BytesRead;
+    };
+
+    std::chrono::steady_clock::time_point   Start = std::chrono::steady_clock::now();
+    for (i = 0 ; i < ThreadCount ; i++)
+    {
+        Threads.push_back(std::thread(Worker, Options.Seed + i));
+    }
+    for (i = 0 ; i < ThreadCount ; i++)
+    {
+        Threads[i].join();
+    }
+    double  Seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+
+    printf("shared ReadAt() %2u thr  %9u ops  %10.0f ops/s  %9.1f MB/s  %u errors\n",
+           ThreadCount,
+           OperationsPerThread * ThreadCount,
+           (OperationsPerThread * ThreadCount) / Seconds,
+           (Bytes / (1024.0 * 1024.0)) / Seconds,
+           Errors.load());
+
+    return Errors;
+}
+
+
+/* Stacks an overlay image on top of the benchmark image and times open() and
+   the merged directory enumeration through it.  The overlay replaces an
+   evenly spread subset of the files and adds as many new ones to the same
+   directories.  Every file in the overlay is read back to make sure that it
+   hides the base image's copy.
+
+   Returns 0 on success and non-zero on failure.
+*/
+static int _BenchOverlay(const uint8_t*                    pImage,
+                         const std::vector<std::string>&   Filenames,
+                         const SBenchOptions&              Options,
+                         std::mt19937&                     Random)
+{
+    FlashFileSystemBuilder              Builder(Options.BuildOptions);
+    FlashFileSystem                     FileSystem("overlay", pImage);
+    std::vector<std::string>            AllNames(Filenames);
+    std::vector<std::string>            OverlayNames;
+    std::vector<std::vector<uint8_t> >  OverlayContents;
+    std::vector<uint8_t>                Image;
+    std::vector<uint8_t>                Contents;
+    std::vector<uint8_t>                Buffer;
+    unsigned int                        OverlayCount = Options.FileCount * Options.OverlayPercent / 100;
+    unsigned int                        FileCount;
+    unsigned int                        i;
+    int                                 Result;
+
+    for (i = 0 ; i < 2 * OverlayCount ; i++)
+    {
+        unsigned int    Index = (i < OverlayCount) ? (unsigned int)((uint64_t)i * Options.FileCount / OverlayCount) :
+                                                     Options.FileCount + i - OverlayCount;
+
+        _SyntheticContents(Random, Options.FileSize / 2 + Random() % (Options.FileSize + 1), Contents);
+        OverlayNames.push_back(_SyntheticFilename(Options, Index));
+        OverlayContents.push_back(Contents);
+        Builder.AddFile(OverlayNames.back().c_str(), Contents.data(), Contents.size());
+        if (i >= OverlayCount)
+        {
+            AllNames.push_back(OverlayNames.back());
+        }
+    }
+    if (Builder.Build(Image))
+    {
+        fprintf(stderr, "error: %s\n", Builder.GetLastError().c_str());
+        return 1;
+    }
+
+    std::vector<uint32_t>   AlignedImage((Image.size() + 3) / 4);
+    memcpy(AlignedImage.data(), Image.data(), Image.size());
+    Result = FileSystem.AddOverlay((const uint8_t*)AlignedImage.data());
+    if (Result)
+    {
+        fprintf(stderr, "error: Failed to add the overlay (%d).  Is FFS_MAX_IMAGES at least 2?\n", Result);
+        return 1;
+    }
+    printf("\nOverlay: %u replaced and %u new files, %llu bytes\n", 
+           OverlayCount, OverlayCount, (unsigned long long)Image.size());
+
+    for (i = 0 ; i < OverlayNames.size() ; i++)
+    {
+        FileHandle* pFile = NULL;
+        
+        Buffer.resize(OverlayContents[i].size() + 1);
+        if (0 != FileSystem.open(&pFile, OverlayNames[i].c_str(), O_RDONLY) ||
+            (ssize_t)OverlayContents[i].size() != pFile->read(Buffer.data(), Buffer.size()) ||
+            0 != memcmp(Buffer.data(), OverlayContents[i].data(), OverlayContents[i].size()))
+        {
+            fprintf(stderr, "error: '%s' wasn't read from the overlay.\n", OverlayNames[i].c_str());
+            return 1;
+        }
+        pFile->close();
+    }
+
+    LatencyRecorder Open("overlay open()+close()");
+    for (i = 0 ; i < Options.Iterations ; i++)
+    {
+        FileHandle* pFile = NULL;
+
+        Open.Start();
+        FileSystem.open(&pFile, AllNames[Random() % AllNames.size()].c_str(), O_RDONLY);
+        pFile->close();
+        Open.Stop();
+    }
+    Open.Report();
+
+    LatencyRecorder Enumerate("overlay recursive enumeration");
+    for (i = 0 ; i < std::max(1U, Options.Iterations / Options.FileCount) ; i++)
+    {
+        Enumerate.Start();
+        FileCount = _RecursiveDir(FileSystem, "");
+        Enumerate.Stop();
+        if (FileCount != AllNames.size())
+        {
+            fprintf(stderr, "error: Enumerated %u of %u files through the overlay.\n", 
+                    FileCount, (unsigned int)AllNames.size());
+            return 1;
+        }
+    }
+    Enumerate.Report();
+
+    return 0;
+}
+
+
+#if FFS_STATS_HISTOGRAMS
+/* Displays one of the FFS_STATS_HISTOGRAMS histograms, skipping the empty
+   buckets.  The host counts nanoseconds instead of cycles.
+*/
+static void _ReportHistogram(const char* pName, const uint32_t* pHistogram)
+{
+    unsigned int    i;
+    
+    printf("%s ns:\n", pName);
+    for (i = 0 ; i < FFS_STATS_HISTOGRAM_BUCKETS ; i++)
+    {
+        if (pHistogram[i])
+        {
+            printf("  %10llu - %10llu  %9u\n", 
+                   (i ? 1ULL << i : 0ULL), (2ULL << i) - 1, pHistogram[i]);
+        }
+    }
+}
+#endif
+
+
+#if FFS_STATS
+/* Displays the counters which the file system gathered over the whole run.
+*/
+static void _ReportStats(FlashFileSystem& FileSystem)
+{
+    SFlashFileSystemStats   Stats;
+    
+    FileSystem.GetStats(&Stats);
+    printf("\nFile system statistics:\n");
+    printf("open() hits/misses       %u/%u\n", Stats.OpenHits, Stats.OpenMisses);
+    printf("search probes            %u\n", Stats.SearchProbes);
+    printf("bytes read               %llu\n", (unsigned long long)Stats.BytesRead);
+    printf("file handles             %u in use, %u high water, %u exhaustions\n",
+           Stats.FileHandlesInUse, Stats.FileHandleHighWater, Stats.FileHandleExhaustions);
+    printf("directory handles        %u in use, %u high water, %u exhaustions\n",
+           Stats.DirHandlesInUse, Stats.DirHandleHighWater, Stats.DirHandleExhaustions);
+    printf("block buffer exhaustions %u\n", Stats.BlockBufferExhaustions);
+#if FFS_STATS_HISTOGRAMS
+    _ReportHistogram("open()", Stats.OpenCycles);
+    _ReportHistogram("read()", Stats.ReadCycles);
+#endif
+}
+#endif
+
+
+/* Internal routine which copies a byte at a time, like the size optimized
+   memcpy() of some embedded C libraries.  The volatile destination stops the
+   compiler from turning the loop back into a memcpy() call.
+*/
+static void __attribute__((noinline)) _ByteCopy(void* pDest, const void* pSource, size_t Length)
+{
+    volatile uint8_t*   pOut = (volatile uint8_t*)pDest;
+    const uint8_t*      pIn = (const uint8_t*)pSource;
+
+    while (Length--)
+    {
+        *pOut++ = *pIn++;
+    }
+}
+
+
+/* Internal routine which calls the C library's memcpy() through the same
+   signature as the other copy routines.
+*/
+static void _LibraryCopy(void* pDest, const void* pSource, size_t Length)
+{
+    memcpy(pDest, pSource, Length);
+}
+
+
+/* Measures the throughput of copying file data into a buffer with a byte
+   loop, memcpy() and FFSCopy() for a range of read sizes and source
+   alignments.  The source walks sequentially through a 4MB buffer, like
+   read() through a large file, and the destination is deliberately
+   misaligned the way an arbitrary caller's buffer can be.
+
+   Returns the number of copies which didn't match the source.
+*/
+static unsigned int _BenchCopy(void)
+{
+    static const size_t     Sizes[] = { 16, 64, 256, 1024, 4096, 16384 };
+    static const size_t     SourceOffsets[] = { 0, 4, 16, 1 };
+    static const size_t     SourceSize = 4 * 1024 * 1024;
+    static const uint64_t   BytesPerRun = 64 * 1024 * 1024;
+    static void (* const    Copies[])(void*, const void*, size_t) = { _ByteCopy, _LibraryCopy, FFSCopy };
+    std::vector<uint8_t>    Source(SourceSize + 64);
+    std::vector<uint8_t>    Dest(16384 + 64);
+    uint8_t*                pDest = Dest.data() + 3;
+    unsigned int            Errors = 0;
+    size_t                  i;
+
+    for (i = 0 ; i < Source.size() ; i++)
+    {
+        Source[i] = (uint8_t)(i * 7 + (i >> 8));
+    }
+    printf("\n%-24s %12s %12s %12s\n", "copy size+source offset", "byte MB/s", "memcpy MB/s", "FFSCopy MB/s");
+    for (size_t Size : Sizes)
+    {
+        for (size_t SourceOffset : SourceOffsets)
+        {
+            char    Label[32];
+
+            snprintf(Label, sizeof(Label), "copy %lu+%lu", (unsigned long)Size, (unsigned long)SourceOffset);
+            printf("%-24s", Label);
+            for (auto Copy : Copies)
+            {
+                uint64_t                                Copied = 0;
+                size_t                                  Offset = 0;
+                std::chrono::steady_clock::time_point   Start = std::chrono::steady_clock::now();
+                double                                  Seconds;
+
+                while (Copied < BytesPerRun)
+                {
+                    if (Offset + Size > SourceSize)
+                    {
+                        Offset = 0;
+                    }
+                    Copy(pDest, &Source[Offset + SourceOffset], Size);
+                    Offset += (Size + 63) & ~(size_t)63;
+                    Copied += Size;
+                }
+                Seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+                printf(" %12.1f", (Copied / (1024.0 * 1024.0)) / Seconds);
+
+                // The last copy must have moved the right bytes.
+                Offset -= (Size + 63) & ~(size_t)63;
+                if (memcmp(pDest, &Source[Offset + SourceOffset], Size))
+                {
+                    Errors++;
+                }
+            }
+            printf("\n");
+        }
+    }
+
+    return Errors;
+}
+
+
+/* Writes Size bytes from pData to a new file.
+
+   Returns 0 on success and non-zero on failure.
+*/
+static int _WriteFile(const char* pFilename, const void* pData, size_t Size)
+{
+    FILE*   pFile = fopen(pFilename, "wb");
+
+    if (!pFile)
+    {
+        fprintf(stderr, "error: Failed to create '%s'.\n", pFilename);
+        return -1;
+    }
+    if (Size != fwrite(pData, 1, Size, pFile))
+    {
+        fprintf(stderr, "error: Failed to write '%s'.\n", pFilename);
+        fclose(pFile);
+        return -1;
+    }
+    fclose(pFile);
+
+    return 0;
+}
+
+
+#if FFS_BLOCK_DEVICE
+/* Displays the number of block device reads and bytes read per operation
+   since the counts were last reset.
+*/
+static void _ReportDeviceReads(MemoryBlockDevice& Device, unsigned int OperationCount)
+{
+    printf("%-24s %9.2f reads/op  %10.0f bytes/op\n",
+           "  device",
+           (double)Device.GetReadCount() / OperationCount,
+           (double)Device.GetReadBytes() / OperationCount);
+    Device.ResetCounts();
+}
+
+
+/* Mounts the benchmark image from a simulated SPI FLASH block device and
+   times mounting, open(), enumeration and reads through the block cache.
+   The number of device reads behind each operation is reported too, since
+   on real hardware they dominate.
+
+   Returns 0 on success and non-zero on failure.
+*/
+static int _BenchBlockDevice(const std::vector<uint8_t>&        Image,
+                             const std::vector<std::string>&    Filenames,
+                             const std::vector<size_t>&         Sizes,
+                             const SBenchOptions&               Options,
+                             std::mt19937&                      Random)
+{
+    MemoryBlockDevice   Device(Image.data(), Image.size());
+    std::vector<char>   Buffer(Options.ReadSize);
+    unsigned int        Iterations = std::min(Options.Iterations, 10000U);
+    unsigned int        FileCount;
+    unsigned int        i;
+
+    Device.SetTiming((uint64_t)(Options.BlockDeviceLatencyUs * 1000.0), (uint64_t)(Options.BlockDeviceMBps * 1000000.0));
+    printf("\nBlock device: %.1f us per read, %.1f MB/s, %u line cache of %u bytes, readahead %u\n",
+           Options.BlockDeviceLatencyUs, Options.BlockDeviceMBps,
+           FFS_BLOCK_CACHE_LINE_COUNT, FFS_BLOCK_CACHE_LINE_SIZE, FFS_BLOCK_CACHE_READAHEAD);
+
+    LatencyRecorder Mount("bd mount");
+    for (i = 0 ; i < std::min(Iterations, 1000U) ; i++)
+    {
+        Mount.Start();
+        FlashFileSystem*    pFileSystem = new FlashFileSystem("bd", Device);
+        Mount.Stop();
+        delete pFileSystem;
+    }
+    Mount.Report();
+    _ReportDeviceReads(Device, i);
+
+    FlashFileSystem FileSystem("bd", Device);
+    if (!FileSystem.IsMounted())
+    {
+        fprintf(stderr, "error: Failed to mount the image from the block device.\n");
+        return 1;
+    }
+    Device.ResetCounts();
+
+    LatencyRecorder OpenHit("bd open hit");
+    for (i = 0 ; i < Iterations ; i++)
+    {
+        const std::string&  Name = Filenames[Random() % Filenames.size()];
+        FileHandle*         pFile = NULL;
+        int                 Result;
+
+        OpenHit.Start();
+        Result = FileSystem.open(&pFile, Name.c_str(), O_RDONLY);
+        OpenHit.Stop();
+        if (Result)
+        {
+            fprintf(stderr, "error: Failed to open '%s' from the block device (%d).\n", Name.c_str(), Result);
+            return 1;
+        }
+        pFile->close();
+    }
+    OpenHit.Report();
+    _ReportDeviceReads(Device, Iterations);
+
+    LatencyRecorder Enumerate("bd recursive enumeration");
+    Enumerate.Start();
+    FileCount = _RecursiveDir(FileSystem, "");
+    Enumerate.Stop();
+    if (FileCount != Filenames.size())
+    {
+        fprintf(stderr, "error: Enumerated %u of %u files from the block device.\n", 
+                FileCount, (unsigned int)Filenames.size());
+        return 1;
+    }
+    Enumerate.Report();
+    _ReportDeviceReads(Device, 1);
+
+    // Small sequential reads through whole files, where readahead matters
+    // most.
+    LatencyRecorder SequentialRead("bd sequential read()");
+    unsigned int    ReadCount = 0;
+    for (i = 0 ; ReadCount < Iterations ; i++)
+    {
+        size_t      Index = Random() % Filenames.size();
+        FileHandle* pFile = NULL;
+        size_t      Total = 0;
+        ssize_t     BytesRead;
+
+        FileSystem.open(&pFile, Filenames[Index].c_str(), O_RDONLY);
+        do
+        {
+            SequentialRead.Start();
+            BytesRead = pFile->read(Buffer.data(), Buffer.size());
+            SequentialRead.Stop(BytesRead > 0 ? BytesRead : 0);
+            Total += (BytesRead > 0) ? BytesRead : 0;
+            ReadCount++;
+        } while (BytesRead > 0);
+        pFile->close();
+        if (Total != Sizes[Index])
+        {
+            fprintf(stderr, "error: Read %lu of %lu bytes of '%s' from the block device.\n", 
+                    (unsigned long)Total, (unsigned long)Sizes[Index], Filenames[Index].c_str());
+            return 1;
+        }
+    }
+    SequentialRead.Report();
+    _ReportDeviceReads(Device, ReadCount);
+
+    LatencyRecorder RandomRead("bd random seek()+read()");
+    for (i = 0 ; i < Iterations ; i++)
+    {
+        const std::string&  Name = Filenames[Random() % Filenames.size()];
+        FileHandle*         pFile = NULL;
+        ssize_t             BytesRead;
+
+        FileSystem.open(&pFile, Name.c_str(), O_RDONLY);
+        Device.ResetCounts();
+        RandomRead.Start();
+        pFile->seek(Random() % (pFile->size() + 1), SEEK_SET);
+        BytesRead = pFile->read(Buffer.data(), Buffer.size());
+        RandomRead.Stop(BytesRead > 0 ? BytesRead : 0);
+        pFile->close();
+    }
+    RandomRead.Report();
+
+    return 0;
+}
+#endif
+
+
+#if FFS_MAPPED_FILE && FFS_LARGE_IMAGES
+// Layout of the sparse image written by _BenchLargeImage().  big.bin starts
+// just after the entry table and runs 1GB past the 4GB mark, and high.bin
+// lies entirely above it.  Only the windows of data which are checked are
+// written, so the rest of the image reads back as zeros without using any
+// disk space.
+#define LARGE_GB                ((uint64_t)1 << 30)
+#define LARGE_SMALL_OFFSET      ((uint64_t)4096)
+#define LARGE_SMALL_SIZE        ((uint64_t)4096)
+#define LARGE_BIG_OFFSET        ((uint64_t)8192)
+#define LARGE_BIG_SIZE          (5 * LARGE_GB)
+#define LARGE_HIGH_OFFSET       (LARGE_BIG_OFFSET + LARGE_BIG_SIZE)
+#define LARGE_HIGH_SIZE         ((uint64_t)1024 * 1024)
+#define LARGE_IMAGE_SIZE        (LARGE_HIGH_OFFSET + LARGE_HIGH_SIZE)
+#define LARGE_WINDOW_SIZE       ((uint64_t)1024 * 1024)
+
+
+/* Returns the byte stored at an offset of the large image.  Every bit of the
+   offset feeds into it, so data read from an offset truncated to 32 bits
+   doesn't match.
+*/
+static uint8_t _LargeImageByte(uint64_t Offset)
+{
+    return (uint8_t)((Offset * 0x9E3779B97F4A7C15ULL) >> 56);
+}
+
+
+/* Returns the offset of the first byte of Data, which was read from the
+   large image at ImageOffset, that doesn't match, or Size if they all do.
+*/
+static size_t _CheckLargeData(const char* pData, uint64_t ImageOffset, size_t Size)
+{
+    size_t  i;
+
+    for (i = 0 ; i < Size ; i++)
+    {
+        if ((uint8_t)pData[i] != _LargeImageByte(ImageOffset + i))
+        {
+            break;
+        }
+    }
+    return i;
+}
+
+
+/* Writes Size bytes of the large image's data at Offset.
+
+   Returns 0 on success and -1 on failure.
+*/
+static int _WriteLargeWindow(int File, uint64_t Offset, uint64_t Size)
+{
+    std::vector<uint8_t>    Buffer(1024 * 1024);
+
+    while (Size > 0)
+    {
+        size_t  Chunk = (size_t)std::min<uint64_t>(Size, Buffer.size());
+        size_t  i;
+
+        for (i = 0 ; i < Chunk ; i++)
+        {
+            Buffer[i] = _LargeImageByte(Offset + i);
+        }
+        if ((ssize_t)Chunk != pwrite(File, Buffer.data(), Chunk, (off_t)Offset))
+        {
+            return -1;
+        }
+        Offset += Chunk;
+        Size -= Chunk;
+    }
+    return 0;
+}
+
+
+/* Writes a sparse version 3 image larger than 4GB by hand, since
+   FlashFileSystemBuilder holds the whole image in RAM.
+
+   Returns 0 on success and -1 on failure.
+*/
+static int _WriteLargeImage(const char* pFilename)
+{
+    static const char*      Names[] = { "big.bin", "high.bin", "small.bin" };
+    static const uint64_t   Offsets[] = { LARGE_BIG_OFFSET, LARGE_HIGH_OFFSET, LARGE_SMALL_OFFSET };
+    static const uint64_t   Sizes[] = { LARGE_BIG_SIZE, LARGE_HIGH_SIZE, LARGE_SMALL_SIZE };
+    static const unsigned   FileCount = sizeof(Names) / sizeof(Names[0]);
+    SFileSystemHeaderV3     Header;
+    SFileSystemEntryV3      Entries[FileCount];
+    std::string             NameData;
+    uint64_t                Boundary = 4 * LARGE_GB;
+    unsigned int            i;
+    int                     File;
+    int                     Result;
+
+    memset(&Header, 0, sizeof(Header));
+    memcpy(Header.FileSystemSignature, FILE_SYSTEM_SIGNATURE_V3, sizeof(Header.FileSystemSignature));
+    Header.FileCount = FileCount;
+    Header.Version = FILE_SYSTEM_VERSION_3;
+    Header.FileEntriesOffset = sizeof(Header);
+    Header.ImageSize = LARGE_IMAGE_SIZE;
+    for (i = 0 ; i < FileCount ; i++)
+    {
+        Entries[i].FilenameOffset = sizeof(Header) + sizeof(Entries) + NameData.size();
+        Entries[i].FileBinaryOffset = Offsets[i];
+        Entries[i].FileBinarySize = Sizes[i];
+        NameData.append(Names[i], strlen(Names[i]) + 1);
+    }
+
+    File = open(pFilename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (File < 0)
+    {
+        fprintf(stderr, "error: Failed to create '%s'.\n", pFilename);
+        return -1;
+    }
+    Result = ftruncate(File, (off_t)LARGE_IMAGE_SIZE);
+    if (0 == Result &&
+        ((ssize_t)sizeof(Header) != pwrite(File, &Header, sizeof(Header), 0) ||
+         (ssize_t)sizeof(Entries) != pwrite(File, Entries, sizeof(Entries), sizeof(Header)) ||
+         (ssize_t)NameData.size() != pwrite(File, NameData.data(), NameData.size(), sizeof(Header) + sizeof(Entries)) ||
+         _WriteLargeWindow(File, LARGE_SMALL_OFFSET, LARGE_SMALL_SIZE) ||
+         _WriteLargeWindow(File, LARGE_BIG_OFFSET, LARGE_WINDOW_SIZE) ||
+         _WriteLargeWindow(File, Boundary - LARGE_WINDOW_SIZE / 2, LARGE_WINDOW_SIZE) ||
+         _WriteLargeWindow(File, LARGE_HIGH_OFFSET - LARGE_WINDOW_SIZE, LARGE_WINDOW_SIZE) ||
+         _WriteLargeWindow(File, LARGE_HIGH_OFFSET, LARGE_HIGH_SIZE)))
+    {
+        Result = -1;
+    }
+    if (close(File) || Result)
+    {
+        fprintf(stderr, "error: Failed to write '%s'.\n", pFilename);
+        return -1;
+    }
+    return 0;
+}
+
+
+/* Mounts the large image and checks and times read(), ReadAt() and seek()
+   on the windows of data which were written, including the one which
+   straddles the 4GB mark.
+
+   Returns 0 on success and non-zero on failure.
+*/
+static int _CheckLargeImage(const char* pFilename, const SBenchOptions& Options, std::mt19937& Random)
+{
+    FlashFileSystemMappedFile   MappedFile;
+    std::vector<char>           Buffer(std::max<uint64_t>(LARGE_WINDOW_SIZE, LARGE_HIGH_SIZE));
+    uint64_t                    Boundary = 4 * LARGE_GB - LARGE_BIG_OFFSET;
+    uint64_t                    WindowStart = Boundary - LARGE_WINDOW_SIZE / 2;
+    FileHandle*                 pFile = NULL;
+    struct stat                 Stat;
+    uint64_t                    Offset;
+    size_t                      ReadSize = (size_t)std::min<uint64_t>(Options.ReadSize, LARGE_WINDOW_SIZE);
+    unsigned int                Iterations = std::min(Options.Iterations, 10000U);
+    unsigned int                i;
+    ssize_t                     BytesRead;
+
+    if (MappedFile.Open(pFilename, FFS_MAP_RANDOM))
+    {
+        fprintf(stderr, "error: Failed to map '%s'.\n", pFilename);
+        return 1;
+    }
+    FlashFileSystem FileSystem("large", MappedFile);
+    if (!FileSystem.IsMounted())
+    {
+        fprintf(stderr, "error: Failed to mount the large image.\n");
+        return 1;
+    }
+    if (FileSystem.stat("big.bin", &Stat) || (uint64_t)Stat.st_size != LARGE_BIG_SIZE ||
+        FileSystem.stat("high.bin", &Stat) || (uint64_t)Stat.st_size != LARGE_HIGH_SIZE ||
+        FileSystem.stat("small.bin", &Stat) || (uint64_t)Stat.st_size != LARGE_SMALL_SIZE)
+    {
+        fprintf(stderr, "error: stat() returned the wrong size for a file in the large image.\n");
+        return 1;
+    }
+
+    // Sequential reads through the window which straddles the 4GB mark.
+    FileSystem.open(&pFile, "big.bin", O_RDONLY);
+    if ((off_t)WindowStart != pFile->seek((off_t)WindowStart, SEEK_SET))
+    {
+        fprintf(stderr, "error: Failed to seek() to the 4GB mark of the large image.\n");
+        return 1;
+    }
+    LatencyRecorder SequentialRead("large read() at 4GB");
+    for (Offset = WindowStart ; Offset < WindowStart + LARGE_WINDOW_SIZE ; Offset += BytesRead)
+    {
+        size_t  Size = (size_t)std::min<uint64_t>(ReadSize, WindowStart + LARGE_WINDOW_SIZE - Offset);
+
+        SequentialRead.Start();
+        BytesRead = pFile->read(Buffer.data(), Size);
+        SequentialRead.Stop(BytesRead > 0 ? BytesRead : 0);
+        if (BytesRead != (ssize_t)Size ||
+            (size_t)BytesRead != _CheckLargeData(Buffer.data(), LARGE_BIG_OFFSET + Offset, BytesRead))
+        {
+            fprintf(stderr, "error: read() returned the wrong data at offset %llu of the large image.\n",
+                    (unsigned long long)(LARGE_BIG_OFFSET + Offset));
+            return 1;
+        }
+    }
+    SequentialRead.Report();
+
+    // Positional reads from either side of the 4GB mark.
+    LatencyRecorder PositionalRead("large ReadAt() at 4GB");
+    for (i = 0 ; i < Iterations ; i++)
+    {
+        Offset = WindowStart + Random() % (LARGE_WINDOW_SIZE - ReadSize + 1);
+        PositionalRead.Start();
+        BytesRead = ((FlashFileSystemFileHandle*)pFile)->ReadAt(Buffer.data(), ReadSize, (off_t)Offset);
+        PositionalRead.Stop(BytesRead > 0 ? BytesRead : 0);
+        if (BytesRead != (ssize_t)ReadSize ||
+            (size_t)BytesRead != _CheckLargeData(Buffer.data(), LARGE_BIG_OFFSET + Offset, BytesRead))
+        {
+            fprintf(stderr, "error: ReadAt() returned the wrong data at offset %llu of the large image.\n",
+                    (unsigned long long)(LARGE_BIG_OFFSET + Offset));
+            return 1;
+        }
+    }
+    PositionalRead.Report();
+
+    // A relative seek back across the 4GB mark, then the end of the 5GB
+    // file.
+    if ((off_t)(Boundary + 16) != pFile->seek((off_t)(Boundary + 16), SEEK_SET) ||
+        (off_t)(Boundary - 16) != pFile->seek(-32, SEEK_CUR) ||
+        32 != pFile->read(Buffer.data(), 32) ||
+        32 != _CheckLargeData(Buffer.data(), LARGE_BIG_OFFSET + Boundary - 16, 32) ||
+        (off_t)(LARGE_BIG_SIZE - LARGE_WINDOW_SIZE) != pFile->seek((off_t)(LARGE_BIG_SIZE - LARGE_WINDOW_SIZE), SEEK_SET) ||
+        (ssize_t)LARGE_WINDOW_SIZE != pFile->read(Buffer.data(), LARGE_WINDOW_SIZE) ||
+        LARGE_WINDOW_SIZE != _CheckLargeData(Buffer.data(), LARGE_HIGH_OFFSET - LARGE_WINDOW_SIZE, LARGE_WINDOW_SIZE) ||
+        0 != pFile->read(Buffer.data(), 1))
+    {
+        fprintf(stderr, "error: seek() and read() across the large image returned the wrong data.\n");
+        return 1;
+    }
+    pFile->close();
+
+    // The files at either end of the image.
+    FileSystem.open(&pFile, "high.bin", O_RDONLY);
+    BytesRead = pFile->read(Buffer.data(), LARGE_HIGH_SIZE);
+    pFile->close();
+    if ((ssize_t)LARGE_HIGH_SIZE != BytesRead ||
+        LARGE_HIGH_SIZE != _CheckLargeData(Buffer.data(), LARGE_HIGH_OFFSET, LARGE_HIGH_SIZE))
+    {
+        fprintf(stderr, "error: Read the wrong data from the file past 4GB in the large image.\n");
+        return 1;
+    }
+    FileSystem.open(&pFile, "small.bin", O_RDONLY);
+    BytesRead = pFile->read(Buffer.data(), LARGE_SMALL_SIZE);
+    pFile->close();
+    if ((ssize_t)LARGE_SMALL_SIZE != BytesRead ||
+        LARGE_SMALL_SIZE != _CheckLargeData(Buffer.data(), LARGE_SMALL_OFFSET, LARGE_SMALL_SIZE))
+    {
+        fprintf(stderr, "error: Read the wrong data from the file below 4GB in the large image.\n");
+        return 1;
+    }
+    printf("%-24s passed\n", "large image checks");
+
+    return 0;
+}
+
+
+/* Writes a sparse version 3 image larger than 4GB, mounts it through
+   FlashFileSystemMappedFile and checks reads on either side of the 4GB mark.
+   The image file is deleted afterwards.
+
+   Returns 0 on success and non-zero on failure.
+*/
+static int _BenchLargeImage(const SBenchOptions& Options, std::mt19937& Random)
+{
+    int Result;
+
+    if (_WriteLargeImage(Options.pLargeImageFilename))
+    {
+        unlink(Options.pLargeImageFilename);
+        return 1;
+    }
+    printf("Large image: %llu byte sparse version 3 image in '%s'\n\n",
+           (unsigned long long)LARGE_IMAGE_SIZE, Options.pLargeImageFilename);
+    Result = _CheckLargeImage(Options.pLargeImageFilename, Options, Random);
+    unlink(Options.pLargeImageFilename);
+
+    return Result;
+}
+#endif
+
+
+static void _DisplayUsage(void)
+{
+    fprintf(stderr,
+            "Usage: ffsbench [options]\n"
+            "\n"
+            "Options:\n"
+            "  --files N        Number of files in the image (default 10000).\n"
+            "  --depth N        Directory levels above each file (default 3).\n"
+            "  --fanout N       Subdirectories per directory (default 8).\n"
+            "  --name-length N  Length of each path component (default 12).\n"
+            "  --file-size N    Average file size in bytes (default 4096).\n"
+            "  --read-size N    Bytes per read() call (default 512).\n"
+            "  --iterations N   Operations per benchmark (default 100000).\n"
+            "  --seed N         Random seed (default 1).\n"
+            "  --threads N      Most threads for the concurrent benchmarks (default 4).\n"
+            "  --zipf S         Zipf exponent for the hot file benchmark (default 1.0).\n"
+            "  --duplicates P   Percentage of files which copy an earlier file (default 0).\n"
+            "  --overlay P      Percentage of files replaced by an overlay image, which\n"
+            "                   adds as many new files (default 0).  Needs a build with\n"
+            "                   -DFFS_MAX_IMAGES=2.\n"
+            "  --block-device US\n"
+            "                   Also mount the image from a simulated SPI FLASH block\n"
+            "                   device whose reads take US microseconds plus the\n"
+            "                   transfer time.  Needs a build with -DFFS_BLOCK_DEVICE=1.\n"
+            "  --block-device-mbps N\n"
+            "                   Transfer rate of the block device in MB/s (default 20).\n"
+            "  --save-image FILE\n"
+            "                   Save the synthetic image for use with ffsreplay.\n"
+            "  --trace FILE     Save an access trace of the single threaded benchmarks\n"
+            "                   for use with ffsreplay.  Needs a build with\n"
+            "                   -DFFS_ACCESS_TRACE=1.\n"
+            "  --large-image FILE\n"
+            "                   Instead of the other benchmarks, write a sparse version\n"
+            "                   3 image larger than 4GB to FILE, mount it and check\n"
+            "                   reads across the 4GB mark.  Needs a build with\n"
+            "                   -DFFS_MAPPED_FILE=1 -DFFS_LARGE_IMAGES=1.\n"
+            "  -1               Use a version 1 image.\n"
+            "  -3               Use a version 3 image, with 64-bit offsets.\n"
+            "  --no-hash        Don't add the filename hash index.\n"
+            "  --compress       Compress the files in the image.\n"
+            "  --block-size N   Compressed block size (default 1024).\n"
+            "  --front-coded    Front code the filenames in the image.\n"
+            "  --no-dedup       Store the data of duplicate files more than once.\n"
+            "  --no-trailer     Don't append the trailer, so that the search mount\n"
+            "                   benchmark scans the image for its signature.\n"
+            "  --checksums      Add checksums and benchmark verification.\n"
+            "  --directory-tree Add a directory tree to the image.\n"
+            "  --encoded-variants\n"
+            "                   Add an encoded variant of every file.  LZ4 data stands\n"
+            "                   in for gzip since it is never decoded on the device.\n"
+            "  --restart-interval N\n"
+            "                   Front coded names between restart points (default 16).\n"
+            "  --align N        Align each file's data to N bytes (default 4).\n"
+            "  --copy-sweep     Compare memcpy() and FFSCopy() across read sizes and\n"
+            "                   source alignments.\n");
+}
+
+
+static int _ParseOptions(int argc, char** argv, SBenchOptions& Options)
+{
+    int i;
+
+    Options.FileCount = 10000;
+    Options.Depth = 3;
+    Options.Fanout = 8;
+    Options.NameLength = 12;
+    Options.FileSize = 4096;
+    Options.ReadSize = 512;
+    Options.Iterations = 100000;
+    Options.Seed = 1;
+    Options.MaxThreads = 4;
+    Options.ZipfExponent = 1.0;
+    Options.DuplicatePercent = 0;
+    Options.EncodedVariants = false;
+    Options.OverlayPercent = 0;
+    Options.BlockDevice = false;
+    Options.BlockDeviceLatencyUs = 0.0;
+    Options.BlockDeviceMBps = 20.0;
+    Options.pSaveImageFilename = NULL;
+    Options.pTraceFilename = NULL;
+    Options.CopySweep = false;
+    Options.pLargeImageFilename = NULL;
+    for (i = 1 ; i < argc ; i++)
+    {
+        const char* pArg = argv[i];
+        const char* pValue = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+        if (0 == strcmp(pArg, "-1"))
+        {
+            Options.BuildOptions.Version2 = false;
+            Options.BuildOptions.HashIndex = false;
+            continue;
+        }
+        if (0 == strcmp(pArg, "-3"))
+        {
+            Options.BuildOptions.Version3 = true;
+            continue;
+        }
+        if (0 == strcmp(pArg, "--no-hash"))
+        {
+            Options.BuildOptions.HashIndex = false;
+            continue;
+        }
+        if (0 == strcmp(pArg, "--compress"))
+        {
+            Options.BuildOptions.Compress = true;
+            continue;
+        }
+        if (0 == strcmp(pArg, "--front-coded"))
+        {
+            Options.BuildOptions.FrontCodedNames = true;
+            continue;
+        }
+        if (0 == strcmp(pArg, "--no-dedup"))
+        {
+            Options.BuildOptions.Deduplicate = false;
+            continue;
+        }
+        if (0 == strcmp(pArg, "--no-trailer"))
+        {
+            Options.BuildOptions.Trailer = false;
+            continue;
+        }
+        if (0 == strcmp(pArg, "--checksums"))
+        {
+            Options.BuildOptions.Checksums = true;
+            continue;
+        }
+        if (0 == strcmp(pArg, "--directory-tree"))
+        {
+            Options.BuildOptions.DirectoryTree = true;
+            continue;
+        }
+        if (0 == strcmp(pArg, "--encoded-variants"))
+        {
+            Options.EncodedVariants = true;
+            continue;
+        }
+        if (0 == strcmp(pArg, "--copy-sweep"))
+        {
+            Options.CopySweep = true;
+            continue;
+        }
+        if (!pValue)
+        {
+            return -1;
+        }
+        i++;
+        if (0 == strcmp(pArg, "--files"))
+            Options.FileCount = strtoul(pValue, NULL, 0);
+        else if (0 == strcmp(pArg, "--depth"))
+            Options.Depth = strtoul(pValue, NULL, 0);
+        else if (0 == strcmp(pArg, "--fanout"))
+            Options.Fanout = strtoul(pValue, NULL, 0);
+        else if (0 == strcmp(pArg, "--name-length"))
+            Options.NameLength = strtoul(pValue, NULL, 0);
+        else if (0 == strcmp(pArg, "--file-size"))
+            Options.FileSize = strtoul(pValue, NULL, 0);
+        else if (0 == strcmp(pArg, "--read-size"))
+            Options.ReadSize = strtoul(pValue, NULL, 0);
+        else if (0 == strcmp(pArg, "--iterations"))
+            Options.Iterations = strtoul(pValue, NULL, 0);
+        else if (0 == strcmp(pArg, "--seed"))
+            Options.Seed = strtoul(pValue, NULL, 0);
+        else if (0 == strcmp(pArg, "--threads"))
+            Options.MaxThreads = strtoul(pValue, NULL, 0);
+        else if (0 == strcmp(pArg, "--zipf"))
+            Options.ZipfExponent = strtod(pValue, NULL);
+        else if (0 == strcmp(pArg, "--duplicates"))
+            Options.DuplicatePercent = strtoul(pValue, NULL, 0);
+        else if (0 == strcmp(pArg, "--overlay"))
+            Options.OverlayPercent = strtoul(pValue, NULL, 0);
+        else if (0 == strcmp(pArg, "--block-device"))
+        {
+            Options.BlockDevice = true;
+            Options.BlockDeviceLatencyUs = strtod(pValue, NULL);
+        }
+        else if (0 == strcmp(pArg, "--block-device-mbps"))
+            Options.BlockDeviceMBps = strtod(pValue, NULL);
+        else if (0 == strcmp(pArg, "--save-image"))
+            Options.pSaveImageFilename = pValue;
+        else if (0 == strcmp(pArg, "--trace"))
+            Options.pTraceFilename = pValue;
+        else if (0 == strcmp(pArg, "--large-image"))
+            Options.pLargeImageFilename = pValue;
+        else if (0 == strcmp(pArg, "--block-size"))
+            Options.BuildOptions.BlockSize = strtoul(pValue, NULL, 0);
+        else if (0 == strcmp(pArg, "--restart-interval"))
+            Options.BuildOptions.RestartInterval = strtoul(pValue, NULL, 0);
+        else if (0 == strcmp(pArg, "--align"))
+            Options.BuildOptions.PayloadAlignment = strtoul(pValue, NULL, 0);
+        else
+            return -1;
+    }
+    if (0 == Options.FileCount || 0 == Options.Fanout || 0 == Options.ReadSize || 0 == Options.Iterations ||
+        Options.OverlayPercent > 100 || Options.BlockDeviceLatencyUs < 0.0 || Options.BlockDeviceMBps < 0.0)
+    {
+        return -1;
+    }
+#if !FFS_BLOCK_DEVICE
+    if (Options.BlockDevice)
+    {
+        fprintf(stderr, "error: --block-device needs a build with -DFFS_BLOCK_DEVICE=1.\n");
+        return -1;
+    }
+#endif
+#if !FFS_ACCESS_TRACE
+    if (Options.pTraceFilename)
+    {
+        fprintf(stderr, "error: --trace needs a build with -DFFS_ACCESS_TRACE=1.\n");
+        return -1;
+    }
+#endif
+#if !FFS_MAPPED_FILE || !FFS_LARGE_IMAGES
+    if (Options.pLargeImageFilename)
+    {
+        fprintf(stderr, "error: --large-image needs a build with -DFFS_MAPPED_FILE=1 -DFFS_LARGE_IMAGES=1.\n");
+        return -1;
+    }
+#endif
+
+    return 0;
+}
+
+
+int main(int argc, char** argv)
+{
+    SBenchOptions               Options;
+    std::vector<std::string>    Filenames;
+    std::vector<size_t>         Sizes;
+    std::vector<std::vector<uint8_t> > AllContents;
+    std::vector<int>            Sources;
+    std::vector<size_t>         VariantSizes;
+    std::vector<uint8_t>        Image;
+    std::vector<uint8_t>        Contents;
+    std::vector<char>           Buffer;
+    unsigned int                i;
+
+    if (_ParseOptions(argc, argv, Options))
+    {
+        _DisplayUsage();
+        return 1;
+    }
+    std::mt19937    Random(Options.Seed);
+#if FFS_MAPPED_FILE && FFS_LARGE_IMAGES
+    if (Options.pLargeImageFilename)
+    {
+        return _BenchLargeImage(Options, Random);
+    }
+#endif
+
+    // Build the synthetic image.  Duplicates copy the contents of a random
+    // earlier file, like the same library vendored into several directories.
+    // Every file's contents are kept so that later reads can be checked.
+    FlashFileSystemBuilder  Builder(Options.BuildOptions);
+    for (i = 0 ; i < Options.FileCount ; i++)
+    {
+        size_t  Size = Options.FileSize / 2 + Random() % (Options.FileSize + 1);
+        int     Source = -1;
+
+        if (Options.DuplicatePercent && i > 0 && Random() % 100 < Options.DuplicatePercent)
+        {
+            Source = Random() % i;
+            Contents = AllContents[Source];
+            Size = Contents.size();
+        }
+        else
+        {
+            _SyntheticContents(Random, Size, Contents);
+        }
+        Filenames.push_back(_SyntheticFilename(Options, i));
+        Sizes.push_back(Size);
+        Builder.AddFile(Filenames.back().c_str(), Contents.data(), Contents.size());
+        if (Options.EncodedVariants)
+        {
+            std::vector<uint8_t>    Encoded;
+
+            FlashFileSystemLZ4Compress(Contents.data(), Contents.size(), Encoded);
+            Builder.AddEncodedVariant(Filenames.back().c_str(), FFS_ENCODING_GZIP, Encoded.data(), Encoded.size());
+            VariantSizes.push_back(Encoded.size());
+        }
+        AllContents.push_back(Contents);
+        Sources.push_back(Source);
+    }
+    if (Builder.Build(Image))
+    {
+        fprintf(stderr, "error: %s\n", Builder.GetLastError().c_str());
+        return 1;
+    }
+    printf("Image: %u files, %llu bytes (%llu bytes of names, %llu bytes saved by %lu duplicates), %s%s%s%s%s\n\n",
+           Options.FileCount,
+           (unsigned long long)Image.size(),
+           (unsigned long long)Builder.GetStats().NameBytes,
+           (unsigned long long)Builder.GetStats().DuplicateBytes,
+           (unsigned long)Builder.GetStats().DuplicateFileCount,
+           Options.BuildOptions.Version3 ? "version 3" : (Options.BuildOptions.Version2 ? "version 2" : "version 1"),
+           Options.BuildOptions.HashIndex ? ", hash index" : "",
+           Options.BuildOptions.Compress ? ", compressed" : "",
+           Options.BuildOptions.FrontCodedNames ? ", front coded names" : "",
+           Options.BuildOptions.DirectoryTree ? ", directory tree" : "");
+    if (Options.pSaveImageFilename && _WriteFile(Options.pSaveImageFilename, Image.data(), Image.size()))
+    {
+        return 1;
+    }
+
+    // The runtime requires the image to be 4-byte aligned, or 8-byte aligned
+    // for version 3.  Placing it on the payload alignment keeps that
+    // alignment for the file data too.
+    size_t                  PayloadAlignment = Options.BuildOptions.PayloadAlignment;
+    size_t                  ImageAlignment = (Options.BuildOptions.Version3 && PayloadAlignment < 8) ? 8 : PayloadAlignment;
+    std::vector<uint8_t>    AlignedImage(Image.size() + ImageAlignment);
+    uint8_t*                pAlignedImage = AlignedImage.data() +
+                                            ((0 - (uintptr_t)AlignedImage.data()) & (ImageAlignment - 1));
+    memcpy(pAlignedImage, Image.data(), Image.size());
+    const uint8_t*          pImage = pAlignedImage;
+
+    // Mount.
+    LatencyRecorder Mount("mount");
+    for (i = 0 ; i < std::min(Options.Iterations, 10000U) ; i++)
+    {
+        Mount.Start();
+        FlashFileSystem*    pFileSystem = new FlashFileSystem("flash", pImage);
+        Mount.Stop();
+        delete pFileSystem;
+    }
+    Mount.Report();
+
+    // Mount the way a device does when the image was appended to the program
+    // binary: 4KB of code, then the image, then erased FLASH up to the next
+    // power of 2.  The trailer leads straight to the image, while images
+    // built with --no-trailer are scanned backwards for the signature.
+    size_t                  FlashSize = 4096;
+    while (FlashSize < 4096 + Image.size())
+    {
+        FlashSize *= 2;
+    }
+    std::vector<uint64_t>   Flash(FlashSize / sizeof(uint64_t), ~(uint64_t)0);
+    uint8_t*                pFlash = (uint8_t*)Flash.data();
+    memset(pFlash, 0, 4096);
+    memcpy(pFlash + 4096, Image.data(), Image.size());
+    LatencyRecorder SearchMount(Options.BuildOptions.Trailer ? "search mount (trailer)" : "search mount (scan)");
+    for (i = 0 ; i < std::min(Options.Iterations, 100U) ; i++)
+    {
+        SearchMount.Start();
+        const uint8_t*      pFound = FlashFileSystem::FindImage(pFlash, pFlash + FlashSize);
+        FlashFileSystem*    pFileSystem = new FlashFileSystem("flash", pFound);
+        SearchMount.Stop();
+        if (pFound != pFlash + 4096 || !pFileSystem->IsMounted())
+        {
+            fprintf(stderr, "error: Failed to find the image in the simulated FLASH.\n");
+            return 1;
+        }
+        delete pFileSystem;
+    }
+    SearchMount.Report();
+    Flash.clear();
+    Flash.shrink_to_fit();
+
+    FlashFileSystem FileSystem("flash", pImage);
+    if (!FileSystem.IsMounted())
+    {
+        fprintf(stderr, "error: Failed to mount the image.\n");
+        return 1;
+    }
+    if (FileSystem.GetPayloadAlignment() != PayloadAlignment)
+    {
+        fprintf(stderr, "error: The mounted image reports a payload alignment of %u.\n", FileSystem.GetPayloadAlignment());
+        return 1;
+    }
+
+    // Record the single threaded benchmarks into a 64MB ring, which keeps
+    // the most recent calls if they don't all fit.
+    std::vector<uint64_t>   TraceRing(Options.pTraceFilename ? (64 * 1024 * 1024) / sizeof(uint64_t) : 0);
+    if (Options.pTraceFilename && FileSystem.EnableAccessTrace(TraceRing.data(), TraceRing.size() * sizeof(uint64_t)))
+    {
+        fprintf(stderr, "error: Failed to enable the access trace.\n");
+        return 1;
+    }
+
+    // open() of existing files, followed by open() of files which don't
+    // exist.
+    LatencyRecorder OpenHit("open hit");
+    for (i = 0 ; i < Options.Iterations ; i++)
+    {
+        const std::string&  Name = Filenames[Random() % Filenames.size()];
+        FileHandle*         pFile = NULL;
+        int                 Result;
+
+        OpenHit.Start();
+        Result = FileSystem.open(&pFile, Name.c_str(), O_RDONLY);
+        OpenHit.Stop();
+        if (Result)
+        {
+            fprintf(stderr, "error: Failed to open '%s' (%d).\n", Name.c_str(), Result);
+            return 1;
+        }
+        pFile->close();
+    }
+    OpenHit.Report();
+
+    LatencyRecorder OpenMiss("open miss");
+    for (i = 0 ; i < Options.Iterations ; i++)
+    {
+        std::string Name = Filenames[Random() % Filenames.size()] + "x";
+        FileHandle* pFile = NULL;
+
+        OpenMiss.Start();
+        FileSystem.open(&pFile, Name.c_str(), O_RDONLY);
+        OpenMiss.Stop();
+    }
+    OpenMiss.Report();
+
+    // stat() of existing files, which is what a web server does to find the
+    // Content-Length of a response.
+    LatencyRecorder StatHit("stat hit");
+    for (i = 0 ; i < Options.Iterations ; i++)
+    {
+        const std::string&  Name = Filenames[Random() % Filenames.size()];
+        struct stat         Stat;
+        int                 Result;
+
+        StatHit.Start();
+        Result = FileSystem.stat(Name.c_str(), &Stat);
+        StatHit.Stop();
+        if (Result || !S_ISREG(Stat.st_mode))
+        {
+            fprintf(stderr, "error: Failed to stat '%s' (%d).\n", Name.c_str(), Result);
+            return 1;
+        }
+    }
+    StatHit.Report();
+
+    // OpenPreferringEncoding() of files with a gzip variant, like a web server
+    // answering a request which accepts gzip, followed by a zero-copy
+    // ReadDirect() of the whole variant.
+    LatencyRecorder OpenEncoded("open gzip variant");
+    for (i = 0 ; i < Options.Iterations && Options.EncodedVariants ; i++)
+    {
+        size_t          Index = Random() % Filenames.size();
+        FileHandle*     pFile = NULL;
+        const void*     pData = NULL;
+        unsigned int    Encoding = FFS_ENCODING_IDENTITY;
+        ssize_t         BytesRead = 0;
+        int             Result;
+
+        OpenEncoded.Start();
+        Result = FileSystem.OpenPreferringEncoding(&pFile, Filenames[Index].c_str(), 1 << FFS_ENCODING_GZIP, &Encoding);
+        if (0 == Result)
+        {
+            BytesRead = ((FlashFileSystemFileHandle*)pFile)->ReadDirect(&pData, VariantSizes[Index]);
+        }
+        OpenEncoded.Stop(BytesRead > 0 ? BytesRead : 0);
+        if (Result || FFS_ENCODING_GZIP != Encoding || BytesRead != (ssize_t)VariantSizes[Index])
+        {
+            fprintf(stderr, "error: Failed to open the gzip variant of '%s' (%d).\n", Filenames[Index].c_str(), Result);
+            return 1;
+        }
+        pFile->close();
+    }
+    OpenEncoded.Report();
+
+    // open() of files picked with a Zipf distribution so that a few hot files
+    // get most of the traffic, like the pages and scripts of a web server.
+    // With FFS_LOOKUP_CACHE_SIZE set these should mostly hit the cache.
+    std::vector<double>     ZipfWeights(Filenames.size());
+    std::vector<unsigned int> ZipfFiles(Filenames.size());
+    for (i = 0 ; i < Filenames.size() ; i++)
+    {
+        ZipfWeights[i] = 1.0 / pow(i + 1, Options.ZipfExponent);
+        ZipfFiles[i] = i;
+    }
+    std::shuffle(ZipfFiles.begin(), ZipfFiles.end(), Random);
+    std::discrete_distribution<unsigned int>    Zipf(ZipfWeights.begin(), ZipfWeights.end());
+    LatencyRecorder OpenZipf("open zipf");
+    uint32_t        CacheHits;
+    uint32_t        CacheMisses;
+    uint32_t        PrevCacheHits;
+    uint32_t        PrevCacheMisses;
+    FileSystem.GetLookupCacheStats(&PrevCacheHits, &PrevCacheMisses);
+    for (i = 0 ; i < Options.Iterations ; i++)
+    {
+        const std::string&  Name = Filenames[ZipfFiles[Zipf(Random)]];
+        FileHandle*         pFile = NULL;
+        int                 Result;
+
+        OpenZipf.Start();
+        Result = FileSystem.open(&pFile, Name.c_str(), O_RDONLY);
+        OpenZipf.Stop();
+        if (Result)
+        {
+            fprintf(stderr, "error: Failed to open '%s' (%d).\n", Name.c_str(), Result);
+            return 1;
+        }
+        pFile->close();
+    }
+    OpenZipf.Report();
+    FileSystem.GetLookupCacheStats(&CacheHits, &CacheMisses);
+    CacheHits -= PrevCacheHits;
+    CacheMisses -= PrevCacheMisses;
+    if (CacheHits + CacheMisses)
+    {
+        printf("%-28s %u hits, %u misses, %.1f%% hit ratio\n",
+               "lookup cache", CacheHits, CacheMisses,
+               100.0 * CacheHits / (CacheHits + CacheMisses));
+    }
+
+    // Full recursive enumeration of the tree.
+    LatencyRecorder Enumerate("recursive enumeration");
+    for (i = 0 ; i < std::max(1U, Options.Iterations / Options.FileCount) ; i++)
+    {
+        unsigned int    FileCount;
+
+        Enumerate.Start();
+        FileCount = _RecursiveDir(FileSystem, "");
+        Enumerate.Stop();
+        if (FileCount != Options.FileCount)
+        {
+            fprintf(stderr, "error: Enumerated %u of %u files.\n", FileCount, Options.FileCount);
+            return 1;
+        }
+    }
+    Enumerate.Report();
+
+    // Listing just the root directory, which has to step over every file
+    // below it unless the image has a directory tree.
+    LatencyRecorder ListRoot("list root directory");
+    for (i = 0 ; i < std::max(1U, Options.Iterations / 100) ; i++)
+    {
+        DirHandle*      pDirectory = NULL;
+        struct dirent   DirEntry;
+
+        ListRoot.Start();
+        FileSystem.open(&pDirectory, "");
+        while (pDirectory->read(&DirEntry) > 0)
+        {
+        }
+        pDirectory->close();
+        ListRoot.Stop();
+    }
+    ListRoot.Report();
+
+    // The same full enumeration through FindFirst()/FindNext(), which walks
+    // the sorted entry table without opening any directories.
+    LatencyRecorder FindAll("FindNext() all files");
+    for (i = 0 ; i < std::max(1U, Options.Iterations / Options.FileCount) ; i++)
+    {
+        FlashFileSystemFind         Find;
+        SFlashFileSystemFindData    File;
+        unsigned int                FileCount = 0;
+
+        FindAll.Start();
+        FileSystem.FindFirst(&Find, "");
+        while (FileSystem.FindNext(&Find, &File) > 0)
+        {
+            FileCount++;
+        }
+        FindAll.Stop();
+        if (FileCount != Options.FileCount)
+        {
+            fprintf(stderr, "error: FindNext() returned %u of %u files.\n", FileCount, Options.FileCount);
+            return 1;
+        }
+    }
+    FindAll.Report();
+
+    // A glob over the files in one directory, like "static/js/*.js".
+    LatencyRecorder FindGlob("FindNext() glob");
+    for (i = 0 ; i < std::max(1U, Options.Iterations / 100) ; i++)
+    {
+        const std::string&          Name = Filenames[Random() % Filenames.size()];
+        std::string                 Directory = Name.substr(0, Name.rfind('/') + 1);
+        FlashFileSystemFind         Find;
+        SFlashFileSystemFindData    File;
+
+        FindGlob.Start();
+        FileSystem.FindFirst(&Find, Directory.c_str(), "f1*");
+        while (FileSystem.FindNext(&Find, &File) > 0)
+        {
+        }
+        FindGlob.Stop();
+    }
+    FindGlob.Report();
+    if (Options.BuildOptions.DirectoryTree)
+    {
+        SFlashFileSystemDirectoryTotals Totals;
+        uint64_t                        TotalSize = 0;
+
+        for (i = 0 ; i < Sizes.size() ; i++)
+        {
+            TotalSize += Sizes[i];
+        }
+        if (0 != FileSystem.GetDirectoryTotals("", &Totals) ||
+            Totals.FileCount != Options.FileCount ||
+            Totals.TotalSize != std::min<uint64_t>(TotalSize, 0xFFFFFFFF))
+        {
+            fprintf(stderr, "error: The directory totals don't match the files in the image.\n");
+            return 1;
+        }
+    }
+
+    // Sequential reads through whole files.
+    Buffer.resize(Options.ReadSize);
+    LatencyRecorder SequentialRead("sequential read()");
+    LatencyRecorder DirectRead("sequential ReadDirect()");
+    for (i = 0 ; i < Options.Iterations ; )
+    {
+        const std::string&  Name = Filenames[Random() % Filenames.size()];
+        FileHandle*         pFile = NULL;
+        ssize_t             BytesRead;
+
+        FileSystem.open(&pFile, Name.c_str(), O_RDONLY);
+        do
+        {
+            SequentialRead.Start();
+            BytesRead = pFile->read(Buffer.data(), Buffer.size());
+            SequentialRead.Stop(BytesRead > 0 ? BytesRead : 0);
+            i++;
+        } while (BytesRead > 0);
+
+        // Compressed files can't be accessed directly.
+        pFile->seek(0, SEEK_SET);
+        while (!Options.BuildOptions.Compress)
+        {
+            const void* pData;
+
+            DirectRead.Start();
+            BytesRead = ((FlashFileSystemFileHandle*)pFile)->ReadDirect(&pData, Buffer.size());
+            DirectRead.Stop(BytesRead > 0 ? BytesRead : 0);
+            if (BytesRead <= 0)
+            {
+                break;
+            }
+        }
+        pFile->close();
+    }
+    SequentialRead.Report();
+    DirectRead.Report();
+
+    // Random seek() and read() within files.
+    LatencyRecorder RandomRead("random seek()+read()");
+    for (i = 0 ; i < Options.Iterations ; i++)
+    {
+        const std::string&  Name = Filenames[Random() % Filenames.size()];
+        FileHandle*         pFile = NULL;
+        ssize_t             BytesRead;
+
+        FileSystem.open(&pFile, Name.c_str(), O_RDONLY);
+        RandomRead.Start();
+        pFile->seek(Random() % (pFile->size() + 1), SEEK_SET);
+        BytesRead = pFile->read(Buffer.data(), Buffer.size());
+        RandomRead.Stop(BytesRead > 0 ? BytesRead : 0);
+        pFile->close();
+    }
+    RandomRead.Report();
+
+    if (Options.DuplicatePercent &&
+        _CheckDuplicateReads(FileSystem, Filenames, AllContents, Sources, Options, Random))
+    {
+        fprintf(stderr, "error: Files which share their data interfered with each other.\n");
+        return 1;
+    }
+
+    // Full image verification, followed by the first open() of each file with
+    // verification enabled, which checks the file, and a second open(),
+    // which only looks at the bitmap.  The bitmap has to outlive FileSystem.
+    std::vector<uint32_t>   Bitmap(FileSystem.GetVerificationBitmapSize() / sizeof(uint32_t));
+    if (Options.BuildOptions.Checksums)
+    {
+        const SFlashFileSystemBuildStats&   Stats = Builder.GetStats();
+        uint64_t                            CheckedBytes = Stats.StoredBytes + Stats.DuplicateBytes +
+                                                           Options.FileCount * sizeof(SFileSystemEntry);
+        LatencyRecorder                     Verify("VerifyImage()");
+        LatencyRecorder                     OpenFirst("open verify first");
+        LatencyRecorder                     OpenAgain("open verify cached");
+        unsigned int                        BadFileCount = 0;
+        int                                 Result = 0;
+
+        for (i = 0 ; i < 10 && 0 == Result ; i++)
+        {
+            Verify.Start();
+            Result = FileSystem.VerifyImage(&BadFileCount);
+            Verify.Stop(CheckedBytes);
+        }
+        if (Result || FileSystem.EnableVerification(Bitmap.data(), Bitmap.size() * sizeof(uint32_t)))
+        {
+            fprintf(stderr, "error: Image failed verification (%d, %u bad files).\n", Result, BadFileCount);
+            return 1;
+        }
+        Verify.Report();
+        for (i = 0 ; i < 2 * Filenames.size() ; i++)
+        {
+            LatencyRecorder&    Recorder = (i < Filenames.size()) ? OpenFirst : OpenAgain;
+            FileHandle*         pFile = NULL;
+
+            Recorder.Start();
+            Result = FileSystem.open(&pFile, Filenames[i % Filenames.size()].c_str(), O_RDONLY);
+            Recorder.Stop();
+            if (Result)
+            {
+                fprintf(stderr, "error: Failed to open '%s' with verification (%d).\n", Filenames[i % Filenames.size()].c_str(), Result);
+                return 1;
+            }
+            pFile->close();
+        }
+        OpenFirst.Report();
+        OpenAgain.Report();
+    }
+
+    if (Options.OverlayPercent && _BenchOverlay(pImage, Filenames, Options, Random))
+    {
+        return 1;
+    }
+#if FFS_BLOCK_DEVICE
+    if (Options.BlockDevice && _BenchBlockDevice(Image, Filenames, Sizes, Options, Random))
+    {
+        return 1;
+    }
+#endif
+
+    if (Options.pTraceFilename)
+    {
+        std::vector<uint8_t>    Trace(TraceRing.size() * sizeof(uint64_t) + sizeof(SFileSystemAccessTraceHeader));
+        size_t                  TraceSize;
+
+        FileSystem.DisableAccessTrace();
+        TraceSize = FileSystem.CopyAccessTrace(Trace.data(), Trace.size());
+        if (_WriteFile(Options.pTraceFilename, Trace.data(), TraceSize))
+        {
+            return 1;
+        }
+        printf("%-24s %9lu bytes saved to '%s'\n", "access trace", (unsigned long)TraceSize, Options.pTraceFilename);
+    }
+
+    // Concurrent open()/read()/close() on the shared handle tables, doubling
+    // the thread count each time.
+    printf("\n");
+    for (i = 1 ; i <= Options.MaxThreads ; i *= 2)
+    {
+        if (_ConcurrentOpenReadClose(FileSystem, Filenames, AllContents, Options, i))
+        {
+            fprintf(stderr, "error: Concurrent readers got the wrong data.\n");
+            return 1;
+        }
+    }
+
+    // Concurrent positional reads through a single handle on the largest
+    // file.
+    {
+        size_t      Largest = std::max_element(Sizes.begin(), Sizes.end()) - Sizes.begin();
+        FileHandle* pFile = NULL;
+
+        FileSystem.open(&pFile, Filenames[Largest].c_str(), O_RDONLY);
+        Buffer.resize(Sizes[Largest]);
+        if ((ssize_t)Buffer.size() != pFile->read(Buffer.data(), Buffer.size()))
+        {
+            fprintf(stderr, "error: Failed to read '%s'.\n", Filenames[Largest].c_str());
+            return 1;
+        }
+        printf("\n");
+        for (i = 1 ; i <= Options.MaxThreads ; i *= 2)
+        {
+            if (_ConcurrentReadAt((FlashFileSystemFileHandle*)pFile, Buffer, Options, i))
+            {
+                fprintf(stderr, "error: Positional reads through a shared handle got the wrong data.\n");
+                return 1;
+            }
+        }
+        pFile->close();
+    }
+    if (Options.CopySweep && _BenchCopy())
+    {
+        fprintf(stderr, "error: A copy didn't match its source.\n");
+        return 1;
+    }
+#if FFS_STATS
+    _ReportStats(FileSystem);
+#endif
+
+    return 0;
+}
@@ -0,0 +1,1131 @@
+/* Copyright 2011 Adam Green (http://mbed.org/users/AdamGreen/)
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+/* Host side library which builds FLASH File System images using the layout
+   described in ffsformat.h.
+*/
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <thread>
+#include <unordered_map>
+#include "FlashFileSystemBuilder.h"
+#include "../../ffsformat.h"
+#include "../../ffscrc32c.h"
+
+
+// LZ4 block format constants.
+#define LZ4_MIN_MATCH       4
+#define LZ4_LAST_LITERALS   5
+#define LZ4_MATCH_LIMIT     12
+#define LZ4_MAX_OFFSET      65535
+#define LZ4_HASH_BITS       12
+
+// Files smaller than this aren't worth the compressed file header overhead.
+#define MIN_COMPRESS_SIZE   64
+
+
+
+/* Internal routine which appends a LZ4 length that didn't fit in its 4-bit
+   token nibble.
+*/
+static void _AppendExtendedLength(std::vector<uint8_t>& Dest, size_t Length)
+{
+    while (Length >= 255)
+    {
+        Dest.push_back(255);
+        Length -= 255;
+    }
+    Dest.push_back((uint8_t)Length);
+}
+
+
+/* Internal routine which appends a LZ4 sequence made up of literals and an
+   optional match.
+*/
+static void _AppendSequence(std::vector<uint8_t>& Dest,
+                            const uint8_t*        pLiterals,
+                            size_t                LiteralLength,
+                            size_t                Offset,
+                            size_t                MatchLength)
+{
+    size_t  MatchCode = MatchLength ? MatchLength - LZ4_MIN_MATCH : 0;
+    uint8_t Token = (uint8_t)((std::min<size_t>(LiteralLength, 15) << 4) | std::min<size_t>(MatchCode, 15));
+
+    Dest.push_back(Token);
+    if (LiteralLength >= 15)
+    {
+        _AppendExtendedLength(Dest, LiteralLength - 15);
+    }
+    Dest.insert(Dest.end(), pLiterals, pLiterals + LiteralLength);
+    if (0 == MatchLength)
+    {
+        return;
+    }
+    Dest.push_back((uint8_t)(Offset & 0xFF));
+    Dest.push_back((uint8_t)(Offset >> 8));
+    if (MatchCode >= 15)
+    {
+        _AppendExtendedLength(Dest, MatchCode - 15);
+    }
+}
+
+
+/* Compresses a single block into the LZ4 block format with a greedy single
+   probe hash table match finder.  It follows the end of block rules of the
+   LZ4 format so the output can be decoded by any LZ4 decoder.
+
+   Parameters:
+    pSource is the data to be compressed.
+    SourceLength is the length of the data to be compressed.
+    Dest is the vector to which the compressed block is written.
+
+   Returns:
+    The size of the compressed block.
+*/
+size_t FlashFileSystemLZ4Compress(const uint8_t* pSource, size_t SourceLength, std::vector<uint8_t>& Dest)
+{
+    std::vector<uint32_t>   HashTable(1 << LZ4_HASH_BITS, 0xFFFFFFFF);
+    size_t                  Anchor = 0;
+    size_t                  Curr = 0;
+
+    Dest.clear();
+    while (SourceLength > LZ4_MATCH_LIMIT && Curr < SourceLength - LZ4_MATCH_LIMIT)
+    {
+        uint32_t    Sequence;
+        uint32_t    Hash;
+        uint32_t    Candidate;
+
+        memcpy(&Sequence, pSource + Curr, sizeof(Sequence));
+        Hash = (Sequence * 2654435761U) >> (32 - LZ4_HASH_BITS);
+        Candidate = HashTable[Hash];
+        HashTable[Hash] = (uint32_t)Curr;
+        if (0xFFFFFFFF == Candidate ||
+            Curr - Candidate > LZ4_MAX_OFFSET ||
+            0 != memcmp(pSource + Candidate, pSource + Curr, LZ4_MIN_MATCH))
+        {
+            Curr++;
+            continue;
+        }
+
+        // Extend the match as far as the last literals rule allows.
+        size_t  MatchLength = LZ4_MIN_MATCH;
+        while (Curr + MatchLength < SourceLength - LZ4_LAST_LITERALS &&
+               pSource[Candidate + MatchLength] == pSource[Curr + MatchLength])
+        {
+            MatchLength++;
+        }
+
+        _AppendSequence(Dest, pSource + Anchor, Curr - Anchor, Curr - Candidate, MatchLength);
+        Curr += MatchLength;
+        Anchor = Curr;
+    }
+
+    // The block always ends with a literal only sequence.
+    _AppendSequence(Dest, pSource + Anchor, SourceLength - Anchor, 0, 0);
+
+    return Dest.size();
+}
+
+
+
+/* Internal routines which append little endian values to the image. */
+static void _Put32(std::vector<uint8_t>& Image, size_t Offset, uint32_t Value)
+{
+    Image[Offset + 0] = (uint8_t)(Value >> 0);
+    Image[Offset + 1] = (uint8_t)(Value >> 8);
+    Image[Offset + 2] = (uint8_t)(Value >> 16);
+    Image[Offset + 3] = (uint8_t)(Value >> 24);
+}
+
+static void _Put64(std::vector<uint8_t>& Image, size_t Offset, uint64_t Value)
+{
+    _Put32(Image, Offset, (uint32_t)Value);
+    _Put32(Image, Offset + 4, (uint32_t)(Value >> 32));
+}
+
+static void _Append32(std::vector<uint8_t>& Data, uint32_t Value)
+{
+    Data.resize(Data.size() + sizeof(Value));
+    _Put32(Data, Data.size() - sizeof(Value), Value);
+}
+
+
+/* Internal routine which rounds an offset up to the next 4-byte boundary. */
+static size_t _Align4(size_t Offset)
+{
+    return (Offset + 3) & ~(size_t)3;
+}
+
+
+/* Internal routine which rounds an offset up to a power of 2 boundary. */
+static size_t _AlignTo(size_t Offset, size_t Alignment)
+{
+    return (Offset + Alignment - 1) & ~(Alignment - 1);
+}
+
+
+
+/* Constructor for FlashFileSystemBuilder.
+
+   Parameters:
+    Options controls the layout of the images created by Build().
+*/
+FlashFileSystemBuilder::FlashFileSystemBuilder(const SFlashFileSystemBuildOptions& Options)
+{
+    m_Options = Options;
+    memset(&m_Stats, 0, sizeof(m_Stats));
+}
+
+
+/* Adds a file to the image from a memory buffer.
+
+   Parameters:
+    pFilename is the name of the file within the image, using '/' to separate
+        directories.  A leading slash is removed.
+    pData is the contents of the file.
+    Size is the length of the file.
+
+   Returns:
+    0 on success or a negative error code on failure.
+*/
+int FlashFileSystemBuilder::AddFile(const char* pFilename, const void* pData, size_t Size)
+{
+    int Result;
+
+    if ('/' == pFilename[0])
+    {
+        pFilename++;
+    }
+    Result = ValidateFilename(pFilename);
+    if (Result)
+    {
+        return Result;
+    }
+
+    m_Files.push_back(SFile());
+    SFile&  File = m_Files.back();
+    File.Name = pFilename;
+    File.Data.assign((const uint8_t*)pData, (const uint8_t*)pData + Size);
+    File.Compressed = false;
+    File.Encoding = FFS_ENCODING_IDENTITY;
+    File.Error = 0;
+
+    return 0;
+}
+
+
+/* Adds a precompressed variant of a file, such as its gzip encoded form,
+   which the runtime can hand out instead of the file itself through
+   FlashFileSystem::OpenPreferringEncoding().  The file must also be added
+   before Build() is called.
+
+   Parameters:
+    pFilename is the name of the file which this is a variant of.
+    Encoding is one of the FFS_ENCODING_* values other than
+        FFS_ENCODING_IDENTITY.
+    pData is the encoded contents of the file.
+    Size is the length of the encoded contents.
+
+   Returns:
+    0 on success or a negative error code on failure.
+*/
+int FlashFileSystemBuilder::AddEncodedVariant(const char* pFilename, unsigned int Encoding, const void* pData, size_t Size)
+{
+    int Result;
+
+    if ('/' == pFilename[0])
+    {
+        pFilename++;
+    }
+    Result = ValidateFilename(pFilename);
+    if (Result)
+    {
+        return Result;
+    }
+    if (FFS_ENCODING_IDENTITY == Encoding || Encoding >= 32)
+    {
+        return SetError(-EINVAL, "%u isn't a valid encoding for a variant of '%s'.", Encoding, pFilename);
+    }
+
+    m_Variants.push_back(SFile());
+    SFile&  Variant = m_Variants.back();
+    Variant.Name = pFilename;
+    Variant.Data.assign((const uint8_t*)pData, (const uint8_t*)pData + Size);
+    Variant.Compressed = false;
+    Variant.Encoding = Encoding;
+    Variant.Error = 0;
+
+    return 0;
+}
+
+
+/* Adds a file to the image from the host's file system.  The file isn't read
+   until Build() is called so that it can be loaded in parallel with other
+   files.
+
+   Parameters:
+    pFilename is the name of the file within the image.
+    pSourcePath is the path of the file on the host.
+
+   Returns:
+    0 on success or a negative error code on failure.
+*/
+int FlashFileSystemBuilder::AddFileFromDisk(const char* pFilename, const char* pSourcePath)
+{
+    int Result;
+
+    if ('/' == pFilename[0])
+    {
+        pFilename++;
+    }
+    Result = ValidateFilename(pFilename);
+    if (Result)
+    {
+        return Result;
+    }
+
+    m_Files.push_back(SFile());
+    SFile&  File = m_Files.back();
+    File.Name = pFilename;
+    File.SourcePath = pSourcePath;
+    File.Compressed = false;
+    File.Encoding = FFS_ENCODING_IDENTITY;
+    File.Error = 0;
+
+    return 0;
+}
+
+
+/* Recursively adds all of the files found in a host directory.  Their names
+   in the image are relative to pSourceDirectory.
+
+   Parameters:
+    pSourceDirectory is the directory on the host to be added.
+
+   Returns:
+    0 on success or a negative error code on failure.
+*/
+int FlashFileSystemBuilder::AddDirectory(const char* pSourceDirectory)
+{
+    namespace fs = std::filesystem;
+    std::error_code Error;
+    fs::path        Root(pSourceDirectory);
+
+    fs::recursive_directory_iterator    Iterator(Root, fs::directory_options::follow_directory_symlink, Error);
+    if (Error)
+    {
+        return SetError(-ENOENT, "Failed to open directory '%s': %s", pSourceDirectory, Error.message().c_str());
+    }
+    for (const fs::directory_entry& Entry : Iterator)
+    {
+        if (!Entry.is_regular_file())
+        {
+            continue;
+        }
+
+        std::string Name = Entry.path().lexically_relative(Root).generic_string();
+        int         Result = AddFileFromDisk(Name.c_str(), Entry.path().string().c_str());
+        if (Result)
+        {
+            return Result;
+        }
+    }
+
+    return 0;
+}
+
+
+/* Builds the image from the files which have been added.  Files are loaded
+   and compressed in parallel but the layout only depends on the sorted
+   filenames so the output is reproducible.
+
+   The layout of a version 2 image is:
+    SFileSystemHeaderV2
+    SFileSystemSection[SectionCount]
+    SFileSystemEntry[FileCount]
+    Optional sections
+    Filenames
+    File data, each aligned to PayloadAlignment (4 bytes by default).  Files
+     with identical contents share one copy.
+    Encoded variant data, each aligned to PayloadAlignment
+    Optional SFileSystemTrailer
+
+   Version 3 images use SFileSystemHeaderV3, SFileSystemSectionV3 and
+   SFileSystemEntryV3 instead and align their sections to 8 bytes.  They
+   only get a trailer when they are small enough for its 32-bit offset.
+
+   Parameters:
+    Image is filled in with the image contents.
+
+   Returns:
+    0 on success or a negative error code on failure.
+*/
+int FlashFileSystemBuilder::Build(std::vector<uint8_t>& Image)
+{
+    std::vector<std::pair<uint32_t, std::vector<uint8_t> > > Sections;
+    size_t          FileCount = m_Files.size();
+    bool            Version3 = m_Options.Version3;
+    size_t          EntrySize = Version3 ? sizeof(SFileSystemEntryV3) : sizeof(SFileSystemEntry);
+    size_t          SectionAlignment = Version3 ? 8 : 4;
+    size_t          HeaderSize;
+    size_t          Offset;
+    size_t          i;
+
+    memset(&m_Stats, 0, sizeof(m_Stats));
+    Image.clear();
+    if (0 == FileCount)
+    {
+        return SetError(-EINVAL, "The image must contain at least one file.");
+    }
+    if (!m_Options.Version2 &&
+        (m_Options.HashIndex || m_Options.Compress || m_Options.FrontCodedNames ||
+         m_Options.EncodedVariants || !m_Variants.empty() || m_Options.Checksums || m_Options.DirectoryTree ||
+         m_Options.PayloadAlignment > 4))
+    {
+        return SetError(-EINVAL, "Hash indexes, compression, front coded names, encoded variants, checksums, "
+                                 "directory trees and payload alignments above 4 require a version 2 image.");
+    }
+    if (!m_Options.Version2 && Version3)
+    {
+        return SetError(-EINVAL, "An image can't be both version 1 and version 3.");
+    }
+    if (m_Options.PayloadAlignment < 4 || (m_Options.PayloadAlignment & (m_Options.PayloadAlignment - 1)))
+    {
+        return SetError(-EINVAL, "The payload alignment must be a power of 2 of at least 4.");
+    }
+    if (m_Options.FrontCodedNames && 0 == m_Options.RestartInterval)
+    {
+        return SetError(-EINVAL, "The front coding restart interval can't be 0.");
+    }
+    if (m_Options.Compress && 0 == m_Options.BlockSize)
+    {
+        return SetError(-EINVAL, "The compression block size can't be 0.");
+    }
+
+    // The runtime binary searches the entries so they must be in strcmp()
+    // order.
+    std::sort(m_Files.begin(), m_Files.end(),
+              [](const SFile& A, const SFile& B) { return A.Name < B.Name; });
+    for (i = 1 ; i < FileCount ; i++)
+    {
+        if (m_Files[i - 1].Name == m_Files[i].Name)
+        {
+            return SetError(-EEXIST, "The file '%s' was added more than once.", m_Files[i].Name.c_str());
+        }
+    }
+
+    if (m_Options.EncodedVariants)
+    {
+        SplitEncodedVariants();
+        FileCount = m_Files.size();
+    }
+
+    ProcessFiles(m_Files);
+    ProcessFiles(m_Variants);
+    for (i = 0 ; i < FileCount ; i++)
+    {
+        if (m_Files[i].Error)
+        {
+            return SetError(m_Files[i].Error, "Failed to read '%s'.", m_Files[i].SourcePath.c_str());
+        }
+    }
+    for (i = 0 ; i < m_Variants.size() ; i++)
+    {
+        SFile&  Variant = m_Variants[i];
+        auto    Match = std::lower_bound(m_Files.begin(), m_Files.end(), Variant.Name,
+                                         [](const SFile& File, const std::string& Name) { return File.Name < Name; });
+
+        if (Variant.Error)
+        {
+            return SetError(Variant.Error, "Failed to read '%s'.", Variant.SourcePath.c_str());
+        }
+        if (Match == m_Files.end() || Match->Name != Variant.Name)
+        {
+            return SetError(-ENOENT, "The encoded variant of '%s' has no matching file.", Variant.Name.c_str());
+        }
+        Variant.FileIndex = (uint32_t)(Match - m_Files.begin());
+    }
+    std::sort(m_Variants.begin(), m_Variants.end(),
+              [](const SFile& A, const SFile& B)
+              { return A.FileIndex < B.FileIndex || (A.FileIndex == B.FileIndex && A.Encoding < B.Encoding); });
+    for (i = 1 ; i < m_Variants.size() ; i++)
+    {
+        if (m_Variants[i - 1].FileIndex == m_Variants[i].FileIndex && m_Variants[i - 1].Encoding == m_Variants[i].Encoding)
+        {
+            return SetError(-EEXIST, "'%s' has more than one variant with the same encoding.", m_Variants[i].Name.c_str());
+        }
+    }
+
+    // Build the optional sections.
+    if (m_Options.HashIndex)
+    {
+        std::vector<uint8_t>    Section;
+        uint32_t                SlotCount = 1;
+
+        // Keep the load factor at or below 50% so that probe sequences stay
+        // short.
+        while (SlotCount <= 2 * FileCount)
+        {
+            SlotCount <<= 1;
+        }
+        std::vector<uint32_t>   Slots(2 * SlotCount, FFS_HASH_SLOT_EMPTY);
+        for (i = 0 ; i < FileCount ; i++)
+        {
+            uint32_t    Slot = m_Files[i].NameHash & (SlotCount - 1);
+
+            while (FFS_HASH_SLOT_EMPTY != Slots[2 * Slot + 1])
+            {
+                Slot = (Slot + 1) & (SlotCount - 1);
+            }
+            Slots[2 * Slot] = m_Files[i].NameHash;
+            Slots[2 * Slot + 1] = (uint32_t)i;
+        }
+        _Append32(Section, SlotCount);
+        for (i = 0 ; i < Slots.size() ; i++)
+        {
+            _Append32(Section, Slots[i]);
+        }
+        Sections.push_back(std::make_pair((uint32_t)FFS_SECTION_HASH_INDEX, Section));
+    }
+    if (m_Options.Compress)
+    {
+        std::vector<uint8_t>    Section(FileCount);
+
+        for (i = 0 ; i < FileCount ; i++)
+        {
+            Section[i] = m_Files[i].Compressed ? FFS_ENTRY_FLAG_COMPRESSED : 0;
+        }
+        Sections.push_back(std::make_pair((uint32_t)FFS_SECTION_ENTRY_FLAGS, Section));
+    }
+    std::vector<uint32_t>   NameRecordOffsets;
+    size_t                  NameSection = Sections.size();
+    if (m_Options.FrontCodedNames)
+    {
+        std::vector<uint8_t>    Section;
+
+        // Every record holds the length of the prefix shared with the
+        // previous name, even at restart points where the whole name is
+        // stored, so that the runtime can skip sub-trees without decoding.
+        _Append32(Section, m_Options.RestartInterval);
+        for (i = 0 ; i < FileCount ; i++)
+        {
+            const std::string&  Name = m_Files[i].Name;
+            size_t              Shared = 0;
+            size_t              Start;
+
+            if (i > 0)
+            {
+                const std::string&  Prev = m_Files[i - 1].Name;
+
+                while (Shared < Prev.size() && Shared < Name.size() && Prev[Shared] == Name[Shared])
+                {
+                    Shared++;
+                }
+            }
+            Start = (0 == i % m_Options.RestartInterval) ? 0 : Shared;
+            NameRecordOffsets.push_back((uint32_t)Section.size());
+            do
+            {
+                Section.push_back((uint8_t)((Shared & 0x7F) | (Shared > 0x7F ? 0x80 : 0)));
+                Shared >>= 7;
+            } while (Shared);
+            Section.insert(Section.end(), Name.begin() + Start, Name.end());
+            Section.push_back(0);
+        }
+        Sections.push_back(std::make_pair((uint32_t)FFS_SECTION_FRONT_CODED_NAMES, Section));
+    }
+
+    size_t                  VariantSection = Sections.size();
+    if (!m_Variants.empty())
+    {
+        // The records are filled in once the data has been laid out.  Those
+        // of version 3 images are padded to 8-byte alignment.
+        std::vector<uint8_t>    Section(Version3 ? sizeof(uint64_t) + m_Variants.size() * sizeof(SFileSystemEncodedVariantV3) :
+                                                   sizeof(SFileSystemEncodedVariants) + m_Variants.size() * sizeof(SFileSystemEncodedVariant));
+
+        _Put32(Section, offsetof(SFileSystemEncodedVariants, VariantCount), (uint32_t)m_Variants.size());
+        Sections.push_back(std::make_pair((uint32_t)FFS_SECTION_ENCODED_VARIANTS, Section));
+    }
+
+    size_t                  ChecksumSection = Sections.size();
+    if (m_Options.Checksums)
+    {
+        // The checksums are filled in once the entries have been written.
+        std::vector<uint8_t>    Section(sizeof(SFileSystemChecksums) + (FileCount + m_Variants.size()) * sizeof(uint32_t));
+
+        _Put32(Section, offsetof(SFileSystemChecksums, Algorithm), FFS_CHECKSUM_CRC32C);
+        Sections.push_back(std::make_pair((uint32_t)FFS_SECTION_FILE_CHECKSUMS, Section));
+    }
+    if (m_Options.DirectoryTree)
+    {
+        std::vector<uint8_t>    Section;
+
+        BuildDirectoryTree(Section);
+        Sections.push_back(std::make_pair((uint32_t)FFS_SECTION_DIRECTORY_TREE, Section));
+    }
+    if (m_Options.PayloadAlignment > 4)
+    {
+        std::vector<uint8_t>    Section;
+
+        _Append32(Section, m_Options.PayloadAlignment);
+        Sections.push_back(std::make_pair((uint32_t)FFS_SECTION_PAYLOAD_ALIGNMENT, Section));
+    }
+
+    // Lay out the image.
+    if (Version3)
+    {
+        HeaderSize = sizeof(SFileSystemHeaderV3) + Sections.size() * sizeof(SFileSystemSectionV3);
+    }
+    else if (m_Options.Version2)
+    {
+        HeaderSize = sizeof(SFileSystemHeaderV2) + Sections.size() * sizeof(SFileSystemSection);
+    }
+    else
+    {
+        HeaderSize = sizeof(SFileSystemHeader);
+    }
+    Offset = HeaderSize + FileCount * EntrySize;
+    std::vector<size_t> SectionOffsets(Sections.size());
+    for (i = 0 ; i < Sections.size() ; i++)
+    {
+        SectionOffsets[i] = Offset;
+        Offset = _AlignTo(Offset + Sections[i].second.size(), SectionAlignment);
+    }
+    for (i = 0 ; i < FileCount ; i++)
+    {
+        if (m_Options.FrontCodedNames)
+        {
+            m_Files[i].FilenameOffset = SectionOffsets[NameSection] + NameRecordOffsets[i];
+            continue;
+        }
+        m_Files[i].FilenameOffset = Offset;
+        Offset += m_Files[i].Name.size() + 1;
+        m_Stats.NameBytes += m_Files[i].Name.size() + 1;
+    }
+    if (m_Options.FrontCodedNames)
+    {
+        m_Stats.NameBytes = Sections[NameSection].second.size();
+    }
+
+    // Files whose stored contents match an earlier file share its data.
+    // The runtime never assumes that entries own their data so each entry
+    // still opens as an independent file.  Encoded variants follow the
+    // files.
+    std::unordered_multimap<uint64_t, const SFile*> StoredFiles;
+    std::vector<SFile*>                             DataOrder;
+    for (i = 0 ; i < FileCount ; i++)
+    {
+        DataOrder.push_back(&m_Files[i]);
+    }
+    for (i = 0 ; i < m_Variants.size() ; i++)
+    {
+        DataOrder.push_back(&m_Variants[i]);
+    }
+    for (i = 0 ; i < DataOrder.size() ; i++)
+    {
+        SFile&  File = *DataOrder[i];
+
+        File.Duplicate = false;
+        if (m_Options.Deduplicate)
+        {
+            auto    Range = StoredFiles.equal_range(File.ContentHash);
+            auto    Match = Range.first;
+
+            while (Match != Range.second && Match->second->Stored != File.Stored)
+            {
+                ++Match;
+            }
+            if (Match != Range.second)
+            {
+                File.DataOffset = Match->second->DataOffset;
+                File.Duplicate = true;
+                m_Stats.DuplicateFileCount++;
+                m_Stats.DuplicateBytes += File.Stored.size();
+                continue;
+            }
+            StoredFiles.insert(std::make_pair(File.ContentHash, &File));
+        }
+        Offset = _AlignTo(Offset, m_Options.PayloadAlignment);
+        File.DataOffset = Offset;
+        Offset += File.Stored.size();
+    }
+    Offset = _Align4(Offset);
+    if (!Version3 && Offset > 0xFFFFFFFF - sizeof(SFileSystemTrailer))
+    {
+        return SetError(-EFBIG, "The image is larger than 4GB.  Build a version 3 image instead.");
+    }
+
+    // Write the image.
+    Image.assign(Offset, 0);
+    if (Version3)
+    {
+        memcpy(&Image[0], FILE_SYSTEM_SIGNATURE_V3, sizeof(((SFileSystemHeaderV3*)0)->FileSystemSignature));
+        _Put32(Image, offsetof(SFileSystemHeaderV3, FileCount), (uint32_t)FileCount);
+        _Put32(Image, offsetof(SFileSystemHeaderV3, Version), FILE_SYSTEM_VERSION_3);
+        _Put64(Image, offsetof(SFileSystemHeaderV3, FileEntriesOffset), HeaderSize);
+        _Put64(Image, offsetof(SFileSystemHeaderV3, ImageSize), Offset);
+        _Put32(Image, offsetof(SFileSystemHeaderV3, SectionCount), (uint32_t)Sections.size());
+        for (i = 0 ; i < Sections.size() ; i++)
+        {
+            size_t  SectionHeader = sizeof(SFileSystemHeaderV3) + i * sizeof(SFileSystemSectionV3);
+
+            _Put32(Image, SectionHeader + offsetof(SFileSystemSectionV3, Type), Sections[i].first);
+            _Put64(Image, SectionHeader + offsetof(SFileSystemSectionV3, Offset), SectionOffsets[i]);
+            _Put64(Image, SectionHeader + offsetof(SFileSystemSectionV3, Size), Sections[i].second.size());
+            std::copy(Sections[i].second.begin(), Sections[i].second.end(), Image.begin() + SectionOffsets[i]);
+        }
+    }
+    else if (m_Options.Version2)
+    {
+        memcpy(&Image[0], FILE_SYSTEM_SIGNATURE_V2, sizeof(((SFileSystemHeaderV2*)0)->FileSystemSignature));
+        _Put32(Image, offsetof(SFileSystemHeaderV2, FileCount), (uint32_t)FileCount);
+        _Put32(Image, offsetof(SFileSystemHeaderV2, Version), FILE_SYSTEM_VERSION_2);
+        _Put32(Image, offsetof(SFileSystemHeaderV2, FileEntriesOffset), (uint32_t)HeaderSize);
+        _Put32(Image, offsetof(SFileSystemHeaderV2, ImageSize), (uint32_t)Offset);
+        _Put32(Image, offsetof(SFileSystemHeaderV2, SectionCount), (uint32_t)Sections.size());
+        for (i = 0 ; i < Sections.size() ; i++)
+        {
+            size_t  SectionHeader = sizeof(SFileSystemHeaderV2) + i * sizeof(SFileSystemSection);
+
+            _Put32(Image, SectionHeader + offsetof(SFileSystemSection, Type), Sections[i].first);
+            _Put32(Image, SectionHeader + offsetof(SFileSystemSection, Offset), (uint32_t)SectionOffsets[i]);
+            _Put32(Image, SectionHeader + offsetof(SFileSystemSection, Size), (uint32_t)Sections[i].second.size());
+            std::copy(Sections[i].second.begin(), Sections[i].second.end(), Image.begin() + SectionOffsets[i]);
+        }
+    }
+    else
+    {
+        memcpy(&Image[0], FILE_SYSTEM_SIGNATURE, sizeof(((SFileSystemHeader*)0)->FileSystemSignature));
+        _Put32(Image, offsetof(SFileSystemHeader, FileCount), (uint32_t)FileCount);
+    }
+    for (i = 0 ; i < FileCount ; i++)
+    {
+        const SFile&    File = m_Files[i];
+        size_t          Entry = HeaderSize + i * EntrySize;
+
+        if (Version3)
+        {
+            _Put64(Image, Entry + offsetof(SFileSystemEntryV3, FilenameOffset), File.FilenameOffset);
+            _Put64(Image, Entry + offsetof(SFileSystemEntryV3, FileBinaryOffset), File.DataOffset);
+            _Put64(Image, Entry + offsetof(SFileSystemEntryV3, FileBinarySize), File.Stored.size());
+        }
+        else
+        {
+            _Put32(Image, Entry + offsetof(SFileSystemEntry, FilenameOffset), (uint32_t)File.FilenameOffset);
+            _Put32(Image, Entry + offsetof(SFileSystemEntry, FileBinaryOffset), (uint32_t)File.DataOffset);
+            _Put32(Image, Entry + offsetof(SFileSystemEntry, FileBinarySize), (uint32_t)File.Stored.size());
+        }
+        if (!m_Options.FrontCodedNames)
+        {
+            memcpy(&Image[File.FilenameOffset], File.Name.c_str(), File.Name.size() + 1);
+        }
+        m_Stats.UncompressedBytes += File.Data.size();
+        if (File.Compressed)
+        {
+            m_Stats.CompressedFileCount++;
+        }
+        if (File.Duplicate)
+        {
+            continue;
+        }
+        std::copy(File.Stored.begin(), File.Stored.end(), Image.begin() + File.DataOffset);
+        m_Stats.StoredBytes += File.Stored.size();
+    }
+    for (i = 0 ; i < m_Variants.size() ; i++)
+    {
+        const SFile&    Variant = m_Variants[i];
+
+        if (Version3)
+        {
+            size_t  Record = SectionOffsets[VariantSection] + sizeof(uint64_t) + i * sizeof(SFileSystemEncodedVariantV3);
+
+            _Put32(Image, Record + offsetof(SFileSystemEncodedVariantV3, FileIndex), Variant.FileIndex);
+            _Put32(Image, Record + offsetof(SFileSystemEncodedVariantV3, Encoding), Variant.Encoding);
+            _Put64(Image, Record + offsetof(SFileSystemEncodedVariantV3, FileBinaryOffset), Variant.DataOffset);
+            _Put64(Image, Record + offsetof(SFileSystemEncodedVariantV3, FileBinarySize), Variant.Stored.size());
+        }
+        else
+        {
+            size_t  Record = SectionOffsets[VariantSection] + sizeof(SFileSystemEncodedVariants) +
+                             i * sizeof(SFileSystemEncodedVariant);
+
+            _Put32(Image, Record + offsetof(SFileSystemEncodedVariant, FileIndex), Variant.FileIndex);
+            _Put32(Image, Record + offsetof(SFileSystemEncodedVariant, Encoding), Variant.Encoding);
+            _Put32(Image, Record + offsetof(SFileSystemEncodedVariant, FileBinaryOffset), (uint32_t)Variant.DataOffset);
+            _Put32(Image, Record + offsetof(SFileSystemEncodedVariant, FileBinarySize), (uint32_t)Variant.Stored.size());
+        }
+        m_Stats.VariantBytes += Variant.Stored.size();
+        if (!Variant.Duplicate)
+        {
+            std::copy(Variant.Stored.begin(), Variant.Stored.end(), Image.begin() + Variant.DataOffset);
+        }
+    }
+    m_Stats.VariantCount = m_Variants.size();
+    if (m_Options.Checksums)
+    {
+        size_t  Checksums = SectionOffsets[ChecksumSection];
+
+        _Put32(Image, Checksums + offsetof(SFileSystemChecksums, EntryTableChecksum),
+               FFSCRC32C(0, &Image[HeaderSize], FileCount * EntrySize));
+        for (i = 0 ; i < FileCount ; i++)
+        {
+            _Put32(Image, Checksums + sizeof(SFileSystemChecksums) + i * sizeof(uint32_t),
+                   FFSCRC32C(0, m_Files[i].Stored.data(), m_Files[i].Stored.size()));
+        }
+        for (i = 0 ; i < m_Variants.size() ; i++)
+        {
+            _Put32(Image, Checksums + sizeof(SFileSystemChecksums) + (FileCount + i) * sizeof(uint32_t),
+                   FFSCRC32C(0, m_Variants[i].Stored.data(), m_Variants[i].Stored.size()));
+        }
+    }
+    if (m_Options.Trailer && Offset <= 0xFFFFFFFF - sizeof(SFileSystemTrailer))
+    {
+        Image.resize(Offset + sizeof(SFileSystemTrailer));
+        _Put32(Image, Offset + offsetof(SFileSystemTrailer, TrailerOffset), (uint32_t)Offset);
+        memcpy(&Image[Offset + offsetof(SFileSystemTrailer, TrailerSignature)],
+               FILE_SYSTEM_TRAILER_SIGNATURE,
+               sizeof(((SFileSystemTrailer*)0)->TrailerSignature));
+        if (Version3)
+        {
+            _Put64(Image, offsetof(SFileSystemHeaderV3, ImageSize), Image.size());
+        }
+        else if (m_Options.Version2)
+        {
+            _Put32(Image, offsetof(SFileSystemHeaderV2, ImageSize), (uint32_t)Image.size());
+        }
+    }
+    m_Stats.FileCount = FileCount;
+    m_Stats.ImageSize = Image.size();
+
+    return 0;
+}
+
+
+/* Protected method which builds the FFS_SECTION_DIRECTORY_TREE section from
+   the sorted files.  Each directory is given a record when its first file is
+   reached, which numbers parents before their children and siblings in name
+   order.  The directories which contain the previous file are kept on a
+   stack and closed once a file outside of them is reached.
+*/
+void FlashFileSystemBuilder::BuildDirectoryTree(std::vector<uint8_t>& Section)
+{
+    struct SDirectory
+    {
+        uint32_t    FirstEntry;
+        uint32_t    EndEntry;
+        uint32_t    Depth;
+        uint32_t    SubdirectoryCount;
+        uint64_t    TotalSize;
+        // Length of the directory's name, including its trailing slash.
+        size_t      NameLength;
+    };
+    std::vector<SDirectory> Directories;
+    std::vector<size_t>     Open;
+    size_t                  i;
+    size_t                  j;
+
+    Directories.push_back({ 0, (uint32_t)m_Files.size(), 0, 0, 0, 0 });
+    Open.push_back(0);
+    for (i = 0 ; i < m_Files.size() ; i++)
+    {
+        const std::string&  Name = m_Files[i].Name;
+        size_t              Slash;
+
+        // Close the directories which don't contain this file.  The root
+        // is never closed.
+        while (Open.size() > 1)
+        {
+            const SDirectory&   Top = Directories[Open.back()];
+
+            if (Name.size() > Top.NameLength && 0 == Name.compare(0, Top.NameLength, m_Files[Top.FirstEntry].Name, 0, Top.NameLength))
+            {
+                break;
+            }
+            Directories[Open.back()].EndEntry = (uint32_t)i;
+            Open.pop_back();
+        }
+
+        // Open the directories which start with this file.
+        for (Slash = Name.find('/', Directories[Open.back()].NameLength) ;
+             std::string::npos != Slash ;
+             Slash = Name.find('/', Slash + 1))
+        {
+            for (j = 0 ; j < Open.size() ; j++)
+            {
+                Directories[Open[j]].SubdirectoryCount++;
+            }
+            Directories.push_back({ (uint32_t)i, 0, (uint32_t)Open.size(), 0, 0, Slash + 1 });
+            Open.push_back(Directories.size() - 1);
+        }
+
+        for (j = 0 ; j < Open.size() ; j++)
+        {
+            Directories[Open[j]].TotalSize += m_Files[i].Data.size();
+        }
+    }
+    for (j = 1 ; j < Open.size() ; j++)
+    {
+        Directories[Open[j]].EndEntry = (uint32_t)m_Files.size();
+    }
+
+    // Totals which don't fit are saturated.
+    _Append32(Section, (uint32_t)Directories.size());
+    for (i = 0 ; i < Directories.size() ; i++)
+    {
+        _Append32(Section, Directories[i].FirstEntry);
+        _Append32(Section, Directories[i].EndEntry);
+        _Append32(Section, Directories[i].Depth);
+        _Append32(Section, Directories[i].SubdirectoryCount);
+        _Append32(Section, (uint32_t)std::min<uint64_t>(Directories[i].TotalSize, 0xFFFFFFFF));
+    }
+}
+
+
+/* Protected method which turns files named NAME.gz and NAME.br into the
+   gzip and brotli encoded variants of NAME when NAME is also in the image
+   and isn't itself a variant, so that a, a.gz and a.gz.gz leave a.gz.gz as
+   a plain file.  m_Files must already be sorted.
+*/
+void FlashFileSystemBuilder::SplitEncodedVariants()
+{
+    static const struct
+    {
+        const char*     pSuffix;
+        unsigned int    Encoding;
+    } Suffixes[] = { { ".gz", FFS_ENCODING_GZIP }, { ".br", FFS_ENCODING_BROTLI } };
+    std::vector<std::string>    Names;
+    std::vector<SFile>          Files;
+    size_t                      i;
+    size_t                      j;
+
+    for (i = 0 ; i < m_Files.size() ; i++)
+    {
+        Names.push_back(m_Files[i].Name);
+    }
+    for (i = 0 ; i < m_Files.size() ; i++)
+    {
+        SFile&  File = m_Files[i];
+
+        for (j = 0 ; j < sizeof(Suffixes)/sizeof(Suffixes[0]) ; j++)
+        {
+            size_t  SuffixLength = strlen(Suffixes[j].pSuffix);
+
+            if (File.Name.size() > SuffixLength &&
+                0 == File.Name.compare(File.Name.size() - SuffixLength, SuffixLength, Suffixes[j].pSuffix))
+            {
+                std::string                         Name = File.Name.substr(0, File.Name.size() - SuffixLength);
+                std::vector<std::string>::iterator  Base = std::lower_bound(Names.begin(), Names.end(), Name);
+
+                // NAME sorts before NAME.gz, so whether it became a variant
+                // has already been decided.
+                if (Base != Names.end() && *Base == Name &&
+                    FFS_ENCODING_IDENTITY == m_Files[Base - Names.begin()].Encoding)
+                {
+                    File.Name = Name;
+                    File.Encoding = Suffixes[j].Encoding;
+                }
+                break;
+            }
+        }
+    }
+    for (i = 0 ; i < m_Files.size() ; i++)
+    {
+        if (FFS_ENCODING_IDENTITY == m_Files[i].Encoding)
+        {
+            Files.push_back(std::move(m_Files[i]));
+        }
+        else
+        {
+            m_Variants.push_back(std::move(m_Files[i]));
+        }
+    }
+    m_Files.swap(Files);
+}
+
+
+/* Protected method which makes sure that a filename can be stored in the
+   image.
+*/
+int FlashFileSystemBuilder::ValidateFilename(const char* pFilename)
+{
+    size_t  Length = strlen(pFilename);
+
+    if (0 == Length || '/' == pFilename[Length - 1] || strstr(pFilename, "//"))
+    {
+        return SetError(-EINVAL, "'%s' isn't a valid filename.", pFilename);
+    }
+    return 0;
+}
+
+
+/* Protected method which loads, hashes and compresses every file in Files,
+   spreading the files across ThreadCount worker threads.
+*/
+void FlashFileSystemBuilder::ProcessFiles(std::vector<SFile>& Files)
+{
+    std::atomic<size_t>         NextFile(0);
+    std::vector<std::thread>    Threads;
+    unsigned int                ThreadCount = m_Options.ThreadCount;
+    unsigned int                i;
+
+    if (0 == ThreadCount)
+    {
+        ThreadCount = std::max(1U, std::thread::hardware_concurrency());
+    }
+    ThreadCount = (unsigned int)std::min<size_t>(ThreadCount, Files.size());
+
+    auto    Worker = [&]()
+    {
+        size_t  Index;
+
+        while ((Index = NextFile.fetch_add(1)) < Files.size())
+        {
+            ProcessFile(Files[Index]);
+        }
+    };
+    for (i = 1 ; i < ThreadCount ; i++)
+    {
+        Threads.push_back(std::thread(Worker));
+    }
+    Worker();
+    for (i = 0 ; i < Threads.size() ; i++)
+    {
+        Threads[i].join();
+    }
+}
+
+
+/* Protected method which loads a single file from disk if required, hashes
+   its name and determines how its data will be stored in the image.
+*/
+void FlashFileSystemBuilder::ProcessFile(SFile& File)
+{
+    size_t  i;
+
+    if (!File.SourcePath.empty())
+    {
+        FILE*   pFile = fopen(File.SourcePath.c_str(), "rb");
+        uint8_t Buffer[64 * 1024];
+        size_t  BytesRead;
+
+        if (!pFile)
+        {
+            File.Error = -errno;
+            return;
+        }
+        File.Data.clear();
+        while ((BytesRead = fread(Buffer, 1, sizeof(Buffer), pFile)) > 0)
+        {
+            File.Data.insert(File.Data.end(), Buffer, Buffer + BytesRead);
+        }
+        if (ferror(pFile))
+        {
+            File.Error = -EIO;
+        }
+        fclose(pFile);
+    }
+
+    File.NameHash = FileSystemHashFilename(File.Name.c_str());
+    File.Compressed = false;
+    File.Stored = File.Data;
+    // Encoded variants are already compressed and are stored as given.  The
+    // compressed file header only has room for sizes below 4GB.
+    if (m_Options.Compress && FFS_ENCODING_IDENTITY == File.Encoding && 
+        File.Data.size() >= MIN_COMPRESS_SIZE && File.Data.size() <= 0xFFFFFFFF)
+    {
+        CompressFile(File);
+    }
+
+    // FNV-1a, which is plenty to find candidates since Build() compares the
+    // contents of any files with matching hashes.
+    File.ContentHash = 14695981039346656037ULL;
+    for (i = 0 ; i < File.Stored.size() ; i++)
+    {
+        File.ContentHash = (File.ContentHash ^ File.Stored[i]) * 1099511628211ULL;
+    }
+}
+
+
+/* Protected method which compresses a file into the SFileSystemCompressedFile
+   format, one block at a time.  The file is only stored compressed if that
+   makes it smaller.
+*/
+void FlashFileSystemBuilder::CompressFile(SFile& File)
+{
+    std::vector<uint8_t>    Compressed;
+    std::vector<uint8_t>    Block;
+    size_t                  Size = File.Data.size();
+    size_t                  BlockSize = m_Options.BlockSize;
+    size_t                  BlockCount = (Size + BlockSize - 1) / BlockSize;
+    size_t                  DataOffset = sizeof(SFileSystemCompressedFile) + (BlockCount + 1) * sizeof(uint32_t);
+    size_t                  i;
+
+    if (Size > 0xFFFFFFFF)
+    {
+        return;
+    }
+    _Append32(Compressed, (uint32_t)Size);
+    _Append32(Compressed, (uint32_t)BlockSize);
+    _Append32(Compressed, FFS_COMPRESSION_LZ4);
+    Compressed.resize(DataOffset);
+    for (i = 0 ; i < BlockCount ; i++)
+    {
+        const uint8_t*  pBlock = &File.Data[i * BlockSize];
+        size_t          BlockLength = std::min(BlockSize, Size - i * BlockSize);
+
+        _Put32(Compressed, sizeof(SFileSystemCompressedFile) + i * sizeof(uint32_t), (uint32_t)Compressed.size());
+
+        // Blocks which don't shrink are stored as is.
+        FlashFileSystemLZ4Compress(pBlock, BlockLength, Block);
+        if (Block.size() < BlockLength)
+        {
+            Compressed.insert(Compressed.end(), Block.begin(), Block.end());
+        }
+        else
+        {
+            Compressed.insert(Compressed.end(), pBlock, pBlock + BlockLength);
+        }
+    }
+    _Put32(Compressed, sizeof(SFileSystemCompressedFile) + BlockCount * sizeof(uint32_t), (uint32_t)Compressed.size());
+
+    if (Compressed.size() < Size)
+    {
+        File.Stored.swap(Compressed);
+        File.Compressed = true;
+    }
+}
+
+
+/* Protected method which records a description of the last error.
+
+   Returns:
+    Result so that it can be used in return statements.
+*/
+int FlashFileSystemBuilder::SetError(int Result, const char* pFormat, ...)
+{
+    char    Buffer[512];
+    va_list Args;
+
+    va_start(Args, pFormat);
+    vsnprintf(Buffer, sizeof(Buffer), pFormat, Args);
+    va_end(Args);
+    m_LastError = Buffer;
+
+    return Result;
+}
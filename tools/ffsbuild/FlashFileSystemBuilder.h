@@ -0,0 +1,186 @@
+/* Copyright 2011 Adam Green (http://mbed.org/users/AdamGreen/)
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+/* Host side library which builds FLASH File System images using the layout
+   described in ffsformat.h.  It is shared by the ffsbuild command line tool
+   and any host code which needs to create images.
+*/
+#ifndef _FLASHFILESYSTEMBUILDER_H_
+#define _FLASHFILESYSTEMBUILDER_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+
+// Options which control the layout of the image created by
+// FlashFileSystemBuilder.
+struct SFlashFileSystemBuildOptions
+{
+    SFlashFileSystemBuildOptions() :
+        Version2(true),
+        Version3(false),
+        HashIndex(true),
+        Compress(false),
+        Trailer(true),
+        FrontCodedNames(false),
+        Deduplicate(true),
+        EncodedVariants(false),
+        Checksums(false),
+        DirectoryTree(false),
+        BlockSize(1024),
+        RestartInterval(16),
+        PayloadAlignment(4),
+        ThreadCount(0)
+    {
+    }
+
+    // Emit a version 2 image.  Version 1 images can't contain any of the
+    // optional sections.
+    bool            Version2;
+    // Emit a version 3 image instead, whose 64-bit offsets let the image
+    // grow past 4GB.  It can contain the same optional sections as a
+    // version 2 image.
+    bool            Version3;
+    // Add a FFS_SECTION_HASH_INDEX section for O(1) open().
+    bool            HashIndex;
+    // Compress files which get smaller when compressed.
+    bool            Compress;
+    // Append a SFileSystemTrailer so that the runtime can locate the image
+    // without scanning FLASH.
+    bool            Trailer;
+    // Store the filenames in a FFS_SECTION_FRONT_CODED_NAMES section.
+    bool            FrontCodedNames;
+    // Store files with identical contents once and point all of their
+    // entries at the same data.
+    bool            Deduplicate;
+    // Store files named NAME.gz and NAME.br as the gzip and brotli encoded
+    // variants of NAME when NAME is also in the image.
+    bool            EncodedVariants;
+    // Add a FFS_SECTION_FILE_CHECKSUMS section so that the runtime can
+    // verify the image.
+    bool            Checksums;
+    // Add a FFS_SECTION_DIRECTORY_TREE section so that the runtime can skip
+    // subdirectories in O(1) and report directory totals.
+    bool            DirectoryTree;
+    // Uncompressed size of each compressed block.  Must not be larger than
+    // the runtime's FFS_MAX_COMPRESSED_BLOCK_SIZE.
+    unsigned int    BlockSize;
+    // Number of front coded names between restart points.
+    unsigned int    RestartInterval;
+    // Alignment of each file's data within the image.  A power of 2 of at
+    // least 4.  Larger values add a FFS_SECTION_PAYLOAD_ALIGNMENT section so
+    // that the runtime can rely on them.
+    unsigned int    PayloadAlignment;
+    // Number of threads used to load and compress files, 0 to use all cores.
+    unsigned int    ThreadCount;
+};
+
+
+// Statistics about the most recently built image.
+struct SFlashFileSystemBuildStats
+{
+    // Number of files in the image.
+    size_t      FileCount;
+    // Number of files which were stored compressed.
+    size_t      CompressedFileCount;
+    // Total size of all files before compression.
+    uint64_t    UncompressedBytes;
+    // Total size of all file data as stored in the image.
+    uint64_t    StoredBytes;
+    // Number of files which share the data of an earlier file.
+    size_t      DuplicateFileCount;
+    // Bytes of file data which weren't stored because of duplicates.
+    uint64_t    DuplicateBytes;
+    // Number of encoded variants in the image.
+    size_t      VariantCount;
+    // Total size of the encoded variants.
+    uint64_t    VariantBytes;
+    // Total size of the filenames as stored in the image.
+    uint64_t    NameBytes;
+    // Total size of the image.
+    uint64_t    ImageSize;
+};
+
+
+// Builds a FLASH File System image from a set of files.  The same set of
+// files and options always produces a byte-for-byte identical image.
+class FlashFileSystemBuilder
+{
+public:
+    FlashFileSystemBuilder(const SFlashFileSystemBuildOptions& Options = SFlashFileSystemBuildOptions());
+
+    int AddFile(const char* pFilename, const void* pData, size_t Size);
+    int AddFileFromDisk(const char* pFilename, const char* pSourcePath);
+    int AddEncodedVariant(const char* pFilename, unsigned int Encoding, const void* pData, size_t Size);
+    int AddDirectory(const char* pSourceDirectory);
+    int Build(std::vector<uint8_t>& Image);
+
+    const SFlashFileSystemBuildStats&   GetStats() const { return m_Stats; }
+    const std::string&                  GetLastError() const { return m_LastError; }
+
+protected:
+    struct SFile
+    {
+        // Name of the file within the image (no leading slash).
+        std::string             Name;
+        // Path of the file on the host if it still needs to be loaded.
+        std::string             SourcePath;
+        // Uncompressed contents of the file.
+        std::vector<uint8_t>    Data;
+        // Contents of the file as stored in the image.
+        std::vector<uint8_t>    Stored;
+        // Non-zero if Stored holds the compressed form of Data.
+        bool                    Compressed;
+        // FFS_ENCODING_IDENTITY for files, otherwise the encoding of a
+        // variant of the file called Name.
+        unsigned int            Encoding;
+        // Index of the file which a variant belongs to.
+        uint32_t                FileIndex;
+        // Non-zero if the data is shared with an earlier file.
+        bool                    Duplicate;
+        // FileSystemHashFilename() of Name.
+        unsigned int            NameHash;
+        // Hash of Stored, used to find files with identical contents.
+        uint64_t                ContentHash;
+        // Offset of the filename and data within the image.
+        uint64_t                FilenameOffset;
+        uint64_t                DataOffset;
+        // Error encountered while loading the file, 0 on success.
+        int                     Error;
+    };
+
+    int     ValidateFilename(const char* pFilename);
+    void    SplitEncodedVariants();
+    void    ProcessFiles(std::vector<SFile>& Files);
+    void    ProcessFile(SFile& File);
+    void    BuildDirectoryTree(std::vector<uint8_t>& Section);
+    void    CompressFile(SFile& File);
+    int     SetError(int Result, const char* pFormat, ...);
+
+    SFlashFileSystemBuildOptions    m_Options;
+    SFlashFileSystemBuildStats      m_Stats;
+    std::vector<SFile>              m_Files;
+    std::vector<SFile>              m_Variants;
+    std::string                     m_LastError;
+};
+
+
+// Compresses a single block into the LZ4 block format understood by
+// FFSLZ4Decompress().  Returns the compressed size.
+size_t FlashFileSystemLZ4Compress(const uint8_t* pSource, size_t SourceLength, std::vector<uint8_t>& Dest);
+
+
+#endif // _FLASHFILESYSTEMBUILDER_H_
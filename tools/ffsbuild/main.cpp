@@ -0,0 +1,225 @@
+/* Copyright 2011 Adam Green (http://mbed.org/users/AdamGreen/)
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+/* Command line tool which builds a FLASH File System image from a directory
+   on the host.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "FlashFileSystemBuilder.h"
+
+
+static void _DisplayUsage(void)
+{
+    fprintf(stderr,
+            "Usage: ffsbuild [options] SourceDirectory ImageFile [HeaderFile]\n"
+            "\n"
+            "Builds a FlashFileSystem image from the contents of SourceDirectory and\n"
+            "writes it to ImageFile.  If HeaderFile is specified, the image is also\n"
+            "written to it as the roFlashDrive array.\n"
+            "\n"
+            "Options:\n"
+            "  -1               Build a version 1 image (no optional sections).\n"
+            "  -3               Build a version 3 image, with 64-bit offsets so that it\n"
+            "                   can be larger than 4GB.\n"
+            "  --no-hash        Don't add the filename hash index.\n"
+            "  --compress       Compress files which get smaller.\n"
+            "  --block-size N   Uncompressed bytes per compressed block (default 1024).\n"
+            "  --no-trailer     Don't append the trailer record.\n"
+            "  --no-dedup       Store every file's data even if it duplicates another.\n"
+            "  --checksums      Add CRC32C checksums so that the image can be verified.\n"
+            "  --directory-tree Add a directory tree for faster readdir() and directory\n"
+            "                   totals.\n"
+            "  --encoded-variants\n"
+            "                   Store NAME.gz and NAME.br as the gzip and brotli encoded\n"
+            "                   variants of NAME.\n"
+            "  --front-coded    Store the filenames front coded.\n"
+            "  --restart-interval N\n"
+            "                   Front coded names between restart points (default 16).\n"
+            "  --align N        Align each file's data to N bytes, a power of 2 of at\n"
+            "                   least 4 (default 4).\n"
+            "  -j N             Number of threads to use (default all cores).\n");
+}
+
+
+static int _WriteImage(const char* pFilename, const std::vector<uint8_t>& Image)
+{
+    FILE*   pFile = fopen(pFilename, "wb");
+
+    if (!pFile)
+    {
+        fprintf(stderr, "error: Failed to create '%s'.\n", pFilename);
+        return -1;
+    }
+    if (Image.size() != fwrite(&Image[0], 1, Image.size(), pFile))
+    {
+        fprintf(stderr, "error: Failed to write '%s'.\n", pFilename);
+        fclose(pFile);
+        return -1;
+    }
+    fclose(pFile);
+
+    return 0;
+}
+
+
+static int _WriteHeader(const char* pFilename, const std::vector<uint8_t>& Image, unsigned int Alignment)
+{
+    FILE*   pFile = fopen(pFilename, "w");
+    size_t  i;
+
+    if (!pFile)
+    {
+        fprintf(stderr, "error: Failed to create '%s'.\n", pFilename);
+        return -1;
+    }
+    fprintf(pFile,
+            "/* FlashFileSystem image generated by ffsbuild. */\n"
+            "#include <stdint.h>\n"
+            "\n"
+            "static const uint8_t roFlashDrive[%lu] __attribute__((aligned(%u))) =\n"
+            "{",
+            (unsigned long)Image.size(),
+            Alignment);
+    for (i = 0 ; i < Image.size() ; i++)
+    {
+        fprintf(pFile, "%s0x%02X,", (i % 16) ? " " : "\n    ", Image[i]);
+    }
+    fprintf(pFile, "\n};\n");
+    if (ferror(pFile))
+    {
+        fprintf(stderr, "error: Failed to write '%s'.\n", pFilename);
+        fclose(pFile);
+        return -1;
+    }
+    fclose(pFile);
+
+    return 0;
+}
+
+
+int main(int argc, char** argv)
+{
+    SFlashFileSystemBuildOptions    Options;
+    std::vector<uint8_t>            Image;
+    const char*                     pArgs[3] = { NULL, NULL, NULL };
+    int                             ArgCount = 0;
+    int                             i;
+
+    for (i = 1 ; i < argc ; i++)
+    {
+        if (0 == strcmp(argv[i], "-1"))
+        {
+            Options.Version2 = false;
+            Options.HashIndex = false;
+        }
+        else if (0 == strcmp(argv[i], "-3"))
+        {
+            Options.Version3 = true;
+        }
+        else if (0 == strcmp(argv[i], "--no-hash"))
+        {
+            Options.HashIndex = false;
+        }
+        else if (0 == strcmp(argv[i], "--compress"))
+        {
+            Options.Compress = true;
+        }
+        else if (0 == strcmp(argv[i], "--block-size") && i + 1 < argc)
+        {
+            Options.BlockSize = strtoul(argv[++i], NULL, 0);
+        }
+        else if (0 == strcmp(argv[i], "--no-trailer"))
+        {
+            Options.Trailer = false;
+        }
+        else if (0 == strcmp(argv[i], "--no-dedup"))
+        {
+            Options.Deduplicate = false;
+        }
+        else if (0 == strcmp(argv[i], "--checksums"))
+        {
+            Options.Checksums = true;
+        }
+        else if (0 == strcmp(argv[i], "--directory-tree"))
+        {
+            Options.DirectoryTree = true;
+        }
+        else if (0 == strcmp(argv[i], "--encoded-variants"))
+        {
+            Options.EncodedVariants = true;
+        }
+        else if (0 == strcmp(argv[i], "--front-coded"))
+        {
+            Options.FrontCodedNames = true;
+        }
+        else if (0 == strcmp(argv[i], "--restart-interval") && i + 1 < argc)
+        {
+            Options.RestartInterval = strtoul(argv[++i], NULL, 0);
+        }
+        else if (0 == strcmp(argv[i], "--align") && i + 1 < argc)
+        {
+            Options.PayloadAlignment = strtoul(argv[++i], NULL, 0);
+        }
+        else if (0 == strcmp(argv[i], "-j") && i + 1 < argc)
+        {
+            Options.ThreadCount = strtoul(argv[++i], NULL, 0);
+        }
+        else if ('-' != argv[i][0] && ArgCount < 3)
+        {
+            pArgs[ArgCount++] = argv[i];
+        }
+        else
+        {
+            _DisplayUsage();
+            return 1;
+        }
+    }
+    if (ArgCount < 2)
+    {
+        _DisplayUsage();
+        return 1;
+    }
+
+    FlashFileSystemBuilder  Builder(Options);
+    if (Builder.AddDirectory(pArgs[0]) || Builder.Build(Image))
+    {
+        fprintf(stderr, "error: %s\n", Builder.GetLastError().c_str());
+        return 1;
+    }
+    // The 64-bit fields of version 3 images are read in place so the array
+    // needs at least 8-byte alignment.
+    if (_WriteImage(pArgs[1], Image) || 
+        (pArgs[2] && _WriteHeader(pArgs[2], Image, (Options.Version3 && Options.PayloadAlignment < 8) ? 8 : Options.PayloadAlignment)))
+    {
+        return 1;
+    }
+
+    const SFlashFileSystemBuildStats&   Stats = Builder.GetStats();
+    printf("%lu files (%lu compressed, %lu duplicates), %llu bytes of file data stored in %llu bytes "
+           "(%llu bytes saved by sharing duplicates), %lu encoded variants (%llu bytes), %llu bytes of names, %llu byte image.\n",
+           (unsigned long)Stats.FileCount,
+           (unsigned long)Stats.CompressedFileCount,
+           (unsigned long)Stats.DuplicateFileCount,
+           (unsigned long long)Stats.UncompressedBytes,
+           (unsigned long long)Stats.StoredBytes,
+           (unsigned long long)Stats.DuplicateBytes,
+           (unsigned long)Stats.VariantCount,
+           (unsigned long long)Stats.VariantBytes,
+           (unsigned long long)Stats.NameBytes,
+           (unsigned long long)Stats.ImageSize);
+
+    return 0;
+}
@@ -0,0 +1,541 @@
+/* Copyright 2011 Adam Green (http://mbed.org/users/AdamGreen/)
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+/* Host tool which replays an access trace recorded by a FlashFileSystem built
+   with FFS_ACCESS_TRACE against an image and reports the latency of each
+   kind of call along with the overall throughput.  The image doesn't need
+   to be the one which the trace was recorded on, so that a trace captured on
+   the device can be used to compare image layouts and build options.
+*/
+#include <mbed.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "FlashFileSystem.h"
+#include "ffstrace.h"
+#include "LatencyRecorder.h"
+#if FFS_BLOCK_DEVICE
+#include "MemoryBlockDevice.h"
+#endif
+
+
+// One call read from the trace file.
+struct SReplayEvent
+{
+    SFileSystemAccessRecord Record;
+    // Name passed to the open events.
+    std::string             Name;
+};
+
+
+// Parameters which control the replay.
+struct SReplayOptions
+{
+    // Number of times the whole trace is replayed.
+    unsigned int    Iterations;
+    // Mount the image from a simulated block device whose reads take
+    // BlockDeviceLatencyUs plus the time to transfer the bytes at
+    // BlockDeviceMBps.
+    bool            BlockDevice;
+    double          BlockDeviceLatencyUs;
+    double          BlockDeviceMBps;
+    const char*     pImageFilename;
+    const char*     pTraceFilename;
+};
+
+
+/* Reads a whole file into Data.
+
+   Returns 0 on success and -1 on failure.
+*/
+static int _ReadFile(const char* pFilename, std::vector<uint8_t>& Data)
+{
+    FILE*   pFile = fopen(pFilename, "rb");
+    long    Size;
+
+    if (!pFile)
+    {
+        fprintf(stderr, "error: Failed to open '%s'.\n", pFilename);
+        return -1;
+    }
+    if (fseek(pFile, 0, SEEK_END) || (Size = ftell(pFile)) < 0 || fseek(pFile, 0, SEEK_SET))
+    {
+        fprintf(stderr, "error: Failed to find the size of '%s'.\n", pFilename);
+        fclose(pFile);
+        return -1;
+    }
+    Data.resize(Size);
+    if (Size && (size_t)Size != fread(&Data[0], 1, Size, pFile))
+    {
+        fprintf(stderr, "error: Failed to read '%s'.\n", pFilename);
+        fclose(pFile);
+        return -1;
+    }
+    fclose(pFile);
+
+    return 0;
+}
+
+
+/* Returns non-zero for the types of access record which are followed by a
+   name. */
+static int _IsNamedAccess(unsigned int Type)
+{
+    return (FFS_ACCESS_OPEN == Type || FFS_ACCESS_OPEN_ENCODED == Type || FFS_ACCESS_OPENDIR == Type);
+}
+
+
+/* Reads the record at Offset into a version 2 SFileSystemAccessRecord.
+   Version 1 records are widened, with their 32-bit seek offsets and results
+   sign extended.
+*/
+static void _ReadRecord(const std::vector<uint8_t>& Trace, 
+                        size_t                      Offset, 
+                        unsigned int                Version, 
+                        SFileSystemAccessRecord*    pRecord)
+{
+    SFileSystemAccessRecordV1   RecordV1;
+
+    if (FFS_ACCESS_TRACE_VERSION_2 == Version)
+    {
+        memcpy(pRecord, &Trace[Offset], sizeof(*pRecord));
+        return;
+    }
+    memcpy(&RecordV1, &Trace[Offset], sizeof(RecordV1));
+    pRecord->Sequence = RecordV1.Sequence;
+    pRecord->Type = RecordV1.Type;
+    pRecord->Whence = RecordV1.Whence;
+    pRecord->Handle = RecordV1.Handle;
+    pRecord->Value = RecordV1.Value;
+    if (FFS_ACCESS_SEEK == RecordV1.Type)
+    {
+        pRecord->Value = (uint64_t)(int64_t)(int32_t)RecordV1.Value;
+    }
+    pRecord->Result = RecordV1.Result;
+}
+
+
+/* Splits the contents of a trace file into events.  Traces which start with
+   an SFileSystemAccessTraceHeader hold version 2 records and the rest are
+   read as version 1 traces.  Sequence gaps, left by records which were
+   overwritten in the ring buffer before the trace was copied, are counted
+   so that they can be reported.
+
+   Returns 0 on success and -1 if the trace is malformed.
+*/
+static int _ParseTrace(const std::vector<uint8_t>& Trace, 
+                       std::vector<SReplayEvent>&  Events, 
+                       unsigned int*               pVersion, 
+                       unsigned int*               pGaps)
+{
+    SFileSystemAccessTraceHeader    Header;
+    size_t                          RecordSize = sizeof(SFileSystemAccessRecordV1);
+    size_t                          Offset = 0;
+
+    *pGaps = 0;
+    *pVersion = 1;
+    if (Trace.size() >= sizeof(Header))
+    {
+        memcpy(&Header, &Trace[0], sizeof(Header));
+        if (FFS_ACCESS_TRACE_SIGNATURE == Header.Signature && 0 == Header.Zero)
+        {
+            if (FFS_ACCESS_TRACE_VERSION_2 != Header.Version || sizeof(SFileSystemAccessRecord) != Header.RecordSize)
+            {
+                fprintf(stderr, "error: Unsupported trace version %u with %u byte records.\n", 
+                        Header.Version, Header.RecordSize);
+                return -1;
+            }
+            *pVersion = Header.Version;
+            RecordSize = sizeof(SFileSystemAccessRecord);
+            Offset = sizeof(Header);
+        }
+    }
+    if (Trace.size() % RecordSize)
+    {
+        fprintf(stderr, "error: The trace isn't a whole number of %u byte records.\n", 
+                (unsigned int)RecordSize);
+        return -1;
+    }
+    while (Offset < Trace.size())
+    {
+        SReplayEvent    Event;
+        size_t          NameSlots = 0;
+
+        _ReadRecord(Trace, Offset, *pVersion, &Event.Record);
+        if (Event.Record.Type < FFS_ACCESS_OPEN || Event.Record.Type > FFS_ACCESS_CLOSEDIR)
+        {
+            fprintf(stderr, "error: Record at offset %lu has unknown type %u.\n", 
+                    (unsigned long)Offset, Event.Record.Type);
+            return -1;
+        }
+        if (!Events.empty() && 
+            Event.Record.Sequence != Events.back().Record.Sequence + 1 + 
+                                     (Events.back().Name.size() + RecordSize - 1) / RecordSize)
+        {
+            (*pGaps)++;
+        }
+        Offset += RecordSize;
+        if (_IsNamedAccess(Event.Record.Type))
+        {
+            if (Event.Record.Value > Trace.size() - Offset)
+            {
+                fprintf(stderr, "error: Name of the record at offset %lu runs past the end of the trace.\n", 
+                        (unsigned long)(Offset - RecordSize));
+                return -1;
+            }
+            NameSlots = (Event.Record.Value + RecordSize - 1) / RecordSize;
+            Event.Name.assign((const char*)&Trace[Offset], Event.Record.Value);
+            Offset += NameSlots * RecordSize;
+        }
+        Events.push_back(Event);
+    }
+
+    return 0;
+}
+
+
+/* Closes the handles which the trace left open so that the next pass starts
+   with every handle free.
+*/
+static void _CloseAll(std::vector<FileHandle*>& Files, std::vector<DirHandle*>& Directories)
+{
+    size_t  i;
+
+    for (i = 0 ; i < Files.size() ; i++)
+    {
+        if (Files[i])
+        {
+            Files[i]->close();
+            Files[i] = NULL;
+        }
+    }
+    for (i = 0 ; i < Directories.size() ; i++)
+    {
+        if (Directories[i])
+        {
+            Directories[i]->close();
+            Directories[i] = NULL;
+        }
+    }
+}
+
+
+/* Replays the events against the file system Options.Iterations times.
+   Recorded handle numbers are mapped to the handles which this replay's
+   opens returned.  Calls on a handle whose open isn't in the trace, because
+   it was overwritten in the ring, are skipped.  Calls which return something
+   other than what they returned when recorded are counted as mismatches,
+   which is expected when replaying against a different image.
+*/
+static void _Replay(FlashFileSystem&                    FileSystem,
+                    const std::vector<SReplayEvent>&    Events,
+                    const SReplayOptions&               Options)
+{
+    static const char*          Names[] = { "", "open", "open encoded", "read", "seek", 
+                                            "close", "opendir", "readdir", "closedir" };
+    LatencyRecorder             Recorders[FFS_ACCESS_CLOSEDIR + 1];
+    std::vector<FileHandle*>    Files(FFS_ACCESS_NO_HANDLE, NULL);
+    std::vector<DirHandle*>     Directories(FFS_ACCESS_NO_HANDLE, NULL);
+    std::vector<char>           Buffer;
+    uint64_t                    Bytes = 0;
+    unsigned int                Skipped = 0;
+    unsigned int                Mismatches = 0;
+    unsigned int                Replayed = 0;
+    unsigned int                Iteration;
+    size_t                      i;
+
+    for (i = 0 ; i <= FFS_ACCESS_CLOSEDIR ; i++)
+    {
+        Recorders[i].SetName(Names[i]);
+    }
+    std::chrono::steady_clock::time_point   Start = std::chrono::steady_clock::now();
+    for (Iteration = 0 ; Iteration < Options.Iterations ; Iteration++)
+    {
+        for (i = 0 ; i < Events.size() ; i++)
+        {
+            const SFileSystemAccessRecord&  Record = Events[i].Record;
+            const char*                     pName = Events[i].Name.c_str();
+            LatencyRecorder&                Recorder = Recorders[Record.Type];
+            uint16_t                        Handle = Record.Handle;
+            FileHandle*                     pFile = NULL;
+            DirHandle*                      pDirectory = NULL;
+            struct dirent                   DirEntry;
+            unsigned int                    Encoding;
+            ssize_t                         Result = 0;
+
+            // Calls on a handle which this replay didn't open are skipped.
+            if ((FFS_ACCESS_READ == Record.Type || FFS_ACCESS_SEEK == Record.Type || FFS_ACCESS_CLOSE == Record.Type) && 
+                (Handle >= Files.size() || !Files[Handle]))
+            {
+                Skipped++;
+                continue;
+            }
+            if ((FFS_ACCESS_READDIR == Record.Type || FFS_ACCESS_CLOSEDIR == Record.Type) && 
+                (Handle >= Directories.size() || !Directories[Handle]))
+            {
+                Skipped++;
+                continue;
+            }
+            
+            switch (Record.Type)
+            {
+            case FFS_ACCESS_OPEN:
+            case FFS_ACCESS_OPEN_ENCODED:
+                Recorder.Start();
+                if (FFS_ACCESS_OPEN == Record.Type)
+                    Result = FileSystem.open(&pFile, pName, O_RDONLY);
+                else
+                    Result = FileSystem.OpenPreferringEncoding(&pFile, pName, Record.Whence, &Encoding);
+                Recorder.Stop();
+                if (0 == Result && Handle < Files.size())
+                {
+                    if (Files[Handle])
+                    {
+                        Files[Handle]->close();
+                    }
+                    Files[Handle] = pFile;
+                }
+                else if (0 == Result)
+                {
+                    pFile->close();
+                }
+                break;
+            case FFS_ACCESS_READ:
+                Buffer.resize(std::max<size_t>(Buffer.size(), Record.Value));
+                Recorder.Start();
+                Result = Files[Handle]->read(Buffer.data(), Record.Value);
+                Recorder.Stop(Result > 0 ? Result : 0);
+                Bytes += (Result > 0) ? Result : 0;
+                break;
+            case FFS_ACCESS_SEEK:
+                Recorder.Start();
+                Result = Files[Handle]->seek((off_t)(int64_t)Record.Value, Record.Whence);
+                Recorder.Stop();
+                break;
+            case FFS_ACCESS_CLOSE:
+                Recorder.Start();
+                Result = Files[Handle]->close();
+                Recorder.Stop();
+                Files[Handle] = NULL;
+                break;
+            case FFS_ACCESS_OPENDIR:
+                Recorder.Start();
+                Result = FileSystem.open(&pDirectory, pName);
+                Recorder.Stop();
+                if (0 == Result && Handle < Directories.size())
+                {
+                    if (Directories[Handle])
+                    {
+                        Directories[Handle]->close();
+                    }
+                    Directories[Handle] = pDirectory;
+                }
+                else if (0 == Result)
+                {
+                    pDirectory->close();
+                }
+                break;
+            case FFS_ACCESS_READDIR:
+                Recorder.Start();
+                Result = Directories[Handle]->read(&DirEntry);
+                Recorder.Stop();
+                break;
+            case FFS_ACCESS_CLOSEDIR:
+                Recorder.Start();
+                Result = Directories[Handle]->close();
+                Recorder.Stop();
+                Directories[Handle] = NULL;
+                break;
+            }
+            if (Result != Record.Result)
+            {
+                Mismatches++;
+            }
+            Replayed++;
+        }
+        _CloseAll(Files, Directories);
+    }
+    double  Seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+
+    for (i = FFS_ACCESS_OPEN ; i <= FFS_ACCESS_CLOSEDIR ; i++)
+    {
+        Recorders[i].Report();
+    }
+    printf("\nreplayed %u calls in %.3f s  %10.0f ops/s  %9.1f MB/s  %u skipped  %u mismatched\n",
+           Replayed,
+           Seconds,
+           Replayed / Seconds,
+           (Bytes / (1024.0 * 1024.0)) / Seconds,
+           Skipped,
+           Mismatches);
+}
+
+
+static void _DisplayUsage(void)
+{
+    fprintf(stderr,
+            "Usage: ffsreplay [options] ImageFile TraceFile\n"
+            "\n"
+            "Replays the calls in TraceFile, an access trace copied from a FlashFileSystem\n"
+            "built with FFS_ACCESS_TRACE, against the image in ImageFile and reports the\n"
+            "latency of each type of call.\n"
+            "\n"
+            "Options:\n"
+            "  --iterations N   Number of times to replay the trace (default 1).\n"
+            "  --block-device US\n"
+            "                   Mount the image from a simulated SPI FLASH block device\n"
+            "                   whose reads take US microseconds plus the transfer time.\n"
+            "                   Needs a build with -DFFS_BLOCK_DEVICE=1.\n"
+            "  --block-device-mbps N\n"
+            "                   Transfer rate of the block device in MB/s (default 20).\n");
+}
+
+
+static int _ParseOptions(int argc, char** argv, SReplayOptions& Options)
+{
+    int i;
+
+    Options.Iterations = 1;
+    Options.BlockDevice = false;
+    Options.BlockDeviceLatencyUs = 0.0;
+    Options.BlockDeviceMBps = 20.0;
+    Options.pImageFilename = NULL;
+    Options.pTraceFilename = NULL;
+    for (i = 1 ; i < argc ; i++)
+    {
+        const char* pArg = argv[i];
+        const char* pValue = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+        if ('-' != pArg[0])
+        {
+            if (!Options.pImageFilename)
+                Options.pImageFilename = pArg;
+            else if (!Options.pTraceFilename)
+                Options.pTraceFilename = pArg;
+            else
+                return -1;
+            continue;
+        }
+        if (!pValue)
+        {
+            return -1;
+        }
+        i++;
+        if (0 == strcmp(pArg, "--iterations"))
+            Options.Iterations = strtoul(pValue, NULL, 0);
+        else if (0 == strcmp(pArg, "--block-device"))
+        {
+            Options.BlockDevice = true;
+            Options.BlockDeviceLatencyUs = strtod(pValue, NULL);
+        }
+        else if (0 == strcmp(pArg, "--block-device-mbps"))
+            Options.BlockDeviceMBps = strtod(pValue, NULL);
+        else
+            return -1;
+    }
+    if (!Options.pTraceFilename || 0 == Options.Iterations || 
+        Options.BlockDeviceLatencyUs < 0.0 || Options.BlockDeviceMBps < 0.0)
+    {
+        return -1;
+    }
+#if !FFS_BLOCK_DEVICE
+    if (Options.BlockDevice)
+    {
+        fprintf(stderr, "error: --block-device needs a build with -DFFS_BLOCK_DEVICE=1.\n");
+        return -1;
+    }
+#endif
+
+    return 0;
+}
+
+
+int main(int argc, char** argv)
+{
+    SReplayOptions              Options;
+    std::vector<uint8_t>        Image;
+    std::vector<uint8_t>        Trace;
+    std::vector<SReplayEvent>   Events;
+    unsigned int                Version;
+    unsigned int                Gaps;
+
+    if (_ParseOptions(argc, argv, Options))
+    {
+        _DisplayUsage();
+        return 1;
+    }
+    if (_ReadFile(Options.pTraceFilename, Trace) || 
+        _ParseTrace(Trace, Events, &Version, &Gaps))
+    {
+        return 1;
+    }
+    printf("Trace: version %u, %lu calls, %u gaps where the ring buffer wrapped\n", Version, (unsigned long)Events.size(), Gaps);
+
+#if FFS_MAPPED_FILE
+    // Map the image rather than copying it, so that large images are read
+    // straight from the page cache.  Replays jump between files at random.
+    FlashFileSystemMappedFile   ImageFile;
+    int                         Result = ImageFile.Open(Options.pImageFilename, FFS_MAP_POPULATE | FFS_MAP_RANDOM);
+    if (Result)
+    {
+        fprintf(stderr, "error: Failed to map '%s' (%d).\n", Options.pImageFilename, Result);
+        return 1;
+    }
+#else
+    // The runtime requires the image to be 4-byte aligned.
+    if (_ReadFile(Options.pImageFilename, Image))
+    {
+        return 1;
+    }
+    std::vector<uint32_t>   AlignedImage((Image.size() + 3) / 4);
+    memcpy(AlignedImage.data(), Image.data(), Image.size());
+#endif
+
+    FlashFileSystem*        pFileSystem;
+#if FFS_BLOCK_DEVICE
+#if FFS_MAPPED_FILE
+    MemoryBlockDevice       Device(ImageFile.GetData(), ImageFile.GetSize());
+#else
+    MemoryBlockDevice       Device(AlignedImage.data(), Image.size());
+#endif
+    if (Options.BlockDevice)
+    {
+        Device.SetTiming((uint64_t)(Options.BlockDeviceLatencyUs * 1000.0), (uint64_t)(Options.BlockDeviceMBps * 1000000.0));
+        printf("Block device: %.1f us per read, %.1f MB/s, %u line cache of %u bytes, readahead %u\n",
+               Options.BlockDeviceLatencyUs, Options.BlockDeviceMBps,
+               FFS_BLOCK_CACHE_LINE_COUNT, FFS_BLOCK_CACHE_LINE_SIZE, FFS_BLOCK_CACHE_READAHEAD);
+        pFileSystem = new FlashFileSystem("flash", Device);
+    }
+    else
+#endif
+    {
+#if FFS_MAPPED_FILE
+        pFileSystem = new FlashFileSystem("flash", ImageFile);
+#else
+        pFileSystem = new FlashFileSystem("flash", (const uint8_t*)AlignedImage.data());
+#endif
+    }
+    if (!pFileSystem->IsMounted())
+    {
+        fprintf(stderr, "error: Failed to mount '%s'.\n", Options.pImageFilename);
+        delete pFileSystem;
+        return 1;
+    }
+    printf("\n");
+    _Replay(*pFileSystem, Events, Options);
+    delete pFileSystem;
+
+    return 0;
+}
@@ -0,0 +1,79 @@
+/* Copyright 2011 Adam Green (http://mbed.org/users/AdamGreen/)
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+/* Minimal stand-in for mbed's FileHandle, DirHandle and FileSystemLike
+   interfaces so that the FlashFileSystem can be built on a Linux host.  The
+   signatures match mbed 6 but there is no retargeting layer, so the host code
+   calls the FileSystemLike::open() methods directly instead of fopen() and
+   opendir().
+*/
+#ifndef _HOST_FILESYSTEMLIKE_H_
+#define _HOST_FILESYSTEMLIKE_H_
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+
+namespace mbed
+{
+
+class FileHandle
+{
+public:
+    virtual ~FileHandle() {}
+
+    virtual ssize_t read(void* buffer, size_t size) = 0;
+    virtual ssize_t write(const void* buffer, size_t size) = 0;
+    virtual off_t   seek(off_t offset, int whence = SEEK_SET) = 0;
+    virtual int     close() = 0;
+    virtual off_t   size() { return -EINVAL; }
+    virtual short   poll(short events) const { return POLLIN | POLLOUT; }
+};
+
+
+class DirHandle
+{
+public:
+    virtual ~DirHandle() {}
+
+    virtual ssize_t read(struct dirent* ent) = 0;
+    virtual int     close() = 0;
+    virtual void    seek(off_t offset) = 0;
+    virtual off_t   tell() = 0;
+    virtual void    rewind() = 0;
+};
+
+
+class FileSystemLike
+{
+public:
+    FileSystemLike(const char* name = NULL) {}
+    virtual ~FileSystemLike() {}
+
+    virtual int open(FileHandle** file, const char* path, int flags) = 0;
+    virtual int open(DirHandle** dir, const char* path) = 0;
+    virtual int stat(const char* path, struct stat* st) { return -ENOSYS; }
+};
+
+} // namespace mbed
+
+using namespace mbed;
+
+
+#endif /* _HOST_FILESYSTEMLIKE_H_ */
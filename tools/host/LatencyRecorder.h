@@ -0,0 +1,89 @@
+/* Copyright 2011 Adam Green (http://mbed.org/users/AdamGreen/)
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+/* Host only latency recorder shared by ffsbench and ffsreplay so that both
+   tools report their results in the same format.
+*/
+#ifndef _HOST_LATENCYRECORDER_H_
+#define _HOST_LATENCYRECORDER_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+
+// Collects the latency of each operation in a benchmark.
+class LatencyRecorder
+{
+public:
+    LatencyRecorder(const char* pName = "") : m_pName(pName), m_Bytes(0) {}
+
+    void SetName(const char* pName)
+    {
+        m_pName = pName;
+    }
+    void Start()
+    {
+        m_Start = std::chrono::steady_clock::now();
+    }
+    void Stop(uint64_t Bytes = 0)
+    {
+        std::chrono::steady_clock::time_point   End = std::chrono::steady_clock::now();
+
+        m_Samples.push_back(std::chrono::duration<double, std::nano>(End - m_Start).count());
+        m_Bytes += Bytes;
+    }
+
+    // Displays the latency percentiles for the recorded operations along
+    // with the throughput if any bytes were transferred.
+    void Report()
+    {
+        double  Total = 0.0;
+        size_t  Count = m_Samples.size();
+        size_t  i;
+
+        if (0 == Count)
+        {
+            return;
+        }
+        std::sort(m_Samples.begin(), m_Samples.end());
+        for (i = 0 ; i < Count ; i++)
+        {
+            Total += m_Samples[i];
+        }
+
+        printf("%-24s %9lu ops  p50 %10.0f  p90 %10.0f  p99 %10.0f  max %10.0f ns",
+               m_pName,
+               (unsigned long)Count,
+               m_Samples[Count / 2],
+               m_Samples[(Count * 90) / 100],
+               m_Samples[(Count * 99) / 100],
+               m_Samples[Count - 1]);
+        if (m_Bytes)
+        {
+            printf("  %9.1f MB/s", (m_Bytes / (1024.0 * 1024.0)) / (Total / 1e9));
+        }
+        printf("\n");
+    }
+
+protected:
+    const char*                             m_pName;
+    std::vector<double>                     m_Samples;
+    uint64_t                                m_Bytes;
+    std::chrono::steady_clock::time_point   m_Start;
+};
+
+#endif /* _HOST_LATENCYRECORDER_H_ */
@@ -0,0 +1,118 @@
+/* Copyright 2011 Adam Green (http://mbed.org/users/AdamGreen/)
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+/* Host only block device which serves reads from an image held in RAM.  Each
+   read can be slowed down to simulate the command overhead and bandwidth of
+   external SPI or QSPI FLASH, so that the FlashFileSystem's block cache can
+   be tuned and benchmarked without hardware.
+*/
+#ifndef _HOST_MEMORYBLOCKDEVICE_H_
+#define _HOST_MEMORYBLOCKDEVICE_H_
+
+#include <atomic>
+#include <chrono>
+#include <errno.h>
+#include <string.h>
+#include "blockdevice/BlockDevice.h"
+
+
+class MemoryBlockDevice : public BlockDevice
+{
+public:
+    // pData holds the Size byte contents of the device and must outlive it.
+    // Reads are made in multiples of ReadSize bytes.
+    MemoryBlockDevice(const void* pData, bd_size_t Size, bd_size_t ReadSize = 1)
+    {
+        m_pData = (const uint8_t*)pData;
+        m_Size = Size;
+        m_ReadSize = ReadSize;
+        m_LatencyNs = 0;
+        m_BytesPerSecond = 0;
+        m_ReadCount = 0;
+        m_ReadBytes = 0;
+    }
+
+    // Every read busy waits for LatencyNs nanoseconds plus the time taken
+    // to transfer its bytes at BytesPerSecond, when that isn't 0.  Busy
+    // waiting keeps short delays accurate, which sleeping wouldn't.
+    void SetTiming(uint64_t LatencyNs, uint64_t BytesPerSecond)
+    {
+        m_LatencyNs = LatencyNs;
+        m_BytesPerSecond = BytesPerSecond;
+    }
+
+    // Number of read() calls and bytes read since the last ResetCounts().
+    uint64_t GetReadCount() const { return m_ReadCount.load(); }
+    uint64_t GetReadBytes() const { return m_ReadBytes.load(); }
+    void ResetCounts()
+    {
+        m_ReadCount = 0;
+        m_ReadBytes = 0;
+    }
+
+    // BlockDevice interface methods.
+    virtual int init() override { return 0; }
+    virtual int deinit() override { return 0; }
+    virtual int read(void* buffer, bd_addr_t addr, bd_size_t size) override
+    {
+        if (addr % m_ReadSize || size % m_ReadSize || addr > m_Size || size > m_Size - addr)
+        {
+            return -EINVAL;
+        }
+        Delay(size);
+        memcpy(buffer, m_pData + addr, size);
+        m_ReadCount++;
+        m_ReadBytes += size;
+        return 0;
+    }
+    virtual int program(const void* buffer, bd_addr_t addr, bd_size_t size) override
+    {
+        return -EPERM;
+    }
+    virtual bd_size_t get_read_size() const override { return m_ReadSize; }
+    virtual bd_size_t get_program_size() const override { return m_ReadSize; }
+    virtual bd_size_t size() const override { return m_Size; }
+    virtual const char* get_type() const override { return "MEMORY"; }
+
+protected:
+    void Delay(bd_size_t Size)
+    {
+        std::chrono::steady_clock::time_point   End;
+        uint64_t                                DelayNs = m_LatencyNs;
+
+        if (m_BytesPerSecond)
+        {
+            DelayNs += Size * 1000000000ULL / m_BytesPerSecond;
+        }
+        if (0 == DelayNs)
+        {
+            return;
+        }
+        End = std::chrono::steady_clock::now() + std::chrono::nanoseconds(DelayNs);
+        while (std::chrono::steady_clock::now() < End)
+        {
+        }
+    }
+
+    const uint8_t*          m_pData;
+    bd_size_t               m_Size;
+    bd_size_t               m_ReadSize;
+    uint64_t                m_LatencyNs;
+    uint64_t                m_BytesPerSecond;
+    std::atomic<uint64_t>   m_ReadCount;
+    std::atomic<uint64_t>   m_ReadBytes;
+};
+
+
+#endif /* _HOST_MEMORYBLOCKDEVICE_H_ */
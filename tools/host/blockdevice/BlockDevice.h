@@ -0,0 +1,53 @@
+/* Copyright 2011 Adam Green (http://mbed.org/users/AdamGreen/)
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+/* Minimal stand-in for mbed's BlockDevice interface so that the
+   FlashFileSystem can mount images from a block device on a Linux host.  The
+   signatures match mbed 6 but only the methods which the file system and the
+   host tools use are declared.
+*/
+#ifndef _HOST_BLOCKDEVICE_H_
+#define _HOST_BLOCKDEVICE_H_
+
+#include <stdint.h>
+
+
+namespace mbed
+{
+
+typedef uint64_t bd_addr_t;
+typedef uint64_t bd_size_t;
+
+
+class BlockDevice
+{
+public:
+    virtual ~BlockDevice() {}
+
+    virtual int         init() = 0;
+    virtual int         deinit() = 0;
+    virtual int         read(void* buffer, bd_addr_t addr, bd_size_t size) = 0;
+    virtual int         program(const void* buffer, bd_addr_t addr, bd_size_t size) = 0;
+    virtual bd_size_t   get_read_size() const = 0;
+    virtual bd_size_t   get_program_size() const = 0;
+    virtual bd_size_t   size() const = 0;
+    virtual const char* get_type() const = 0;
+};
+
+} // namespace mbed
+
+using namespace mbed;
+
+
+#endif /* _HOST_BLOCKDEVICE_H_ */
@@ -0,0 +1,43 @@
+/* Copyright 2011 Adam Green (http://mbed.org/users/AdamGreen/)
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+/* Minimal stand-in for the parts of mbed.h used by the FlashFileSystem so
+   that it can be built and benchmarked on a Linux host.  Only add what the
+   file system itself needs.
+*/
+#ifndef _HOST_MBED_H_
+#define _HOST_MBED_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "FileSystemLike.h"
+
+
+// The host has no DWT cycle counter so the FFS_STATS_HISTOGRAMS of the
+// FlashFileSystem count nanoseconds instead.
+static inline uint32_t _HostCycleCount(void)
+{
+    struct timespec Time;
+    
+    clock_gettime(CLOCK_MONOTONIC, &Time);
+    return (uint32_t)((uint64_t)Time.tv_sec * 1000000000ULL + Time.tv_nsec);
+}
+#define FFS_STATS_CYCLE_COUNT()     _HostCycleCount()
+
+
+#endif /* _HOST_MBED_H_ */
@@ -0,0 +1,45 @@
+/* Copyright 2011 Adam Green (http://mbed.org/users/AdamGreen/)
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+/* Host implementation of mbed's PlatformMutex, built on std::mutex.  Unlike
+   mbed's it isn't recursive, which the FlashFileSystem doesn't need.
+*/
+#ifndef _HOST_PLATFORMMUTEX_H_
+#define _HOST_PLATFORMMUTEX_H_
+
+#include <mutex>
+
+
+class PlatformMutex
+{
+public:
+    void lock()
+    {
+        m_Mutex.lock();
+    }
+    bool trylock()
+    {
+        return m_Mutex.try_lock();
+    }
+    void unlock()
+    {
+        m_Mutex.unlock();
+    }
+
+protected:
+    std::mutex  m_Mutex;
+};
+
+
+#endif /* _HOST_PLATFORMMUTEX_H_ */
@@ -0,0 +1,92 @@
+/* Copyright 2011 Adam Green (http://mbed.org/users/AdamGreen/)
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+/* Host implementation of the mbed_atomic.h functions used by the
+   FlashFileSystem, built on the GCC/Clang __atomic builtins.  Like mbed's,
+   they are all sequentially consistent.
+*/
+#ifndef _HOST_MBED_ATOMIC_H_
+#define _HOST_MBED_ATOMIC_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+static inline bool core_util_atomic_cas_u8(volatile uint8_t* ptr, uint8_t* expectedCurrentValue, uint8_t desiredValue)
+{
+    return __atomic_compare_exchange_n(ptr, expectedCurrentValue, desiredValue, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+static inline uint8_t core_util_atomic_load_u8(const volatile uint8_t* valuePtr)
+{
+    return __atomic_load_n(valuePtr, __ATOMIC_SEQ_CST);
+}
+
+static inline void core_util_atomic_store_u8(volatile uint8_t* valuePtr, uint8_t desiredValue)
+{
+    __atomic_store_n(valuePtr, desiredValue, __ATOMIC_SEQ_CST);
+}
+
+static inline uint8_t core_util_atomic_exchange_u8(volatile uint8_t* valuePtr, uint8_t desiredValue)
+{
+    return __atomic_exchange_n(valuePtr, desiredValue, __ATOMIC_SEQ_CST);
+}
+
+static inline bool core_util_atomic_cas_u32(volatile uint32_t* ptr, uint32_t* expectedCurrentValue, uint32_t desiredValue)
+{
+    return __atomic_compare_exchange_n(ptr, expectedCurrentValue, desiredValue, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+static inline uint32_t core_util_atomic_load_u32(const volatile uint32_t* valuePtr)
+{
+    return __atomic_load_n(valuePtr, __ATOMIC_SEQ_CST);
+}
+
+static inline void core_util_atomic_store_u32(volatile uint32_t* valuePtr, uint32_t desiredValue)
+{
+    __atomic_store_n(valuePtr, desiredValue, __ATOMIC_SEQ_CST);
+}
+
+static inline uint32_t core_util_atomic_incr_u32(volatile uint32_t* valuePtr, uint32_t delta)
+{
+    return __atomic_add_fetch(valuePtr, delta, __ATOMIC_SEQ_CST);
+}
+
+static inline uint32_t core_util_atomic_decr_u32(volatile uint32_t* valuePtr, uint32_t delta)
+{
+    return __atomic_sub_fetch(valuePtr, delta, __ATOMIC_SEQ_CST);
+}
+
+static inline uint32_t core_util_atomic_fetch_or_u32(volatile uint32_t* valuePtr, uint32_t arg)
+{
+    return __atomic_fetch_or(valuePtr, arg, __ATOMIC_SEQ_CST);
+}
+
+static inline uint64_t core_util_atomic_load_u64(const volatile uint64_t* valuePtr)
+{
+    return __atomic_load_n(valuePtr, __ATOMIC_SEQ_CST);
+}
+
+static inline void core_util_atomic_store_u64(volatile uint64_t* valuePtr, uint64_t desiredValue)
+{
+    __atomic_store_n(valuePtr, desiredValue, __ATOMIC_SEQ_CST);
+}
+
+static inline uint64_t core_util_atomic_incr_u64(volatile uint64_t* valuePtr, uint64_t delta)
+{
+    return __atomic_add_fetch(valuePtr, delta, __ATOMIC_SEQ_CST);
+}
+
+
+#endif /* _HOST_MBED_ATOMIC_H_ */